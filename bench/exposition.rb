@@ -0,0 +1,38 @@
+# frozen_string_literal: true
+
+# Throughput of the Prometheus and OpenMetrics text exposition.
+#
+#   bundle exec rake compile
+#   ruby bench/exposition.rb [series] [iterations]
+#
+# Values are a mix of integers and fractions, so both the integer fast path
+# and the shortest round trip formatting are measured.
+
+$LOAD_PATH.unshift File.expand_path("../lib", __dir__)
+require "cmetrics"
+require "benchmark"
+
+series = Integer(ARGV[0] || 100_000)
+iterations = Integer(ARGV[1] || 10)
+
+gauge = CMetrics::Gauge.new
+gauge.create("kubernetes", "network", "load", "Network load", ["hostname", "app", "shard"])
+series.times do |i|
+  gauge.set(i.even? ? i : i / 7.0, ["host-#{i % 100}.calyptia.com", "cmetrics", (i / 100).to_s])
+end
+
+def report(label, bytes, series, iterations, seconds)
+  printf("%-12s %10.1f MB/s %12.0f series/s\n", label,
+         bytes * iterations / seconds / 1_000_000.0,
+         series * iterations / seconds)
+end
+
+puts "#{series} series, #{iterations} iterations"
+
+%i[to_prometheus to_openmetrics].each do |method|
+  bytes = gauge.public_send(method).bytesize
+  seconds = Benchmark.realtime do
+    iterations.times { gauge.public_send(method) }
+  end
+  report(method.to_s.delete_prefix("to_"), bytes, series, iterations, seconds)
+end
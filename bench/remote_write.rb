@@ -0,0 +1,44 @@
+# frozen_string_literal: true
+
+# Throughput of Prometheus remote write WriteRequest pack/unpack.
+#
+#   bundle exec rake compile
+#   ruby bench/remote_write.rb [series] [iterations]
+#
+# Run it on both revisions to compare protobuf-c changes. Buffers are not
+# compressed so that only the protobuf encoding is measured.
+
+$LOAD_PATH.unshift File.expand_path("../lib", __dir__)
+require "cmetrics"
+require "benchmark"
+
+series = Integer(ARGV[0] || 10_000)
+iterations = Integer(ARGV[1] || 50)
+
+counter = CMetrics::Counter.new
+counter.create("kubernetes", "network", "load", "Network load", ["hostname", "app", "shard"])
+series.times do |i|
+  counter.add(i * 1.5, ["host-#{i % 100}.calyptia.com", "cmetrics", (i / 100).to_s])
+end
+
+serde = CMetrics::Serde.new
+serde.from_msgpack(counter.to_msgpack)
+buffer = serde.prometheus_remote_write(compress: nil)
+
+def report(label, bytes, series, iterations, seconds)
+  printf("%-8s %10.1f MB/s %12.0f series/s\n", label,
+         bytes * iterations / seconds / 1_000_000.0,
+         series * iterations / seconds)
+end
+
+puts "#{series} series, #{buffer.bytesize} bytes per WriteRequest, #{iterations} iterations"
+
+pack = Benchmark.realtime do
+  iterations.times { serde.prometheus_remote_write(compress: nil) }
+end
+report("pack", buffer.bytesize, series, iterations, pack)
+
+unpack = Benchmark.realtime do
+  iterations.times { CMetrics::Serde.new.from_prometheus_remote_write(buffer, compressed: nil) }
+end
+report("unpack", buffer.bytesize, series, iterations, unpack)
@@ -37,4 +37,5 @@ void Init_cmetrics(void)
     Init_cmetrics_gauge(rb_mCMetrics);
     Init_cmetrics_serde(rb_mCMetrics);
     Init_cmetrics_untyped(rb_mCMetrics);
+    Init_cmetrics_registry(rb_mCMetrics);
 }
@@ -0,0 +1,346 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+struct aggregate_group {
+    double sum;
+    double min;
+    double max;
+    uint64_t count;
+    uint64_t timestamp;
+    size_t labels; /* offset into aggregate_ctx.label_pool */
+};
+
+struct aggregate_ctx {
+    const char *fqname;
+    int op;
+    int type;
+    struct cmt_map *first;
+
+    /* retained label keys */
+    int key_count;
+    char **keys;
+
+    /* per source map: retained key position -> source label index */
+    int *index;
+    char **values;
+    char **retained;
+
+    struct cmetrics_key key;
+    struct cmetrics_table table;
+    struct aggregate_group *groups;
+    size_t group_count;
+    size_t group_capacity;
+    char **label_pool;
+};
+
+static int
+find_first_map(struct cmt_map *map, void *data)
+{
+    struct aggregate_ctx *ctx = data;
+
+    if (strcmp(map->opts->fqname, ctx->fqname) == 0) {
+        ctx->first = map;
+        ctx->type = map->type;
+        return 1;
+    }
+
+    return 0;
+}
+
+static struct aggregate_group *
+group_get(struct aggregate_ctx *ctx, char **retained)
+{
+    int i;
+    int created;
+    void **slot;
+    size_t group;
+    struct aggregate_group *tmp_groups;
+    char **tmp_pool;
+
+    ctx->key.length = 0;
+    for (i = 0; i < ctx->key_count; i++) {
+        if (cmetrics_key_append(&ctx->key, retained[i], strlen(retained[i])) != 0) {
+            return NULL;
+        }
+    }
+
+    slot = cmetrics_table_lookup(&ctx->table, ctx->key.buf, ctx->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return NULL;
+    }
+    if (!created) {
+        return &ctx->groups[(uintptr_t)*slot];
+    }
+
+    if (ctx->group_count == ctx->group_capacity) {
+        ctx->group_capacity = ctx->group_capacity > 0 ? ctx->group_capacity * 2 : 16;
+        tmp_groups = realloc(ctx->groups, ctx->group_capacity * sizeof(struct aggregate_group));
+        if (tmp_groups == NULL) {
+            return NULL;
+        }
+        ctx->groups = tmp_groups;
+        tmp_pool = realloc(ctx->label_pool,
+                           ctx->group_capacity * (ctx->key_count + 1) * sizeof(char *));
+        if (tmp_pool == NULL) {
+            return NULL;
+        }
+        ctx->label_pool = tmp_pool;
+    }
+
+    group = ctx->group_count++;
+    *slot = (void *)(uintptr_t)group;
+
+    ctx->groups[group].sum = 0;
+    ctx->groups[group].count = 0;
+    ctx->groups[group].timestamp = 0;
+    ctx->groups[group].labels = group * (ctx->key_count + 1);
+    for (i = 0; i < ctx->key_count; i++) {
+        ctx->label_pool[ctx->groups[group].labels + i] = retained[i];
+    }
+
+    return &ctx->groups[group];
+}
+
+static int
+aggregate_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    double val;
+    uint64_t ts;
+    struct aggregate_ctx *ctx = data;
+    struct aggregate_group *group;
+
+    cmetrics_context_label_values(map, metric, ctx->values);
+    for (i = 0; i < ctx->key_count; i++) {
+        ctx->retained[i] = ctx->index[i] >= 0 ? ctx->values[ctx->index[i]] : "";
+    }
+
+    group = group_get(ctx, ctx->retained);
+    if (group == NULL) {
+        return -1;
+    }
+
+    val = cmt_metric_get_value(metric);
+    ts = cmt_metric_get_timestamp(metric);
+
+    if (group->count == 0) {
+        group->min = val;
+        group->max = val;
+    }
+    else {
+        if (val < group->min) {
+            group->min = val;
+        }
+        if (val > group->max) {
+            group->max = val;
+        }
+    }
+    group->sum += val;
+    group->count++;
+    if (ts > group->timestamp) {
+        group->timestamp = ts;
+    }
+
+    return 0;
+}
+
+static int
+aggregate_map(struct cmt_map *map, void *data)
+{
+    int i;
+    int j;
+    int ret;
+    struct aggregate_ctx *ctx = data;
+    char **map_keys;
+    char **tmp_values;
+
+    if (map->type != ctx->type || strcmp(map->opts->fqname, ctx->fqname) != 0) {
+        return 0;
+    }
+
+    map_keys = calloc(map->label_count + 1, sizeof(char *));
+    tmp_values = realloc(ctx->values, (map->label_count + 1) * sizeof(char *));
+    if (map_keys == NULL || tmp_values == NULL) {
+        free(map_keys);
+        if (tmp_values) {
+            ctx->values = tmp_values;
+        }
+        return -1;
+    }
+    ctx->values = tmp_values;
+
+    /* families with the same name may have different label sets */
+    cmetrics_context_label_keys(map, map_keys);
+    for (i = 0; i < ctx->key_count; i++) {
+        ctx->index[i] = -1;
+        for (j = 0; j < map->label_count; j++) {
+            if (strcmp(ctx->keys[i], map_keys[j]) == 0) {
+                ctx->index[i] = j;
+                break;
+            }
+        }
+    }
+    free(map_keys);
+
+    ret = cmetrics_context_foreach_metric(map, aggregate_metric, ctx);
+
+    return ret;
+}
+
+static double
+group_value(struct aggregate_ctx *ctx, struct aggregate_group *group)
+{
+    switch (ctx->op) {
+    case CMETRICS_AGGREGATE_AVG:
+        return group->sum / (double)group->count;
+    case CMETRICS_AGGREGATE_MAX:
+        return group->max;
+    case CMETRICS_AGGREGATE_MIN:
+        return group->min;
+    case CMETRICS_AGGREGATE_COUNT:
+        return (double)group->count;
+    default:
+        return group->sum;
+    }
+}
+
+static int
+emit_groups(struct cmt *dst, struct aggregate_ctx *ctx)
+{
+    size_t i;
+    int type = ctx->type;
+    struct cmt_map *map;
+    struct cmt_metric *metric;
+    struct aggregate_group *group;
+
+    /* averages and counts are no longer monotonic */
+    if (ctx->op == CMETRICS_AGGREGATE_AVG || ctx->op == CMETRICS_AGGREGATE_COUNT) {
+        type = CMT_GAUGE;
+    }
+
+    map = cmetrics_context_family_create(dst, type, ctx->first->opts,
+                                         ctx->key_count, ctx->keys);
+    if (map == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < ctx->group_count; i++) {
+        group = &ctx->groups[i];
+        metric = cmt_map_metric_get(map->opts, map, ctx->key_count,
+                                    ctx->key_count > 0 ? &ctx->label_pool[group->labels] : NULL,
+                                    CMT_TRUE);
+        if (metric == NULL) {
+            return -1;
+        }
+        cmt_metric_set(metric, group->timestamp, group_value(ctx, group));
+    }
+
+    return 0;
+}
+
+/*
+ * Aggregate every series of the families named 'fqname' from 'src' into a
+ * single family in 'dst'. The series are grouped by the retained labels:
+ * 'label_keys' themselves, or with 'without' set, every label of the
+ * family except them.
+ *
+ * Returns 0 on success, -1 when the family does not exist and -2 on
+ * allocation failures.
+ */
+int
+cmetrics_aggregate(struct cmt *dst, struct cmt *src, const char *fqname,
+                   int label_count, char **label_keys, int without, int op)
+{
+    int i;
+    int j;
+    int ret = 0;
+    int excluded;
+    char **first_keys = NULL;
+    struct aggregate_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fqname = fqname;
+    ctx.op = op;
+
+    if (cmetrics_context_foreach_map(src, find_first_map, &ctx) == 0) {
+        return -1;
+    }
+
+    if (without) {
+        first_keys = calloc(ctx.first->label_count + 1, sizeof(char *));
+        ctx.keys = calloc(ctx.first->label_count + 1, sizeof(char *));
+        if (first_keys == NULL || ctx.keys == NULL) {
+            ret = -2;
+            goto exit;
+        }
+        cmetrics_context_label_keys(ctx.first, first_keys);
+        for (i = 0; i < ctx.first->label_count; i++) {
+            excluded = CMT_FALSE;
+            for (j = 0; j < label_count; j++) {
+                if (strcmp(first_keys[i], label_keys[j]) == 0) {
+                    excluded = CMT_TRUE;
+                    break;
+                }
+            }
+            if (!excluded) {
+                ctx.keys[ctx.key_count++] = first_keys[i];
+            }
+        }
+    }
+    else {
+        ctx.keys = calloc(label_count + 1, sizeof(char *));
+        if (ctx.keys == NULL) {
+            ret = -2;
+            goto exit;
+        }
+        for (i = 0; i < label_count; i++) {
+            ctx.keys[ctx.key_count++] = label_keys[i];
+        }
+    }
+
+    ctx.index = calloc(ctx.key_count + 1, sizeof(int));
+    ctx.retained = calloc(ctx.key_count + 1, sizeof(char *));
+    if (ctx.index == NULL || ctx.retained == NULL ||
+        cmetrics_table_init(&ctx.table, 64) != 0) {
+        ret = -2;
+        goto exit;
+    }
+
+    if (cmetrics_context_foreach_map(src, aggregate_map, &ctx) != 0 ||
+        cmetrics_context_copy_static_labels(dst, src) != 0 ||
+        emit_groups(dst, &ctx) != 0) {
+        ret = -2;
+    }
+
+exit:
+    cmetrics_table_destroy(&ctx.table);
+    free(ctx.key.buf);
+    free(ctx.groups);
+    free(ctx.label_pool);
+    free(ctx.values);
+    free(ctx.retained);
+    free(ctx.index);
+    free(ctx.keys);
+    free(first_keys);
+
+    return ret;
+}
@@ -35,38 +35,335 @@
 #include <cmetrics/cmt_counter.h>
 #include <cmetrics/cmt_gauge.h>
 #include <cmetrics/cmt_untyped.h>
-#include <cmetrics/cmt_encode_influx.h>
 #include <cmetrics/cmt_encode_prometheus.h>
 #include <cmetrics/cmt_encode_msgpack.h>
-#include <cmetrics/cmt_encode_text.h>
 #include <cmetrics/cmt_decode_msgpack.h>
+#include <cmetrics/cmt_map.h>
+#include <cmetrics/cmt_metric.h>
+#include <cmetrics/cmt_histogram.h>
+#include <cmetrics/cmt_summary.h>
+
+/* Read-only mapping of a whole file, see cmetrics_mmap.c. */
+struct cmetrics_mapping {
+    char *buffer;
+    size_t size;
+    size_t released;    /* leading bytes handed back to the kernel */
+};
+
+/* Growable malloc'd byte buffer, meant to be reused between calls. */
+struct cmetrics_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+struct cmetrics_table_entry {
+    uint64_t hash;
+    char *key;
+    size_t length;
+    void *value;
+};
+
+struct cmetrics_table {
+    struct cmetrics_table_entry *entries;
+    size_t size;
+    size_t count;
+};
+
+/*
+ * Opt-in cache of the exposition output. Every mutation bumps generation;
+ * the cached String is reused while its generation is current, or for
+ * max_staleness nanoseconds when it is set.
+ *
+ * generation is also the changed_since: token. Once a token was handed
+ * out, updates of one series stamp it with their generation in 'changes'
+ * (cmt_metric * -> generation, stored in the slot); other mutations
+ * raise changes_floor, which is the generation of every series that is
+ * not stamped later.
+ */
+struct cmetrics_cache {
+    int enabled;
+    uint64_t generation;
+    uint64_t max_staleness;
+    VALUE prometheus;
+    uint64_t prometheus_generation;
+    uint64_t prometheus_time;
+    int changes_enabled;
+    uint64_t changes_floor;
+    struct cmetrics_table changes;
+};
 
 struct CMetricsCounter {
     struct cmt *instance;
     struct cmt_counter *counter;
+    struct cmetrics_cache cache;
+    struct cmetrics_table exemplars;
 };
 
 struct CMetricsGauge {
     struct cmt *instance;
     struct cmt_gauge *gauge;
+    struct cmetrics_cache cache;
 };
 
 struct CMetricsSerde {
     struct cmt *instance;
     size_t unpack_msgpack_offset;
+    struct cmetrics_cache cache;
+    struct cmetrics_buffer filtered; /* scratch of the only:/labels: filters */
 };
 
 struct CMetricsUntyped {
     struct cmt *instance;
     struct cmt_untyped *untyped;
+    struct cmetrics_cache cache;
+};
+
+struct cmetrics_statsd;
+
+struct CMetricsRegistry {
+    struct cmt *instance;
+    struct cmetrics_statsd *statsd;
+    struct cmetrics_cache cache;
+};
+
+enum cmetrics_compress_method {
+    CMETRICS_COMPRESS_NONE,
+    CMETRICS_COMPRESS_GZIP,
+    CMETRICS_COMPRESS_ZSTD,
+    CMETRICS_COMPRESS_SNAPPY
+};
+
+#define cmetrics_cache_touch(cache) ((cache)->changes_floor = ++(cache)->generation)
+
+enum cmetrics_mp_type {
+    CMETRICS_MP_NIL,
+    CMETRICS_MP_BOOL,
+    CMETRICS_MP_UINT,
+    CMETRICS_MP_INT,
+    CMETRICS_MP_FLOAT,
+    CMETRICS_MP_STR,
+    CMETRICS_MP_BIN,
+    CMETRICS_MP_ARRAY,
+    CMETRICS_MP_MAP,
+    CMETRICS_MP_EXT
+};
+
+struct cmetrics_mp_reader {
+    const unsigned char *buf;
+    size_t size;
+    size_t offset;
+};
+
+struct cmetrics_mp_token {
+    int type;
+    uint32_t length; /* bytes for str/bin/ext, entries for array/map */
+    const char *ptr;
+    uint64_t u;
+    int64_t i;
+    double d;
+};
+
+struct cmetrics_msgpack_filter {
+    VALUE names;        /* nil or Array of String/Regexp matched against fqname */
+    VALUE label_keys;   /* Array of String */
+    VALUE label_values; /* Array of String/Regexp */
+    VALUE scratch;      /* String reused for regexp matches */
+    int error;          /* jump tag of an exception raised by a Regexp */
 };
 
+/*
+ * A filter applied by a decoder with a string dictionary (compact
+ * payloads, snapshots): label values are matched once per dictionary
+ * entry.
+ */
+struct cmetrics_msgpack_filter_state {
+    struct cmetrics_msgpack_filter *filter; /* NULL keeps everything */
+    long label_count;
+    int *static_match;      /* per label: -1 not static, else whether it matches */
+    long *key_index;        /* per label: position in the family keys or -1 */
+    int per_series;         /* series of the family are checked */
+    uint32_t string_count;
+    unsigned char *matches; /* per label and string: 0 unknown, 1 match, 2 no match */
+};
+
+/* enough for "-2.2250738585072014e-308" and a NUL */
+#define CMETRICS_DTOA_SIZE 32
+
+#define CMETRICS_EXEMPLAR_TRACE_ID_MAX 64
+
+/* The latest exemplar of a series, without allocations of its own. */
+struct cmetrics_exemplar {
+    double value;
+    uint64_t timestamp;
+    uint8_t trace_id_length;
+    char trace_id[CMETRICS_EXEMPLAR_TRACE_ID_MAX];
+};
+
+struct cmetrics_key {
+    char *buf;
+    size_t length;
+    size_t capacity;
+};
+
+enum cmetrics_aggregate_op {
+    CMETRICS_AGGREGATE_SUM,
+    CMETRICS_AGGREGATE_AVG,
+    CMETRICS_AGGREGATE_MAX,
+    CMETRICS_AGGREGATE_MIN,
+    CMETRICS_AGGREGATE_COUNT
+};
+
+enum cmetrics_merge_policy {
+    CMETRICS_MERGE_SUM,
+    CMETRICS_MERGE_LAST,
+    CMETRICS_MERGE_MAX
+};
+
+#define CMETRICS_MERGE_ERROR_LABELS -2
+#define CMETRICS_MERGE_ERROR_STATIC_LABELS -3
+
+#define CMETRICS_TRANSCODE_ERROR_INPUT -2
+
+typedef int (*cmetrics_map_cb)(struct cmt_map *map, void *data);
+typedef int (*cmetrics_metric_cb)(struct cmt_map *map, struct cmt_metric *metric, void *data);
+
 void Init_cmetrics_counter(VALUE rb_mCMetrics);
 void Init_cmetrics_gauge(VALUE rb_mCMetrics);
 void Init_cmetrics_serde(VALUE rb_mCMetrics);
 void Init_cmetrics_untyped(VALUE rb_mCMetrics);
+void Init_cmetrics_registry(VALUE rb_mCMetrics);
 const struct CMetricsCounter *cmetrics_counter_get_ptr(VALUE rb_mCMetrics);
 const struct CMetricsGauge *cmetrics_gauge_get_ptr(VALUE rb_mCMetrics);
 const struct CMetricsUntyped *cmetrics_untyped_get_ptr(VALUE rb_mCMetrics);
+struct CMetricsSerde *cmetrics_serde_get_ptr(VALUE rb_mCMetrics);
+VALUE cmetrics_serde_new(struct cmt *cmt);
+
+void cmetrics_mp_reader_init(struct cmetrics_mp_reader *reader,
+                             const char *buf, size_t size, size_t offset);
+int cmetrics_mp_read(struct cmetrics_mp_reader *reader, struct cmetrics_mp_token *token);
+int cmetrics_mp_read_type(struct cmetrics_mp_reader *reader,
+                          struct cmetrics_mp_token *token, int type);
+int cmetrics_mp_skip(struct cmetrics_mp_reader *reader);
+int cmetrics_mp_token_equals(struct cmetrics_mp_token *token, const char *str);
+int cmetrics_msgpack_validate(const char *buf, size_t size, size_t *offset);
+void cmetrics_mp_write_array(VALUE out, uint32_t length);
+void cmetrics_mp_write_map(VALUE out, uint32_t length);
+void cmetrics_mp_write_str(VALUE out, const char *str, size_t length);
+void cmetrics_mp_write_uint(VALUE out, uint64_t value);
+void cmetrics_mp_write_int(VALUE out, int64_t value);
+void cmetrics_mp_write_double(VALUE out, double value);
+int cmetrics_msgpack_filter(const char *buf, size_t size, size_t *offset,
+                            struct cmetrics_msgpack_filter *filter, struct cmetrics_buffer *out);
+int cmetrics_msgpack_filter_state_init(struct cmetrics_msgpack_filter_state *state,
+                                       struct cmetrics_msgpack_filter *filter,
+                                       uint32_t string_count);
+void cmetrics_msgpack_filter_state_destroy(struct cmetrics_msgpack_filter_state *state);
+void cmetrics_msgpack_filter_state_static(struct cmetrics_msgpack_filter_state *state,
+                                          const char *key, const char *val);
+int cmetrics_msgpack_filter_state_family(struct cmetrics_msgpack_filter_state *state,
+                                         struct cmt_opts *opts, char **keys, uint32_t key_count);
+int cmetrics_msgpack_filter_state_series(struct cmetrics_msgpack_filter_state *state,
+                                         uint32_t count, const uint32_t *refs, char **values);
+
+size_t cmetrics_dtoa(double value, char *buffer);
+int cmetrics_encode_prometheus(struct cmt *cmt, char **out, size_t *size);
+int cmetrics_encode_influx(struct cmt *cmt, char **out, size_t *size);
+int cmetrics_encode_text(struct cmt *cmt, char **out, size_t *size);
+int cmetrics_encode_openmetrics(struct cmt *cmt, struct cmetrics_table *exemplars,
+                                char **out, size_t *size);
+int cmetrics_transcode_msgpack(const char *buf, size_t size, int influx,
+                               char **out, size_t *out_size);
+
+uint64_t cmetrics_hash_bytes(const void *data, size_t length);
+int cmetrics_table_init(struct cmetrics_table *table, size_t capacity);
+void cmetrics_table_destroy(struct cmetrics_table *table);
+void cmetrics_table_clear(struct cmetrics_table *table);
+void **cmetrics_table_lookup(struct cmetrics_table *table, const void *key, size_t length,
+                             int create, int *created);
+void *cmetrics_table_remove(struct cmetrics_table *table, const void *key, size_t length);
+int cmetrics_key_append(struct cmetrics_key *key, const char *str, size_t length);
+int cmetrics_buffer_append(struct cmetrics_buffer *buffer, const void *data, size_t length);
+void cmetrics_buffer_destroy(struct cmetrics_buffer *buffer);
+
+struct cmt_map *cmetrics_context_family_create(struct cmt *cmt, int type, struct cmt_opts *opts,
+                                               int label_count, char **label_keys);
+struct cmt_map *cmetrics_context_distribution_create(struct cmt *cmt, int type,
+                                                     struct cmt_opts *opts,
+                                                     size_t bound_count, double *bounds,
+                                                     int label_count, char **label_keys);
+void cmetrics_context_label_keys(struct cmt_map *map, char **keys);
+void cmetrics_context_label_values(struct cmt_map *map, struct cmt_metric *metric, char **values);
+int cmetrics_context_copy_static_labels(struct cmt *dst, struct cmt *src);
+int cmetrics_context_static_labels_conflict(struct cmt *dst, struct cmt *src);
+int cmetrics_context_foreach_map(struct cmt *cmt, cmetrics_map_cb cb, void *data);
+int cmetrics_context_foreach_family(struct cmt *cmt, cmetrics_map_cb cb, void *data);
+int cmetrics_context_move(struct cmt *dst, struct cmt *src);
+int cmetrics_context_copy_changed(struct cmt *dst, struct cmt *src,
+                                  struct cmetrics_cache *cache, uint64_t since);
+int cmetrics_context_foreach_metric(struct cmt_map *map, cmetrics_metric_cb cb, void *data);
+
+int cmetrics_aggregate(struct cmt *dst, struct cmt *src, const char *fqname,
+                       int label_count, char **label_keys, int without, int op);
+int cmetrics_merge(struct cmt *dst, struct cmt *src, int policy);
+
+VALUE cmetrics_export_msgpack(struct cmt *cmt, struct cmetrics_cache *cache, int argc, VALUE *argv);
+VALUE cmetrics_export_prometheus(struct cmt *cmt, struct cmetrics_cache *cache, int argc, VALUE *argv);
+VALUE cmetrics_export_influx(struct cmt *cmt, int argc, VALUE *argv);
+VALUE cmetrics_export_remote_write(struct cmt *cmt, int argc, VALUE *argv);
+VALUE cmetrics_export_opentelemetry(struct cmt *cmt, int argc, VALUE *argv);
+VALUE cmetrics_export_openmetrics(struct cmt *cmt, struct cmetrics_table *exemplars);
+VALUE cmetrics_export_text(struct cmt *cmt);
+VALUE cmetrics_export_transcoded(int argc, VALUE *argv, int influx);
+VALUE cmetrics_encode_json(struct cmt *cmt, int ndjson);
+int cmetrics_msgpack_to_json_lines(const char *buf, size_t size, VALUE out);
+VALUE cmetrics_export_splunk_hec(struct cmt *cmt, int argc, VALUE *argv);
+VALUE cmetrics_export_cloudwatch_emf(struct cmt *cmt, int argc, VALUE *argv);
+
+void cmetrics_exemplar_parse(VALUE rb_exemplar, double value, struct cmetrics_exemplar *exemplar);
+int cmetrics_exemplar_set(struct cmetrics_table *exemplars, struct cmt_metric *metric,
+                          struct cmetrics_exemplar *exemplar);
+void cmetrics_exemplars_destroy(struct cmetrics_table *exemplars);
+
+VALUE cmetrics_remote_write_each_batch(struct cmt *cmt, VALUE rb_opts);
+int cmetrics_remote_write_decode(struct cmt *cmt, const char *buffer, size_t size, int method);
+VALUE cmetrics_compact_encode(struct cmt *cmt);
+int cmetrics_compact_detect(const char *buf, size_t size, size_t offset);
+int cmetrics_compact_decode(struct cmt *cmt, const char *buf, size_t size, size_t *offset,
+                            struct cmetrics_msgpack_filter *filter);
+VALUE cmetrics_snapshot_encode(struct cmt *cmt);
+int cmetrics_snapshot_decode(struct cmt *cmt, const char *buf, size_t size,
+                            struct cmetrics_msgpack_filter *filter);
+int cmetrics_snapshot_detect(const char *buf, size_t size);
+int cmetrics_snapshot_aggregate(const char *buf, size_t size, const char *fqname, int op,
+                                double *result);
+int cmetrics_mapping_open(struct cmetrics_mapping *mapping, const char *path);
+void cmetrics_mapping_release(struct cmetrics_mapping *mapping, size_t offset);
+void cmetrics_mapping_close(struct cmetrics_mapping *mapping);
+int cmetrics_prometheus_decode(struct cmt *cmt, const char *buffer, size_t size, size_t *line);
+
+struct cmetrics_statsd *cmetrics_statsd_create(struct cmt *cmt, struct cmetrics_cache *cache,
+                                               double *buckets, size_t bucket_count);
+void cmetrics_statsd_destroy(struct cmetrics_statsd *statsd);
+long cmetrics_statsd_ingest(struct cmetrics_statsd *statsd, const char *buffer, size_t size,
+                            uint64_t now);
+uint64_t cmetrics_statsd_rejected(struct cmetrics_statsd *statsd);
+
+int cmetrics_compress_parse(VALUE rb_opts);
+VALUE cmetrics_compress(const char *input, size_t size, int method);
+VALUE cmetrics_compress_str(VALUE input, int method);
+VALUE cmetrics_compress_into(const char *input, size_t size, int method, VALUE target);
+int cmetrics_snappy_uncompress(const char *input, size_t size, char **output, size_t *output_size);
+
+void cmetrics_cache_init(struct cmetrics_cache *cache);
+void cmetrics_cache_mark(struct cmetrics_cache *cache);
+void cmetrics_cache_destroy(struct cmetrics_cache *cache);
+void cmetrics_cache_touch_series(struct cmetrics_cache *cache, struct cmt_map *map,
+                                 int labels_count, char **labels);
+void cmetrics_cache_touch_metric(struct cmetrics_cache *cache, struct cmt_metric *metric);
+void cmetrics_cache_forget_metric(struct cmetrics_cache *cache, struct cmt_metric *metric);
+void cmetrics_cache_forget_all(struct cmetrics_cache *cache);
+void cmetrics_cache_configure(struct cmetrics_cache *cache, int argc, VALUE *argv);
+void cmetrics_cache_disable(struct cmetrics_cache *cache);
 
 #endif // _CMETRICS_C_H
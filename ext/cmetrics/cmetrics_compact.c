@@ -0,0 +1,909 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+#include <math.h>
+
+/*
+ * Compact msgpack payloads. Every string of the context (names, label
+ * keys and values, static labels) is written once in a dictionary and
+ * referenced by its index; series are flat arrays:
+ *
+ *   {"compact" => 1,
+ *    "strings" => [String, ...],
+ *    "static_labels" => [key, value, ...],
+ *    "families" => [[type, ns, ss, name, desc, [key, ...], [series, ...]], ...]}
+ *
+ *   series: [timestamp delta, value, label value, ...]
+ *
+ * Histogram and summary families have an eighth entry, the bucket upper
+ * bounds or the quantiles, and their series hold a sum, a count and the
+ * cumulative bucket counts or quantile values (empty when unset):
+ *
+ *   series: [timestamp delta, sum, count, [value, ...], label value, ...]
+ *
+ * Timestamps are deltas from the previous series of the payload, values
+ * are written as integers whenever that is exact.
+ */
+
+#define COMPACT_VERSION 1
+
+struct compact_encoder {
+    struct cmetrics_table strings; /* string -> index + 1 */
+    const char **dictionary;       /* strings in index order */
+    size_t count;
+    size_t capacity;
+    char **values;                 /* label values of the current series */
+    int values_capacity;
+    uint32_t families;
+    uint64_t timestamp;
+    struct cmt *cmt;
+    VALUE out;
+};
+
+static int
+compact_intern(struct compact_encoder *enc, const char *str)
+{
+    int created;
+    void **slot;
+    size_t capacity;
+    const char **dictionary;
+
+    slot = cmetrics_table_lookup(&enc->strings, str, strlen(str), CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (!created) {
+        return 0;
+    }
+
+    if (enc->count == enc->capacity) {
+        capacity = enc->capacity > 0 ? enc->capacity * 2 : 64;
+        dictionary = realloc(enc->dictionary, capacity * sizeof(char *));
+        if (dictionary == NULL) {
+            return -1;
+        }
+        enc->dictionary = dictionary;
+        enc->capacity = capacity;
+    }
+    enc->dictionary[enc->count++] = str;
+    *slot = (void *)(uintptr_t)enc->count;
+
+    return 0;
+}
+
+static void
+compact_write_ref(struct compact_encoder *enc, const char *str)
+{
+    void **slot = cmetrics_table_lookup(&enc->strings, str, strlen(str), CMT_FALSE, NULL);
+
+    /* every string was interned by the first pass */
+    cmetrics_mp_write_uint(enc->out, (uintptr_t)*slot - 1);
+}
+
+static void
+compact_write_value(VALUE out, double value)
+{
+    if (value >= 0 && value < 18446744073709551616.0 && !signbit(value) &&
+        value == (double)(uint64_t)value) {
+        cmetrics_mp_write_uint(out, (uint64_t)value);
+    }
+    else if (value < 0 && value >= -9223372036854775808.0 &&
+             value == (double)(int64_t)value) {
+        cmetrics_mp_write_int(out, (int64_t)value);
+    }
+    else {
+        cmetrics_mp_write_double(out, value);
+    }
+}
+
+static int
+compact_reserve_values(struct compact_encoder *enc, int count)
+{
+    char **values;
+
+    if (count <= enc->values_capacity) {
+        return 0;
+    }
+    values = realloc(enc->values, count * sizeof(char *));
+    if (values == NULL) {
+        return -1;
+    }
+    enc->values = values;
+    enc->values_capacity = count;
+
+    return 0;
+}
+
+static int
+intern_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    struct compact_encoder *enc = data;
+
+    if (metric == &map->metric) {
+        return 0;
+    }
+
+    cmetrics_context_label_values(map, metric, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        if (compact_intern(enc, enc->values[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+intern_map(struct cmt_map *map, void *data)
+{
+    int i;
+    struct compact_encoder *enc = data;
+
+    if (compact_reserve_values(enc, map->label_count) != 0 ||
+        compact_intern(enc, map->opts->ns) != 0 ||
+        compact_intern(enc, map->opts->subsystem) != 0 ||
+        compact_intern(enc, map->opts->name) != 0 ||
+        compact_intern(enc, map->opts->description) != 0) {
+        return -1;
+    }
+
+    cmetrics_context_label_keys(map, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        if (compact_intern(enc, enc->values[i]) != 0) {
+            return -1;
+        }
+    }
+    enc->families++;
+
+    return cmetrics_context_foreach_metric(map, intern_metric, enc);
+}
+
+static int
+is_distribution(int type)
+{
+    return type == CMT_HISTOGRAM || type == CMT_SUMMARY;
+}
+
+/* The sum, count and bucket counts or quantile values of a series. */
+static void
+write_distribution(struct compact_encoder *enc, struct cmt_map *map, struct cmt_metric *metric)
+{
+    size_t i;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    if (map->type == CMT_HISTOGRAM) {
+        histogram = map->parent;
+        compact_write_value(enc->out, cmt_metric_hist_get_sum_value(metric));
+        cmetrics_mp_write_uint(enc->out, cmt_metric_hist_get_count_value(metric));
+        cmetrics_mp_write_array(enc->out, histogram->buckets->count + 1);
+        for (i = 0; i <= histogram->buckets->count; i++) {
+            cmetrics_mp_write_uint(enc->out, cmt_metric_hist_get_value(metric, (int)i));
+        }
+        return;
+    }
+
+    summary = map->parent;
+    compact_write_value(enc->out, cmt_summary_get_sum_value(metric));
+    cmetrics_mp_write_uint(enc->out, cmt_summary_get_count_value(metric));
+    cmetrics_mp_write_array(enc->out, metric->sum_quantiles_set ? summary->quantiles_count : 0);
+    for (i = 0; metric->sum_quantiles_set && i < summary->quantiles_count; i++) {
+        compact_write_value(enc->out, cmt_summary_quantile_get_value(metric, (int)i));
+    }
+}
+
+static int
+write_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    uint64_t timestamp;
+    struct compact_encoder *enc = data;
+    int label_count = metric == &map->metric ? 0 : map->label_count;
+
+    timestamp = cmt_metric_get_timestamp(metric);
+
+    if (is_distribution(map->type)) {
+        cmetrics_mp_write_array(enc->out, 4 + label_count);
+        cmetrics_mp_write_int(enc->out, (int64_t)(timestamp - enc->timestamp));
+        write_distribution(enc, map, metric);
+    }
+    else {
+        cmetrics_mp_write_array(enc->out, 2 + label_count);
+        cmetrics_mp_write_int(enc->out, (int64_t)(timestamp - enc->timestamp));
+        compact_write_value(enc->out, cmt_metric_get_value(metric));
+    }
+    enc->timestamp = timestamp;
+
+    if (label_count > 0) {
+        cmetrics_context_label_values(map, metric, enc->values);
+        for (i = 0; i < label_count; i++) {
+            compact_write_ref(enc, enc->values[i]);
+        }
+    }
+
+    return 0;
+}
+
+static int
+write_map(struct cmt_map *map, void *data)
+{
+    int i;
+    size_t bound_count;
+    double *bounds;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+    struct compact_encoder *enc = data;
+
+    cmetrics_mp_write_array(enc->out, is_distribution(map->type) ? 8 : 7);
+    cmetrics_mp_write_uint(enc->out, map->type);
+    compact_write_ref(enc, map->opts->ns);
+    compact_write_ref(enc, map->opts->subsystem);
+    compact_write_ref(enc, map->opts->name);
+    compact_write_ref(enc, map->opts->description);
+
+    cmetrics_context_label_keys(map, enc->values);
+    cmetrics_mp_write_array(enc->out, map->label_count);
+    for (i = 0; i < map->label_count; i++) {
+        compact_write_ref(enc, enc->values[i]);
+    }
+
+    cmetrics_mp_write_array(enc->out, map->metric_static_set + cfl_list_size(&map->metrics));
+    cmetrics_context_foreach_metric(map, write_metric, enc);
+
+    if (!is_distribution(map->type)) {
+        return 0;
+    }
+    if (map->type == CMT_HISTOGRAM) {
+        histogram = map->parent;
+        bound_count = histogram->buckets->count;
+        bounds = histogram->buckets->upper_bounds;
+    }
+    else {
+        summary = map->parent;
+        bound_count = summary->quantiles_count;
+        bounds = summary->quantiles;
+    }
+    cmetrics_mp_write_array(enc->out, bound_count);
+    for (i = 0; i < (int)bound_count; i++) {
+        cmetrics_mp_write_double(enc->out, bounds[i]);
+    }
+
+    return 0;
+}
+
+static VALUE
+compact_encode(VALUE data)
+{
+    size_t i;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    struct compact_encoder *enc = (struct compact_encoder *)data;
+    struct cmt *cmt = enc->cmt;
+
+    enc->out = rb_str_buf_new(4096);
+
+    cmetrics_mp_write_map(enc->out, 4);
+    cmetrics_mp_write_str(enc->out, "compact", 7);
+    cmetrics_mp_write_uint(enc->out, COMPACT_VERSION);
+
+    cmetrics_mp_write_str(enc->out, "strings", 7);
+    cmetrics_mp_write_array(enc->out, enc->count);
+    for (i = 0; i < enc->count; i++) {
+        cmetrics_mp_write_str(enc->out, enc->dictionary[i], strlen(enc->dictionary[i]));
+    }
+
+    cmetrics_mp_write_str(enc->out, "static_labels", 13);
+    cmetrics_mp_write_array(enc->out, cfl_list_size(&cmt->static_labels->list) * 2);
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        compact_write_ref(enc, static_label->key);
+        compact_write_ref(enc, static_label->val);
+    }
+
+    cmetrics_mp_write_str(enc->out, "families", 8);
+    cmetrics_mp_write_array(enc->out, enc->families);
+    cmetrics_context_foreach_family(cmt, write_map, enc);
+
+    return enc->out;
+}
+
+static VALUE
+compact_release(VALUE data)
+{
+    struct compact_encoder *enc = (struct compact_encoder *)data;
+
+    cmetrics_table_destroy(&enc->strings);
+    free(enc->dictionary);
+    free(enc->values);
+
+    return Qnil;
+}
+
+/*
+ * Encode the families of 'cmt' as a compact payload. Raises NoMemError
+ * when the dictionary cannot be built.
+ */
+VALUE
+cmetrics_compact_encode(struct cmt *cmt)
+{
+    int ret = 0;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    struct compact_encoder enc;
+
+    memset(&enc, 0, sizeof(enc));
+    if (cmetrics_table_init(&enc.strings, 64) != 0) {
+        rb_raise(rb_eNoMemError, "cannot encode the cmt context");
+    }
+
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        if (compact_intern(&enc, static_label->key) != 0 ||
+            compact_intern(&enc, static_label->val) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        ret = cmetrics_context_foreach_family(cmt, intern_map, &enc);
+    }
+    if (ret != 0) {
+        compact_release((VALUE)&enc);
+        rb_raise(rb_eNoMemError, "cannot encode the cmt context");
+    }
+
+    enc.cmt = cmt;
+
+    return rb_ensure(compact_encode, (VALUE)&enc, compact_release, (VALUE)&enc);
+}
+
+struct compact_decoder {
+    struct cmetrics_mp_reader reader;
+    struct cmt *cmt;           /* NULL when only validating */
+    uint32_t string_count;
+    char **strings;            /* NUL terminated copies */
+    char **values;             /* family label keys, then series label values */
+    uint32_t *refs;            /* dictionary indices of the series label values */
+    uint64_t timestamp;
+    uint32_t bound_count;      /* histogram bucket bounds or summary quantiles */
+    double *bounds;
+    double sum;                /* histogram and summary series */
+    uint64_t count;
+    uint64_t *buckets;
+    double *quantiles;         /* NULL when the series has none */
+    double *quantile_values;
+    struct cmetrics_msgpack_filter *filter;
+    struct cmetrics_msgpack_filter_state state;
+};
+
+static int
+compact_read_index(struct compact_decoder *dec, uint32_t *index)
+{
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_UINT) != 0 ||
+        token.u >= dec->string_count) {
+        return -1;
+    }
+    *index = (uint32_t)token.u;
+
+    return 0;
+}
+
+static int
+compact_read_ref(struct compact_decoder *dec, char **str)
+{
+    uint32_t index;
+
+    if (compact_read_index(dec, &index) != 0) {
+        return -1;
+    }
+    if (str) {
+        *str = dec->strings ? dec->strings[index] : NULL;
+    }
+
+    return 0;
+}
+
+/* Copy the dictionary into one block, each string followed by a NUL. */
+static int
+compact_read_strings(struct compact_decoder *dec)
+{
+    uint32_t i;
+    size_t total = 0;
+    size_t start;
+    char *data;
+    struct cmetrics_mp_token array;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    start = dec->reader.offset;
+    for (i = 0; i < array.length; i++) {
+        if (cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        total += token.length + 1;
+    }
+    dec->string_count = array.length;
+    if (dec->cmt == NULL) {
+        return 0;
+    }
+
+    /* the block of pointers is followed by the string data */
+    dec->strings = malloc(array.length * sizeof(char *) + total + 1);
+    if (dec->strings == NULL) {
+        return -1;
+    }
+    data = (char *)(dec->strings + array.length);
+
+    dec->reader.offset = start;
+    for (i = 0; i < array.length; i++) {
+        cmetrics_mp_read(&dec->reader, &token);
+        memcpy(data, token.ptr, token.length);
+        data[token.length] = '\0';
+        dec->strings[i] = data;
+        data += token.length + 1;
+    }
+
+    return cmetrics_msgpack_filter_state_init(&dec->state, dec->filter, array.length);
+}
+
+static int
+compact_read_static_labels(struct compact_decoder *dec)
+{
+    uint32_t i;
+    char *key;
+    char *val;
+    struct cmetrics_mp_token array;
+
+    if (cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0 ||
+        array.length % 2 != 0) {
+        return -1;
+    }
+    for (i = 0; i < array.length; i += 2) {
+        if (compact_read_ref(dec, &key) != 0 || compact_read_ref(dec, &val) != 0) {
+            return -1;
+        }
+        if (dec->cmt == NULL) {
+            continue;
+        }
+        if (cmt_label_add(dec->cmt, key, val) != 0) {
+            return -1;
+        }
+        cmetrics_msgpack_filter_state_static(&dec->state, key, val);
+    }
+
+    return 0;
+}
+
+static int
+compact_read_number(struct compact_decoder *dec, double *value)
+{
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read(&dec->reader, &token) != 0) {
+        return -1;
+    }
+    switch (token.type) {
+    case CMETRICS_MP_UINT:
+        *value = (double)token.u;
+        break;
+    case CMETRICS_MP_INT:
+        *value = (double)token.i;
+        break;
+    case CMETRICS_MP_FLOAT:
+        *value = token.d;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The sum, count and bucket counts or quantile values of a series. */
+static int
+compact_read_distribution(struct compact_decoder *dec, int type)
+{
+    uint32_t i;
+    double value;
+    struct cmetrics_mp_token array;
+    struct cmetrics_mp_token token;
+
+    if (compact_read_number(dec, &dec->sum) != 0 ||
+        cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_UINT) != 0 ||
+        cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    dec->count = token.u;
+
+    if (type == CMT_HISTOGRAM) {
+        if (array.length != dec->bound_count + 1) {
+            return -1;
+        }
+        for (i = 0; i < array.length; i++) {
+            if (cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_UINT) != 0) {
+                return -1;
+            }
+            if (dec->buckets) {
+                dec->buckets[i] = token.u;
+            }
+        }
+        return 0;
+    }
+
+    if (array.length != 0 && array.length != dec->bound_count) {
+        return -1;
+    }
+    for (i = 0; i < array.length; i++) {
+        if (compact_read_number(dec, &value) != 0) {
+            return -1;
+        }
+        if (dec->quantile_values) {
+            dec->quantile_values[i] = value;
+        }
+    }
+    dec->quantiles = array.length > 0 ? dec->quantile_values : NULL;
+
+    return 0;
+}
+
+/*
+ * Read one series: its label values go to dec->values from 'values' on,
+ * their indices to dec->refs. Histogram and summary values go to 'dec'.
+ */
+static int
+compact_read_series(struct compact_decoder *dec, int type, int label_count, char **values,
+                    uint32_t *count, double *value)
+{
+    uint32_t i;
+    uint32_t index;
+    uint32_t fields = is_distribution(type) ? 4 : 2;
+    struct cmetrics_mp_token array;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0 ||
+        (array.length != fields && array.length != fields + (uint32_t)label_count)) {
+        return -1;
+    }
+
+    if (cmetrics_mp_read(&dec->reader, &token) != 0) {
+        return -1;
+    }
+    if (token.type == CMETRICS_MP_UINT) {
+        dec->timestamp += token.u;
+    }
+    else if (token.type == CMETRICS_MP_INT) {
+        dec->timestamp += (uint64_t)token.i;
+    }
+    else {
+        return -1;
+    }
+
+    if (is_distribution(type) ? compact_read_distribution(dec, type) != 0 :
+                                compact_read_number(dec, value) != 0) {
+        return -1;
+    }
+
+    for (i = fields; i < array.length; i++) {
+        if (compact_read_index(dec, &index) != 0) {
+            return -1;
+        }
+        if (values) {
+            values[i - fields] = dec->strings[index];
+            dec->refs[i - fields] = index;
+        }
+    }
+    *count = array.length - fields;
+
+    return 0;
+}
+
+/*
+ * Read the bucket bounds or quantiles which follow the series of a
+ * histogram or summary family, and size the series buffers after them.
+ */
+static int
+compact_read_bounds(struct compact_decoder *dec)
+{
+    uint32_t i;
+    double bound;
+    struct cmetrics_mp_token array;
+
+    if (cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    dec->bound_count = array.length;
+
+    if (dec->cmt) {
+        free(dec->bounds);
+        free(dec->buckets);
+        free(dec->quantile_values);
+        dec->bounds = malloc(((size_t)array.length + 1) * sizeof(double));
+        dec->buckets = malloc(((size_t)array.length + 1) * sizeof(uint64_t));
+        dec->quantile_values = malloc(((size_t)array.length + 1) * sizeof(double));
+        if (dec->bounds == NULL || dec->buckets == NULL || dec->quantile_values == NULL) {
+            return -1;
+        }
+    }
+    for (i = 0; i < array.length; i++) {
+        if (compact_read_number(dec, &bound) != 0) {
+            return -1;
+        }
+        if (dec->bounds) {
+            dec->bounds[i] = bound;
+        }
+    }
+
+    return 0;
+}
+
+static struct cmt_map *
+compact_family_create(struct compact_decoder *dec, int type, struct cmt_opts *opts,
+                      int label_count)
+{
+    if (is_distribution(type)) {
+        return cmetrics_context_distribution_create(dec->cmt, type, opts, dec->bound_count,
+                                                    dec->bounds, label_count, dec->values);
+    }
+
+    return cmetrics_context_family_create(dec->cmt, type, opts, label_count, dec->values);
+}
+
+static int
+compact_set_series(struct compact_decoder *dec, struct cmt_map *map,
+                   uint32_t count, char **values, double value)
+{
+    struct cmt_metric *metric;
+
+    if (count == 0) {
+        values = NULL;
+    }
+
+    if (map->type == CMT_HISTOGRAM) {
+        return cmt_histogram_set_default(map->parent, dec->timestamp, dec->buckets,
+                                         dec->sum, dec->count, count, values);
+    }
+    if (map->type == CMT_SUMMARY) {
+        return cmt_summary_set_default(map->parent, dec->timestamp, dec->quantiles,
+                                       dec->sum, dec->count, count, values);
+    }
+
+    metric = cmt_map_metric_get(map->opts, map, count, values, CMT_TRUE);
+    if (metric == NULL) {
+        return -1;
+    }
+    cmt_metric_set(metric, dec->timestamp, value);
+
+    return 0;
+}
+
+static int
+compact_read_family(struct compact_decoder *dec)
+{
+    uint32_t i;
+    uint32_t count;
+    int type;
+    int keep;
+    double value = 0;
+    size_t series;
+    size_t end = 0;
+    struct cmt_opts opts;
+    struct cmt_map *map = NULL;
+    struct cmetrics_mp_token array;
+    struct cmetrics_mp_token token;
+
+    memset(&opts, 0, sizeof(opts));
+
+    if (cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0 ||
+        cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_UINT) != 0 ||
+        token.u > CMT_UNTYPED) {
+        return -1;
+    }
+    type = (int)token.u;
+    if (array.length != (is_distribution(type) ? 8 : 7)) {
+        return -1;
+    }
+
+    if (compact_read_ref(dec, &opts.ns) != 0 ||
+        compact_read_ref(dec, &opts.subsystem) != 0 ||
+        compact_read_ref(dec, &opts.name) != 0 ||
+        compact_read_ref(dec, &opts.description) != 0 ||
+        cmetrics_mp_read_type(&dec->reader, &array, CMETRICS_MP_ARRAY) != 0 ||
+        array.length > INT_MAX) {
+        return -1;
+    }
+
+    /* label keys first, then the label values of the current series */
+    if (dec->cmt) {
+        free(dec->values);
+        free(dec->refs);
+        dec->values = malloc((2 * (size_t)array.length + 1) * sizeof(char *));
+        dec->refs = malloc(((size_t)array.length + 1) * sizeof(uint32_t));
+        if (dec->values == NULL || dec->refs == NULL) {
+            return -1;
+        }
+    }
+    for (i = 0; i < array.length; i++) {
+        if (compact_read_ref(dec, dec->values ? &dec->values[i] : NULL) != 0) {
+            return -1;
+        }
+    }
+
+    /* the bounds follow the series, which need them */
+    if (is_distribution(type)) {
+        series = dec->reader.offset;
+        if (cmetrics_mp_skip(&dec->reader) != 0 || compact_read_bounds(dec) != 0) {
+            return -1;
+        }
+        end = dec->reader.offset;
+        dec->reader.offset = series;
+    }
+
+    keep = dec->cmt != NULL &&
+           cmetrics_msgpack_filter_state_family(&dec->state, &opts, dec->values, array.length);
+
+    if (cmetrics_mp_read_type(&dec->reader, &token, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    for (i = 0; i < token.length; i++) {
+        if (compact_read_series(dec, type, (int)array.length,
+                                dec->values ? dec->values + array.length : NULL,
+                                &count, &value) != 0) {
+            return -1;
+        }
+        if (!keep || !cmetrics_msgpack_filter_state_series(&dec->state, count, dec->refs,
+                                                            dec->values + array.length)) {
+            continue;
+        }
+
+        /* families left without series by the filter are not created */
+        if (map == NULL) {
+            map = compact_family_create(dec, type, &opts, (int)array.length);
+            if (map == NULL) {
+                return -1;
+            }
+        }
+        if (compact_set_series(dec, map, count, dec->values + array.length, value) != 0) {
+            return -1;
+        }
+    }
+    if (end > 0) {
+        dec->reader.offset = end;
+    }
+
+    if (keep && !dec->state.per_series && map == NULL &&
+        compact_family_create(dec, type, &opts, (int)array.length) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the payload at 'offset' is a compact one, which the encoder
+ * starts with its "compact" key.
+ */
+int
+cmetrics_compact_detect(const char *buf, size_t size, size_t offset)
+{
+    struct cmetrics_mp_reader reader;
+    struct cmetrics_mp_token token;
+
+    cmetrics_mp_reader_init(&reader, buf, size, offset);
+
+    return cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_MAP) == 0 &&
+           token.length > 0 &&
+           cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_STR) == 0 &&
+           cmetrics_mp_token_equals(&token, "compact");
+}
+
+/*
+ * Decode the compact payload at *offset into 'cmt', or only check it when
+ * 'cmt' is NULL. The families and series rejected by 'filter', when it is
+ * not NULL, are skipped. On success *offset points right after the payload.
+ */
+int
+cmetrics_compact_decode(struct cmt *cmt, const char *buf, size_t size, size_t *offset,
+                        struct cmetrics_msgpack_filter *filter)
+{
+    int ret = 0;
+    uint32_t i;
+    uint32_t j;
+    size_t strings = 0;
+    size_t static_labels = 0;
+    size_t families = 0;
+    size_t end;
+    struct compact_decoder dec;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    memset(&dec, 0, sizeof(dec));
+    dec.cmt = cmt;
+    dec.filter = cmt ? filter : NULL;
+    cmetrics_mp_reader_init(&dec.reader, buf, size, *offset);
+
+    /* locate the sections first, the dictionary is needed by the others */
+    if (cmetrics_mp_read_type(&dec.reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+    for (i = 0; i < map.length && ret == 0; i++) {
+        if (cmetrics_mp_read_type(&dec.reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "compact")) {
+            if (cmetrics_mp_read_type(&dec.reader, &token, CMETRICS_MP_UINT) != 0 ||
+                token.u != COMPACT_VERSION) {
+                return -1;
+            }
+            continue;
+        }
+        if (cmetrics_mp_token_equals(&key, "strings")) {
+            strings = dec.reader.offset;
+        }
+        else if (cmetrics_mp_token_equals(&key, "static_labels")) {
+            static_labels = dec.reader.offset;
+        }
+        else if (cmetrics_mp_token_equals(&key, "families")) {
+            families = dec.reader.offset;
+        }
+        ret = cmetrics_mp_skip(&dec.reader);
+    }
+    if (ret != 0 || strings == 0 || families == 0) {
+        return -1;
+    }
+    end = dec.reader.offset;
+
+    dec.reader.offset = strings;
+    ret = compact_read_strings(&dec);
+
+    if (ret == 0 && static_labels > 0) {
+        dec.reader.offset = static_labels;
+        ret = compact_read_static_labels(&dec);
+    }
+
+    if (ret == 0) {
+        dec.reader.offset = families;
+        ret = cmetrics_mp_read_type(&dec.reader, &token, CMETRICS_MP_ARRAY);
+        for (j = 0; j < token.length && ret == 0; j++) {
+            ret = compact_read_family(&dec);
+        }
+    }
+
+    free(dec.strings);
+    free(dec.values);
+    free(dec.refs);
+    free(dec.bounds);
+    free(dec.buckets);
+    free(dec.quantile_values);
+    cmetrics_msgpack_filter_state_destroy(&dec.state);
+
+    if (ret != 0) {
+        return -1;
+    }
+    *offset = end;
+
+    return 0;
+}
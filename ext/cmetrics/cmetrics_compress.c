@@ -0,0 +1,574 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+#include <ruby/thread.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+# include <zlib.h>
+# define CMETRICS_HAVE_GZIP 1
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+# include <zstd.h>
+# define CMETRICS_HAVE_ZSTD 1
+#endif
+
+/*
+ * Compression of encoder output. Compressors write straight into the
+ * returned (or the caller's) Ruby String and run without the GVL.
+ */
+
+/* snappy block format: a varint length followed by literals and copies */
+#define SNAPPY_BLOCK_SIZE  65536
+#define SNAPPY_HASH_BITS   14
+#define SNAPPY_HASH_SIZE   (1 << SNAPPY_HASH_BITS)
+#define SNAPPY_MIN_MATCH   4
+
+struct compress_args {
+    int method;
+    const char *input;
+    size_t input_size;
+    char *output;
+    size_t output_size;
+    int ret;
+};
+
+static inline uint32_t
+snappy_load32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline uint32_t
+snappy_hash(uint32_t v)
+{
+    return (v * 0x1e35a7bdU) >> (32 - SNAPPY_HASH_BITS);
+}
+
+static size_t
+snappy_max_compressed_length(size_t size)
+{
+    return 32 + size + size / 6;
+}
+
+static unsigned char *
+snappy_emit_literal(unsigned char *out, const unsigned char *literal, size_t length)
+{
+    size_t n = length - 1;
+
+    if (n < 60) {
+        *out++ = (unsigned char)(n << 2);
+    }
+    else if (n < (1 << 8)) {
+        *out++ = 60 << 2;
+        *out++ = (unsigned char)n;
+    }
+    else {
+        /* blocks are at most 64KiB, so two bytes are enough */
+        *out++ = 61 << 2;
+        *out++ = (unsigned char)(n & 0xff);
+        *out++ = (unsigned char)(n >> 8);
+    }
+    memcpy(out, literal, length);
+
+    return out + length;
+}
+
+static unsigned char *
+snappy_emit_copy(unsigned char *out, size_t offset, size_t length)
+{
+    /* copies with 2 bytes offsets hold up to 64 bytes */
+    while (length >= 68) {
+        *out++ = (63 << 2) | 2;
+        *out++ = (unsigned char)(offset & 0xff);
+        *out++ = (unsigned char)(offset >> 8);
+        length -= 64;
+    }
+    if (length > 64) {
+        *out++ = (59 << 2) | 2;
+        *out++ = (unsigned char)(offset & 0xff);
+        *out++ = (unsigned char)(offset >> 8);
+        length -= 60;
+    }
+
+    if (length < 12 && offset < 2048) {
+        *out++ = (unsigned char)(1 | ((length - 4) << 2) | ((offset >> 8) << 5));
+        *out++ = (unsigned char)(offset & 0xff);
+    }
+    else {
+        *out++ = (unsigned char)(((length - 1) << 2) | 2);
+        *out++ = (unsigned char)(offset & 0xff);
+        *out++ = (unsigned char)(offset >> 8);
+    }
+
+    return out;
+}
+
+static unsigned char *
+snappy_compress_block(unsigned char *out, const unsigned char *block, size_t size,
+                      uint16_t *table)
+{
+    const unsigned char *p = block;
+    const unsigned char *end = block + size;
+    const unsigned char *literal = block;
+    const unsigned char *candidate;
+    const unsigned char *match_end;
+    size_t offset;
+    uint32_t h;
+
+    if (size < SNAPPY_MIN_MATCH + 1) {
+        return size > 0 ? snappy_emit_literal(out, block, size) : out;
+    }
+
+    memset(table, 0, SNAPPY_HASH_SIZE * sizeof(uint16_t));
+
+    while (p + SNAPPY_MIN_MATCH <= end) {
+        h = snappy_hash(snappy_load32(p));
+        candidate = block + table[h];
+        table[h] = (uint16_t)(p - block);
+
+        if (candidate >= p || snappy_load32(candidate) != snappy_load32(p)) {
+            p++;
+            continue;
+        }
+
+        if (p > literal) {
+            out = snappy_emit_literal(out, literal, p - literal);
+        }
+
+        offset = p - candidate;
+        match_end = p + SNAPPY_MIN_MATCH;
+        candidate += SNAPPY_MIN_MATCH;
+        while (match_end < end && *match_end == *candidate) {
+            match_end++;
+            candidate++;
+        }
+        out = snappy_emit_copy(out, offset, match_end - p);
+        p = match_end;
+        literal = p;
+    }
+
+    if (literal < end) {
+        out = snappy_emit_literal(out, literal, end - literal);
+    }
+
+    return out;
+}
+
+static int
+snappy_compress(const char *input, size_t size, char *output, size_t *output_size)
+{
+    unsigned char *out = (unsigned char *)output;
+    const unsigned char *in = (const unsigned char *)input;
+    size_t n = size;
+    size_t block;
+    uint16_t *table;
+
+    table = malloc(SNAPPY_HASH_SIZE * sizeof(uint16_t));
+    if (table == NULL) {
+        return -1;
+    }
+
+    while (n >= 0x80) {
+        *out++ = (unsigned char)(n | 0x80);
+        n >>= 7;
+    }
+    *out++ = (unsigned char)n;
+
+    while (size > 0) {
+        block = size < SNAPPY_BLOCK_SIZE ? size : SNAPPY_BLOCK_SIZE;
+        out = snappy_compress_block(out, in, block, table);
+        in += block;
+        size -= block;
+    }
+    free(table);
+
+    *output_size = out - (unsigned char *)output;
+
+    return 0;
+}
+
+/*
+ * Uncompress a snappy block into a new buffer owned by the caller (free()).
+ * Returns 0 on success and -1 on malformed input.
+ */
+int
+cmetrics_snappy_uncompress(const char *input, size_t size, char **output, size_t *output_size)
+{
+    const unsigned char *in = (const unsigned char *)input;
+    const unsigned char *end = in + size;
+    unsigned char *out;
+    size_t length = 0;
+    size_t op = 0;
+    size_t n;
+    size_t offset;
+    int shift = 0;
+    unsigned char tag;
+
+    for (;;) {
+        if (in >= end || shift > 28) {
+            return -1;
+        }
+        length |= (size_t)(*in & 0x7f) << shift;
+        if ((*in++ & 0x80) == 0) {
+            break;
+        }
+        shift += 7;
+    }
+
+    /* a copy tag expands 3 bytes into at most 64, refuse bogus lengths */
+    if (length > size * 22 + 64) {
+        return -1;
+    }
+
+    out = malloc(length > 0 ? length : 1);
+    if (out == NULL) {
+        return -1;
+    }
+
+    while (in < end) {
+        tag = *in++;
+        switch (tag & 3) {
+        case 0:
+            n = tag >> 2;
+            if (n >= 60) {
+                size_t bytes = n - 59;
+                size_t i;
+
+                if ((size_t)(end - in) < bytes) {
+                    goto error;
+                }
+                n = 0;
+                for (i = 0; i < bytes; i++) {
+                    n |= (size_t)in[i] << (8 * i);
+                }
+                in += bytes;
+            }
+            n += 1;
+            if ((size_t)(end - in) < n || length - op < n) {
+                goto error;
+            }
+            memcpy(out + op, in, n);
+            in += n;
+            op += n;
+            continue;
+        case 1:
+            if (in >= end) {
+                goto error;
+            }
+            n = ((tag >> 2) & 7) + 4;
+            offset = ((size_t)(tag >> 5) << 8) | *in++;
+            break;
+        case 2:
+            if (end - in < 2) {
+                goto error;
+            }
+            n = (tag >> 2) + 1;
+            offset = in[0] | ((size_t)in[1] << 8);
+            in += 2;
+            break;
+        default:
+            if (end - in < 4) {
+                goto error;
+            }
+            n = (tag >> 2) + 1;
+            offset = in[0] | ((size_t)in[1] << 8) | ((size_t)in[2] << 16) | ((size_t)in[3] << 24);
+            in += 4;
+            break;
+        }
+
+        if (offset == 0 || offset > op || length - op < n) {
+            goto error;
+        }
+        /* copies may overlap their own output */
+        for (; n > 0; n--, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    if (op != length) {
+        goto error;
+    }
+
+    *output = (char *)out;
+    *output_size = length;
+
+    return 0;
+
+error:
+    free(out);
+    return -1;
+}
+
+#ifdef CMETRICS_HAVE_GZIP
+/* zlib counts in uInt, larger buffers are handed over in pieces */
+#define GZIP_CHUNK_SIZE ((size_t)UINT_MAX)
+
+static int
+gzip_compress(const char *input, size_t size, char *output, size_t *output_size)
+{
+    int ret;
+    size_t input_left = size;
+    size_t output_left = *output_size;
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    /* 16 + MAX_WBITS writes a gzip header */
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    stream.next_in = (Bytef *)input;
+    stream.next_out = (Bytef *)output;
+    do {
+        if (stream.avail_in == 0 && input_left > 0) {
+            stream.avail_in = (uInt)(input_left < GZIP_CHUNK_SIZE ?
+                                     input_left : GZIP_CHUNK_SIZE);
+            input_left -= stream.avail_in;
+        }
+        if (stream.avail_out == 0 && output_left > 0) {
+            stream.avail_out = (uInt)(output_left < GZIP_CHUNK_SIZE ?
+                                      output_left : GZIP_CHUNK_SIZE);
+            output_left -= stream.avail_out;
+        }
+        ret = deflate(&stream, input_left == 0 ? Z_FINISH : Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    /* total_out is a uLong, 32 bits wide on Windows */
+    *output_size = (size_t)((char *)stream.next_out - output);
+    deflateEnd(&stream);
+
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+#endif
+
+#ifdef CMETRICS_HAVE_ZSTD
+static int
+zstd_compress(const char *input, size_t size, char *output, size_t *output_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(output, *output_size, input, size, 3);
+    if (ZSTD_isError(ret)) {
+        return -1;
+    }
+    *output_size = ret;
+
+    return 0;
+}
+#endif
+
+static size_t
+compress_bound(int method, size_t size)
+{
+    switch (method) {
+#ifdef CMETRICS_HAVE_GZIP
+    case CMETRICS_COMPRESS_GZIP:
+        /* compressBound() plus the gzip header and trailer, in size_t
+         * since uLong is 32 bits wide on Windows */
+        return size + (size >> 12) + (size >> 14) + (size >> 25) + 13 + 18;
+#endif
+#ifdef CMETRICS_HAVE_ZSTD
+    case CMETRICS_COMPRESS_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+    default:
+        return snappy_max_compressed_length(size);
+    }
+}
+
+static void *
+compress_without_gvl(void *data)
+{
+    struct compress_args *args = data;
+
+    switch (args->method) {
+#ifdef CMETRICS_HAVE_GZIP
+    case CMETRICS_COMPRESS_GZIP:
+        args->ret = gzip_compress(args->input, args->input_size,
+                                  args->output, &args->output_size);
+        break;
+#endif
+#ifdef CMETRICS_HAVE_ZSTD
+    case CMETRICS_COMPRESS_ZSTD:
+        args->ret = zstd_compress(args->input, args->input_size,
+                                  args->output, &args->output_size);
+        break;
+#endif
+    default:
+        args->ret = snappy_compress(args->input, args->input_size,
+                                    args->output, &args->output_size);
+        break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse the compress: option: nil, :gzip, :zstd or :snappy. Raises
+ * ArgumentError for unknown or not compiled in methods.
+ */
+int
+cmetrics_compress_parse(VALUE rb_opts)
+{
+    VALUE rb_method;
+    ID id;
+
+    if (NIL_P(rb_opts)) {
+        return CMETRICS_COMPRESS_NONE;
+    }
+
+    rb_method = rb_hash_aref(rb_opts, ID2SYM(rb_intern("compress")));
+    if (NIL_P(rb_method)) {
+        return CMETRICS_COMPRESS_NONE;
+    }
+
+    Check_Type(rb_method, T_SYMBOL);
+    id = SYM2ID(rb_method);
+    if (id == rb_intern("snappy")) {
+        return CMETRICS_COMPRESS_SNAPPY;
+    }
+    else if (id == rb_intern("gzip")) {
+#ifdef CMETRICS_HAVE_GZIP
+        return CMETRICS_COMPRESS_GZIP;
+#else
+        rb_raise(rb_eArgError, "gzip support is not compiled in");
+#endif
+    }
+    else if (id == rb_intern("zstd")) {
+#ifdef CMETRICS_HAVE_ZSTD
+        return CMETRICS_COMPRESS_ZSTD;
+#else
+        rb_raise(rb_eArgError, "zstd support is not compiled in");
+#endif
+    }
+
+    rb_raise(rb_eArgError, "compress: should be :gzip, :zstd or :snappy");
+}
+
+/*
+ * Compress into the binary String 'str', which holds 'args->output_size'
+ * bytes. It is locked while the compressor runs without the GVL.
+ */
+static void
+compress_to_str(VALUE str, struct compress_args *args)
+{
+    args->output = RSTRING_PTR(str);
+    args->ret = -1;
+
+    rb_str_locktmp(str);
+    rb_thread_call_without_gvl(compress_without_gvl, args, NULL, NULL);
+    rb_str_unlocktmp(str);
+
+    if (args->ret != 0) {
+        rb_raise(rb_eRuntimeError, "cannot compress the encoded buffer");
+    }
+
+    rb_str_set_len(str, args->output_size);
+    rb_enc_associate(str, rb_ascii8bit_encoding());
+}
+
+/*
+ * Compress 'size' bytes of 'input' into a new binary String. 'input' must
+ * not be a Ruby object since it is read without the GVL.
+ */
+VALUE
+cmetrics_compress(const char *input, size_t size, int method)
+{
+    VALUE str;
+    struct compress_args args;
+
+    if (method == CMETRICS_COMPRESS_NONE) {
+        return rb_str_new(input, size);
+    }
+
+    args.method = method;
+    args.input = input;
+    args.input_size = size;
+    args.output_size = compress_bound(method, size);
+
+    str = rb_str_buf_new(args.output_size);
+    compress_to_str(str, &args);
+
+    return str;
+}
+
+static VALUE
+compress_locked(VALUE data)
+{
+    struct compress_args *args = (struct compress_args *)data;
+    VALUE str = rb_str_buf_new(args->output_size);
+
+    compress_to_str(str, args);
+
+    return str;
+}
+
+static VALUE
+compress_unlock(VALUE input)
+{
+    rb_str_unlocktmp(input);
+
+    return Qnil;
+}
+
+/*
+ * Same as cmetrics_compress() for the contents of the String 'input',
+ * which is locked instead of copied while the compressor reads it.
+ * 'method' must not be CMETRICS_COMPRESS_NONE.
+ */
+VALUE
+cmetrics_compress_str(VALUE input, int method)
+{
+    struct compress_args args;
+
+    args.method = method;
+    args.input = RSTRING_PTR(input);
+    args.input_size = RSTRING_LEN(input);
+    args.output_size = compress_bound(method, args.input_size);
+
+    rb_str_locktmp(input);
+
+    return rb_ensure(compress_locked, (VALUE)&args, compress_unlock, input);
+}
+
+/*
+ * Same as cmetrics_compress(), replacing the contents of 'target' instead
+ * of allocating a String. 'method' must not be CMETRICS_COMPRESS_NONE.
+ */
+VALUE
+cmetrics_compress_into(const char *input, size_t size, int method, VALUE target)
+{
+    struct compress_args args;
+
+    args.method = method;
+    args.input = input;
+    args.input_size = size;
+    args.output_size = compress_bound(method, size);
+
+    rb_str_resize(target, (long)args.output_size);
+    compress_to_str(target, &args);
+
+    return target;
+}
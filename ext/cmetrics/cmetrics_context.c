@@ -0,0 +1,488 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/*
+ * Helpers shared by the features which build or rewrite cmt contexts
+ * directly through the cmetrics API.
+ */
+
+/*
+ * Create a counter, gauge or untyped family in 'cmt' and return its map.
+ */
+struct cmt_map *
+cmetrics_context_family_create(struct cmt *cmt, int type, struct cmt_opts *opts,
+                               int label_count, char **label_keys)
+{
+    struct cmt_counter *counter;
+    struct cmt_gauge *gauge;
+    struct cmt_untyped *untyped;
+
+    switch (type) {
+    case CMT_COUNTER:
+        counter = cmt_counter_create(cmt, opts->ns, opts->subsystem, opts->name,
+                                     opts->description, label_count, label_keys);
+        return counter ? counter->map : NULL;
+    case CMT_GAUGE:
+        gauge = cmt_gauge_create(cmt, opts->ns, opts->subsystem, opts->name,
+                                 opts->description, label_count, label_keys);
+        return gauge ? gauge->map : NULL;
+    case CMT_UNTYPED:
+        untyped = cmt_untyped_create(cmt, opts->ns, opts->subsystem, opts->name,
+                                     opts->description, label_count, label_keys);
+        return untyped ? untyped->map : NULL;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Create a histogram or summary family in 'cmt' and return its map.
+ * 'bounds' holds the bucket upper bounds of a histogram, or the
+ * quantiles of a summary.
+ */
+struct cmt_map *
+cmetrics_context_distribution_create(struct cmt *cmt, int type, struct cmt_opts *opts,
+                                     size_t bound_count, double *bounds,
+                                     int label_count, char **label_keys)
+{
+    struct cmt_histogram *histogram;
+    struct cmt_histogram_buckets *buckets;
+    struct cmt_summary *summary;
+
+    if (type == CMT_HISTOGRAM) {
+        buckets = cmt_histogram_buckets_create_size(bounds, bound_count);
+        if (buckets == NULL) {
+            return NULL;
+        }
+        histogram = cmt_histogram_create(cmt, opts->ns, opts->subsystem, opts->name,
+                                         opts->description, buckets, label_count, label_keys);
+        return histogram ? histogram->map : NULL;
+    }
+    if (type == CMT_SUMMARY) {
+        summary = cmt_summary_create(cmt, opts->ns, opts->subsystem, opts->name,
+                                     opts->description, bound_count, bounds,
+                                     label_count, label_keys);
+        return summary ? summary->map : NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Collect the label keys of a map into 'keys', which must hold
+ * map->label_count entries.
+ */
+void
+cmetrics_context_label_keys(struct cmt_map *map, char **keys)
+{
+    int i = 0;
+    struct cfl_list *head;
+    struct cmt_map_label *label;
+
+    cfl_list_foreach(head, &map->label_keys) {
+        label = cfl_list_entry(head, struct cmt_map_label, _head);
+        keys[i++] = label->name;
+    }
+}
+
+/*
+ * Collect the label values of a metric into 'values' (map->label_count
+ * entries). Missing trailing values are set to an empty string.
+ */
+void
+cmetrics_context_label_values(struct cmt_map *map, struct cmt_metric *metric, char **values)
+{
+    int i = 0;
+    struct cfl_list *head;
+    struct cmt_map_label *label;
+
+    cfl_list_foreach(head, &metric->labels) {
+        if (i >= map->label_count) {
+            break;
+        }
+        label = cfl_list_entry(head, struct cmt_map_label, _head);
+        values[i++] = label->name;
+    }
+    for (; i < map->label_count; i++) {
+        values[i] = "";
+    }
+}
+
+static struct cmt_label *
+static_label_find(struct cmt *cmt, const char *key)
+{
+    struct cfl_list *head;
+    struct cmt_label *label;
+
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        label = cfl_list_entry(head, struct cmt_label, _head);
+        if (strcmp(label->key, key) == 0) {
+            return label;
+        }
+    }
+
+    return NULL;
+}
+
+/* Add the static labels of 'src' which 'dst' does not define yet. */
+int
+cmetrics_context_copy_static_labels(struct cmt *dst, struct cmt *src)
+{
+    struct cfl_list *head;
+    struct cmt_label *label;
+
+    cfl_list_foreach(head, &src->static_labels->list) {
+        label = cfl_list_entry(head, struct cmt_label, _head);
+        if (static_label_find(dst, label->key) == NULL &&
+            cmt_label_add(dst, label->key, label->val) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Whether 'dst' and 'src' both define a static label with different
+ * values; cmetrics_context_copy_static_labels() would keep the one of
+ * 'dst' for the series of 'src'.
+ */
+int
+cmetrics_context_static_labels_conflict(struct cmt *dst, struct cmt *src)
+{
+    struct cfl_list *head;
+    struct cmt_label *label;
+    struct cmt_label *dst_label;
+
+    cfl_list_foreach(head, &src->static_labels->list) {
+        label = cfl_list_entry(head, struct cmt_label, _head);
+        dst_label = static_label_find(dst, label->key);
+        if (dst_label != NULL && strcmp(dst_label->val, label->val) != 0) {
+            return CMT_TRUE;
+        }
+    }
+
+    return CMT_FALSE;
+}
+
+/*
+ * Call 'cb' for the map of every counter, gauge and untyped family.
+ * Iteration stops at the first non zero return value, which is returned.
+ */
+int
+cmetrics_context_foreach_map(struct cmt *cmt, cmetrics_map_cb cb, void *data)
+{
+    int ret;
+    struct cfl_list *head;
+    struct cmt_counter *counter;
+    struct cmt_gauge *gauge;
+    struct cmt_untyped *untyped;
+
+    cfl_list_foreach(head, &cmt->counters) {
+        counter = cfl_list_entry(head, struct cmt_counter, _head);
+        if ((ret = cb(counter->map, data)) != 0) {
+            return ret;
+        }
+    }
+
+    cfl_list_foreach(head, &cmt->gauges) {
+        gauge = cfl_list_entry(head, struct cmt_gauge, _head);
+        if ((ret = cb(gauge->map, data)) != 0) {
+            return ret;
+        }
+    }
+
+    cfl_list_foreach(head, &cmt->untypeds) {
+        untyped = cfl_list_entry(head, struct cmt_untyped, _head);
+        if ((ret = cb(untyped->map, data)) != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Same as cmetrics_context_foreach_map(), histograms and summaries included. */
+int
+cmetrics_context_foreach_family(struct cmt *cmt, cmetrics_map_cb cb, void *data)
+{
+    int ret;
+    struct cfl_list *head;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    if ((ret = cmetrics_context_foreach_map(cmt, cb, data)) != 0) {
+        return ret;
+    }
+
+    cfl_list_foreach(head, &cmt->histograms) {
+        histogram = cfl_list_entry(head, struct cmt_histogram, _head);
+        if ((ret = cb(histogram->map, data)) != 0) {
+            return ret;
+        }
+    }
+
+    cfl_list_foreach(head, &cmt->summaries) {
+        summary = cfl_list_entry(head, struct cmt_summary, _head);
+        if ((ret = cb(summary->map, data)) != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Call 'cb' for every series of a map, the static one first. */
+int
+cmetrics_context_foreach_metric(struct cmt_map *map, cmetrics_metric_cb cb, void *data)
+{
+    int ret;
+    struct cfl_list *head;
+    struct cmt_metric *metric;
+
+    if (map->metric_static_set == 1) {
+        if ((ret = cb(map, &map->metric, data)) != 0) {
+            return ret;
+        }
+    }
+
+    cfl_list_foreach(head, &map->metrics) {
+        metric = cfl_list_entry(head, struct cmt_metric, _head);
+        if ((ret = cb(map, metric, data)) != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+#define CONTEXT_MOVE_LIST(dst, src, type, list)                          \
+    do {                                                                 \
+        struct cfl_list *head;                                           \
+        struct cfl_list *tmp;                                            \
+        type *entry;                                                     \
+        cfl_list_foreach_safe(head, tmp, &(src)->list) {                 \
+            entry = cfl_list_entry(head, type, _head);                   \
+            cfl_list_del(&entry->_head);                                 \
+            cfl_list_add(&entry->_head, &(dst)->list);                   \
+            entry->cmt = (dst);                                          \
+        }                                                                \
+    } while (0)
+
+/*
+ * Move every family of 'src' into 'dst' without copying maps, series or
+ * labels; 'src' is left without families. Static labels of 'src' are
+ * copied since 'dst' may define some of them already.
+ */
+int
+cmetrics_context_move(struct cmt *dst, struct cmt *src)
+{
+    if (cmetrics_context_copy_static_labels(dst, src) != 0) {
+        return -1;
+    }
+
+    CONTEXT_MOVE_LIST(dst, src, struct cmt_counter, counters);
+    CONTEXT_MOVE_LIST(dst, src, struct cmt_gauge, gauges);
+    CONTEXT_MOVE_LIST(dst, src, struct cmt_untyped, untypeds);
+    CONTEXT_MOVE_LIST(dst, src, struct cmt_histogram, histograms);
+    CONTEXT_MOVE_LIST(dst, src, struct cmt_summary, summaries);
+
+    return 0;
+}
+
+struct copy_changed_ctx {
+    struct cmt *dst;
+    struct cmetrics_cache *cache;
+    uint64_t since;
+    struct cmt_map *dst_map;
+    char **keys;
+    char **values;
+    uint64_t *buckets;
+    double *quantiles;
+};
+
+/* The generation of the last update of 'metric', see struct cmetrics_cache. */
+static uint64_t
+series_generation(struct cmetrics_cache *cache, struct cmt_metric *metric)
+{
+    void **slot;
+    uint64_t generation;
+
+    slot = cmetrics_table_lookup(&cache->changes, &metric, sizeof(metric), CMT_FALSE, NULL);
+    if (slot == NULL) {
+        return cache->changes_floor;
+    }
+    generation = (uintptr_t)*slot;
+
+    return generation > cache->changes_floor ? generation : cache->changes_floor;
+}
+
+/* Create an empty family like the one of 'map' in 'cmt', with the given keys. */
+static struct cmt_map *
+copy_changed_family(struct cmt *cmt, struct cmt_map *map, char **keys)
+{
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    switch (map->type) {
+    case CMT_HISTOGRAM:
+        histogram = map->parent;
+        return cmetrics_context_distribution_create(cmt, map->type, map->opts,
+                                                    histogram->buckets->count,
+                                                    histogram->buckets->upper_bounds,
+                                                    map->label_count, keys);
+    case CMT_SUMMARY:
+        summary = map->parent;
+        return cmetrics_context_distribution_create(cmt, map->type, map->opts,
+                                                    summary->quantiles_count,
+                                                    summary->quantiles,
+                                                    map->label_count, keys);
+    default:
+        return cmetrics_context_family_create(cmt, map->type, map->opts,
+                                              map->label_count, keys);
+    }
+}
+
+static int
+copy_changed_distribution(struct copy_changed_ctx *ctx, struct cmt_metric *metric,
+                          int label_count)
+{
+    size_t i;
+    char **values = label_count > 0 ? ctx->values : NULL;
+    uint64_t timestamp = cmt_metric_get_timestamp(metric);
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    if (ctx->dst_map->type == CMT_HISTOGRAM) {
+        histogram = ctx->dst_map->parent;
+        for (i = 0; i <= histogram->buckets->count; i++) {
+            ctx->buckets[i] = cmt_metric_hist_get_value(metric, (int)i);
+        }
+        return cmt_histogram_set_default(histogram, timestamp, ctx->buckets,
+                                         cmt_metric_hist_get_sum_value(metric),
+                                         cmt_metric_hist_get_count_value(metric),
+                                         label_count, values);
+    }
+
+    summary = ctx->dst_map->parent;
+    for (i = 0; metric->sum_quantiles_set && i < summary->quantiles_count; i++) {
+        ctx->quantiles[i] = cmt_summary_quantile_get_value(metric, (int)i);
+    }
+
+    return cmt_summary_set_default(summary, timestamp,
+                                   metric->sum_quantiles_set ? ctx->quantiles : NULL,
+                                   cmt_summary_get_sum_value(metric),
+                                   cmt_summary_get_count_value(metric),
+                                   label_count, values);
+}
+
+static int
+copy_changed_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int is_static = metric == &map->metric;
+    uint64_t generation;
+    struct cmt_metric *dst;
+    struct copy_changed_ctx *ctx = data;
+
+    generation = series_generation(ctx->cache, metric);
+
+    if (generation <= ctx->since) {
+        return 0;
+    }
+
+    if (ctx->dst_map == NULL) {
+        cmetrics_context_label_keys(map, ctx->keys);
+        ctx->dst_map = copy_changed_family(ctx->dst, map, ctx->keys);
+        if (ctx->dst_map == NULL) {
+            return -1;
+        }
+    }
+
+    cmetrics_context_label_values(map, metric, ctx->values);
+    if (map->type == CMT_HISTOGRAM || map->type == CMT_SUMMARY) {
+        return copy_changed_distribution(ctx, metric, is_static ? 0 : map->label_count);
+    }
+
+    dst = cmt_map_metric_get(ctx->dst_map->opts, ctx->dst_map,
+                             is_static ? 0 : map->label_count,
+                             is_static ? NULL : ctx->values, CMT_TRUE);
+    if (dst == NULL) {
+        return -1;
+    }
+    cmt_metric_set(dst, cmt_metric_get_timestamp(metric), cmt_metric_get_value(metric));
+
+    return 0;
+}
+
+static int
+copy_changed_map(struct cmt_map *map, void *data)
+{
+    int ret = -1;
+    size_t bound_count = 0;
+    struct copy_changed_ctx *ctx = data;
+
+    if (map->type == CMT_HISTOGRAM) {
+        bound_count = ((struct cmt_histogram *)map->parent)->buckets->count;
+    }
+    else if (map->type == CMT_SUMMARY) {
+        bound_count = ((struct cmt_summary *)map->parent)->quantiles_count;
+    }
+
+    ctx->dst_map = NULL;
+    ctx->keys = calloc(map->label_count + 1, sizeof(char *));
+    ctx->values = calloc(map->label_count + 1, sizeof(char *));
+    ctx->buckets = calloc(bound_count + 1, sizeof(uint64_t));
+    ctx->quantiles = calloc(bound_count + 1, sizeof(double));
+    if (ctx->keys != NULL && ctx->values != NULL &&
+        ctx->buckets != NULL && ctx->quantiles != NULL) {
+        ret = cmetrics_context_foreach_metric(map, copy_changed_metric, ctx);
+    }
+
+    free(ctx->keys);
+    free(ctx->values);
+    free(ctx->buckets);
+    free(ctx->quantiles);
+
+    return ret;
+}
+
+/*
+ * Copy the series of 'src' updated after generation 'since' of 'cache'
+ * into 'dst', with the static labels.
+ */
+int
+cmetrics_context_copy_changed(struct cmt *dst, struct cmt *src,
+                              struct cmetrics_cache *cache, uint64_t since)
+{
+    struct copy_changed_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.dst = dst;
+    ctx.cache = cache;
+    ctx.since = since;
+
+    if (cmetrics_context_foreach_family(src, copy_changed_map, &ctx) != 0 ||
+        cmetrics_context_copy_static_labels(dst, src) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
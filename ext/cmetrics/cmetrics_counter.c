@@ -21,11 +21,12 @@
 
 VALUE rb_cCounter;
 
+static void counter_mark(void* ptr);
 static void counter_free(void* ptr);
 
 static const rb_data_type_t rb_cmetrics_counter_type = { "cmetrics/counter",
                                                          {
-                                                             0,
+                                                             counter_mark,
                                                              counter_free,
                                                              0,
                                                          },
@@ -50,12 +51,22 @@ const struct CMetricsCounter *cmetrics_counter_get_ptr(VALUE self)
     return cmetricsCounter;
 }
 
+static void
+counter_mark(void* ptr)
+{
+    struct CMetricsCounter* cmetricsCounter = (struct CMetricsCounter*)ptr;
+
+    cmetrics_cache_mark(&cmetricsCounter->cache);
+}
+
 static void
 counter_free(void* ptr)
 {
     struct CMetricsCounter* cmetricsCounter = (struct CMetricsCounter*)ptr;
 
     if (cmetricsCounter) {
+        cmetrics_cache_destroy(&cmetricsCounter->cache);
+        cmetrics_exemplars_destroy(&cmetricsCounter->exemplars);
         if (cmetricsCounter->counter) {
             cmt_counter_destroy(cmetricsCounter->counter);
         }
@@ -74,6 +85,7 @@ rb_cmetrics_counter_alloc(VALUE klass)
     struct CMetricsCounter* cmetricsCounter;
     obj = TypedData_Make_Struct(
             klass, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
+    cmetrics_cache_init(&cmetricsCounter->cache);
     return obj;
 }
 
@@ -116,6 +128,8 @@ rb_cmetrics_counter_create(int argc, VALUE* argv, VALUE self)
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
+    cmetrics_cache_touch(&cmetricsCounter->cache);
+
     rb_scan_args(argc, argv, "41", &rb_namespace, &rb_subsystem, &rb_name, &rb_help, &rb_labels);
 
     Check_Type(rb_namespace, T_STRING);
@@ -198,9 +212,10 @@ rb_cmetrics_counter_increment(int argc, VALUE* argv, VALUE self)
     struct CMetricsCounter* cmetricsCounter;
     uint64_t ts;
     int ret = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -216,14 +231,16 @@ rb_cmetrics_counter_increment(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_counter_inc(cmetricsCounter->counter, ts,
                                   labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_counter_inc(cmetricsCounter->counter, ts,
@@ -248,8 +265,6 @@ rb_cmetrics_counter_increment(int argc, VALUE* argv, VALUE self)
             ret = cmt_counter_inc(cmetricsCounter->counter, ts,
                                   labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -259,6 +274,10 @@ rb_cmetrics_counter_increment(int argc, VALUE* argv, VALUE self)
                               labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsCounter->cache, cmetricsCounter->counter->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -344,20 +363,24 @@ rb_cmetrics_counter_get_value(int argc, VALUE* argv, VALUE self)
 /*
  * Add value into counter.
  *
+ * @param exemplar [Hash] {trace_id: String} kept as the latest exemplar of the series
  * @return [Boolean]
  *
  */
 static VALUE
 rb_cmetrics_counter_add(int argc, VALUE* argv, VALUE self)
 {
-    VALUE rb_labels, rb_num;
+    VALUE rb_labels, rb_num, rb_opts = Qnil, rb_exemplar = Qnil;
     struct CMetricsCounter* cmetricsCounter;
+    struct cmetrics_exemplar exemplar;
+    struct cmt_metric *metric;
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -367,7 +390,7 @@ rb_cmetrics_counter_add(int argc, VALUE* argv, VALUE self)
         rb_raise(rb_eRuntimeError, "Create counter with CMetrics::Counter#create first.");
     }
 
-    rb_scan_args(argc, argv, "11", &rb_num, &rb_labels);
+    rb_scan_args(argc, argv, "11:", &rb_num, &rb_labels, &rb_opts);
 
     switch(TYPE(rb_num)) {
     case T_FLOAT:
@@ -380,18 +403,26 @@ rb_cmetrics_counter_add(int argc, VALUE* argv, VALUE self)
         rb_raise(rb_eArgError, "CMetrics::Counter#add can handle numerics values only.");
     }
 
+    if (!NIL_P(rb_opts)) {
+        rb_exemplar = rb_hash_aref(rb_opts, ID2SYM(rb_intern("exemplar")));
+    }
+    if (!NIL_P(rb_exemplar)) {
+        cmetrics_exemplar_parse(rb_exemplar, value, &exemplar);
+    }
 
     ts = cfl_time_now();
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_counter_add(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_counter_add(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
@@ -415,8 +446,6 @@ rb_cmetrics_counter_add(int argc, VALUE* argv, VALUE self)
             ret = cmt_counter_add(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -426,6 +455,20 @@ rb_cmetrics_counter_add(int argc, VALUE* argv, VALUE self)
                               labels_count, labels);
     }
 
+    if (ret == 0 && !NIL_P(rb_exemplar)) {
+        exemplar.timestamp = ts;
+        metric = cmt_map_metric_get(cmetricsCounter->counter->map->opts,
+                                    cmetricsCounter->counter->map,
+                                    labels_count, labels, CMT_FALSE);
+        if (metric == NULL ||
+            cmetrics_exemplar_set(&cmetricsCounter->exemplars, metric, &exemplar) != 0) {
+            ret = -1;
+        }
+    }
+    cmetrics_cache_touch_series(&cmetricsCounter->cache, cmetricsCounter->counter->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -447,9 +490,10 @@ rb_cmetrics_counter_set(int argc, VALUE* argv, VALUE self)
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -476,13 +520,15 @@ rb_cmetrics_counter_set(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_counter_set(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_counter_set(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
@@ -507,8 +553,6 @@ rb_cmetrics_counter_set(int argc, VALUE* argv, VALUE self)
             ret = cmt_counter_set(cmetricsCounter->counter, ts, value,
                                   labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -518,6 +562,10 @@ rb_cmetrics_counter_set(int argc, VALUE* argv, VALUE self)
                               labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsCounter->cache, cmetricsCounter->counter->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -541,6 +589,8 @@ rb_cmetrics_counter_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
+    cmetrics_cache_touch(&cmetricsCounter->cache);
+
     if (!cmetricsCounter->counter) {
         rb_raise(rb_eRuntimeError, "Create counter with CMetrics::Counter#create first.");
     }
@@ -576,83 +626,184 @@ rb_cmetrics_counter_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
 }
 
 static VALUE
-rb_cmetrics_counter_to_prometheus(VALUE self)
+rb_cmetrics_counter_to_prometheus(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsCounter* cmetricsCounter;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    prom = cmt_encode_prometheus_create(cmetricsCounter->instance, CMT_TRUE);
+    return cmetrics_export_prometheus(cmetricsCounter->instance, &cmetricsCounter->cache, argc, argv);
+}
+
+/*
+ * Reuse the output of #to_prometheus, as a frozen String, until the
+ * counter is updated.
+ *
+ * @param max_staleness [Float] also reuse it for this many seconds after updates
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_cmetrics_counter_enable_exposition_cache(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
 
-    str = rb_str_new2(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    cmt_encode_prometheus_destroy(prom);
+    cmetrics_cache_configure(&cmetricsCounter->cache, argc, argv);
 
-    return str;
+    return Qnil;
 }
 
 static VALUE
-rb_cmetrics_counter_to_influx(VALUE self)
+rb_cmetrics_counter_disable_exposition_cache(VALUE self)
 {
     struct CMetricsCounter* cmetricsCounter;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    prom = cmt_encode_influx_create(cmetricsCounter->instance);
+    cmetrics_cache_disable(&cmetricsCounter->cache);
+
+    return Qnil;
+}
 
-    str = rb_str_new2(prom);
+static VALUE
+rb_cmetrics_counter_to_influx(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
 
-    cmt_encode_influx_destroy(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    return str;
+    return cmetrics_export_influx(cmetricsCounter->instance, argc, argv);
 }
 
+/*
+ * Encode as OpenTelemetry (OTLP) protobuf.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String] binary String
+ *
+ */
 static VALUE
-rb_cmetrics_counter_to_msgpack(VALUE self)
+rb_cmetrics_counter_to_opentelemetry(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsCounter* cmetricsCounter;
-    char *buffer;
-    size_t buffer_size;
-    int ret = 0;
 
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    ret = cmt_encode_msgpack_create(cmetricsCounter->instance, &buffer, &buffer_size);
+    return cmetrics_export_opentelemetry(cmetricsCounter->instance, argc, argv);
+}
 
-    if (ret == 0) {
-        return rb_str_new(buffer, buffer_size);
-    } else {
-        return Qnil;
-    }
+/*
+ * Encode as Splunk HTTP Event Collector metric events.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param host [String] event host
+ * @param index [String] target index
+ * @param source [String] event source
+ * @param source_type [String] event sourcetype
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_counter_to_splunk_hec(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
+
+    return cmetrics_export_splunk_hec(cmetricsCounter->instance, argc, argv);
 }
 
+/*
+ * Encode as CloudWatch embedded metric format (EMF), one JSON document
+ * per line.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @return [String]
+ *
+ */
 static VALUE
-rb_cmetrics_counter_to_text(VALUE self)
+rb_cmetrics_counter_to_cloudwatch_emf(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsCounter* cmetricsCounter;
-    cfl_sds_t buffer;
-    VALUE text;
 
     TypedData_Get_Struct(
             self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    buffer = cmt_encode_text_create(cmetricsCounter->instance);
-    if (buffer == NULL) {
-        return Qnil;
-    }
+    return cmetrics_export_cloudwatch_emf(cmetricsCounter->instance, argc, argv);
+}
+
+/*
+ * Encode as a binary snapshot, see CMetrics::Serde.from_snapshot.
+ * Histograms and summaries are not supported.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_counter_to_snapshot(VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    text = rb_str_new2(buffer);
+    return cmetrics_snapshot_encode(cmetricsCounter->instance);
+}
 
-    cfl_sds_destroy(buffer);
+/*
+ * Encode as OpenMetrics text, with the exemplars recorded by #add.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_counter_to_openmetrics(VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
+
+    return cmetrics_export_openmetrics(cmetricsCounter->instance, &cmetricsCounter->exemplars);
+}
+
+/*
+ * Encode as msgpack.
+ *
+ * @param changed_since [Integer] only encode series updated after this token
+ * @return [String, Array] the buffer, or [buffer, token] with changed_since:
+ *
+ */
+static VALUE
+rb_cmetrics_counter_to_msgpack(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
+
+    return cmetrics_export_msgpack(cmetricsCounter->instance, &cmetricsCounter->cache, argc, argv);
+}
+
+static VALUE
+rb_cmetrics_counter_to_text(VALUE self)
+{
+    struct CMetricsCounter* cmetricsCounter;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsCounter, &rb_cmetrics_counter_type, cmetricsCounter);
 
-    return text;
+    return cmetrics_export_text(cmetricsCounter->instance);
 }
 
 void Init_cmetrics_counter(VALUE rb_mCMetrics)
@@ -673,8 +824,15 @@ void Init_cmetrics_counter(VALUE rb_mCMetrics)
     rb_define_method(rb_cCounter, "val=", rb_cmetrics_counter_set, -1);
     rb_define_method(rb_cCounter, "value=", rb_cmetrics_counter_set, -1);
     rb_define_method(rb_cCounter, "add_label", rb_cmetrics_counter_add_label, 2);
-    rb_define_method(rb_cCounter, "to_influx", rb_cmetrics_counter_to_influx, 0);
-    rb_define_method(rb_cCounter, "to_prometheus", rb_cmetrics_counter_to_prometheus, 0);
-    rb_define_method(rb_cCounter, "to_msgpack", rb_cmetrics_counter_to_msgpack, 0);
+    rb_define_method(rb_cCounter, "to_influx", rb_cmetrics_counter_to_influx, -1);
+    rb_define_method(rb_cCounter, "to_opentelemetry", rb_cmetrics_counter_to_opentelemetry, -1);
+    rb_define_method(rb_cCounter, "to_splunk_hec", rb_cmetrics_counter_to_splunk_hec, -1);
+    rb_define_method(rb_cCounter, "to_cloudwatch_emf", rb_cmetrics_counter_to_cloudwatch_emf, -1);
+    rb_define_method(rb_cCounter, "to_snapshot", rb_cmetrics_counter_to_snapshot, 0);
+    rb_define_method(rb_cCounter, "to_openmetrics", rb_cmetrics_counter_to_openmetrics, 0);
+    rb_define_method(rb_cCounter, "to_prometheus", rb_cmetrics_counter_to_prometheus, -1);
+    rb_define_method(rb_cCounter, "enable_exposition_cache", rb_cmetrics_counter_enable_exposition_cache, -1);
+    rb_define_method(rb_cCounter, "disable_exposition_cache", rb_cmetrics_counter_disable_exposition_cache, 0);
+    rb_define_method(rb_cCounter, "to_msgpack", rb_cmetrics_counter_to_msgpack, -1);
     rb_define_method(rb_cCounter, "to_s", rb_cmetrics_counter_to_text, 0);
 }
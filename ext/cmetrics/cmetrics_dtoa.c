@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+#include <math.h>
+
+/*
+ * Locale and libc independent double formatting for the text encoders.
+ *
+ * Integral values up to 2^53 are printed as integers. Everything else goes
+ * through Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers"), which produces the shortest digits that
+ * parse back to the same double in almost every case, and a correct but
+ * slightly longer form otherwise.
+ */
+
+#define DTOA_SIGNIFICAND_MASK UINT64_C(0x000fffffffffffff)
+#define DTOA_EXPONENT_MASK    UINT64_C(0x7ff0000000000000)
+#define DTOA_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define DTOA_EXPONENT_BIAS    1075
+
+struct diy_fp {
+    uint64_t f;
+    int e;
+};
+
+/* 10^k for k = -348, -340, ..., 340, normalized to 64 bits */
+static const uint64_t cached_powers_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b),
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_table[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+    UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+    UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+    UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+    UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+    UINT64_C(10000000000000000000)
+};
+
+static struct diy_fp
+diy_fp_multiply(struct diy_fp x, struct diy_fp y)
+{
+    struct diy_fp r;
+    const uint64_t m32 = UINT64_C(0xffffffff);
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & m32;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & m32;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+
+    /* round */
+    tmp += UINT64_C(1) << 31;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+
+    return r;
+}
+
+static struct diy_fp
+diy_fp_normalize(struct diy_fp x)
+{
+    while (!(x.f & (UINT64_C(1) << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+
+    return x;
+}
+
+/* The boundaries m- and m+ of 'v', with the exponent of the normalized m+. */
+static void
+diy_fp_boundaries(struct diy_fp v, struct diy_fp *minus, struct diy_fp *plus)
+{
+    struct diy_fp pl;
+    struct diy_fp mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    while (!(pl.f & (DTOA_HIDDEN_BIT << 1))) {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - 52 - 2;
+    pl.e -= 64 - 52 - 2;
+
+    if (v.f == DTOA_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    }
+    else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *minus = mi;
+    *plus = pl;
+}
+
+/* A cached power c = 10^-K such that the exponent of e * c is in [-60, -32]. */
+static struct diy_fp
+cached_power(int e, int *k)
+{
+    struct diy_fp r;
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int kk = (int)dk;
+    unsigned index;
+
+    if (dk - kk > 0.0) {
+        kk++;
+    }
+    index = (unsigned)((kk >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+
+    r.f = cached_powers_f[index];
+    r.e = cached_powers_e[index];
+
+    return r;
+}
+
+static void
+grisu_round(char *buffer, int length, uint64_t delta, uint64_t rest,
+            uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int
+count_digits(uint32_t n)
+{
+    int digits = 1;
+
+    while (n >= 10 && digits < 10) {
+        n /= 10;
+        digits++;
+    }
+
+    return digits;
+}
+
+static void
+digit_gen(struct diy_fp w, struct diy_fp mp, uint64_t delta,
+          char *buffer, int *length, int *k)
+{
+    int kappa;
+    int index;
+    uint32_t d;
+    uint64_t tmp;
+    struct diy_fp one;
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1;
+    uint64_t p2;
+
+    one.f = UINT64_C(1) << -mp.e;
+    one.e = mp.e;
+    p1 = (uint32_t)(mp.f >> -one.e);
+    p2 = mp.f & (one.f - 1);
+    kappa = count_digits(p1);
+    *length = 0;
+
+    while (kappa > 0) {
+        d = p1 / (uint32_t)pow10_table[kappa - 1];
+        p1 %= (uint32_t)pow10_table[kappa - 1];
+        if (d || *length) {
+            buffer[(*length)++] = (char)('0' + d);
+        }
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *k += kappa;
+            grisu_round(buffer, *length, delta, tmp, pow10_table[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || *length) {
+            buffer[(*length)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            index = -kappa;
+            grisu_round(buffer, *length, delta, p2, one.f,
+                        wp_w * (index < 20 ? pow10_table[index] : 0));
+            return;
+        }
+    }
+}
+
+/* Shortest digits of a positive finite 'value': value = digits * 10^k. */
+static int
+grisu2(double value, char *digits, int *k)
+{
+    int length;
+    int mk;
+    uint64_t bits;
+    struct diy_fp v;
+    struct diy_fp w;
+    struct diy_fp w_minus;
+    struct diy_fp w_plus;
+    struct diy_fp c_mk;
+
+    memcpy(&bits, &value, sizeof(bits));
+    v.f = bits & DTOA_SIGNIFICAND_MASK;
+    if (bits & DTOA_EXPONENT_MASK) {
+        v.f += DTOA_HIDDEN_BIT;
+        v.e = (int)((bits & DTOA_EXPONENT_MASK) >> 52) - DTOA_EXPONENT_BIAS;
+    }
+    else {
+        v.e = 1 - DTOA_EXPONENT_BIAS;
+    }
+
+    diy_fp_boundaries(v, &w_minus, &w_plus);
+    c_mk = cached_power(w_plus.e, &mk);
+    w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+    w_plus = diy_fp_multiply(w_plus, c_mk);
+    w_minus = diy_fp_multiply(w_minus, c_mk);
+    w_minus.f++;
+    w_plus.f--;
+
+    *k = mk;
+    digit_gen(w, w_plus, w_plus.f - w_minus.f, digits, &length, k);
+
+    return length;
+}
+
+static size_t
+format_uint64(uint64_t value, char *buffer)
+{
+    char tmp[20];
+    size_t length = 0;
+    size_t i;
+
+    do {
+        tmp[length++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    for (i = 0; i < length; i++) {
+        buffer[i] = tmp[length - 1 - i];
+    }
+
+    return length;
+}
+
+/*
+ * Write 'value' into 'buffer' (CMETRICS_DTOA_SIZE bytes), NUL terminated,
+ * and return its length. Plain notation is used for decimal exponents in
+ * [-5, 21), like 0.00012 or 1234.5, and 1.5e-07 / 1e+21 otherwise.
+ * NaN and infinities are written as NaN, +Inf and -Inf.
+ */
+size_t
+cmetrics_dtoa(double value, char *buffer)
+{
+    char digits[20];
+    int length;
+    int k;
+    int point;
+    int exponent;
+    size_t n = 0;
+
+    if (isnan(value)) {
+        memcpy(buffer, "NaN", 4);
+        return 3;
+    }
+    else if (isinf(value)) {
+        memcpy(buffer, value > 0 ? "+Inf" : "-Inf", 5);
+        return 4;
+    }
+
+    if (signbit(value)) {
+        buffer[n++] = '-';
+        value = -value;
+    }
+
+    /* integer fast path, exact below 2^53 */
+    if (value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+        n += format_uint64((uint64_t)value, buffer + n);
+        buffer[n] = '\0';
+        return n;
+    }
+
+    length = grisu2(value, digits, &k);
+    /* position of the decimal point relative to the first digit */
+    point = length + k;
+
+    if (point > 0 && point <= 21) {
+        if (k >= 0) {
+            /* 1234e3 -> 1234000 */
+            memcpy(buffer + n, digits, length);
+            n += length;
+            memset(buffer + n, '0', k);
+            n += k;
+        }
+        else {
+            /* 1234e-2 -> 12.34 */
+            memcpy(buffer + n, digits, point);
+            n += point;
+            buffer[n++] = '.';
+            memcpy(buffer + n, digits + point, length - point);
+            n += length - point;
+        }
+    }
+    else if (point <= 0 && point > -5) {
+        /* 1234e-6 -> 0.001234 */
+        buffer[n++] = '0';
+        buffer[n++] = '.';
+        memset(buffer + n, '0', -point);
+        n += -point;
+        memcpy(buffer + n, digits, length);
+        n += length;
+    }
+    else {
+        /* 1234e30 -> 1.234e+33 */
+        buffer[n++] = digits[0];
+        if (length > 1) {
+            buffer[n++] = '.';
+            memcpy(buffer + n, digits + 1, length - 1);
+            n += length - 1;
+        }
+        exponent = point - 1;
+        buffer[n++] = 'e';
+        buffer[n++] = exponent < 0 ? '-' : '+';
+        if (exponent < 0) {
+            exponent = -exponent;
+        }
+        if (exponent < 10) {
+            buffer[n++] = '0';
+        }
+        n += format_uint64((uint64_t)exponent, buffer + n);
+    }
+    buffer[n] = '\0';
+
+    return n;
+}
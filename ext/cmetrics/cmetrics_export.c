@@ -0,0 +1,650 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+#include <cmetrics/cmt_encode_prometheus_remote_write.h>
+#include <cmetrics/cmt_encode_opentelemetry.h>
+#include <cmetrics/cmt_encode_splunk_hec.h>
+#include <cmetrics/cmt_encode_cloudwatch_emf.h>
+
+/*
+ * Encoders shared by Counter, Gauge, Untyped and Serde.
+ */
+
+struct export_buffer {
+    char *buffer;
+    size_t size;
+    int method;
+    VALUE target;
+};
+
+static VALUE
+export_compress(VALUE data)
+{
+    struct export_buffer *out = (struct export_buffer *)data;
+
+    if (NIL_P(out->target)) {
+        return cmetrics_compress(out->buffer, out->size, out->method);
+    }
+
+    /* compressed output goes straight into the caller's String */
+    if (out->method != CMETRICS_COMPRESS_NONE) {
+        return cmetrics_compress_into(out->buffer, out->size, out->method, out->target);
+    }
+
+    /* overwrite the caller's String, keeping its capacity */
+    rb_str_modify(out->target);
+    rb_str_set_len(out->target, 0);
+    rb_str_cat(out->target, out->buffer, out->size);
+    rb_enc_associate(out->target, rb_ascii8bit_encoding());
+
+    return out->target;
+}
+
+static VALUE
+msgpack_release(VALUE data)
+{
+    cmt_encode_msgpack_destroy(((struct export_buffer *)data)->buffer);
+
+    return Qnil;
+}
+
+static VALUE
+emf_release(VALUE data)
+{
+    cmt_encode_cloudwatch_emf_destroy(((struct export_buffer *)data)->buffer);
+
+    return Qnil;
+}
+
+static VALUE
+sds_release(VALUE data)
+{
+    cfl_sds_destroy(((struct export_buffer *)data)->buffer);
+
+    return Qnil;
+}
+
+static VALUE
+buffer_release(VALUE data)
+{
+    free(((struct export_buffer *)data)->buffer);
+
+    return Qnil;
+}
+
+#define EXPOSITION_PROMETHEUS  0
+#define EXPOSITION_OPENMETRICS 1
+#define EXPOSITION_INFLUX      2
+#define EXPOSITION_TEXT        3
+
+/* Text exposition, from our own encoder rather than cmetrics' printf based one. */
+static VALUE
+exposition_encode(struct cmt *cmt, struct cmetrics_table *exemplars, int format, int method)
+{
+    int ret;
+    struct export_buffer out;
+
+    if (cmt == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    out.method = method;
+    out.target = Qnil;
+    if (format == EXPOSITION_OPENMETRICS) {
+        ret = cmetrics_encode_openmetrics(cmt, exemplars, &out.buffer, &out.size);
+    }
+    else if (format == EXPOSITION_INFLUX) {
+        ret = cmetrics_encode_influx(cmt, &out.buffer, &out.size);
+    }
+    else if (format == EXPOSITION_TEXT) {
+        ret = cmetrics_encode_text(cmt, &out.buffer, &out.size);
+    }
+    else {
+        ret = cmetrics_encode_prometheus(cmt, &out.buffer, &out.size);
+    }
+    if (ret != 0) {
+        rb_raise(rb_eNoMemError, "cannot encode the cmt context");
+    }
+
+    return rb_ensure(export_compress, (VALUE)&out, buffer_release, (VALUE)&out);
+}
+
+static VALUE
+msgpack_encode(struct cmt *cmt, int method)
+{
+    struct export_buffer out;
+
+    out.method = method;
+    out.target = Qnil;
+    if (cmt_encode_msgpack_create(cmt, &out.buffer, &out.size) != 0) {
+        return Qnil;
+    }
+
+    /* compression may raise, do not leak the encoded buffer */
+    return rb_ensure(export_compress, (VALUE)&out, msgpack_release, (VALUE)&out);
+}
+
+/*
+ * Wrap an encoded sds buffer, compressing it if requested, and free it.
+ * The result is written into 'target' unless it is nil.
+ */
+static VALUE
+sds_export_into(cfl_sds_t buffer, int method, VALUE target)
+{
+    struct export_buffer out;
+
+    if (buffer == NULL) {
+        rb_raise(rb_eRuntimeError, "cannot encode the cmt context");
+    }
+    out.buffer = buffer;
+    out.size = cfl_sds_len(buffer);
+    out.method = method;
+    out.target = target;
+
+    return rb_ensure(export_compress, (VALUE)&out, sds_release, (VALUE)&out);
+}
+
+static VALUE
+sds_export(cfl_sds_t buffer, int method)
+{
+    return sds_export_into(buffer, method, Qnil);
+}
+
+/* The compact encoder writes into a String, compressed straight from it. */
+static VALUE
+compact_encode(struct cmt *cmt, int method)
+{
+    VALUE str;
+
+    str = cmetrics_compact_encode(cmt);
+    if (method == CMETRICS_COMPRESS_NONE) {
+        return str;
+    }
+
+    return cmetrics_compress_str(str, method);
+}
+
+struct changed_args {
+    struct cmt *cmt;
+    int method;
+    int compact;
+};
+
+static VALUE
+msgpack_encode_changed(VALUE data)
+{
+    struct changed_args *args = (struct changed_args *)data;
+
+    if (args->compact) {
+        return compact_encode(args->cmt, args->method);
+    }
+
+    return msgpack_encode(args->cmt, args->method);
+}
+
+/*
+ * Implementation of #to_msgpack(changed_since: nil, compact: false, compress: nil).
+ *
+ * Without changed_since: the whole context is encoded. With it, only the
+ * series updated after the token are encoded and [buffer, token] is
+ * returned; the token is the generation of 'cache' and is passed back on
+ * the next call.
+ *
+ * With compact: true, the payload interns every string once per context
+ * and refers to it by index; Serde#from_msgpack reads either format.
+ */
+VALUE
+cmetrics_export_msgpack(struct cmt *cmt, struct cmetrics_cache *cache, int argc, VALUE *argv)
+{
+    VALUE rb_opts, rb_token, rb_buffer;
+    struct cmt *changed;
+    uint64_t since = 0;
+    uint64_t token;
+    int method;
+    int compact = CMT_FALSE;
+    int state = 0;
+    struct changed_args changed_args;
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+    method = cmetrics_compress_parse(rb_opts);
+
+    if (!NIL_P(rb_opts)) {
+        compact = RTEST(rb_hash_aref(rb_opts, ID2SYM(rb_intern("compact"))));
+    }
+
+    if (NIL_P(rb_opts) || !RTEST(rb_funcall(rb_opts, rb_intern("key?"), 1,
+                                             ID2SYM(rb_intern("changed_since"))))) {
+        return compact ? compact_encode(cmt, method) : msgpack_encode(cmt, method);
+    }
+
+    rb_token = rb_hash_aref(rb_opts, ID2SYM(rb_intern("changed_since")));
+    if (!NIL_P(rb_token)) {
+        since = NUM2ULL(rb_token);
+    }
+
+    /* series not stamped since then are reported as of this generation */
+    if (!cache->changes_enabled) {
+        if (cmetrics_table_init(&cache->changes, 64) != 0) {
+            rb_raise(rb_eNoMemError, "cannot allocate changed series table");
+        }
+        cache->changes_enabled = CMT_TRUE;
+        cmetrics_cache_touch(cache);
+    }
+
+    changed = cmt_create();
+    if (changed == NULL) {
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+    token = cache->generation;
+    if (cmetrics_context_copy_changed(changed, cmt, cache, since) != 0) {
+        cmt_destroy(changed);
+        rb_raise(rb_eRuntimeError, "cannot copy changed series");
+    }
+    changed_args.cmt = changed;
+    changed_args.method = method;
+    changed_args.compact = compact;
+
+    rb_buffer = rb_protect((VALUE (*)(VALUE))msgpack_encode_changed, (VALUE)&changed_args, &state);
+    cmt_destroy(changed);
+    if (state) {
+        rb_jump_tag(state);
+    }
+
+    return rb_assoc_new(rb_buffer, ULL2NUM(token));
+}
+
+void
+cmetrics_cache_init(struct cmetrics_cache *cache)
+{
+    memset(cache, 0, sizeof(struct cmetrics_cache));
+    cache->prometheus = Qnil;
+}
+
+void
+cmetrics_cache_mark(struct cmetrics_cache *cache)
+{
+    rb_gc_mark(cache->prometheus);
+}
+
+void
+cmetrics_cache_destroy(struct cmetrics_cache *cache)
+{
+    cmetrics_table_destroy(&cache->changes);
+}
+
+/*
+ * Record an update of one series. Once changed_since: was used, the
+ * series is stamped with the new generation.
+ */
+void
+cmetrics_cache_touch_series(struct cmetrics_cache *cache, struct cmt_map *map,
+                            int labels_count, char **labels)
+{
+    struct cmt_metric *metric;
+
+    if (labels_count == 0) {
+        metric = &map->metric;
+    }
+    else if (cache->changes_enabled) {
+        /* a failed update created no series */
+        metric = cmt_map_metric_get(map->opts, map, labels_count, labels, CMT_FALSE);
+        if (metric == NULL) {
+            cache->generation++;
+            return;
+        }
+    }
+    else {
+        cache->generation++;
+        return;
+    }
+
+    cmetrics_cache_touch_metric(cache, metric);
+}
+
+/* Same as cmetrics_cache_touch_series(), for a series the caller holds. */
+void
+cmetrics_cache_touch_metric(struct cmetrics_cache *cache, struct cmt_metric *metric)
+{
+    void **slot;
+
+    cache->generation++;
+    if (!cache->changes_enabled) {
+        return;
+    }
+
+    slot = cmetrics_table_lookup(&cache->changes, &metric, sizeof(metric), CMT_TRUE, NULL);
+    if (slot == NULL) {
+        /* report every series rather than lose this one */
+        cache->changes_floor = cache->generation;
+        return;
+    }
+    *slot = (void *)(uintptr_t)cache->generation;
+}
+
+/* Drop the stamp of a series about to be freed, its address may be reused. */
+void
+cmetrics_cache_forget_metric(struct cmetrics_cache *cache, struct cmt_metric *metric)
+{
+    if (cache->changes_enabled) {
+        cmetrics_table_remove(&cache->changes, &metric, sizeof(metric));
+    }
+}
+
+/* Drop the stamps of every series, once the families moved elsewhere. */
+void
+cmetrics_cache_forget_all(struct cmetrics_cache *cache)
+{
+    cmetrics_table_clear(&cache->changes);
+    cmetrics_cache_touch(cache);
+}
+
+/*
+ * Implementation of #enable_exposition_cache(max_staleness: nil).
+ * max_staleness is given in seconds.
+ */
+void
+cmetrics_cache_configure(struct cmetrics_cache *cache, int argc, VALUE *argv)
+{
+    VALUE rb_opts, rb_staleness = Qnil;
+    double staleness;
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+
+    if (!NIL_P(rb_opts)) {
+        rb_staleness = rb_hash_aref(rb_opts, ID2SYM(rb_intern("max_staleness")));
+    }
+
+    cache->max_staleness = 0;
+    if (!NIL_P(rb_staleness)) {
+        staleness = NUM2DBL(rb_staleness);
+        if (staleness < 0) {
+            rb_raise(rb_eArgError, "max_staleness: must not be negative");
+        }
+        cache->max_staleness = (uint64_t)(staleness * 1000000000.0);
+    }
+    cache->enabled = CMT_TRUE;
+}
+
+void
+cmetrics_cache_disable(struct cmetrics_cache *cache)
+{
+    cache->enabled = CMT_FALSE;
+    cache->prometheus = Qnil;
+}
+
+/*
+ * Implementation of #to_prometheus(compress: nil). With the exposition
+ * cache enabled, uncompressed output is frozen and shared between calls.
+ */
+VALUE
+cmetrics_export_prometheus(struct cmt *cmt, struct cmetrics_cache *cache, int argc, VALUE *argv)
+{
+    VALUE rb_opts;
+    uint64_t now;
+    VALUE str;
+    int method;
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+    method = cmetrics_compress_parse(rb_opts);
+
+    if (!cache->enabled || method != CMETRICS_COMPRESS_NONE) {
+        return exposition_encode(cmt, NULL, EXPOSITION_PROMETHEUS, method);
+    }
+
+    now = cfl_time_now();
+    if (!NIL_P(cache->prometheus)) {
+        if (cache->prometheus_generation == cache->generation) {
+            return cache->prometheus;
+        }
+        if (cache->max_staleness > 0 && now >= cache->prometheus_time &&
+            now - cache->prometheus_time <= cache->max_staleness) {
+            return cache->prometheus;
+        }
+    }
+
+    str = rb_obj_freeze(exposition_encode(cmt, NULL, EXPOSITION_PROMETHEUS,
+                                          CMETRICS_COMPRESS_NONE));
+    cache->prometheus = str;
+    cache->prometheus_generation = cache->generation;
+    cache->prometheus_time = now;
+
+    return str;
+}
+
+/*
+ * Implementation of #to_openmetrics. 'exemplars' may be NULL.
+ */
+VALUE
+cmetrics_export_openmetrics(struct cmt *cmt, struct cmetrics_table *exemplars)
+{
+    VALUE str = exposition_encode(cmt, exemplars, EXPOSITION_OPENMETRICS, CMETRICS_COMPRESS_NONE);
+
+    rb_enc_associate(str, rb_utf8_encoding());
+
+    return str;
+}
+
+/* Implementation of #to_s, in the layout of cmt_encode_text(). */
+VALUE
+cmetrics_export_text(struct cmt *cmt)
+{
+    VALUE str = exposition_encode(cmt, NULL, EXPOSITION_TEXT, CMETRICS_COMPRESS_NONE);
+
+    rb_enc_associate(str, rb_utf8_encoding());
+
+    return str;
+}
+
+/*
+ * Implementation of Serde.msgpack_to_prometheus and Serde.msgpack_to_influx
+ * (buffer, compress: nil).
+ */
+VALUE
+cmetrics_export_transcoded(int argc, VALUE *argv, int influx)
+{
+    VALUE rb_buffer;
+    VALUE rb_opts;
+    int ret;
+    struct export_buffer out;
+
+    rb_scan_args(argc, argv, "1:", &rb_buffer, &rb_opts);
+
+    if (NIL_P(rb_buffer)) {
+        rb_raise(rb_eArgError, "nil is not valid value for buffer");
+    }
+    StringValue(rb_buffer);
+
+    out.method = cmetrics_compress_parse(rb_opts);
+    out.target = Qnil;
+    ret = cmetrics_transcode_msgpack(RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer), influx,
+                                     &out.buffer, &out.size);
+    RB_GC_GUARD(rb_buffer);
+
+    if (ret == CMETRICS_TRANSCODE_ERROR_INPUT) {
+        rb_raise(rb_eArgError, "invalid cmetrics msgpack buffer");
+    }
+    if (ret != 0) {
+        rb_raise(rb_eNoMemError, "cannot transcode the msgpack buffer");
+    }
+
+    return rb_ensure(export_compress, (VALUE)&out, buffer_release, (VALUE)&out);
+}
+
+/* Implementation of #to_influx(compress: nil). */
+VALUE
+cmetrics_export_influx(struct cmt *cmt, int argc, VALUE *argv)
+{
+    VALUE rb_opts;
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+
+    return exposition_encode(cmt, NULL, EXPOSITION_INFLUX, cmetrics_compress_parse(rb_opts));
+}
+
+/*
+ * Implementation of #prometheus_remote_write(compress: nil). The protobuf
+ * payload is binary, Prometheus expects it compressed with :snappy.
+ */
+VALUE
+cmetrics_export_remote_write(struct cmt *cmt, int argc, VALUE *argv)
+{
+    VALUE rb_opts;
+    VALUE str;
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+
+    str = sds_export(cmt_encode_prometheus_remote_write_create(cmt),
+                     cmetrics_compress_parse(rb_opts));
+    rb_enc_associate(str, rb_ascii8bit_encoding());
+
+    return str;
+}
+
+/*
+ * Implementation of #to_opentelemetry(buffer = nil, compress: nil). The
+ * OTLP ExportMetricsServiceRequest is written into 'buffer' when given so
+ * that periodic exports reuse its capacity.
+ */
+VALUE
+cmetrics_export_opentelemetry(struct cmt *cmt, int argc, VALUE *argv)
+{
+    VALUE rb_buffer;
+    VALUE rb_opts;
+    VALUE str;
+    int method;
+
+    rb_scan_args(argc, argv, "01:", &rb_buffer, &rb_opts);
+
+    if (!NIL_P(rb_buffer)) {
+        Check_Type(rb_buffer, T_STRING);
+        rb_check_frozen(rb_buffer);
+    }
+    method = cmetrics_compress_parse(rb_opts);
+
+    str = sds_export_into(cmt_encode_opentelemetry_create(cmt), method, rb_buffer);
+    rb_enc_associate(str, rb_ascii8bit_encoding());
+
+    return str;
+}
+
+static const char *
+export_string_option(VALUE rb_opts, const char *name, int required)
+{
+    VALUE rb_value = Qnil;
+
+    if (!NIL_P(rb_opts)) {
+        rb_value = rb_hash_aref(rb_opts, ID2SYM(rb_intern(name)));
+    }
+    if (NIL_P(rb_value)) {
+        if (required) {
+            rb_raise(rb_eArgError, "%s: is required", name);
+        }
+        return NULL;
+    }
+
+    return StringValueCStr(rb_value);
+}
+
+/*
+ * Implementation of #to_splunk_hec(buffer = nil, host:, index: nil,
+ * source: nil, source_type: nil, compress: nil): one HEC metric event per
+ * series, as written by cmetrics.
+ */
+VALUE
+cmetrics_export_splunk_hec(struct cmt *cmt, int argc, VALUE *argv)
+{
+    VALUE rb_buffer;
+    VALUE rb_opts;
+    VALUE str;
+    int method;
+    const char *host;
+    const char *index;
+    const char *source;
+    const char *source_type;
+
+    rb_scan_args(argc, argv, "01:", &rb_buffer, &rb_opts);
+
+    if (!NIL_P(rb_buffer)) {
+        Check_Type(rb_buffer, T_STRING);
+        rb_check_frozen(rb_buffer);
+    }
+    host = export_string_option(rb_opts, "host", CMT_TRUE);
+    index = export_string_option(rb_opts, "index", CMT_FALSE);
+    source = export_string_option(rb_opts, "source", CMT_FALSE);
+    source_type = export_string_option(rb_opts, "source_type", CMT_FALSE);
+    method = cmetrics_compress_parse(rb_opts);
+
+    /* the option Strings are referenced from rb_opts while encoding */
+    str = sds_export_into(cmt_encode_splunk_hec_create(cmt, host, index, source, source_type),
+                          method, rb_buffer);
+    RB_GC_GUARD(rb_opts);
+    if (method == CMETRICS_COMPRESS_NONE) {
+        rb_enc_associate(str, rb_utf8_encoding());
+    }
+
+    return str;
+}
+
+static VALUE
+emf_json_lines(VALUE data)
+{
+    struct export_buffer *out = (struct export_buffer *)data;
+
+    if (NIL_P(out->target)) {
+        out->target = rb_str_buf_new(out->size * 2);
+    }
+    else {
+        rb_str_modify(out->target);
+        rb_str_set_len(out->target, 0);
+    }
+    if (cmetrics_msgpack_to_json_lines(out->buffer, out->size, out->target) != 0) {
+        rb_raise(rb_eRuntimeError, "cannot convert CloudWatch EMF records");
+    }
+    rb_enc_associate(out->target, rb_utf8_encoding());
+
+    return out->target;
+}
+
+/*
+ * Implementation of #to_cloudwatch_emf(buffer = nil). cmetrics writes the
+ * EMF records as msgpack maps; they are turned into one JSON document per
+ * line, the form CloudWatch Logs expects.
+ */
+VALUE
+cmetrics_export_cloudwatch_emf(struct cmt *cmt, int argc, VALUE *argv)
+{
+    VALUE rb_buffer;
+    struct export_buffer out;
+
+    rb_scan_args(argc, argv, "01", &rb_buffer);
+
+    if (!NIL_P(rb_buffer)) {
+        Check_Type(rb_buffer, T_STRING);
+        rb_check_frozen(rb_buffer);
+    }
+
+    out.method = CMETRICS_COMPRESS_NONE;
+    out.target = rb_buffer;
+    if (cmt_encode_cloudwatch_emf_create(cmt, &out.buffer, &out.size, CMT_FALSE) != 0) {
+        rb_raise(rb_eRuntimeError, "cannot encode the cmt context");
+    }
+
+    return rb_ensure(emf_json_lines, (VALUE)&out, emf_release, (VALUE)&out);
+}
@@ -0,0 +1,1449 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+#include <time.h>
+
+/*
+ * Prometheus and OpenMetrics text exposition, Influx line protocol and the
+ * human readable text of #to_s,
+ * walking the context directly so that values go through cmetrics_dtoa()
+ * instead of printf. The output is built in a malloc'd buffer without
+ * calling into Ruby.
+ *
+ * The OpenMetrics flavor exposes counters as _total samples and untyped
+ * families as 'unknown', has timestamps in seconds and ends with '# EOF'.
+ * Exemplars are kept outside of cmetrics, one fixed size slot per series
+ * keyed by the address of its cmt_metric, which never moves.
+ *
+ * cmetrics_transcode_msgpack() writes the same Prometheus text, or Influx
+ * line protocol, straight from msgpack payloads: label keys, bucket bounds
+ * and static labels are re-read from the payload for every series instead
+ * of being copied anywhere.
+ */
+
+struct exposition_ctx {
+    char *buf;
+    size_t length;
+    size_t capacity;
+    int error;
+
+    int openmetrics;
+    struct cmt *cmt;
+    struct cmetrics_table *exemplars;
+    const char *suffix;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    /* msgpack transcoding */
+    int influx;
+    const struct cmetrics_mp_reader *reader;
+    size_t static_labels;
+};
+
+static void
+out_cat(struct exposition_ctx *ctx, const char *str, size_t length)
+{
+    char *tmp;
+    size_t capacity;
+
+    if (ctx->error || length == 0) {
+        return;
+    }
+    if (length > ctx->capacity - ctx->length) {
+        capacity = ctx->capacity > 0 ? ctx->capacity : 4096;
+        while (length > capacity - ctx->length) {
+            capacity *= 2;
+        }
+        tmp = realloc(ctx->buf, capacity);
+        if (tmp == NULL) {
+            ctx->error = CMT_TRUE;
+            return;
+        }
+        ctx->buf = tmp;
+        ctx->capacity = capacity;
+    }
+    memcpy(ctx->buf + ctx->length, str, length);
+    ctx->length += length;
+}
+
+#define out_lit(ctx, str) out_cat((ctx), (str), sizeof(str) - 1)
+
+static void
+out_str(struct exposition_ctx *ctx, const char *str)
+{
+    out_cat(ctx, str, strlen(str));
+}
+
+/* Escape backslashes, line feeds and, if 'quote' is set, double quotes. */
+static void
+out_escaped(struct exposition_ctx *ctx, const char *str, size_t length, int quote)
+{
+    size_t i;
+    size_t start = 0;
+
+    for (i = 0; i < length; i++) {
+        if (str[i] != '\\' && str[i] != '\n' && (!quote || str[i] != '"')) {
+            continue;
+        }
+        out_cat(ctx, str + start, i - start);
+        out_cat(ctx, str[i] == '\n' ? "\\n" : str[i] == '"' ? "\\\"" : "\\\\", 2);
+        start = i + 1;
+    }
+    out_cat(ctx, str + start, length - start);
+}
+
+/* Escape commas, equal signs and spaces of Influx tags. */
+static void
+out_influx_escaped(struct exposition_ctx *ctx, const char *str, size_t length)
+{
+    size_t i;
+    size_t start = 0;
+
+    for (i = 0; i < length; i++) {
+        if (str[i] != ',' && str[i] != '=' && str[i] != ' ') {
+            continue;
+        }
+        out_cat(ctx, str + start, i - start);
+        out_lit(ctx, "\\");
+        start = i;
+    }
+    out_cat(ctx, str + start, length - start);
+}
+
+static void
+out_influx_tag(struct exposition_ctx *ctx, const char *key, size_t key_length,
+               const char *value, size_t value_length)
+{
+    /* the line protocol has no empty tag values */
+    if (value_length == 0) {
+        return;
+    }
+    out_lit(ctx, ",");
+    out_influx_escaped(ctx, key, key_length);
+    out_lit(ctx, "=");
+    out_influx_escaped(ctx, value, value_length);
+}
+
+static void
+out_double(struct exposition_ctx *ctx, double value)
+{
+    char buf[CMETRICS_DTOA_SIZE];
+
+    out_cat(ctx, buf, cmetrics_dtoa(value, buf));
+}
+
+/* OpenMetrics le and quantile values are canonical numbers: 1.0 rather than 1 */
+static const char *
+format_bound(struct exposition_ctx *ctx, char *buf, double value)
+{
+    size_t length = cmetrics_dtoa(value, buf);
+
+    if (ctx->openmetrics && strpbrk(buf, ".eIN") == NULL) {
+        memcpy(buf + length, ".0", 3);
+    }
+
+    return buf;
+}
+
+static void
+out_timestamp(struct exposition_ctx *ctx, uint64_t timestamp)
+{
+    char buf[32];
+    size_t length;
+    uint64_t fraction;
+
+    /* Influx: nanoseconds */
+    if (ctx->influx) {
+        out_cat(ctx, buf, snprintf(buf, sizeof(buf), "%" PRIu64, timestamp));
+        return;
+    }
+
+    /* Prometheus: milliseconds */
+    if (!ctx->openmetrics) {
+        out_cat(ctx, buf, snprintf(buf, sizeof(buf), "%" PRIu64, timestamp / 1000000));
+        return;
+    }
+
+    /* OpenMetrics: seconds */
+    fraction = timestamp % 1000000000;
+    length = snprintf(buf, sizeof(buf), "%" PRIu64, timestamp / 1000000000);
+    if (fraction > 0) {
+        length += snprintf(buf + length, sizeof(buf) - length, ".%09" PRIu64, fraction);
+        while (buf[length - 1] == '0') {
+            length--;
+        }
+    }
+    out_cat(ctx, buf, length);
+}
+
+static void
+out_label(struct exposition_ctx *ctx, int *first, const char *key, const char *value)
+{
+    out_cat(ctx, *first ? "{" : ",", 1);
+    out_str(ctx, key);
+    out_lit(ctx, "=\"");
+    out_escaped(ctx, value, strlen(value), CMT_TRUE);
+    out_lit(ctx, "\"");
+    *first = CMT_FALSE;
+}
+
+/* Static labels, then the series labels, then 'key' (le, quantile) if set. */
+static void
+out_labels(struct exposition_ctx *ctx, struct cmt_map *map, struct cmt_metric *metric,
+           const char *key, const char *value)
+{
+    int first = CMT_TRUE;
+    struct cfl_list *head;
+    struct cfl_list *key_head;
+    struct cmt_label *static_label;
+    struct cmt_map_label *label_key;
+    struct cmt_map_label *label_value;
+
+    cfl_list_foreach(head, &ctx->cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        out_label(ctx, &first, static_label->key, static_label->val);
+    }
+
+    if (metric != &map->metric) {
+        key_head = map->label_keys.next;
+        cfl_list_foreach(head, &metric->labels) {
+            if (key_head == &map->label_keys) {
+                break;
+            }
+            label_key = cfl_list_entry(key_head, struct cmt_map_label, _head);
+            label_value = cfl_list_entry(head, struct cmt_map_label, _head);
+            out_label(ctx, &first, label_key->name, label_value->name);
+            key_head = key_head->next;
+        }
+    }
+
+    if (key != NULL) {
+        out_label(ctx, &first, key, value);
+    }
+    if (!first) {
+        out_lit(ctx, "}");
+    }
+}
+
+static void
+out_sample(struct exposition_ctx *ctx, struct cmt_map *map, struct cmt_metric *metric,
+           const char *suffix, const char *key, const char *key_value, double value)
+{
+    uint64_t timestamp = cmt_metric_get_timestamp(metric);
+
+    out_str(ctx, map->opts->fqname);
+    out_str(ctx, suffix);
+    out_labels(ctx, map, metric, key, key_value);
+    out_lit(ctx, " ");
+    out_double(ctx, value);
+    if (!ctx->openmetrics || timestamp > 0) {
+        out_lit(ctx, " ");
+        out_timestamp(ctx, timestamp);
+    }
+}
+
+static void
+out_exemplar(struct exposition_ctx *ctx, struct cmt_metric *metric)
+{
+    void **slot;
+    struct cmt_metric *key = metric;
+    struct cmetrics_exemplar *exemplar;
+
+    if (ctx->exemplars == NULL || ctx->exemplars->entries == NULL) {
+        return;
+    }
+    slot = cmetrics_table_lookup(ctx->exemplars, &key, sizeof(key), CMT_FALSE, NULL);
+    if (slot == NULL || *slot == NULL) {
+        return;
+    }
+    exemplar = *slot;
+
+    out_lit(ctx, " # {trace_id=\"");
+    out_escaped(ctx, exemplar->trace_id, exemplar->trace_id_length, CMT_TRUE);
+    out_lit(ctx, "\"} ");
+    out_double(ctx, exemplar->value);
+    out_lit(ctx, " ");
+    out_timestamp(ctx, exemplar->timestamp);
+}
+
+/* Influx tags: static labels, then the series labels. */
+static void
+out_influx_tags(struct exposition_ctx *ctx, struct cmt_map *map, struct cmt_metric *metric)
+{
+    struct cfl_list *head;
+    struct cfl_list *key_head;
+    struct cmt_label *static_label;
+    struct cmt_map_label *label_key;
+    struct cmt_map_label *label_value;
+
+    cfl_list_foreach(head, &ctx->cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        out_influx_tag(ctx, static_label->key, strlen(static_label->key),
+                       static_label->val, strlen(static_label->val));
+    }
+
+    if (metric == &map->metric) {
+        return;
+    }
+    key_head = map->label_keys.next;
+    cfl_list_foreach(head, &metric->labels) {
+        if (key_head == &map->label_keys) {
+            break;
+        }
+        label_key = cfl_list_entry(key_head, struct cmt_map_label, _head);
+        label_value = cfl_list_entry(head, struct cmt_map_label, _head);
+        out_influx_tag(ctx, label_key->name, strlen(label_key->name),
+                       label_value->name, strlen(label_value->name));
+        key_head = key_head->next;
+    }
+}
+
+static void
+out_influx_field(struct exposition_ctx *ctx, const char *name, double value)
+{
+    out_str(ctx, name);
+    out_lit(ctx, "=");
+    out_double(ctx, value);
+    out_lit(ctx, ",");
+}
+
+/*
+ * One line per series, as cmetrics_transcode_msgpack() writes them:
+ * histogram buckets and summary quantiles are fields named after their
+ * bound.
+ */
+static int
+out_influx_metric(struct exposition_ctx *ctx, struct cmt_map *map, struct cmt_metric *metric)
+{
+    char bound[CMETRICS_DTOA_SIZE];
+    size_t i;
+    struct cmt_opts *opts = map->opts;
+    struct cmt_histogram_buckets *buckets;
+
+    out_str(ctx, opts->ns);
+    if (opts->subsystem[0] != '\0') {
+        out_lit(ctx, "_");
+        out_str(ctx, opts->subsystem);
+    }
+    out_influx_tags(ctx, map, metric);
+    out_lit(ctx, " ");
+
+    if (ctx->histogram != NULL) {
+        buckets = ctx->histogram->buckets;
+        for (i = 0; i <= buckets->count; i++) {
+            if (i < buckets->count) {
+                cmetrics_dtoa(buckets->upper_bounds[i], bound);
+            }
+            out_influx_field(ctx, i < buckets->count ? bound : "+Inf",
+                             (double)cmt_metric_hist_get_value(metric, (int)i));
+        }
+        out_lit(ctx, "sum=");
+        out_double(ctx, cmt_metric_hist_get_sum_value(metric));
+        out_lit(ctx, ",count=");
+        out_double(ctx, (double)cmt_metric_hist_get_count_value(metric));
+    }
+    else if (ctx->summary != NULL) {
+        if (metric->sum_quantiles_set) {
+            for (i = 0; i < ctx->summary->quantiles_count; i++) {
+                cmetrics_dtoa(ctx->summary->quantiles[i], bound);
+                out_influx_field(ctx, bound, cmt_summary_quantile_get_value(metric, (int)i));
+            }
+        }
+        out_lit(ctx, "sum=");
+        out_double(ctx, cmt_summary_get_sum_value(metric));
+        out_lit(ctx, ",count=");
+        out_double(ctx, (double)cmt_summary_get_count_value(metric));
+    }
+    else {
+        out_influx_escaped(ctx, opts->name, strlen(opts->name));
+        out_lit(ctx, "=");
+        out_double(ctx, cmt_metric_get_value(metric));
+    }
+
+    out_lit(ctx, " ");
+    out_timestamp(ctx, cmt_metric_get_timestamp(metric));
+    out_lit(ctx, "\n");
+
+    return ctx->error;
+}
+
+static int
+out_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    char bound[CMETRICS_DTOA_SIZE + 2];
+    size_t i;
+    struct exposition_ctx *ctx = data;
+    struct cmt_histogram_buckets *buckets;
+
+    if (ctx->influx) {
+        return out_influx_metric(ctx, map, metric);
+    }
+
+    if (ctx->histogram != NULL) {
+        buckets = ctx->histogram->buckets;
+        for (i = 0; i <= buckets->count; i++) {
+            out_sample(ctx, map, metric, "_bucket", "le",
+                       i < buckets->count ?
+                       format_bound(ctx, bound, buckets->upper_bounds[i]) : "+Inf",
+                       (double)cmt_metric_hist_get_value(metric, (int)i));
+            out_lit(ctx, "\n");
+        }
+        out_sample(ctx, map, metric, "_count", NULL, NULL,
+                   (double)cmt_metric_hist_get_count_value(metric));
+        out_lit(ctx, "\n");
+        out_sample(ctx, map, metric, "_sum", NULL, NULL,
+                   cmt_metric_hist_get_sum_value(metric));
+        out_lit(ctx, "\n");
+        return ctx->error;
+    }
+
+    if (ctx->summary != NULL) {
+        if (metric->sum_quantiles_set) {
+            for (i = 0; i < ctx->summary->quantiles_count; i++) {
+                out_sample(ctx, map, metric, "", "quantile",
+                           format_bound(ctx, bound, ctx->summary->quantiles[i]),
+                           cmt_summary_quantile_get_value(metric, (int)i));
+                out_lit(ctx, "\n");
+            }
+        }
+        out_sample(ctx, map, metric, "_count", NULL, NULL,
+                   (double)cmt_summary_get_count_value(metric));
+        out_lit(ctx, "\n");
+        out_sample(ctx, map, metric, "_sum", NULL, NULL,
+                   cmt_summary_get_sum_value(metric));
+        out_lit(ctx, "\n");
+        return ctx->error;
+    }
+
+    out_sample(ctx, map, metric, ctx->suffix, NULL, NULL, cmt_metric_get_value(metric));
+    if (ctx->openmetrics && map->type == CMT_COUNTER) {
+        out_exemplar(ctx, metric);
+    }
+    out_lit(ctx, "\n");
+
+    return ctx->error;
+}
+
+static void
+out_family(struct exposition_ctx *ctx, struct cmt_map *map, const char *type)
+{
+    size_t length = strlen(map->opts->fqname);
+
+    if (map->metric_static_set == 0 && cfl_list_is_empty(&map->metrics)) {
+        return;
+    }
+
+    ctx->suffix = "";
+    if (ctx->influx) {
+        cmetrics_context_foreach_metric(map, out_metric, ctx);
+        return;
+    }
+    if (!ctx->openmetrics) {
+        out_lit(ctx, "# HELP ");
+        out_cat(ctx, map->opts->fqname, length);
+        out_lit(ctx, " ");
+        out_escaped(ctx, map->opts->description, strlen(map->opts->description), CMT_FALSE);
+        out_lit(ctx, "\n# TYPE ");
+        out_cat(ctx, map->opts->fqname, length);
+        out_lit(ctx, " ");
+        out_str(ctx, type);
+        out_lit(ctx, "\n");
+        cmetrics_context_foreach_metric(map, out_metric, ctx);
+        return;
+    }
+
+    /* counter families are named without the _total suffix of their samples */
+    if (map->type == CMT_COUNTER) {
+        if (length > 6 && strcmp(map->opts->fqname + length - 6, "_total") == 0) {
+            length -= 6;
+        }
+        else {
+            ctx->suffix = "_total";
+        }
+    }
+
+    out_lit(ctx, "# TYPE ");
+    out_cat(ctx, map->opts->fqname, length);
+    out_lit(ctx, " ");
+    out_str(ctx, map->type == CMT_UNTYPED ? "unknown" : type);
+    out_lit(ctx, "\n# HELP ");
+    out_cat(ctx, map->opts->fqname, length);
+    out_lit(ctx, " ");
+    out_escaped(ctx, map->opts->description, strlen(map->opts->description), CMT_TRUE);
+    out_lit(ctx, "\n");
+
+    cmetrics_context_foreach_metric(map, out_metric, ctx);
+}
+
+static int
+out_map(struct cmt_map *map, void *data)
+{
+    struct exposition_ctx *ctx = data;
+
+    out_family(ctx, map,
+               map->type == CMT_COUNTER ? "counter" :
+               map->type == CMT_GAUGE ? "gauge" : "untyped");
+
+    return ctx->error;
+}
+
+static int
+encode_finish(struct exposition_ctx *ctx, char **out, size_t *size)
+{
+    /* an empty context still returns a buffer */
+    if (!ctx->error && ctx->buf == NULL) {
+        ctx->buf = malloc(1);
+        ctx->error = ctx->buf == NULL;
+    }
+
+    if (ctx->error) {
+        free(ctx->buf);
+        return -1;
+    }
+    *out = ctx->buf;
+    *size = ctx->length;
+
+    return 0;
+}
+
+static int
+encode(struct exposition_ctx *ctx, struct cmt *cmt, char **out, size_t *size)
+{
+    struct cfl_list *head;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    ctx->cmt = cmt;
+
+    cmetrics_context_foreach_map(cmt, out_map, ctx);
+
+    cfl_list_foreach(head, &cmt->histograms) {
+        histogram = cfl_list_entry(head, struct cmt_histogram, _head);
+        ctx->histogram = histogram;
+        out_family(ctx, histogram->map, "histogram");
+    }
+    ctx->histogram = NULL;
+
+    cfl_list_foreach(head, &cmt->summaries) {
+        summary = cfl_list_entry(head, struct cmt_summary, _head);
+        ctx->summary = summary;
+        out_family(ctx, summary->map, "summary");
+    }
+
+    if (ctx->openmetrics) {
+        out_lit(ctx, "# EOF\n");
+    }
+
+    return encode_finish(ctx, out, size);
+}
+
+/*
+ * Encode 'cmt' in the Prometheus text format, with timestamps, into a
+ * malloc'd buffer.
+ */
+int
+cmetrics_encode_prometheus(struct cmt *cmt, char **out, size_t *size)
+{
+    struct exposition_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    return encode(&ctx, cmt, out, size);
+}
+
+/*
+ * Encode 'cmt' as Influx line protocol, with nanosecond timestamps, into a
+ * malloc'd buffer.
+ */
+int
+cmetrics_encode_influx(struct cmt *cmt, char **out, size_t *size)
+{
+    struct exposition_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.influx = CMT_TRUE;
+
+    return encode(&ctx, cmt, out, size);
+}
+
+/*
+ * Encode 'cmt' in the OpenMetrics text format into a malloc'd buffer.
+ * 'exemplars' may be NULL.
+ */
+int
+cmetrics_encode_openmetrics(struct cmt *cmt, struct cmetrics_table *exemplars,
+                            char **out, size_t *size)
+{
+    struct exposition_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.openmetrics = CMT_TRUE;
+    ctx.exemplars = exemplars;
+
+    return encode(&ctx, cmt, out, size);
+}
+
+static void
+out_uint64(struct exposition_ctx *ctx, uint64_t value)
+{
+    char buf[32];
+
+    out_cat(ctx, buf, snprintf(buf, sizeof(buf), "%" PRIu64, value));
+}
+
+/* RFC 3339 with nanoseconds, as cmt_encode_text() writes it. */
+static void
+text_timestamp(struct exposition_ctx *ctx, uint64_t timestamp)
+{
+    char buf[64];
+    size_t length;
+    time_t seconds = (time_t)(timestamp / 1000000000);
+    struct tm tm;
+
+    gmtime_r(&seconds, &tm);
+    length = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S.", &tm);
+    length += snprintf(buf + length, sizeof(buf) - length, "%09" PRIu64 "Z ",
+                       timestamp % 1000000000);
+    out_cat(ctx, buf, length);
+}
+
+static int
+text_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    char bound[CMETRICS_DTOA_SIZE];
+    size_t i;
+    struct exposition_ctx *ctx = data;
+    struct cmt_histogram *histogram;
+    struct cmt_summary *summary;
+
+    text_timestamp(ctx, cmt_metric_get_timestamp(metric));
+    out_str(ctx, map->opts->fqname);
+    out_labels(ctx, map, metric, NULL, NULL);
+    out_lit(ctx, " = ");
+
+    switch (map->type) {
+    case CMT_HISTOGRAM:
+        histogram = map->parent;
+        out_lit(ctx, "{ buckets = { ");
+        for (i = 0; i < histogram->buckets->count; i++) {
+            out_cat(ctx, bound, cmetrics_dtoa(histogram->buckets->upper_bounds[i], bound));
+            out_lit(ctx, "=");
+            out_uint64(ctx, cmt_metric_hist_get_value(metric, (int)i));
+            out_lit(ctx, ", ");
+        }
+        out_lit(ctx, "+Inf=");
+        out_uint64(ctx, cmt_metric_hist_get_value(metric, (int)i));
+        out_lit(ctx, " }, sum=");
+        out_double(ctx, cmt_metric_hist_get_sum_value(metric));
+        out_lit(ctx, ", count=");
+        out_uint64(ctx, cmt_metric_hist_get_count_value(metric));
+        out_lit(ctx, " }");
+        break;
+    case CMT_SUMMARY:
+        summary = map->parent;
+        out_lit(ctx, "{ quantiles = { ");
+        /* series built from sum and count only have no quantile values */
+        for (i = 0; metric->sum_quantiles_set && i < summary->quantiles_count; i++) {
+            if (i > 0) {
+                out_lit(ctx, ", ");
+            }
+            out_double(ctx, summary->quantiles[i]);
+            out_lit(ctx, "=");
+            out_double(ctx, cmt_summary_quantile_get_value(metric, (int)i));
+        }
+        out_lit(ctx, " }, sum=");
+        out_double(ctx, cmt_summary_get_sum_value(metric));
+        out_lit(ctx, ", count=");
+        out_uint64(ctx, cmt_summary_get_count_value(metric));
+        out_lit(ctx, " }");
+        break;
+    default:
+        out_double(ctx, cmt_metric_get_value(metric));
+        break;
+    }
+    out_lit(ctx, "\n");
+
+    return ctx->error;
+}
+
+#define TEXT_LIST(ctx, cmt, type, list)                                       \
+    do {                                                                      \
+        struct cfl_list *head;                                                \
+        type *family;                                                         \
+        cfl_list_foreach(head, &(cmt)->list) {                                \
+            family = cfl_list_entry(head, type, _head);                       \
+            cmetrics_context_foreach_metric(family->map, text_metric, (ctx)); \
+        }                                                                     \
+    } while (0)
+
+/*
+ * Encode 'cmt' in the layout of cmt_encode_text(), with values written by
+ * cmetrics_dtoa(), into a malloc'd buffer. Label values are escaped like
+ * in the Prometheus text format.
+ */
+int
+cmetrics_encode_text(struct cmt *cmt, char **out, size_t *size)
+{
+    struct exposition_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cmt = cmt;
+
+    /* the family order of cmt_encode_text() */
+    TEXT_LIST(&ctx, cmt, struct cmt_counter, counters);
+    TEXT_LIST(&ctx, cmt, struct cmt_gauge, gauges);
+    TEXT_LIST(&ctx, cmt, struct cmt_summary, summaries);
+    TEXT_LIST(&ctx, cmt, struct cmt_histogram, histograms);
+    TEXT_LIST(&ctx, cmt, struct cmt_untyped, untypeds);
+
+    return encode_finish(&ctx, out, size);
+}
+
+struct stream_family {
+    int type;
+    struct cmetrics_mp_token ns;
+    struct cmetrics_mp_token ss;
+    struct cmetrics_mp_token name;
+    struct cmetrics_mp_token desc;
+    /* payload offsets, 0 when missing */
+    size_t label_keys;
+    size_t bounds;      /* bucket upper bounds or quantiles */
+    size_t values;
+};
+
+struct stream_series {
+    uint64_t timestamp;
+    double value;
+    size_t labels;
+    size_t distribution; /* the 'histogram' or 'summary' map */
+};
+
+/* Histogram or summary sample of a series. */
+struct stream_distribution {
+    size_t values;      /* cumulative bucket counts or quantile values */
+    int quantiles_set;
+    double sum;
+    double count;
+};
+
+static int
+stream_read_number(struct cmetrics_mp_reader *reader, double *value)
+{
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read(reader, &token) != 0) {
+        return -1;
+    }
+
+    switch (token.type) {
+    case CMETRICS_MP_UINT:
+        *value = (double)token.u;
+        return 0;
+    case CMETRICS_MP_INT:
+        *value = (double)token.i;
+        return 0;
+    case CMETRICS_MP_FLOAT:
+        *value = token.d;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Summary quantiles and sums are encoded as the raw bits of the double. */
+static int
+stream_read_bits(struct cmetrics_mp_reader *reader, double *value)
+{
+    union {
+        uint64_t u;
+        double d;
+    } f64;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT) != 0) {
+        return -1;
+    }
+    f64.u = token.u;
+    *value = f64.d;
+
+    return 0;
+}
+
+static void
+stream_fqname(struct exposition_ctx *ctx, struct stream_family *family)
+{
+    if (family->ns.length > 0) {
+        out_cat(ctx, family->ns.ptr, family->ns.length);
+        out_lit(ctx, "_");
+    }
+    if (family->ss.length > 0) {
+        out_cat(ctx, family->ss.ptr, family->ss.length);
+        out_lit(ctx, "_");
+    }
+    out_cat(ctx, family->name.ptr, family->name.length);
+}
+
+static void
+stream_label(struct exposition_ctx *ctx, int *first,
+             const char *key, size_t key_length, const char *value, size_t value_length)
+{
+    if (ctx->influx) {
+        out_influx_tag(ctx, key, key_length, value, value_length);
+        return;
+    }
+
+    out_cat(ctx, *first ? "{" : ",", 1);
+    out_cat(ctx, key, key_length);
+    out_lit(ctx, "=\"");
+    out_escaped(ctx, value, value_length, CMT_TRUE);
+    out_lit(ctx, "\"");
+    *first = CMT_FALSE;
+}
+
+/* Static labels, then the series labels, then 'key' (le, quantile) if set. */
+static int
+stream_labels(struct exposition_ctx *ctx, struct stream_family *family,
+              struct stream_series *series, const char *key, const char *value)
+{
+    int first = CMT_TRUE;
+    uint32_t i;
+    struct cmetrics_mp_reader keys = *ctx->reader;
+    struct cmetrics_mp_reader values = *ctx->reader;
+    struct cmetrics_mp_token key_array;
+    struct cmetrics_mp_token value_array;
+    struct cmetrics_mp_token label_key;
+    struct cmetrics_mp_token label_value;
+
+    if (ctx->static_labels > 0) {
+        values.offset = ctx->static_labels;
+        if (cmetrics_mp_read_type(&values, &value_array, CMETRICS_MP_ARRAY) != 0) {
+            return -1;
+        }
+        for (i = 0; i < value_array.length; i++) {
+            if (cmetrics_mp_read_type(&values, &label_key, CMETRICS_MP_ARRAY) != 0 ||
+                label_key.length != 2 ||
+                cmetrics_mp_read_type(&values, &label_key, CMETRICS_MP_STR) != 0 ||
+                cmetrics_mp_read_type(&values, &label_value, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            stream_label(ctx, &first, label_key.ptr, label_key.length,
+                         label_value.ptr, label_value.length);
+        }
+    }
+
+    if (series->labels > 0 && family->label_keys > 0) {
+        keys.offset = family->label_keys;
+        values.offset = series->labels;
+        if (cmetrics_mp_read_type(&keys, &key_array, CMETRICS_MP_ARRAY) != 0 ||
+            cmetrics_mp_read_type(&values, &value_array, CMETRICS_MP_ARRAY) != 0 ||
+            value_array.length > key_array.length) {
+            return -1;
+        }
+        for (i = 0; i < value_array.length; i++) {
+            if (cmetrics_mp_read_type(&keys, &label_key, CMETRICS_MP_STR) != 0 ||
+                cmetrics_mp_read_type(&values, &label_value, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            stream_label(ctx, &first, label_key.ptr, label_key.length,
+                         label_value.ptr, label_value.length);
+        }
+    }
+
+    if (key != NULL) {
+        stream_label(ctx, &first, key, strlen(key), value, strlen(value));
+    }
+    if (!first) {
+        out_lit(ctx, "}");
+    }
+
+    return 0;
+}
+
+static int
+stream_sample(struct exposition_ctx *ctx, struct stream_family *family,
+              struct stream_series *series, const char *suffix,
+              const char *key, const char *key_value, double value)
+{
+    stream_fqname(ctx, family);
+    out_str(ctx, suffix);
+    if (stream_labels(ctx, family, series, key, key_value) != 0) {
+        return -1;
+    }
+    out_lit(ctx, " ");
+    out_double(ctx, value);
+    out_lit(ctx, " ");
+    out_timestamp(ctx, series->timestamp);
+    out_lit(ctx, "\n");
+
+    return 0;
+}
+
+static int
+stream_read_distribution(struct exposition_ctx *ctx, struct stream_family *family,
+                         struct stream_series *series, struct stream_distribution *dist)
+{
+    uint32_t i;
+    int ret = 0;
+    struct cmetrics_mp_reader reader = *ctx->reader;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    memset(dist, 0, sizeof(*dist));
+
+    if (series->distribution == 0 || family->bounds == 0) {
+        return -1;
+    }
+    reader.offset = series->distribution;
+    if (cmetrics_mp_read_type(&reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length && ret == 0; i++) {
+        if (cmetrics_mp_read_type(&reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "buckets") ||
+            cmetrics_mp_token_equals(&key, "quantiles")) {
+            dist->values = reader.offset;
+            ret = cmetrics_mp_skip(&reader);
+        }
+        else if (cmetrics_mp_token_equals(&key, "quantiles_set")) {
+            ret = cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_UINT);
+            dist->quantiles_set = ret == 0 && token.u > 0;
+        }
+        else if (cmetrics_mp_token_equals(&key, "count")) {
+            ret = stream_read_number(&reader, &dist->count);
+        }
+        else if (cmetrics_mp_token_equals(&key, "sum")) {
+            ret = family->type == CMT_SUMMARY ?
+                  stream_read_bits(&reader, &dist->sum) :
+                  stream_read_number(&reader, &dist->sum);
+        }
+        else {
+            ret = cmetrics_mp_skip(&reader);
+        }
+    }
+
+    return ret == 0 && dist->values > 0 ? 0 : -1;
+}
+
+/*
+ * Buckets (with a trailing +Inf one) or quantiles of a series, as Prometheus
+ * samples or as Influx fields named after their bound.
+ */
+static int
+stream_distribution(struct exposition_ctx *ctx, struct stream_family *family,
+                    struct stream_series *series)
+{
+    char bound[CMETRICS_DTOA_SIZE];
+    uint32_t i;
+    double upper_bound;
+    double value;
+    const char *name;
+    struct stream_distribution dist;
+    struct cmetrics_mp_reader bounds = *ctx->reader;
+    struct cmetrics_mp_reader values = *ctx->reader;
+    struct cmetrics_mp_token bound_array;
+    struct cmetrics_mp_token value_array;
+
+    if (stream_read_distribution(ctx, family, series, &dist) != 0) {
+        return -1;
+    }
+
+    bounds.offset = family->bounds;
+    values.offset = dist.values;
+    if (cmetrics_mp_read_type(&bounds, &bound_array, CMETRICS_MP_ARRAY) != 0 ||
+        cmetrics_mp_read_type(&values, &value_array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    if (family->type == CMT_HISTOGRAM ?
+        value_array.length != bound_array.length + 1 :
+        value_array.length != bound_array.length) {
+        return -1;
+    }
+
+    for (i = 0; i < value_array.length; i++) {
+        name = "+Inf";
+        if (i < bound_array.length) {
+            if (stream_read_number(&bounds, &upper_bound) != 0) {
+                return -1;
+            }
+            cmetrics_dtoa(upper_bound, bound);
+            name = bound;
+        }
+        if ((family->type == CMT_HISTOGRAM ?
+             stream_read_number(&values, &value) :
+             stream_read_bits(&values, &value)) != 0) {
+            return -1;
+        }
+        if (family->type == CMT_SUMMARY && !dist.quantiles_set) {
+            continue;
+        }
+
+        if (ctx->influx) {
+            out_str(ctx, name);
+            out_lit(ctx, "=");
+            out_double(ctx, value);
+            out_lit(ctx, ",");
+        }
+        else if (family->type == CMT_HISTOGRAM) {
+            if (stream_sample(ctx, family, series, "_bucket", "le", name, value) != 0) {
+                return -1;
+            }
+        }
+        else if (stream_sample(ctx, family, series, "", "quantile", name, value) != 0) {
+            return -1;
+        }
+    }
+
+    if (ctx->influx) {
+        out_lit(ctx, "sum=");
+        out_double(ctx, dist.sum);
+        out_lit(ctx, ",count=");
+        out_double(ctx, dist.count);
+        return 0;
+    }
+
+    if (stream_sample(ctx, family, series, "_count", NULL, NULL, dist.count) != 0 ||
+        stream_sample(ctx, family, series, "_sum", NULL, NULL, dist.sum) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* One line per series: measurement and tags, the fields, the timestamp. */
+static int
+stream_influx_series(struct exposition_ctx *ctx, struct stream_family *family,
+                     struct stream_series *series)
+{
+    out_cat(ctx, family->ns.ptr, family->ns.length);
+    if (family->ss.length > 0) {
+        out_lit(ctx, "_");
+        out_cat(ctx, family->ss.ptr, family->ss.length);
+    }
+    if (stream_labels(ctx, family, series, NULL, NULL) != 0) {
+        return -1;
+    }
+    out_lit(ctx, " ");
+
+    if (family->type == CMT_HISTOGRAM || family->type == CMT_SUMMARY) {
+        if (stream_distribution(ctx, family, series) != 0) {
+            return -1;
+        }
+    }
+    else {
+        out_influx_escaped(ctx, family->name.ptr, family->name.length);
+        out_lit(ctx, "=");
+        out_double(ctx, series->value);
+    }
+
+    out_lit(ctx, " ");
+    out_timestamp(ctx, series->timestamp);
+    out_lit(ctx, "\n");
+
+    return 0;
+}
+
+static int
+stream_read_series(struct cmetrics_mp_reader *reader, struct stream_series *series)
+{
+    uint32_t i;
+    int ret = 0;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    memset(series, 0, sizeof(*series));
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length && ret == 0; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "ts")) {
+            ret = cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT);
+            if (ret == 0) {
+                series->timestamp = token.u;
+            }
+            continue;
+        }
+        if (cmetrics_mp_token_equals(&key, "value")) {
+            ret = stream_read_number(reader, &series->value);
+            continue;
+        }
+        if (cmetrics_mp_token_equals(&key, "labels")) {
+            series->labels = reader->offset;
+        }
+        else if (cmetrics_mp_token_equals(&key, "histogram") ||
+                 cmetrics_mp_token_equals(&key, "summary")) {
+            series->distribution = reader->offset;
+        }
+        ret = cmetrics_mp_skip(reader);
+    }
+
+    return ret;
+}
+
+static int
+stream_read_family_meta(struct cmetrics_mp_reader *reader, struct stream_family *family)
+{
+    uint32_t i;
+    uint32_t j;
+    int ret = 0;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+    struct cmetrics_mp_token *dst;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length && ret == 0; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "type")) {
+            ret = cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT);
+            family->type = ret == 0 && token.u <= CMT_UNTYPED ? (int)token.u : -1;
+        }
+        else if (cmetrics_mp_token_equals(&key, "opts")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_MAP) != 0) {
+                return -1;
+            }
+            for (j = token.length; j > 0 && ret == 0; j--) {
+                if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+                    return -1;
+                }
+                dst = cmetrics_mp_token_equals(&key, "ns") ? &family->ns :
+                      cmetrics_mp_token_equals(&key, "ss") ? &family->ss :
+                      cmetrics_mp_token_equals(&key, "name") ? &family->name :
+                      cmetrics_mp_token_equals(&key, "desc") ? &family->desc : NULL;
+                ret = dst ? cmetrics_mp_read_type(reader, dst, CMETRICS_MP_STR) :
+                            cmetrics_mp_skip(reader);
+            }
+        }
+        else if (cmetrics_mp_token_equals(&key, "labels")) {
+            family->label_keys = reader->offset;
+            ret = cmetrics_mp_skip(reader);
+        }
+        else if (cmetrics_mp_token_equals(&key, "buckets") ||
+                 cmetrics_mp_token_equals(&key, "quantiles")) {
+            family->bounds = reader->offset;
+            ret = cmetrics_mp_skip(reader);
+        }
+        else {
+            ret = cmetrics_mp_skip(reader);
+        }
+    }
+
+    return ret;
+}
+
+static int
+stream_family(struct exposition_ctx *ctx, struct cmetrics_mp_reader *reader)
+{
+    static const char *types[] = { "counter", "gauge", "histogram", "summary", "untyped" };
+    uint32_t i;
+    struct stream_family family;
+    struct stream_series series;
+    struct cmetrics_mp_reader values;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token array;
+
+    memset(&family, 0, sizeof(family));
+    family.type = -1;
+
+    /* 'values' may come first, its offset is enough */
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            if (stream_read_family_meta(reader, &family) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (cmetrics_mp_token_equals(&key, "values")) {
+            family.values = reader->offset;
+        }
+        if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+    if (family.type < 0 || family.name.ptr == NULL || family.values == 0) {
+        return -1;
+    }
+
+    values = *reader;
+    values.offset = family.values;
+    if (cmetrics_mp_read_type(&values, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    if (array.length == 0) {
+        return 0;
+    }
+
+    if (!ctx->influx) {
+        out_lit(ctx, "# HELP ");
+        stream_fqname(ctx, &family);
+        out_lit(ctx, " ");
+        if (family.desc.ptr != NULL) {
+            out_escaped(ctx, family.desc.ptr, family.desc.length, CMT_FALSE);
+        }
+        out_lit(ctx, "\n# TYPE ");
+        stream_fqname(ctx, &family);
+        out_lit(ctx, " ");
+        out_str(ctx, types[family.type]);
+        out_lit(ctx, "\n");
+    }
+
+    for (i = 0; i < array.length && !ctx->error; i++) {
+        if (stream_read_series(&values, &series) != 0) {
+            return -1;
+        }
+        if (ctx->influx) {
+            if (stream_influx_series(ctx, &family, &series) != 0) {
+                return -1;
+            }
+        }
+        else if (family.type == CMT_HISTOGRAM || family.type == CMT_SUMMARY) {
+            if (stream_distribution(ctx, &family, &series) != 0) {
+                return -1;
+            }
+        }
+        else if (stream_sample(ctx, &family, &series, "", NULL, NULL, series.value) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Remember where the static labels of the payload are, if any. */
+static int
+stream_scan_context_meta(struct exposition_ctx *ctx, struct cmetrics_mp_reader *reader)
+{
+    uint32_t i;
+    uint32_t j;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (!cmetrics_mp_token_equals(&key, "processing")) {
+            if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_MAP) != 0) {
+            return -1;
+        }
+        for (j = token.length; j > 0; j--) {
+            if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (cmetrics_mp_token_equals(&key, "static_labels")) {
+                ctx->static_labels = reader->offset;
+            }
+            if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+stream_payload(struct exposition_ctx *ctx, struct cmetrics_mp_reader *reader)
+{
+    uint32_t i;
+    size_t metrics = 0;
+    struct cmetrics_mp_reader families;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token array;
+
+    ctx->static_labels = 0;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            if (stream_scan_context_meta(ctx, reader) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (cmetrics_mp_token_equals(&key, "metrics")) {
+            metrics = reader->offset;
+        }
+        if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+    if (metrics == 0) {
+        return -1;
+    }
+
+    families = *reader;
+    families.offset = metrics;
+    if (cmetrics_mp_read_type(&families, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    for (i = 0; i < array.length && !ctx->error; i++) {
+        if (stream_family(ctx, &families) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Transcode the msgpack payloads of 'buf' (one or several concatenated) to
+ * the Prometheus text format, or to Influx line protocol when 'influx' is
+ * set, into a malloc'd buffer. Families are written in payload order and
+ * are not merged across payloads. Returns CMETRICS_TRANSCODE_ERROR_INPUT
+ * for malformed payloads and -1 when out of memory.
+ */
+int
+cmetrics_transcode_msgpack(const char *buf, size_t size, int influx,
+                           char **out, size_t *out_size)
+{
+    size_t offset = 0;
+    struct exposition_ctx ctx;
+    struct cmetrics_mp_reader reader;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.influx = influx;
+    ctx.reader = &reader;
+
+    cmetrics_mp_reader_init(&reader, buf, size, 0);
+
+    while (reader.offset < size && !ctx.error) {
+        if (cmetrics_msgpack_validate(buf, size, &offset) != 0 ||
+            stream_payload(&ctx, &reader) != 0) {
+            free(ctx.buf);
+            return CMETRICS_TRANSCODE_ERROR_INPUT;
+        }
+        /* both walked the same payload */
+        reader.offset = offset;
+    }
+
+    return encode_finish(&ctx, out, out_size);
+}
+
+/*
+ * Read an exemplar Hash ({trace_id: String}) into 'exemplar'. Raises
+ * ArgumentError when it is malformed.
+ */
+void
+cmetrics_exemplar_parse(VALUE rb_exemplar, double value, struct cmetrics_exemplar *exemplar)
+{
+    VALUE rb_trace_id;
+
+    Check_Type(rb_exemplar, T_HASH);
+
+    rb_trace_id = rb_hash_aref(rb_exemplar, ID2SYM(rb_intern("trace_id")));
+    if (NIL_P(rb_trace_id)) {
+        rb_trace_id = rb_hash_aref(rb_exemplar, rb_str_new_cstr("trace_id"));
+    }
+    if (NIL_P(rb_trace_id)) {
+        rb_raise(rb_eArgError, "exemplar must have a trace_id");
+    }
+    Check_Type(rb_trace_id, T_STRING);
+    if (RSTRING_LEN(rb_trace_id) == 0 ||
+        RSTRING_LEN(rb_trace_id) > CMETRICS_EXEMPLAR_TRACE_ID_MAX) {
+        rb_raise(rb_eArgError, "exemplar trace_id must be 1 to %d bytes",
+                 CMETRICS_EXEMPLAR_TRACE_ID_MAX);
+    }
+
+    memset(exemplar, 0, sizeof(struct cmetrics_exemplar));
+    exemplar->value = value;
+    exemplar->trace_id_length = (uint8_t)RSTRING_LEN(rb_trace_id);
+    memcpy(exemplar->trace_id, RSTRING_PTR(rb_trace_id), exemplar->trace_id_length);
+}
+
+/* Store 'exemplar' as the latest one of 'metric'. */
+int
+cmetrics_exemplar_set(struct cmetrics_table *exemplars, struct cmt_metric *metric,
+                      struct cmetrics_exemplar *exemplar)
+{
+    void **slot;
+
+    if (exemplars->entries == NULL && cmetrics_table_init(exemplars, 16) != 0) {
+        return -1;
+    }
+
+    slot = cmetrics_table_lookup(exemplars, &metric, sizeof(metric), CMT_TRUE, NULL);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (*slot == NULL) {
+        *slot = malloc(sizeof(struct cmetrics_exemplar));
+        if (*slot == NULL) {
+            return -1;
+        }
+    }
+    memcpy(*slot, exemplar, sizeof(struct cmetrics_exemplar));
+
+    return 0;
+}
+
+void
+cmetrics_exemplars_destroy(struct cmetrics_table *exemplars)
+{
+    size_t i;
+
+    if (exemplars->entries == NULL) {
+        return;
+    }
+    for (i = 0; i < exemplars->size; i++) {
+        if (exemplars->entries[i].key != NULL) {
+            free(exemplars->entries[i].value);
+        }
+    }
+    cmetrics_table_destroy(exemplars);
+}
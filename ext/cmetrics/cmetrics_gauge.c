@@ -21,11 +21,12 @@
 
 VALUE rb_cGauge;
 
+static void gauge_mark(void* ptr);
 static void gauge_free(void* ptr);
 
 static const rb_data_type_t rb_cmetrics_gauge_type = { "cmetrics/gauge",
                                                        {
-                                                         0,
+                                                         gauge_mark,
                                                          gauge_free,
                                                          0,
                                                        },
@@ -50,12 +51,21 @@ const struct CMetricsGauge *cmetrics_gauge_get_ptr(VALUE self)
     return cmetricsGauge;
 }
 
+static void
+gauge_mark(void* ptr)
+{
+    struct CMetricsGauge* cmetricsGauge = (struct CMetricsGauge*)ptr;
+
+    cmetrics_cache_mark(&cmetricsGauge->cache);
+}
+
 static void
 gauge_free(void* ptr)
 {
     struct CMetricsGauge* cmetricsGauge = (struct CMetricsGauge*)ptr;
 
     if (cmetricsGauge) {
+        cmetrics_cache_destroy(&cmetricsGauge->cache);
         if (cmetricsGauge->gauge) {
             cmt_gauge_destroy(cmetricsGauge->gauge);
         }
@@ -74,6 +84,7 @@ rb_cmetrics_gauge_alloc(VALUE klass)
     struct CMetricsGauge* cmetricsGauge;
     obj = TypedData_Make_Struct(
             klass, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
+    cmetrics_cache_init(&cmetricsGauge->cache);
     return obj;
 }
 
@@ -116,6 +127,8 @@ rb_cmetrics_gauge_create(int argc, VALUE* argv, VALUE self)
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
+    cmetrics_cache_touch(&cmetricsGauge->cache);
+
     rb_scan_args(argc, argv, "41", &rb_namespace, &rb_subsystem, &rb_name, &rb_help, &rb_labels);
 
     Check_Type(rb_namespace, T_STRING);
@@ -198,9 +211,10 @@ rb_cmetrics_gauge_increment(int argc, VALUE* argv, VALUE self)
     struct CMetricsGauge* cmetricsGauge;
     uint64_t ts;
     int ret = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -216,14 +230,16 @@ rb_cmetrics_gauge_increment(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_gauge_inc(cmetricsGauge->gauge, ts,
                                 labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_gauge_inc(cmetricsGauge->gauge, ts,
@@ -248,8 +264,6 @@ rb_cmetrics_gauge_increment(int argc, VALUE* argv, VALUE self)
             ret = cmt_gauge_inc(cmetricsGauge->gauge, ts,
                                 labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -259,6 +273,10 @@ rb_cmetrics_gauge_increment(int argc, VALUE* argv, VALUE self)
                             labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsGauge->cache, cmetricsGauge->gauge->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -279,9 +297,10 @@ rb_cmetrics_gauge_decrement(int argc, VALUE* argv, VALUE self)
     struct CMetricsGauge* cmetricsGauge;
     uint64_t ts;
     int ret = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -297,14 +316,16 @@ rb_cmetrics_gauge_decrement(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_gauge_dec(cmetricsGauge->gauge, ts,
                                 labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
 
             ret = cmt_gauge_dec(cmetricsGauge->gauge, ts,
@@ -329,8 +350,6 @@ rb_cmetrics_gauge_decrement(int argc, VALUE* argv, VALUE self)
             ret = cmt_gauge_dec(cmetricsGauge->gauge, ts,
                                 labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -340,6 +359,10 @@ rb_cmetrics_gauge_decrement(int argc, VALUE* argv, VALUE self)
                             labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsGauge->cache, cmetricsGauge->gauge->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -436,9 +459,10 @@ rb_cmetrics_gauge_add(int argc, VALUE* argv, VALUE self)
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -466,13 +490,15 @@ rb_cmetrics_gauge_add(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_add(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_add(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
@@ -496,8 +522,6 @@ rb_cmetrics_gauge_add(int argc, VALUE* argv, VALUE self)
             ret = cmt_gauge_add(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -507,6 +531,10 @@ rb_cmetrics_gauge_add(int argc, VALUE* argv, VALUE self)
                             labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsGauge->cache, cmetricsGauge->gauge->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -528,9 +556,10 @@ rb_cmetrics_gauge_sub(int argc, VALUE* argv, VALUE self)
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -558,13 +587,15 @@ rb_cmetrics_gauge_sub(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_sub(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_sub(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
@@ -588,8 +619,6 @@ rb_cmetrics_gauge_sub(int argc, VALUE* argv, VALUE self)
             ret = cmt_gauge_sub(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -599,6 +628,10 @@ rb_cmetrics_gauge_sub(int argc, VALUE* argv, VALUE self)
                             labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsGauge->cache, cmetricsGauge->gauge->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -620,9 +653,10 @@ rb_cmetrics_gauge_set(int argc, VALUE* argv, VALUE self)
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -649,13 +683,15 @@ rb_cmetrics_gauge_set(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_set(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_gauge_set(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
@@ -680,8 +716,6 @@ rb_cmetrics_gauge_set(int argc, VALUE* argv, VALUE self)
             ret = cmt_gauge_set(cmetricsGauge->gauge, ts, value,
                                 labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -691,6 +725,10 @@ rb_cmetrics_gauge_set(int argc, VALUE* argv, VALUE self)
                             labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsGauge->cache, cmetricsGauge->gauge->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -714,6 +752,8 @@ rb_cmetrics_gauge_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
+    cmetrics_cache_touch(&cmetricsGauge->cache);
+
     if (!cmetricsGauge->gauge) {
         rb_raise(rb_eRuntimeError, "Create gauge with CMetrics::Gauge#create first.");
     }
@@ -750,83 +790,184 @@ rb_cmetrics_gauge_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
 }
 
 static VALUE
-rb_cmetrics_gauge_to_influx(VALUE self)
+rb_cmetrics_gauge_to_influx(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
+
+    return cmetrics_export_influx(cmetricsGauge->instance, argc, argv);
+}
+
+/*
+ * Encode as OpenTelemetry (OTLP) protobuf.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String] binary String
+ *
+ */
+static VALUE
+rb_cmetrics_gauge_to_opentelemetry(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
+
+    return cmetrics_export_opentelemetry(cmetricsGauge->instance, argc, argv);
+}
+
+/*
+ * Encode as Splunk HTTP Event Collector metric events.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param host [String] event host
+ * @param index [String] target index
+ * @param source [String] event source
+ * @param source_type [String] event sourcetype
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_gauge_to_splunk_hec(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
+
+    return cmetrics_export_splunk_hec(cmetricsGauge->instance, argc, argv);
+}
+
+/*
+ * Encode as CloudWatch embedded metric format (EMF), one JSON document
+ * per line.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_gauge_to_cloudwatch_emf(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsGauge* cmetricsGauge;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    prom = cmt_encode_influx_create(cmetricsGauge->instance);
+    return cmetrics_export_cloudwatch_emf(cmetricsGauge->instance, argc, argv);
+}
 
-    str = rb_str_new2(prom);
+/*
+ * Encode as a binary snapshot, see CMetrics::Serde.from_snapshot.
+ * Histograms and summaries are not supported.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_gauge_to_snapshot(VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
 
-    cmt_encode_influx_destroy(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    return str;
+    return cmetrics_snapshot_encode(cmetricsGauge->instance);
 }
 
+/*
+ * Encode as OpenMetrics text.
+ *
+ * @return [String]
+ *
+ */
 static VALUE
-rb_cmetrics_gauge_to_prometheus(VALUE self)
+rb_cmetrics_gauge_to_openmetrics(VALUE self)
 {
     struct CMetricsGauge* cmetricsGauge;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    prom = cmt_encode_prometheus_create(cmetricsGauge->instance, CMT_TRUE);
+    return cmetrics_export_openmetrics(cmetricsGauge->instance, NULL);
+}
 
-    str = rb_str_new2(prom);
+static VALUE
+rb_cmetrics_gauge_to_prometheus(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
 
-    cmt_encode_prometheus_destroy(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    return str;
+    return cmetrics_export_prometheus(cmetricsGauge->instance, &cmetricsGauge->cache, argc, argv);
 }
 
+/*
+ * Reuse the output of #to_prometheus, as a frozen String, until the
+ * gauge is updated.
+ *
+ * @param max_staleness [Float] also reuse it for this many seconds after updates
+ * @return [nil]
+ *
+ */
 static VALUE
-rb_cmetrics_gauge_to_msgpack(VALUE self)
+rb_cmetrics_gauge_enable_exposition_cache(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsGauge* cmetricsGauge;
-    char *buffer;
-    size_t buffer_size;
-    int ret = 0;
 
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    ret = cmt_encode_msgpack_create(cmetricsGauge->instance, &buffer, &buffer_size);
+    cmetrics_cache_configure(&cmetricsGauge->cache, argc, argv);
 
-    if (ret == 0) {
-        return rb_str_new(buffer, buffer_size);
-    } else {
-        return Qnil;
-    }
+    return Qnil;
 }
 
 static VALUE
-rb_cmetrics_gauge_to_text(VALUE self)
+rb_cmetrics_gauge_disable_exposition_cache(VALUE self)
 {
     struct CMetricsGauge* cmetricsGauge;
-    cfl_sds_t  buffer;
-    VALUE text;
 
     TypedData_Get_Struct(
             self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    buffer = cmt_encode_text_create(cmetricsGauge->instance);
-    if (buffer == NULL) {
-        return Qnil;
-    }
+    cmetrics_cache_disable(&cmetricsGauge->cache);
+
+    return Qnil;
+}
+
+/*
+ * Encode as msgpack.
+ *
+ * @param changed_since [Integer] only encode series updated after this token
+ * @return [String, Array] the buffer, or [buffer, token] with changed_since:
+ *
+ */
+static VALUE
+rb_cmetrics_gauge_to_msgpack(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
 
-    text = rb_str_new2(buffer);
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    cfl_sds_destroy(buffer);
+    return cmetrics_export_msgpack(cmetricsGauge->instance, &cmetricsGauge->cache, argc, argv);
+}
+
+static VALUE
+rb_cmetrics_gauge_to_text(VALUE self)
+{
+    struct CMetricsGauge* cmetricsGauge;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsGauge, &rb_cmetrics_gauge_type, cmetricsGauge);
 
-    return text;
+    return cmetrics_export_text(cmetricsGauge->instance);
 }
 
 void Init_cmetrics_gauge(VALUE rb_mCMetrics)
@@ -850,8 +991,15 @@ void Init_cmetrics_gauge(VALUE rb_mCMetrics)
     rb_define_method(rb_cGauge, "val=", rb_cmetrics_gauge_set, -1);
     rb_define_method(rb_cGauge, "value=", rb_cmetrics_gauge_set, -1);
     rb_define_method(rb_cGauge, "add_label", rb_cmetrics_gauge_add_label, 2);
-    rb_define_method(rb_cGauge, "to_influx", rb_cmetrics_gauge_to_influx, 0);
-    rb_define_method(rb_cGauge, "to_prometheus", rb_cmetrics_gauge_to_prometheus, 0);
-    rb_define_method(rb_cGauge, "to_msgpack", rb_cmetrics_gauge_to_msgpack, 0);
+    rb_define_method(rb_cGauge, "to_influx", rb_cmetrics_gauge_to_influx, -1);
+    rb_define_method(rb_cGauge, "to_opentelemetry", rb_cmetrics_gauge_to_opentelemetry, -1);
+    rb_define_method(rb_cGauge, "to_splunk_hec", rb_cmetrics_gauge_to_splunk_hec, -1);
+    rb_define_method(rb_cGauge, "to_cloudwatch_emf", rb_cmetrics_gauge_to_cloudwatch_emf, -1);
+    rb_define_method(rb_cGauge, "to_snapshot", rb_cmetrics_gauge_to_snapshot, 0);
+    rb_define_method(rb_cGauge, "to_openmetrics", rb_cmetrics_gauge_to_openmetrics, 0);
+    rb_define_method(rb_cGauge, "to_prometheus", rb_cmetrics_gauge_to_prometheus, -1);
+    rb_define_method(rb_cGauge, "enable_exposition_cache", rb_cmetrics_gauge_enable_exposition_cache, -1);
+    rb_define_method(rb_cGauge, "disable_exposition_cache", rb_cmetrics_gauge_disable_exposition_cache, 0);
+    rb_define_method(rb_cGauge, "to_msgpack", rb_cmetrics_gauge_to_msgpack, -1);
     rb_define_method(rb_cGauge, "to_s", rb_cmetrics_gauge_to_text, 0);
 }
@@ -0,0 +1,345 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+#include <math.h>
+
+/*
+ * JSON encoding of counters, gauges and untyped series, with the keys and
+ * the layout of Serde#metrics. The parts which are identical for every
+ * series (static labels, family names) are escaped once and copied.
+ */
+
+struct json_ctx {
+    VALUE out;
+    int ndjson;
+    VALUE static_labels; /* ,"static_labels":{...} or empty */
+    VALUE head;          /* {"namespace":...,"subsystem":... */
+    VALUE tail;          /* ,"name":...,"description":...,"value": */
+    int first_family;
+};
+
+#define json_lit(out, str) rb_str_buf_cat((out), (str), sizeof(str) - 1)
+
+static void
+json_string(VALUE out, const char *str, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    char unicode[6] = { '\\', 'u', '0', '0', 0, 0 };
+    unsigned char c;
+    size_t i;
+    size_t start = 0;
+
+    json_lit(out, "\"");
+    for (i = 0; i < length; i++) {
+        c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        rb_str_buf_cat(out, str + start, i - start);
+        switch (c) {
+        case '"':
+            json_lit(out, "\\\"");
+            break;
+        case '\\':
+            json_lit(out, "\\\\");
+            break;
+        case '\n':
+            json_lit(out, "\\n");
+            break;
+        case '\r':
+            json_lit(out, "\\r");
+            break;
+        case '\t':
+            json_lit(out, "\\t");
+            break;
+        case '\b':
+            json_lit(out, "\\b");
+            break;
+        case '\f':
+            json_lit(out, "\\f");
+            break;
+        default:
+            unicode[4] = hex[c >> 4];
+            unicode[5] = hex[c & 0x0f];
+            rb_str_buf_cat(out, unicode, sizeof(unicode));
+            break;
+        }
+        start = i + 1;
+    }
+    rb_str_buf_cat(out, str + start, length - start);
+    json_lit(out, "\"");
+}
+
+static void
+json_cstr(VALUE out, const char *str)
+{
+    json_string(out, str, strlen(str));
+}
+
+/*
+ * Numbers keep a fraction, as Float#to_json does, so that document stores
+ * do not map the field as an integer. JSON has no NaN nor Infinity, they
+ * are written as null.
+ */
+static void
+json_double(VALUE out, double value)
+{
+    char buf[CMETRICS_DTOA_SIZE + 2];
+    size_t length;
+
+    if (isnan(value) || isinf(value)) {
+        json_lit(out, "null");
+        return;
+    }
+    length = cmetrics_dtoa(value, buf);
+    if (memchr(buf, '.', length) == NULL && memchr(buf, 'e', length) == NULL) {
+        memcpy(buf + length, ".0", 2);
+        length += 2;
+    }
+    rb_str_buf_cat(out, buf, length);
+}
+
+static VALUE
+json_static_labels(struct cmt *cmt)
+{
+    int first = CMT_TRUE;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    VALUE out = rb_str_buf_new(0);
+
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        if (first) {
+            json_lit(out, ",\"static_labels\":{");
+            first = CMT_FALSE;
+        }
+        else {
+            json_lit(out, ",");
+        }
+        json_cstr(out, static_label->key);
+        json_lit(out, ":");
+        json_cstr(out, static_label->val);
+    }
+    if (!first) {
+        json_lit(out, "}");
+    }
+
+    return out;
+}
+
+static int
+json_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int first = CMT_TRUE;
+    struct json_ctx *ctx = data;
+    struct cfl_list *head;
+    struct cfl_list *key_head;
+    struct cmt_map_label *label_key;
+    struct cmt_map_label *label_value;
+
+    rb_str_buf_append(ctx->out, ctx->head);
+    rb_str_buf_append(ctx->out, ctx->static_labels);
+
+    if (metric != &map->metric) {
+        key_head = map->label_keys.next;
+        cfl_list_foreach(head, &metric->labels) {
+            if (key_head == &map->label_keys) {
+                break;
+            }
+            label_key = cfl_list_entry(key_head, struct cmt_map_label, _head);
+            label_value = cfl_list_entry(head, struct cmt_map_label, _head);
+            rb_str_buf_cat2(ctx->out, first ? ",\"labels\":{" : ",");
+            json_cstr(ctx->out, label_key->name);
+            json_lit(ctx->out, ":");
+            json_cstr(ctx->out, label_value->name);
+            first = CMT_FALSE;
+            key_head = key_head->next;
+        }
+        if (!first) {
+            json_lit(ctx->out, "}");
+        }
+    }
+
+    rb_str_buf_append(ctx->out, ctx->tail);
+    json_double(ctx->out, cmt_metric_get_value(metric));
+    json_lit(ctx->out, ",\"timestamp\":");
+    json_double(ctx->out, cmt_metric_get_timestamp(metric) / 1000000000.0);
+    json_lit(ctx->out, "}");
+    rb_str_buf_cat(ctx->out, ctx->ndjson ? "\n" : ",", 1);
+
+    return 0;
+}
+
+static int
+json_map(struct cmt_map *map, void *data)
+{
+    struct json_ctx *ctx = data;
+    struct cmt_opts *opts = map->opts;
+
+    rb_str_set_len(ctx->head, 0);
+    json_lit(ctx->head, "{\"namespace\":");
+    json_cstr(ctx->head, opts->ns);
+    json_lit(ctx->head, ",\"subsystem\":");
+    json_cstr(ctx->head, opts->subsystem);
+
+    rb_str_set_len(ctx->tail, 0);
+    json_lit(ctx->tail, ",\"name\":");
+    json_cstr(ctx->tail, opts->name);
+    json_lit(ctx->tail, ",\"description\":");
+    json_cstr(ctx->tail, opts->description);
+    json_lit(ctx->tail, ",\"value\":");
+
+    if (ctx->ndjson) {
+        return cmetrics_context_foreach_metric(map, json_metric, ctx);
+    }
+
+    rb_str_buf_cat2(ctx->out, ctx->first_family ? "[" : ",[");
+    ctx->first_family = CMT_FALSE;
+    cmetrics_context_foreach_metric(map, json_metric, ctx);
+    /* replace the separator of the last series */
+    if (RSTRING_PTR(ctx->out)[RSTRING_LEN(ctx->out) - 1] == ',') {
+        rb_str_set_len(ctx->out, RSTRING_LEN(ctx->out) - 1);
+    }
+    json_lit(ctx->out, "]");
+
+    return 0;
+}
+
+/*
+ * Encode the counters, gauges and untyped families of 'cmt' as a JSON
+ * Array of families, each an Array of series Objects, or as one series
+ * Object per line when 'ndjson' is set.
+ */
+VALUE
+cmetrics_encode_json(struct cmt *cmt, int ndjson)
+{
+    struct json_ctx ctx;
+
+    ctx.out = rb_str_buf_new(4096);
+    ctx.ndjson = ndjson;
+    ctx.static_labels = json_static_labels(cmt);
+    ctx.head = rb_str_buf_new(0);
+    ctx.tail = rb_str_buf_new(0);
+    ctx.first_family = CMT_TRUE;
+
+    if (!ndjson) {
+        json_lit(ctx.out, "[");
+    }
+    cmetrics_context_foreach_map(cmt, json_map, &ctx);
+    if (!ndjson) {
+        json_lit(ctx.out, "]");
+    }
+
+    RB_GC_GUARD(ctx.static_labels);
+    RB_GC_GUARD(ctx.head);
+    RB_GC_GUARD(ctx.tail);
+    rb_enc_associate(ctx.out, rb_utf8_encoding());
+
+    return ctx.out;
+}
+
+static int
+json_from_msgpack(struct cmetrics_mp_reader *reader, VALUE out)
+{
+    char buf[24];
+    uint32_t i;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read(reader, &token) != 0) {
+        return -1;
+    }
+
+    switch (token.type) {
+    case CMETRICS_MP_NIL:
+        json_lit(out, "null");
+        return 0;
+    case CMETRICS_MP_BOOL:
+        rb_str_buf_cat2(out, token.u ? "true" : "false");
+        return 0;
+    case CMETRICS_MP_UINT:
+        rb_str_buf_cat(out, buf, snprintf(buf, sizeof(buf), "%" PRIu64, token.u));
+        return 0;
+    case CMETRICS_MP_INT:
+        rb_str_buf_cat(out, buf, snprintf(buf, sizeof(buf), "%" PRId64, token.i));
+        return 0;
+    case CMETRICS_MP_FLOAT:
+        json_double(out, token.d);
+        return 0;
+    case CMETRICS_MP_STR:
+        json_string(out, token.ptr, token.length);
+        return 0;
+    case CMETRICS_MP_ARRAY:
+        json_lit(out, "[");
+        for (i = 0; i < token.length; i++) {
+            if (i > 0) {
+                json_lit(out, ",");
+            }
+            if (json_from_msgpack(reader, out) != 0) {
+                return -1;
+            }
+        }
+        json_lit(out, "]");
+        return 0;
+    case CMETRICS_MP_MAP:
+        json_lit(out, "{");
+        for (i = 0; i < token.length; i++) {
+            struct cmetrics_mp_token key;
+
+            if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (i > 0) {
+                json_lit(out, ",");
+            }
+            json_string(out, key.ptr, key.length);
+            json_lit(out, ":");
+            if (json_from_msgpack(reader, out) != 0) {
+                return -1;
+            }
+        }
+        json_lit(out, "}");
+        return 0;
+    default:
+        /* bin and ext have no JSON counterpart */
+        return -1;
+    }
+}
+
+/*
+ * Append the msgpack objects of 'buf' to 'out' as JSON, one per line.
+ * Map keys must be strings.
+ */
+int
+cmetrics_msgpack_to_json_lines(const char *buf, size_t size, VALUE out)
+{
+    struct cmetrics_mp_reader reader;
+
+    cmetrics_mp_reader_init(&reader, buf, size, 0);
+
+    while (reader.offset < size) {
+        if (json_from_msgpack(&reader, out) != 0) {
+            return -1;
+        }
+        json_lit(out, "\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,467 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/* key prefixes to tell the static series apart from a series of empty labels */
+#define MERGE_SERIES_STATIC  "s"
+#define MERGE_SERIES_LABELED "l"
+
+struct merge_family {
+    struct cmt_map *map;
+    char **keys;
+    struct cmetrics_table series;
+};
+
+struct merge_ctx {
+    struct cmt *dst;
+    int policy;
+    int error;
+
+    /* fqname and type -> index into families */
+    struct cmetrics_table table;
+    /* fqname and type -> first source map of a family missing in dst */
+    struct cmetrics_table checked;
+    struct merge_family *families;
+    size_t family_count;
+    size_t family_capacity;
+
+    /* state of the source map being merged */
+    struct merge_family *family;
+    int *index;
+    char **values;
+    char **ordered;
+
+    struct cmetrics_key key;
+};
+
+static int
+series_key(struct merge_ctx *ctx, int is_static, int count, char **values)
+{
+    int i;
+
+    ctx->key.length = 0;
+    if (is_static) {
+        return cmetrics_key_append(&ctx->key, MERGE_SERIES_STATIC, 1);
+    }
+
+    if (cmetrics_key_append(&ctx->key, MERGE_SERIES_LABELED, 1) != 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (cmetrics_key_append(&ctx->key, values[i], strlen(values[i])) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+family_key(struct merge_ctx *ctx, struct cmt_map *map)
+{
+    char type = (char)map->type;
+
+    ctx->key.length = 0;
+    if (cmetrics_key_append(&ctx->key, &type, 1) != 0 ||
+        cmetrics_key_append(&ctx->key, map->opts->fqname,
+                            strlen(map->opts->fqname)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+index_series(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int created;
+    void **slot;
+    struct merge_ctx *ctx = data;
+
+    cmetrics_context_label_values(map, metric, ctx->values);
+    if (series_key(ctx, metric == &map->metric, map->label_count, ctx->values) != 0) {
+        return -1;
+    }
+
+    slot = cmetrics_table_lookup(&ctx->family->series, ctx->key.buf, ctx->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -1;
+    }
+    *slot = metric;
+
+    return 0;
+}
+
+static int
+values_reserve(struct merge_ctx *ctx, int count)
+{
+    char **tmp_values;
+    char **tmp_ordered;
+    int *tmp_index;
+
+    tmp_values = realloc(ctx->values, (count + 1) * sizeof(char *));
+    if (tmp_values == NULL) {
+        return -1;
+    }
+    ctx->values = tmp_values;
+
+    tmp_ordered = realloc(ctx->ordered, (count + 1) * sizeof(char *));
+    if (tmp_ordered == NULL) {
+        return -1;
+    }
+    ctx->ordered = tmp_ordered;
+
+    tmp_index = realloc(ctx->index, (count + 1) * sizeof(int));
+    if (tmp_index == NULL) {
+        return -1;
+    }
+    ctx->index = tmp_index;
+
+    return 0;
+}
+
+/* Register a destination map, indexing its existing series. */
+static struct merge_family *
+family_add(struct merge_ctx *ctx, struct cmt_map *map)
+{
+    int created;
+    void **slot;
+    size_t capacity;
+    struct merge_family *tmp_families;
+    struct merge_family *family;
+
+    if (family_key(ctx, map) != 0) {
+        return NULL;
+    }
+    slot = cmetrics_table_lookup(&ctx->table, ctx->key.buf, ctx->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return NULL;
+    }
+    if (!created) {
+        /* duplicated families in the destination: merge into the first one */
+        return &ctx->families[(uintptr_t)*slot];
+    }
+
+    if (ctx->family_count == ctx->family_capacity) {
+        capacity = ctx->family_capacity > 0 ? ctx->family_capacity * 2 : 16;
+        tmp_families = realloc(ctx->families, capacity * sizeof(struct merge_family));
+        if (tmp_families == NULL) {
+            return NULL;
+        }
+        ctx->families = tmp_families;
+        ctx->family_capacity = capacity;
+    }
+
+    family = &ctx->families[ctx->family_count];
+    memset(family, 0, sizeof(struct merge_family));
+    family->map = map;
+    family->keys = calloc(map->label_count + 1, sizeof(char *));
+    if (family->keys == NULL || cmetrics_table_init(&family->series, 16) != 0) {
+        free(family->keys);
+        return NULL;
+    }
+    *slot = (void *)(uintptr_t)ctx->family_count++;
+    cmetrics_context_label_keys(map, family->keys);
+
+    if (values_reserve(ctx, map->label_count) != 0) {
+        return NULL;
+    }
+    ctx->family = family;
+    if (cmetrics_context_foreach_metric(map, index_series, ctx) != 0) {
+        return NULL;
+    }
+
+    return family;
+}
+
+static int
+index_family(struct cmt_map *map, void *data)
+{
+    return family_add(data, map) == NULL ? -1 : 0;
+}
+
+static void
+combine(struct merge_ctx *ctx, struct cmt_metric *dst, struct cmt_metric *src)
+{
+    double val = cmt_metric_get_value(dst);
+    double src_val = cmt_metric_get_value(src);
+    uint64_t ts = cmt_metric_get_timestamp(dst);
+    uint64_t src_ts = cmt_metric_get_timestamp(src);
+
+    switch (ctx->policy) {
+    case CMETRICS_MERGE_LAST:
+        if (src_ts >= ts) {
+            val = src_val;
+        }
+        break;
+    case CMETRICS_MERGE_MAX:
+        if (src_val > val) {
+            val = src_val;
+        }
+        break;
+    default:
+        val += src_val;
+        break;
+    }
+
+    cmt_metric_set(dst, src_ts > ts ? src_ts : ts, val);
+}
+
+/* Whether 'map' has the label keys 'keys', in any order. */
+static int
+keys_match(struct merge_ctx *ctx, struct cmt_map *map, char **keys, int count)
+{
+    int i;
+    int j;
+
+    if (map->label_count != count) {
+        return CMT_FALSE;
+    }
+    cmetrics_context_label_keys(map, ctx->values);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < count && strcmp(keys[i], ctx->values[j]) != 0; j++);
+        if (j == count) {
+            return CMT_FALSE;
+        }
+    }
+
+    return CMT_TRUE;
+}
+
+/*
+ * First pass over 'src': every family must have the label keys of the
+ * family it is merged into, so that 'dst' is not modified on errors.
+ */
+static int
+check_map(struct cmt_map *map, void *data)
+{
+    int created;
+    void **slot;
+    struct cmt_map *first;
+    struct merge_family *family;
+    struct merge_ctx *ctx = data;
+
+    if (values_reserve(ctx, map->label_count) != 0 || family_key(ctx, map) != 0) {
+        return -1;
+    }
+
+    slot = cmetrics_table_lookup(&ctx->table, ctx->key.buf, ctx->key.length,
+                                 CMT_FALSE, NULL);
+    if (slot != NULL) {
+        family = &ctx->families[(uintptr_t)*slot];
+        if (!keys_match(ctx, map, family->keys, family->map->label_count)) {
+            ctx->error = CMETRICS_MERGE_ERROR_LABELS;
+            return -1;
+        }
+        return 0;
+    }
+
+    /* a family new to 'dst' is created from its first source map */
+    slot = cmetrics_table_lookup(&ctx->checked, ctx->key.buf, ctx->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (created) {
+        *slot = map;
+        return 0;
+    }
+    first = *slot;
+    if (values_reserve(ctx, first->label_count > map->label_count ?
+                       first->label_count : map->label_count) != 0) {
+        return -1;
+    }
+    cmetrics_context_label_keys(first, ctx->ordered);
+    if (!keys_match(ctx, map, ctx->ordered, first->label_count)) {
+        ctx->error = CMETRICS_MERGE_ERROR_LABELS;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+merge_series(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    int created;
+    int is_static = metric == &map->metric;
+    void **slot;
+    struct merge_ctx *ctx = data;
+    struct merge_family *family = ctx->family;
+    struct cmt_metric *dst;
+
+    cmetrics_context_label_values(map, metric, ctx->values);
+    for (i = 0; i < family->map->label_count; i++) {
+        ctx->ordered[i] = ctx->values[ctx->index[i]];
+    }
+
+    if (series_key(ctx, is_static, family->map->label_count, ctx->ordered) != 0) {
+        return -1;
+    }
+    slot = cmetrics_table_lookup(&family->series, ctx->key.buf, ctx->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    if (!created) {
+        combine(ctx, *slot, metric);
+        return 0;
+    }
+
+    dst = cmt_map_metric_get(family->map->opts, family->map,
+                             is_static ? 0 : family->map->label_count,
+                             is_static ? NULL : ctx->ordered, CMT_TRUE);
+    if (dst == NULL) {
+        return -1;
+    }
+    cmt_metric_set(dst, cmt_metric_get_timestamp(metric), cmt_metric_get_value(metric));
+    *slot = dst;
+
+    return 0;
+}
+
+static int
+merge_map(struct cmt_map *map, void *data)
+{
+    int i;
+    int j;
+    int ret;
+    void **slot;
+    char **src_keys;
+    struct cmt_map *dst_map;
+    struct merge_ctx *ctx = data;
+
+    if (family_key(ctx, map) != 0) {
+        return -1;
+    }
+    slot = cmetrics_table_lookup(&ctx->table, ctx->key.buf, ctx->key.length,
+                                 CMT_FALSE, NULL);
+    if (slot != NULL) {
+        ctx->family = &ctx->families[(uintptr_t)*slot];
+    }
+    else {
+        src_keys = calloc(map->label_count + 1, sizeof(char *));
+        if (src_keys == NULL) {
+            return -1;
+        }
+        cmetrics_context_label_keys(map, src_keys);
+        dst_map = cmetrics_context_family_create(ctx->dst, map->type, map->opts,
+                                                 map->label_count, src_keys);
+        free(src_keys);
+        if (dst_map == NULL) {
+            return -1;
+        }
+        ctx->family = family_add(ctx, dst_map);
+        if (ctx->family == NULL) {
+            return -1;
+        }
+    }
+
+    if (values_reserve(ctx, map->label_count > ctx->family->map->label_count ?
+                       map->label_count : ctx->family->map->label_count) != 0) {
+        return -1;
+    }
+
+    /* series are unified by their label values, whatever the key order is */
+    if (map->label_count != ctx->family->map->label_count) {
+        ctx->error = CMETRICS_MERGE_ERROR_LABELS;
+        return -1;
+    }
+    src_keys = calloc(map->label_count + 1, sizeof(char *));
+    if (src_keys == NULL) {
+        return -1;
+    }
+    cmetrics_context_label_keys(map, src_keys);
+    for (i = 0; i < ctx->family->map->label_count; i++) {
+        ctx->index[i] = -1;
+        for (j = 0; j < map->label_count; j++) {
+            if (strcmp(ctx->family->keys[i], src_keys[j]) == 0) {
+                ctx->index[i] = j;
+                break;
+            }
+        }
+        if (ctx->index[i] < 0) {
+            free(src_keys);
+            ctx->error = CMETRICS_MERGE_ERROR_LABELS;
+            return -1;
+        }
+    }
+    free(src_keys);
+
+    ret = cmetrics_context_foreach_metric(map, merge_series, ctx);
+
+    return ret;
+}
+
+/*
+ * Merge the counters, gauges and untyped families of 'src' into 'dst'.
+ * Families are unified by type and fully qualified name, series by their
+ * label values, and the values of series found in both contexts are
+ * combined by 'policy'.
+ *
+ * Returns 0 on success, CMETRICS_MERGE_ERROR_LABELS when a family has
+ * different label keys on both sides, CMETRICS_MERGE_ERROR_STATIC_LABELS
+ * when a static label has different values on both sides and -1 on
+ * allocation failures. 'dst' is left untouched on label errors, and may
+ * be partially merged on allocation failures.
+ */
+int
+cmetrics_merge(struct cmt *dst, struct cmt *src, int policy)
+{
+    int ret = 0;
+    size_t i;
+    struct merge_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.dst = dst;
+    ctx.policy = policy;
+
+    if (cmetrics_table_init(&ctx.table, 64) != 0 ||
+        cmetrics_table_init(&ctx.checked, 16) != 0 ||
+        cmetrics_context_foreach_map(dst, index_family, &ctx) != 0 ||
+        cmetrics_context_foreach_map(src, check_map, &ctx) != 0) {
+        ret = ctx.error != 0 ? ctx.error : -1;
+    }
+    else if (cmetrics_context_static_labels_conflict(dst, src)) {
+        ret = CMETRICS_MERGE_ERROR_STATIC_LABELS;
+    }
+    else if (cmetrics_context_foreach_map(src, merge_map, &ctx) != 0 ||
+             cmetrics_context_copy_static_labels(dst, src) != 0) {
+        ret = ctx.error != 0 ? ctx.error : -1;
+    }
+
+    for (i = 0; i < ctx.family_count; i++) {
+        cmetrics_table_destroy(&ctx.families[i].series);
+        free(ctx.families[i].keys);
+    }
+    free(ctx.families);
+    cmetrics_table_destroy(&ctx.table);
+    cmetrics_table_destroy(&ctx.checked);
+    free(ctx.key.buf);
+    free(ctx.values);
+    free(ctx.ordered);
+    free(ctx.index);
+
+    return ret;
+}
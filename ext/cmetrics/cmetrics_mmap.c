@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include "cmetrics_c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+# define CMETRICS_HAVE_MMAP 1
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+/*
+ * Read-only file mappings, so that recorded buffers are decoded straight
+ * from the page cache instead of being read into a Ruby String.
+ */
+
+/* Consumed pages are handed back in chunks of this size at least. */
+#define MAPPING_RELEASE_CHUNK (16 * 1024 * 1024)
+
+/*
+ * Map the whole file at 'path'. Returns -1 with errno set on failure;
+ * an empty file gives an empty mapping.
+ */
+int
+cmetrics_mapping_open(struct cmetrics_mapping *mapping, const char *path)
+{
+#ifdef CMETRICS_HAVE_MMAP
+    int fd;
+    int err;
+    void *buffer;
+    struct stat st;
+
+    memset(mapping, 0, sizeof(struct cmetrics_mapping));
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    buffer = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    /* the mapping holds its own reference to the file */
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+
+#ifdef HAVE_MADVISE
+    madvise(buffer, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    mapping->buffer = buffer;
+    mapping->size = (size_t)st.st_size;
+
+    return 0;
+#else
+    memset(mapping, 0, sizeof(struct cmetrics_mapping));
+    errno = ENOSYS;
+
+    return -1;
+#endif
+}
+
+/*
+ * Tell the kernel that everything before 'offset' was consumed, so that
+ * replaying a large file does not keep all of it resident.
+ */
+void
+cmetrics_mapping_release(struct cmetrics_mapping *mapping, size_t offset)
+{
+#if defined(CMETRICS_HAVE_MMAP) && defined(HAVE_MADVISE)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = offset - offset % page;
+
+    if (end <= mapping->released || end - mapping->released < MAPPING_RELEASE_CHUNK) {
+        return;
+    }
+
+    madvise(mapping->buffer + mapping->released, end - mapping->released, MADV_DONTNEED);
+    mapping->released = end;
+#endif
+}
+
+void
+cmetrics_mapping_close(struct cmetrics_mapping *mapping)
+{
+#ifdef CMETRICS_HAVE_MMAP
+    if (mapping->buffer != NULL) {
+        munmap(mapping->buffer, mapping->size);
+    }
+#endif
+    memset(mapping, 0, sizeof(struct cmetrics_mapping));
+}
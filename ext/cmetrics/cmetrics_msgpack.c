@@ -0,0 +1,1527 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/*
+ * Minimal msgpack cursor used to look into cmetrics payloads without
+ * materializing a cmt context. Nothing in here allocates: strings are
+ * returned as (pointer, length) pairs into the scanned buffer.
+ */
+
+static inline uint16_t
+read_be16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+read_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t
+read_be64(const unsigned char *p)
+{
+    return ((uint64_t)read_be32(p) << 32) | (uint64_t)read_be32(p + 4);
+}
+
+void
+cmetrics_mp_reader_init(struct cmetrics_mp_reader *reader,
+                        const char *buf, size_t size, size_t offset)
+{
+    reader->buf = (const unsigned char *)buf;
+    reader->size = size;
+    reader->offset = offset;
+}
+
+static inline int
+reader_need(struct cmetrics_mp_reader *reader, size_t n)
+{
+    return (reader->size - reader->offset) >= n ? 0 : -1;
+}
+
+/* Containers can never hold more entries than there are bytes left. */
+static inline int
+reader_check_entries(struct cmetrics_mp_reader *reader, uint64_t entries)
+{
+    return entries <= (uint64_t)(reader->size - reader->offset) ? 0 : -1;
+}
+
+static int
+read_payload(struct cmetrics_mp_reader *reader,
+             struct cmetrics_mp_token *token, size_t length)
+{
+    if (reader_need(reader, length) != 0) {
+        return -1;
+    }
+    token->ptr = (const char *)reader->buf + reader->offset;
+    token->length = length;
+    reader->offset += length;
+
+    return 0;
+}
+
+int
+cmetrics_mp_read(struct cmetrics_mp_reader *reader, struct cmetrics_mp_token *token)
+{
+    const unsigned char *p;
+    unsigned char c;
+    size_t length;
+    union {
+        uint32_t u;
+        float f;
+    } f32;
+    union {
+        uint64_t u;
+        double d;
+    } f64;
+
+    if (reader_need(reader, 1) != 0) {
+        return -1;
+    }
+
+    c = reader->buf[reader->offset++];
+    p = reader->buf + reader->offset;
+    token->ptr = NULL;
+    token->length = 0;
+
+    if (c <= 0x7f) {
+        token->type = CMETRICS_MP_UINT;
+        token->u = c;
+        return 0;
+    }
+    if (c >= 0xe0) {
+        token->type = CMETRICS_MP_INT;
+        token->i = (int8_t)c;
+        return 0;
+    }
+    if (c >= 0xa0 && c <= 0xbf) {
+        token->type = CMETRICS_MP_STR;
+        return read_payload(reader, token, c & 0x1f);
+    }
+    if (c >= 0x80 && c <= 0x8f) {
+        token->type = CMETRICS_MP_MAP;
+        token->length = c & 0x0f;
+        return reader_check_entries(reader, (uint64_t)token->length * 2);
+    }
+    if (c >= 0x90 && c <= 0x9f) {
+        token->type = CMETRICS_MP_ARRAY;
+        token->length = c & 0x0f;
+        return reader_check_entries(reader, token->length);
+    }
+
+    switch (c) {
+    case 0xc0:
+        token->type = CMETRICS_MP_NIL;
+        return 0;
+    case 0xc2:
+    case 0xc3:
+        token->type = CMETRICS_MP_BOOL;
+        token->u = c & 0x01;
+        return 0;
+    case 0xc4: /* bin 8 */
+    case 0xd9: /* str 8 */
+        if (reader_need(reader, 1) != 0) {
+            return -1;
+        }
+        token->type = c == 0xc4 ? CMETRICS_MP_BIN : CMETRICS_MP_STR;
+        reader->offset += 1;
+        return read_payload(reader, token, p[0]);
+    case 0xc5: /* bin 16 */
+    case 0xda: /* str 16 */
+        if (reader_need(reader, 2) != 0) {
+            return -1;
+        }
+        token->type = c == 0xc5 ? CMETRICS_MP_BIN : CMETRICS_MP_STR;
+        reader->offset += 2;
+        return read_payload(reader, token, read_be16(p));
+    case 0xc6: /* bin 32 */
+    case 0xdb: /* str 32 */
+        if (reader_need(reader, 4) != 0) {
+            return -1;
+        }
+        token->type = c == 0xc6 ? CMETRICS_MP_BIN : CMETRICS_MP_STR;
+        reader->offset += 4;
+        return read_payload(reader, token, read_be32(p));
+    case 0xc7: /* ext 8 */
+    case 0xc8: /* ext 16 */
+    case 0xc9: /* ext 32 */
+        length = (size_t)1 << (c - 0xc7);
+        if (reader_need(reader, length + 1) != 0) {
+            return -1;
+        }
+        token->type = CMETRICS_MP_EXT;
+        if (c == 0xc7) {
+            length = p[0];
+        }
+        else if (c == 0xc8) {
+            length = read_be16(p);
+        }
+        else {
+            length = read_be32(p);
+        }
+        reader->offset += ((size_t)1 << (c - 0xc7)) + 1;
+        return read_payload(reader, token, length);
+    case 0xca:
+        if (reader_need(reader, 4) != 0) {
+            return -1;
+        }
+        f32.u = read_be32(p);
+        token->type = CMETRICS_MP_FLOAT;
+        token->d = f32.f;
+        reader->offset += 4;
+        return 0;
+    case 0xcb:
+        if (reader_need(reader, 8) != 0) {
+            return -1;
+        }
+        f64.u = read_be64(p);
+        token->type = CMETRICS_MP_FLOAT;
+        token->d = f64.d;
+        reader->offset += 8;
+        return 0;
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        length = (size_t)1 << (c - 0xcc);
+        if (reader_need(reader, length) != 0) {
+            return -1;
+        }
+        token->type = CMETRICS_MP_UINT;
+        switch (length) {
+        case 1: token->u = p[0]; break;
+        case 2: token->u = read_be16(p); break;
+        case 4: token->u = read_be32(p); break;
+        default: token->u = read_be64(p); break;
+        }
+        reader->offset += length;
+        return 0;
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        length = (size_t)1 << (c - 0xd0);
+        if (reader_need(reader, length) != 0) {
+            return -1;
+        }
+        token->type = CMETRICS_MP_INT;
+        switch (length) {
+        case 1: token->i = (int8_t)p[0]; break;
+        case 2: token->i = (int16_t)read_be16(p); break;
+        case 4: token->i = (int32_t)read_be32(p); break;
+        default: token->i = (int64_t)read_be64(p); break;
+        }
+        reader->offset += length;
+        return 0;
+    case 0xd4: /* fixext 1, 2, 4, 8, 16 */
+    case 0xd5:
+    case 0xd6:
+    case 0xd7:
+    case 0xd8:
+        token->type = CMETRICS_MP_EXT;
+        reader->offset += 1;
+        if (reader->offset > reader->size) {
+            return -1;
+        }
+        return read_payload(reader, token, (size_t)1 << (c - 0xd4));
+    case 0xdc:
+    case 0xdd:
+        length = c == 0xdc ? 2 : 4;
+        if (reader_need(reader, length) != 0) {
+            return -1;
+        }
+        token->type = CMETRICS_MP_ARRAY;
+        token->length = length == 2 ? read_be16(p) : read_be32(p);
+        reader->offset += length;
+        return reader_check_entries(reader, token->length);
+    case 0xde:
+    case 0xdf:
+        length = c == 0xde ? 2 : 4;
+        if (reader_need(reader, length) != 0) {
+            return -1;
+        }
+        token->type = CMETRICS_MP_MAP;
+        token->length = length == 2 ? read_be16(p) : read_be32(p);
+        reader->offset += length;
+        return reader_check_entries(reader, (uint64_t)token->length * 2);
+    default:
+        /* 0xc1 is never used */
+        return -1;
+    }
+}
+
+/*
+ * Skip one complete object. Nested containers are handled with a single
+ * counter of pending objects, so there is no recursion and no depth limit.
+ */
+int
+cmetrics_mp_skip(struct cmetrics_mp_reader *reader)
+{
+    struct cmetrics_mp_token token;
+    uint64_t pending = 1;
+
+    while (pending > 0) {
+        if (cmetrics_mp_read(reader, &token) != 0) {
+            return -1;
+        }
+        pending--;
+        if (token.type == CMETRICS_MP_ARRAY) {
+            pending += token.length;
+        }
+        else if (token.type == CMETRICS_MP_MAP) {
+            pending += (uint64_t)token.length * 2;
+        }
+    }
+
+    return 0;
+}
+
+int
+cmetrics_mp_read_type(struct cmetrics_mp_reader *reader,
+                      struct cmetrics_mp_token *token, int type)
+{
+    if (cmetrics_mp_read(reader, token) != 0 || token->type != type) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+cmetrics_mp_token_equals(struct cmetrics_mp_token *token, const char *str)
+{
+    size_t len = strlen(str);
+
+    return token->type == CMETRICS_MP_STR &&
+           token->length == len && memcmp(token->ptr, str, len) == 0;
+}
+
+static int
+validate_string_array(struct cmetrics_mp_reader *reader, uint32_t *count)
+{
+    uint32_t i;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+    if (count) {
+        *count = token.length;
+    }
+    for (i = token.length; i > 0; i--) {
+        if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+validate_number(struct cmetrics_mp_reader *reader)
+{
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read(reader, &token) != 0) {
+        return -1;
+    }
+
+    switch (token.type) {
+    case CMETRICS_MP_UINT:
+    case CMETRICS_MP_INT:
+    case CMETRICS_MP_FLOAT:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int
+validate_family_opts(struct cmetrics_mp_reader *reader)
+{
+    uint32_t i;
+    int has_name = CMT_FALSE;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "ns") ||
+            cmetrics_mp_token_equals(&key, "ss") ||
+            cmetrics_mp_token_equals(&key, "name") ||
+            cmetrics_mp_token_equals(&key, "desc")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (cmetrics_mp_token_equals(&key, "name")) {
+                has_name = CMT_TRUE;
+            }
+        }
+        else if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+
+    return has_name ? 0 : -1;
+}
+
+static int
+validate_family_meta(struct cmetrics_mp_reader *reader, uint32_t *label_count)
+{
+    uint32_t i;
+    int has_opts = CMT_FALSE;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "ver")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT) != 0) {
+                return -1;
+            }
+        }
+        else if (cmetrics_mp_token_equals(&key, "type")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT) != 0 ||
+                token.u > CMT_UNTYPED) {
+                return -1;
+            }
+        }
+        else if (cmetrics_mp_token_equals(&key, "opts")) {
+            if (validate_family_opts(reader) != 0) {
+                return -1;
+            }
+            has_opts = CMT_TRUE;
+        }
+        else if (cmetrics_mp_token_equals(&key, "labels")) {
+            if (validate_string_array(reader, label_count) != 0) {
+                return -1;
+            }
+        }
+        else if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+
+    return has_opts ? 0 : -1;
+}
+
+static int
+validate_family_values(struct cmetrics_mp_reader *reader, uint32_t label_count)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t count;
+    struct cmetrics_mp_token array;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    if (cmetrics_mp_read_type(reader, &array, CMETRICS_MP_ARRAY) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < array.length; i++) {
+        if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+            return -1;
+        }
+        for (j = 0; j < map.length; j++) {
+            if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (cmetrics_mp_token_equals(&key, "ts") ||
+                cmetrics_mp_token_equals(&key, "hash")) {
+                if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_UINT) != 0) {
+                    return -1;
+                }
+            }
+            else if (cmetrics_mp_token_equals(&key, "value")) {
+                if (validate_number(reader) != 0) {
+                    return -1;
+                }
+            }
+            else if (cmetrics_mp_token_equals(&key, "labels")) {
+                if (validate_string_array(reader, &count) != 0 ||
+                    count > label_count) {
+                    return -1;
+                }
+            }
+            else if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+validate_family(struct cmetrics_mp_reader *reader)
+{
+    uint32_t i;
+    uint32_t label_count = 0;
+    size_t values_offset = 0;
+    int has_meta = CMT_FALSE;
+    int has_values_ahead = CMT_FALSE;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            if (validate_family_meta(reader, &label_count) != 0) {
+                return -1;
+            }
+            has_meta = CMT_TRUE;
+        }
+        else if (cmetrics_mp_token_equals(&key, "values")) {
+            if (has_meta) {
+                if (validate_family_values(reader, label_count) != 0) {
+                    return -1;
+                }
+                values_offset = reader->offset;
+                continue;
+            }
+            /* label keys live in 'meta', so check values once it is known */
+            values_offset = reader->offset;
+            if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+            has_values_ahead = CMT_TRUE;
+        }
+        else if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+
+    if (!has_meta || values_offset == 0) {
+        return -1;
+    }
+
+    if (has_values_ahead) {
+        struct cmetrics_mp_reader values = *reader;
+
+        values.offset = values_offset;
+        return validate_family_values(&values, label_count);
+    }
+
+    return 0;
+}
+
+/*
+ * Check that the buffer starting at *offset holds one well-formed cmetrics
+ * msgpack payload. On success *offset points right after it.
+ */
+int
+cmetrics_msgpack_validate(const char *buf, size_t size, size_t *offset)
+{
+    uint32_t i;
+    uint32_t j;
+    int has_meta = CMT_FALSE;
+    int has_metrics = CMT_FALSE;
+    struct cmetrics_mp_reader reader;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    cmetrics_mp_reader_init(&reader, buf, size, *offset);
+
+    if (cmetrics_mp_read_type(&reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(&reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            if (cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_MAP) != 0) {
+                return -1;
+            }
+            /* the context header is a map, its contents are opaque here */
+            for (j = (uint32_t)token.length * 2; j > 0; j--) {
+                if (cmetrics_mp_skip(&reader) != 0) {
+                    return -1;
+                }
+            }
+            has_meta = CMT_TRUE;
+        }
+        else if (cmetrics_mp_token_equals(&key, "metrics")) {
+            if (cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_ARRAY) != 0) {
+                return -1;
+            }
+            for (j = 0; j < token.length; j++) {
+                if (validate_family(&reader) != 0) {
+                    return -1;
+                }
+            }
+            has_metrics = CMT_TRUE;
+        }
+        else if (cmetrics_mp_skip(&reader) != 0) {
+            return -1;
+        }
+    }
+
+    if (!has_meta || !has_metrics) {
+        return -1;
+    }
+
+    *offset = reader.offset;
+
+    return 0;
+}
+
+static void
+write_container_header(VALUE out, uint32_t length,
+                       unsigned char fix, unsigned char m16, unsigned char m32)
+{
+    unsigned char header[5];
+
+    if (length < 16) {
+        header[0] = fix | (unsigned char)length;
+        rb_str_cat(out, (const char *)header, 1);
+    }
+    else if (length <= 0xffff) {
+        header[0] = m16;
+        header[1] = (unsigned char)(length >> 8);
+        header[2] = (unsigned char)length;
+        rb_str_cat(out, (const char *)header, 3);
+    }
+    else {
+        header[0] = m32;
+        header[1] = (unsigned char)(length >> 24);
+        header[2] = (unsigned char)(length >> 16);
+        header[3] = (unsigned char)(length >> 8);
+        header[4] = (unsigned char)length;
+        rb_str_cat(out, (const char *)header, 5);
+    }
+}
+
+void
+cmetrics_mp_write_array(VALUE out, uint32_t length)
+{
+    write_container_header(out, length, 0x90, 0xdc, 0xdd);
+}
+
+void
+cmetrics_mp_write_map(VALUE out, uint32_t length)
+{
+    write_container_header(out, length, 0x80, 0xde, 0xdf);
+}
+
+void
+cmetrics_mp_write_str(VALUE out, const char *str, size_t length)
+{
+    unsigned char header[5];
+
+    if (length < 32) {
+        header[0] = 0xa0 | (unsigned char)length;
+        rb_str_cat(out, (const char *)header, 1);
+    }
+    else if (length <= 0xff) {
+        header[0] = 0xd9;
+        header[1] = (unsigned char)length;
+        rb_str_cat(out, (const char *)header, 2);
+    }
+    else {
+        write_container_header(out, (uint32_t)length, 0xa0, 0xda, 0xdb);
+    }
+    rb_str_cat(out, str, length);
+}
+
+void
+cmetrics_mp_write_uint(VALUE out, uint64_t value)
+{
+    int i;
+    int bytes;
+    unsigned char header[9];
+
+    if (value <= 0x7f) {
+        header[0] = (unsigned char)value;
+        rb_str_cat(out, (const char *)header, 1);
+        return;
+    }
+
+    if (value <= 0xff) {
+        header[0] = 0xcc;
+        bytes = 1;
+    }
+    else if (value <= 0xffff) {
+        header[0] = 0xcd;
+        bytes = 2;
+    }
+    else if (value <= 0xffffffff) {
+        header[0] = 0xce;
+        bytes = 4;
+    }
+    else {
+        header[0] = 0xcf;
+        bytes = 8;
+    }
+    for (i = 0; i < bytes; i++) {
+        header[bytes - i] = (unsigned char)(value >> (i * 8));
+    }
+    rb_str_cat(out, (const char *)header, bytes + 1);
+}
+
+void
+cmetrics_mp_write_int(VALUE out, int64_t value)
+{
+    int i;
+    int bytes;
+    unsigned char header[9];
+
+    if (value >= 0) {
+        cmetrics_mp_write_uint(out, (uint64_t)value);
+        return;
+    }
+    if (value >= -32) {
+        header[0] = (unsigned char)(int8_t)value;
+        rb_str_cat(out, (const char *)header, 1);
+        return;
+    }
+
+    if (value >= INT8_MIN) {
+        header[0] = 0xd0;
+        bytes = 1;
+    }
+    else if (value >= INT16_MIN) {
+        header[0] = 0xd1;
+        bytes = 2;
+    }
+    else if (value >= INT32_MIN) {
+        header[0] = 0xd2;
+        bytes = 4;
+    }
+    else {
+        header[0] = 0xd3;
+        bytes = 8;
+    }
+    for (i = 0; i < bytes; i++) {
+        header[bytes - i] = (unsigned char)((uint64_t)value >> (i * 8));
+    }
+    rb_str_cat(out, (const char *)header, bytes + 1);
+}
+
+void
+cmetrics_mp_write_double(VALUE out, double value)
+{
+    int i;
+    unsigned char header[9];
+    union {
+        uint64_t u;
+        double d;
+    } f64;
+
+    f64.d = value;
+    header[0] = 0xcb;
+    for (i = 0; i < 8; i++) {
+        header[8 - i] = (unsigned char)(f64.u >> (i * 8));
+    }
+    rb_str_cat(out, (const char *)header, 9);
+}
+
+static inline int
+copy_span(struct cmetrics_buffer *out, struct cmetrics_mp_reader *reader, size_t from, size_t to)
+{
+    return cmetrics_buffer_append(out, reader->buf + from, to - from);
+}
+
+/* Write an array32 header whose count is patched once it is known. */
+static int
+reserve_array(struct cmetrics_buffer *out, size_t *position)
+{
+    static const unsigned char header[5] = { 0xdd, 0, 0, 0, 0 };
+
+    *position = out->size;
+
+    return cmetrics_buffer_append(out, header, sizeof(header));
+}
+
+static void
+patch_array(struct cmetrics_buffer *out, size_t position, uint32_t count)
+{
+    unsigned char *p = (unsigned char *)out->data + position;
+
+    p[1] = (unsigned char)(count >> 24);
+    p[2] = (unsigned char)(count >> 16);
+    p[3] = (unsigned char)(count >> 8);
+    p[4] = (unsigned char)count;
+}
+
+/*
+ * Copy 'count' strings joined by '_' into the filter's scratch String, so
+ * that regexps run on it without a String being allocated per match. The
+ * String takes the encoding of a Regexp with non-ASCII characters, UTF-8
+ * otherwise.
+ */
+static VALUE
+filter_scratch(struct cmetrics_msgpack_filter *filter, VALUE pattern,
+               struct cmetrics_mp_token **parts, int count)
+{
+    int i;
+    int encindex;
+    size_t length = 0;
+    char *ptr;
+    VALUE scratch = filter->scratch;
+
+    encindex = rb_enc_get_index(pattern);
+    if (encindex == rb_usascii_encindex()) {
+        encindex = rb_utf8_encindex();
+    }
+    rb_enc_associate_index(scratch, encindex);
+
+    for (i = 0; i < count; i++) {
+        length += parts[i]->length + (i > 0);
+    }
+
+    rb_str_resize(scratch, (long)length);
+    ptr = RSTRING_PTR(scratch);
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            *ptr++ = '_';
+        }
+        memcpy(ptr, parts[i]->ptr, parts[i]->length);
+        ptr += parts[i]->length;
+    }
+    ENC_CODERANGE_CLEAR(scratch);
+
+    return scratch;
+}
+
+/* Whether 'count' strings joined by '_' equal the String 'pattern'. */
+static int
+filter_equals(VALUE pattern, struct cmetrics_mp_token **parts, int count)
+{
+    int i;
+    const char *ptr = RSTRING_PTR(pattern);
+    size_t left = (size_t)RSTRING_LEN(pattern);
+
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            if (left == 0 || *ptr != '_') {
+                return CMT_FALSE;
+            }
+            ptr++;
+            left--;
+        }
+        if (left < parts[i]->length || memcmp(ptr, parts[i]->ptr, parts[i]->length) != 0) {
+            return CMT_FALSE;
+        }
+        ptr += parts[i]->length;
+        left -= parts[i]->length;
+    }
+
+    return left == 0;
+}
+
+static VALUE
+filter_regexp_match(VALUE data)
+{
+    VALUE *args = (VALUE *)data;
+
+    /* Regexp#match? neither sets $~ nor keeps or copies its subject */
+    return rb_funcall(args[0], rb_intern("match?"), 1, args[1]);
+}
+
+/*
+ * Match strings located in the scanned buffer, joined by '_', against a
+ * String or Regexp. Plain strings are compared in place.
+ *
+ * The decoders hold malloc'd state and partial contexts while matching,
+ * so an exception raised by a Regexp is kept in filter->error instead of
+ * unwinding them; nothing matches afterwards and the caller re-raises it
+ * once they are freed.
+ */
+static int
+filter_match_parts(struct cmetrics_msgpack_filter *filter, VALUE pattern,
+                   struct cmetrics_mp_token **parts, int count)
+{
+    VALUE args[2];
+    VALUE matched;
+
+    if (filter->error != 0) {
+        return CMT_FALSE;
+    }
+    if (RB_TYPE_P(pattern, T_STRING)) {
+        return filter_equals(pattern, parts, count);
+    }
+
+    args[0] = pattern;
+    args[1] = filter_scratch(filter, pattern, parts, count);
+    matched = rb_protect(filter_regexp_match, (VALUE)args, &filter->error);
+
+    return filter->error == 0 && RTEST(matched);
+}
+
+static int
+filter_match(struct cmetrics_msgpack_filter *filter, VALUE pattern,
+             const char *ptr, size_t length)
+{
+    struct cmetrics_mp_token token;
+    struct cmetrics_mp_token *parts = &token;
+
+    token.ptr = ptr;
+    token.length = (uint32_t)length;
+
+    return filter_match_parts(filter, pattern, &parts, 1);
+}
+
+static int
+filter_match_key(struct cmetrics_msgpack_filter *filter, long n,
+                 const char *ptr, size_t length)
+{
+    return filter_match(filter, RARRAY_AREF(filter->label_keys, n), ptr, length);
+}
+
+static int
+filter_match_value(struct cmetrics_msgpack_filter *filter, long n,
+                   const char *ptr, size_t length)
+{
+    return filter_match(filter, RARRAY_AREF(filter->label_values, n), ptr, length);
+}
+
+/* Whether the fqname composed of 'ns', 'ss' and 'name' passes only:. */
+static int
+filter_match_name(struct cmetrics_msgpack_filter *filter, struct cmetrics_mp_token *ns,
+                  struct cmetrics_mp_token *ss, struct cmetrics_mp_token *name)
+{
+    long i;
+    int count = 0;
+    struct cmetrics_mp_token *parts[3];
+
+    if (NIL_P(filter->names)) {
+        return CMT_TRUE;
+    }
+
+    /* same composition as cmt_opts fqname: non-empty parts joined by '_' */
+    if (ns->length > 0) {
+        parts[count++] = ns;
+    }
+    if (ss->length > 0) {
+        parts[count++] = ss;
+    }
+    if (name->length > 0) {
+        parts[count++] = name;
+    }
+
+    for (i = 0; i < RARRAY_LEN(filter->names); i++) {
+        if (filter_match_parts(filter, RARRAY_AREF(filter->names, i), parts, count)) {
+            return CMT_TRUE;
+        }
+    }
+
+    return CMT_FALSE;
+}
+
+/* Fill in static label matches from the context header. */
+static int
+filter_scan_context_meta(struct cmetrics_mp_reader *reader,
+                         struct cmetrics_msgpack_filter *filter, int *static_match)
+{
+    uint32_t i;
+    uint32_t j;
+    long n;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+    struct cmetrics_mp_token label_key;
+    struct cmetrics_mp_token label_val;
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (!cmetrics_mp_token_equals(&key, "processing")) {
+            if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_MAP) != 0) {
+            return -1;
+        }
+        for (j = token.length; j > 0; j--) {
+            struct cmetrics_mp_token labels;
+            uint32_t k;
+
+            if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (!cmetrics_mp_token_equals(&key, "static_labels")) {
+                if (cmetrics_mp_skip(reader) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (cmetrics_mp_read_type(reader, &labels, CMETRICS_MP_ARRAY) != 0) {
+                return -1;
+            }
+            for (k = 0; k < labels.length; k++) {
+                if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_ARRAY) != 0 ||
+                    token.length != 2 ||
+                    cmetrics_mp_read_type(reader, &label_key, CMETRICS_MP_STR) != 0 ||
+                    cmetrics_mp_read_type(reader, &label_val, CMETRICS_MP_STR) != 0) {
+                    return -1;
+                }
+                for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+                    if (filter_match_key(filter, n, label_key.ptr, label_key.length)) {
+                        static_match[n] =
+                            filter_match_value(filter, n, label_val.ptr, label_val.length);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read a family 'meta' map: fqname parts and the position of each filtered
+ * label key (-1 when the family does not define it).
+ */
+static int
+filter_scan_family_meta(struct cmetrics_mp_reader *reader,
+                        struct cmetrics_msgpack_filter *filter,
+                        int *name_matched, long *key_index)
+{
+    uint32_t i;
+    uint32_t j;
+    long n;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+    struct cmetrics_mp_token ns = { CMETRICS_MP_STR, 0, "", 0, 0, 0 };
+    struct cmetrics_mp_token ss = { CMETRICS_MP_STR, 0, "", 0, 0, 0 };
+    struct cmetrics_mp_token name = { CMETRICS_MP_STR, 0, "", 0, 0, 0 };
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "opts")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_MAP) != 0) {
+                return -1;
+            }
+            for (j = token.length; j > 0; j--) {
+                struct cmetrics_mp_token *dst = NULL;
+                struct cmetrics_mp_token opt;
+
+                if (cmetrics_mp_read_type(reader, &opt, CMETRICS_MP_STR) != 0) {
+                    return -1;
+                }
+                if (cmetrics_mp_token_equals(&opt, "ns")) {
+                    dst = &ns;
+                }
+                else if (cmetrics_mp_token_equals(&opt, "ss")) {
+                    dst = &ss;
+                }
+                else if (cmetrics_mp_token_equals(&opt, "name")) {
+                    dst = &name;
+                }
+
+                if (dst) {
+                    if (cmetrics_mp_read_type(reader, dst, CMETRICS_MP_STR) != 0) {
+                        return -1;
+                    }
+                }
+                else if (cmetrics_mp_skip(reader) != 0) {
+                    return -1;
+                }
+            }
+        }
+        else if (cmetrics_mp_token_equals(&key, "labels")) {
+            if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_ARRAY) != 0) {
+                return -1;
+            }
+            for (j = 0; j < token.length; j++) {
+                struct cmetrics_mp_token label;
+
+                if (cmetrics_mp_read_type(reader, &label, CMETRICS_MP_STR) != 0) {
+                    return -1;
+                }
+                for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+                    if (key_index[n] < 0 &&
+                        filter_match_key(filter, n, label.ptr, label.length)) {
+                        key_index[n] = j;
+                    }
+                }
+            }
+        }
+        else if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+
+    *name_matched = filter_match_name(filter, &ns, &ss, &name);
+
+    return 0;
+}
+
+static int
+filter_match_series(struct cmetrics_mp_reader *reader,
+                    struct cmetrics_msgpack_filter *filter,
+                    long *key_index, int *matched)
+{
+    uint32_t i;
+    uint32_t j;
+    long n;
+    long wanted = 0;
+    long found = 0;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+    struct cmetrics_mp_token label;
+
+    for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+        if (key_index[n] >= 0) {
+            wanted++;
+        }
+    }
+
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+
+    *matched = CMT_TRUE;
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (!cmetrics_mp_token_equals(&key, "labels")) {
+            if (cmetrics_mp_skip(reader) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (cmetrics_mp_read_type(reader, &token, CMETRICS_MP_ARRAY) != 0) {
+            return -1;
+        }
+        for (j = 0; j < token.length; j++) {
+            if (cmetrics_mp_read_type(reader, &label, CMETRICS_MP_STR) != 0) {
+                return -1;
+            }
+            if (!*matched) {
+                continue;
+            }
+            for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+                if (key_index[n] != (long)j) {
+                    continue;
+                }
+                found++;
+                if (!filter_match_value(filter, n, label.ptr, label.length)) {
+                    *matched = CMT_FALSE;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* series without some of the filtered labels never match */
+    if (found < wanted) {
+        *matched = CMT_FALSE;
+    }
+
+    return 0;
+}
+
+static int
+filter_family(struct cmetrics_mp_reader *reader,
+              struct cmetrics_msgpack_filter *filter,
+              int *static_match, long *key_index, struct cmetrics_buffer *out, int *kept)
+{
+    uint32_t i;
+    uint32_t j;
+    long n;
+    int matched;
+    int name_matched = CMT_FALSE;
+    uint32_t series = 0;
+    size_t family_start;
+    size_t values_start = 0;
+    size_t entry_start;
+    size_t out_start;
+    size_t header;
+    struct cmetrics_mp_reader family_reader;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+
+    *kept = CMT_FALSE;
+    family_start = reader->offset;
+
+    for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+        key_index[n] = -1;
+    }
+
+    /* first pass: family meta and the location of its values */
+    if (cmetrics_mp_read_type(reader, &map, CMETRICS_MP_MAP) != 0) {
+        return -1;
+    }
+    for (i = 0; i < map.length; i++) {
+        if (cmetrics_mp_read_type(reader, &key, CMETRICS_MP_STR) != 0) {
+            return -1;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            if (filter_scan_family_meta(reader, filter, &name_matched, key_index) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (values_start == 0 && cmetrics_mp_token_equals(&key, "values")) {
+            values_start = reader->offset;
+        }
+        if (cmetrics_mp_skip(reader) != 0) {
+            return -1;
+        }
+    }
+
+    if (!name_matched) {
+        return 0;
+    }
+
+    for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+        /* labels which are not part of the family can only be static ones */
+        if (key_index[n] < 0 && static_match[n] != CMT_TRUE) {
+            return 0;
+        }
+    }
+
+    for (n = 0; n < RARRAY_LEN(filter->label_keys); n++) {
+        if (key_index[n] >= 0) {
+            break;
+        }
+    }
+
+    /* nothing to check per series */
+    if (n == RARRAY_LEN(filter->label_keys) || values_start == 0) {
+        *kept = CMT_TRUE;
+        return copy_span(out, reader, family_start, reader->offset);
+    }
+
+    /* second pass: copy the family with only the matching series */
+    out_start = out->size;
+    family_reader = *reader;
+    family_reader.offset = family_start;
+    cmetrics_mp_read_type(&family_reader, &map, CMETRICS_MP_MAP);
+    if (copy_span(out, &family_reader, family_start, family_reader.offset) != 0) {
+        return -1;
+    }
+    for (i = 0; i < map.length; i++) {
+        entry_start = family_reader.offset;
+        cmetrics_mp_read_type(&family_reader, &key, CMETRICS_MP_STR);
+        if (family_reader.offset != values_start) {
+            cmetrics_mp_skip(&family_reader);
+            if (copy_span(out, &family_reader, entry_start, family_reader.offset) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (copy_span(out, &family_reader, entry_start, values_start) != 0 ||
+            reserve_array(out, &header) != 0 ||
+            cmetrics_mp_read_type(&family_reader, &token, CMETRICS_MP_ARRAY) != 0) {
+            return -1;
+        }
+        for (j = 0; j < token.length; j++) {
+            entry_start = family_reader.offset;
+            if (filter_match_series(&family_reader, filter, key_index, &matched) != 0) {
+                return -1;
+            }
+            if (matched) {
+                if (copy_span(out, &family_reader, entry_start, family_reader.offset) != 0) {
+                    return -1;
+                }
+                series++;
+            }
+        }
+        patch_array(out, header, series);
+    }
+
+    if (series == 0) {
+        out->size = out_start;
+        return 0;
+    }
+    *kept = CMT_TRUE;
+
+    return 0;
+}
+
+/*
+ * Copy the cmetrics payload at *offset into 'out', replacing its content,
+ * without the families and series which do not pass the filter. On
+ * success *offset points right after the source payload.
+ */
+int
+cmetrics_msgpack_filter(const char *buf, size_t size, size_t *offset,
+                        struct cmetrics_msgpack_filter *filter, struct cmetrics_buffer *out)
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t families = 0;
+    long n;
+    long label_count;
+    int kept;
+    int ret = 0;
+    int *static_match;
+    long *key_index;
+    size_t entry_start;
+    size_t header;
+    struct cmetrics_mp_reader reader;
+    struct cmetrics_mp_token map;
+    struct cmetrics_mp_token key;
+    struct cmetrics_mp_token token;
+    VALUE tmp_static_match;
+    VALUE tmp_key_index;
+
+    label_count = RARRAY_LEN(filter->label_keys);
+    static_match = ALLOCV_N(int, tmp_static_match, label_count + 1);
+    key_index = ALLOCV_N(long, tmp_key_index, label_count + 1);
+    for (n = 0; n < label_count; n++) {
+        static_match[n] = -1;
+    }
+
+    out->size = 0;
+    cmetrics_mp_reader_init(&reader, buf, size, *offset);
+
+    if (cmetrics_mp_read_type(&reader, &map, CMETRICS_MP_MAP) != 0 ||
+        copy_span(out, &reader, *offset, reader.offset) != 0) {
+        ret = -1;
+        goto exit;
+    }
+
+    /* the encoder always writes 'meta' ahead of 'metrics', static label
+     * matches are therefore known before the families are visited. */
+    for (i = 0; i < map.length && ret == 0; i++) {
+        entry_start = reader.offset;
+        if (cmetrics_mp_read_type(&reader, &key, CMETRICS_MP_STR) != 0) {
+            ret = -1;
+            break;
+        }
+        if (cmetrics_mp_token_equals(&key, "meta")) {
+            ret = filter_scan_context_meta(&reader, filter, static_match);
+            if (ret == 0) {
+                ret = copy_span(out, &reader, entry_start, reader.offset);
+            }
+        }
+        else if (cmetrics_mp_token_equals(&key, "metrics")) {
+            if (copy_span(out, &reader, entry_start, reader.offset) != 0 ||
+                cmetrics_mp_read_type(&reader, &token, CMETRICS_MP_ARRAY) != 0 ||
+                reserve_array(out, &header) != 0) {
+                ret = -1;
+                break;
+            }
+            for (j = 0; j < token.length; j++) {
+                if (filter_family(&reader, filter, static_match, key_index, out, &kept) != 0) {
+                    ret = -1;
+                    break;
+                }
+                if (kept) {
+                    families++;
+                }
+            }
+            patch_array(out, header, families);
+        }
+        else {
+            ret = cmetrics_mp_skip(&reader);
+            if (ret == 0) {
+                ret = copy_span(out, &reader, entry_start, reader.offset);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        *offset = reader.offset;
+    }
+
+exit:
+    ALLOCV_END(tmp_static_match);
+    ALLOCV_END(tmp_key_index);
+
+    return ret;
+}
+
+int
+cmetrics_msgpack_filter_state_init(struct cmetrics_msgpack_filter_state *state,
+                                   struct cmetrics_msgpack_filter *filter,
+                                   uint32_t string_count)
+{
+    long n;
+
+    memset(state, 0, sizeof(struct cmetrics_msgpack_filter_state));
+    if (filter == NULL) {
+        return 0;
+    }
+    state->filter = filter;
+    state->label_count = RARRAY_LEN(filter->label_keys);
+    state->string_count = string_count;
+
+    state->static_match = malloc((state->label_count + 1) * sizeof(int));
+    state->key_index = malloc((state->label_count + 1) * sizeof(long));
+    state->matches = calloc((size_t)state->label_count * string_count + 1, 1);
+    if (state->static_match == NULL || state->key_index == NULL || state->matches == NULL) {
+        cmetrics_msgpack_filter_state_destroy(state);
+        return -1;
+    }
+    for (n = 0; n < state->label_count; n++) {
+        state->static_match[n] = -1;
+    }
+
+    return 0;
+}
+
+void
+cmetrics_msgpack_filter_state_destroy(struct cmetrics_msgpack_filter_state *state)
+{
+    free(state->static_match);
+    free(state->key_index);
+    free(state->matches);
+    memset(state, 0, sizeof(struct cmetrics_msgpack_filter_state));
+}
+
+void
+cmetrics_msgpack_filter_state_static(struct cmetrics_msgpack_filter_state *state,
+                                     const char *key, const char *val)
+{
+    long n;
+
+    for (n = 0; n < state->label_count; n++) {
+        if (filter_match_key(state->filter, n, key, strlen(key))) {
+            state->static_match[n] =
+                filter_match_value(state->filter, n, val, strlen(val));
+        }
+    }
+}
+
+/*
+ * Whether a family passes the filter. Also records which of its label
+ * values the series are checked on.
+ */
+int
+cmetrics_msgpack_filter_state_family(struct cmetrics_msgpack_filter_state *state,
+                                     struct cmt_opts *opts, char **keys, uint32_t key_count)
+{
+    uint32_t i;
+    long n;
+    struct cmetrics_mp_token ns = { CMETRICS_MP_STR, 0, NULL, 0, 0, 0 };
+    struct cmetrics_mp_token ss = { CMETRICS_MP_STR, 0, NULL, 0, 0, 0 };
+    struct cmetrics_mp_token name = { CMETRICS_MP_STR, 0, NULL, 0, 0, 0 };
+
+    state->per_series = CMT_FALSE;
+    if (state->filter == NULL) {
+        return CMT_TRUE;
+    }
+
+    ns.ptr = opts->ns;
+    ns.length = (uint32_t)strlen(opts->ns);
+    ss.ptr = opts->subsystem;
+    ss.length = (uint32_t)strlen(opts->subsystem);
+    name.ptr = opts->name;
+    name.length = (uint32_t)strlen(opts->name);
+    if (!filter_match_name(state->filter, &ns, &ss, &name)) {
+        return CMT_FALSE;
+    }
+
+    for (n = 0; n < state->label_count; n++) {
+        state->key_index[n] = -1;
+        for (i = 0; i < key_count; i++) {
+            if (filter_match_key(state->filter, n, keys[i], strlen(keys[i]))) {
+                state->key_index[n] = i;
+                state->per_series = CMT_TRUE;
+                break;
+            }
+        }
+        /* labels which are not part of the family can only be static ones */
+        if (state->key_index[n] < 0 && state->static_match[n] != CMT_TRUE) {
+            return CMT_FALSE;
+        }
+    }
+
+    return CMT_TRUE;
+}
+
+/*
+ * Whether a series of the last family passed to _family() matches; 'refs'
+ * are the dictionary indices of its 'count' label values.
+ */
+int
+cmetrics_msgpack_filter_state_series(struct cmetrics_msgpack_filter_state *state,
+                                     uint32_t count, const uint32_t *refs, char **values)
+{
+    long n;
+    long position;
+    unsigned char *match;
+
+    if (!state->per_series) {
+        return CMT_TRUE;
+    }
+
+    for (n = 0; n < state->label_count; n++) {
+        position = state->key_index[n];
+        if (position < 0) {
+            continue;
+        }
+        /* series without some of the filtered labels never match */
+        if (count == 0) {
+            return CMT_FALSE;
+        }
+        match = &state->matches[(size_t)n * state->string_count + refs[position]];
+        if (*match == 0) {
+            *match = filter_match_value(state->filter, n, values[position],
+                                        strlen(values[position])) ? 1 : 2;
+        }
+        if (*match != 1) {
+            return CMT_FALSE;
+        }
+    }
+
+    return CMT_TRUE;
+}
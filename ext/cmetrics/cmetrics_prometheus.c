@@ -0,0 +1,776 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/*
+ * Prometheus text exposition format parser. The buffer is walked twice,
+ * line by line: the first pass checks the syntax, reads the HELP and TYPE
+ * comments and collects the label keys of every metric name, the second
+ * one sets every sample in the cmt context. Names, label values and help
+ * texts are unescaped into a scratch buffer.
+ *
+ * A metric name is one cmt family whose label keys are the union of the
+ * keys of its samples, in the order they are first seen; keys a sample
+ * does not have are set to "" and samples without labels are stored in
+ * the static series.
+ */
+
+/* longest value or timestamp token, "-1.7976931348623157e+308" fits */
+#define PROM_NUMBER_MAX 64
+
+struct prom_meta {
+    int type;
+    char *help;
+};
+
+struct prom_family {
+    struct cmt_map *map;
+    char **keys;
+    size_t key_count;
+    size_t key_capacity;
+};
+
+struct prom_parser {
+    struct cmt *cmt;
+    uint64_t now;
+    size_t line;
+    int scan;              /* first pass, nothing is set in 'cmt' */
+
+    /* metric name -> struct prom_meta */
+    struct cmetrics_table meta;
+    /* metric name -> struct prom_family */
+    struct cmetrics_table families;
+
+    /* label values of the current sample in the order of its family keys */
+    char **row;
+    size_t row_capacity;
+
+    /* unescaped strings of the current line */
+    char *scratch;
+    size_t scratch_length;
+    size_t scratch_capacity;
+
+    /* offsets into scratch of the label keys and values */
+    size_t *offsets;
+    char **keys;
+    char **values;
+    size_t label_count;
+    size_t label_capacity;
+};
+
+static int
+is_name_start(int c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':';
+}
+
+static int
+is_name_char(int c)
+{
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+static int
+is_label_char(int c)
+{
+    return c != ':' && is_name_char(c);
+}
+
+static const char *
+skip_blanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    return p;
+}
+
+static int
+scratch_reserve(struct prom_parser *parser, size_t size)
+{
+    char *tmp;
+    size_t capacity;
+
+    if (parser->scratch_capacity - parser->scratch_length >= size) {
+        return 0;
+    }
+
+    capacity = parser->scratch_capacity > 0 ? parser->scratch_capacity : 256;
+    while (capacity - parser->scratch_length < size) {
+        capacity *= 2;
+    }
+    tmp = realloc(parser->scratch, capacity);
+    if (tmp == NULL) {
+        return -1;
+    }
+    parser->scratch = tmp;
+    parser->scratch_capacity = capacity;
+
+    return 0;
+}
+
+/* Append a NUL terminated copy of [p, end) to scratch and return its offset. */
+static int
+scratch_append(struct prom_parser *parser, const char *p, const char *end, size_t *offset)
+{
+    if (scratch_reserve(parser, end - p + 1) != 0) {
+        return -2;
+    }
+
+    *offset = parser->scratch_length;
+    memcpy(parser->scratch + parser->scratch_length, p, end - p);
+    parser->scratch_length += end - p;
+    parser->scratch[parser->scratch_length++] = '\0';
+
+    return 0;
+}
+
+/*
+ * Unescape [p, end) into scratch until 'quote' (or the end when it is
+ * zero). \\ and \n are unescaped, and \" within quotes.
+ */
+static int
+scratch_unescape(struct prom_parser *parser, const char **cur, const char *end,
+                 char quote, size_t *offset)
+{
+    const char *p = *cur;
+    char *out;
+
+    /* the unescaped string is never longer than its source */
+    if (scratch_reserve(parser, end - p + 1) != 0) {
+        return -2;
+    }
+    *offset = parser->scratch_length;
+    out = parser->scratch + parser->scratch_length;
+
+    while (p < end && *p != quote) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+            switch (*p) {
+            case 'n':
+                *out++ = '\n';
+                break;
+            case '\\':
+            case '"':
+                *out++ = *p;
+                break;
+            default:
+                /* unknown escapes are kept as they are */
+                *out++ = '\\';
+                *out++ = *p;
+                break;
+            }
+            p++;
+            continue;
+        }
+        *out++ = *p++;
+    }
+
+    if (quote != '\0') {
+        if (p >= end) {
+            return -1;
+        }
+        p++;
+    }
+
+    *out++ = '\0';
+    parser->scratch_length = out - parser->scratch;
+    *cur = p;
+
+    return 0;
+}
+
+static int
+labels_reserve(struct prom_parser *parser, size_t count)
+{
+    size_t capacity;
+    size_t *tmp_offsets;
+    char **tmp_keys;
+    char **tmp_values;
+
+    if (count <= parser->label_capacity) {
+        return 0;
+    }
+
+    capacity = parser->label_capacity > 0 ? parser->label_capacity * 2 : 16;
+    tmp_offsets = realloc(parser->offsets, capacity * 2 * sizeof(size_t));
+    if (tmp_offsets == NULL) {
+        return -1;
+    }
+    parser->offsets = tmp_offsets;
+    tmp_keys = realloc(parser->keys, capacity * sizeof(char *));
+    if (tmp_keys == NULL) {
+        return -1;
+    }
+    parser->keys = tmp_keys;
+    tmp_values = realloc(parser->values, capacity * sizeof(char *));
+    if (tmp_values == NULL) {
+        return -1;
+    }
+    parser->values = tmp_values;
+    parser->label_capacity = capacity;
+
+    return 0;
+}
+
+static struct prom_meta *
+meta_get(struct prom_parser *parser, const char *name, size_t length, int create)
+{
+    int created;
+    void **slot;
+
+    slot = cmetrics_table_lookup(&parser->meta, name, length, create, &created);
+    if (slot == NULL) {
+        return NULL;
+    }
+    if (create && created) {
+        *slot = calloc(1, sizeof(struct prom_meta));
+        if (*slot != NULL) {
+            ((struct prom_meta *)*slot)->type = CMT_UNTYPED;
+        }
+    }
+
+    return *slot;
+}
+
+static int
+meta_type(const char *p, const char *end)
+{
+    size_t length = end - p;
+
+    if (length == 7 && memcmp(p, "counter", 7) == 0) {
+        return CMT_COUNTER;
+    }
+    else if (length == 5 && memcmp(p, "gauge", 5) == 0) {
+        return CMT_GAUGE;
+    }
+    else if ((length == 7 && memcmp(p, "untyped", 7) == 0) ||
+             (length == 9 && memcmp(p, "histogram", 9) == 0) ||
+             (length == 7 && memcmp(p, "summary", 7) == 0)) {
+        /* histogram and summary samples are imported as untyped series */
+        return CMT_UNTYPED;
+    }
+
+    return -1;
+}
+
+/* '# HELP name text' and '# TYPE name type'; other comments are ignored. */
+static int
+parse_comment(struct prom_parser *parser, const char *p, const char *end)
+{
+    int ret;
+    int is_help;
+    int type;
+    size_t offset;
+    const char *name;
+    const char *name_end;
+    struct prom_meta *meta;
+
+    p = skip_blanks(p + 1, end);
+    if (end - p < 5 || (p[4] != ' ' && p[4] != '\t')) {
+        return 0;
+    }
+    if (memcmp(p, "HELP", 4) == 0) {
+        is_help = CMT_TRUE;
+    }
+    else if (memcmp(p, "TYPE", 4) == 0) {
+        is_help = CMT_FALSE;
+    }
+    else {
+        return 0;
+    }
+
+    p = skip_blanks(p + 4, end);
+    name = p;
+    if (p >= end || !is_name_start(*p)) {
+        return -1;
+    }
+    while (p < end && is_name_char(*p)) {
+        p++;
+    }
+    name_end = p;
+    p = skip_blanks(p, end);
+
+    if (is_help) {
+        parser->scratch_length = 0;
+        ret = scratch_unescape(parser, &p, end, '\0', &offset);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    else {
+        type = meta_type(p, end);
+        if (type < 0) {
+            return -1;
+        }
+    }
+
+    meta = meta_get(parser, name, name_end - name, CMT_TRUE);
+    if (meta == NULL) {
+        return -2;
+    }
+    if (is_help) {
+        free(meta->help);
+        meta->help = strdup(parser->scratch + offset);
+        if (meta->help == NULL) {
+            return -2;
+        }
+    }
+    else {
+        meta->type = type;
+    }
+
+    return 0;
+}
+
+static int
+parse_number(const char **cur, const char *end, int integer, double *value, int64_t *integer_value)
+{
+    const char *p = *cur;
+    char *parsed;
+    char buf[PROM_NUMBER_MAX];
+    size_t length;
+
+    while (p < end && *p != ' ' && *p != '\t') {
+        p++;
+    }
+    length = p - *cur;
+    if (length == 0 || length >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, *cur, length);
+    buf[length] = '\0';
+
+    if (integer) {
+        *integer_value = strtoll(buf, &parsed, 10);
+    }
+    else {
+        *value = strtod(buf, &parsed);
+    }
+    if (parsed != buf + length) {
+        return -1;
+    }
+    *cur = p;
+
+    return 0;
+}
+
+/* Labels between the braces; 'p' points after '{'. */
+static int
+parse_labels(struct prom_parser *parser, const char **cur, const char *end)
+{
+    int ret;
+    const char *p = *cur;
+    const char *key;
+
+    for (;;) {
+        p = skip_blanks(p, end);
+        if (p < end && *p == '}') {
+            break;
+        }
+
+        key = p;
+        if (p >= end || !is_name_start(*p) || *p == ':') {
+            return -1;
+        }
+        while (p < end && is_label_char(*p)) {
+            p++;
+        }
+
+        if (labels_reserve(parser, parser->label_count + 1) != 0) {
+            return -2;
+        }
+        ret = scratch_append(parser, key, p, &parser->offsets[parser->label_count * 2]);
+        if (ret != 0) {
+            return ret;
+        }
+
+        p = skip_blanks(p, end);
+        if (p >= end || *p != '=') {
+            return -1;
+        }
+        p = skip_blanks(p + 1, end);
+        if (p >= end || *p != '"') {
+            return -1;
+        }
+        p++;
+        ret = scratch_unescape(parser, &p, end, '"',
+                               &parser->offsets[parser->label_count * 2 + 1]);
+        if (ret != 0) {
+            return ret;
+        }
+        parser->label_count++;
+
+        p = skip_blanks(p, end);
+        if (p < end && *p == ',') {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '}') {
+            break;
+        }
+        return -1;
+    }
+
+    *cur = p + 1;
+
+    return 0;
+}
+
+static struct prom_family *
+family_get(struct prom_parser *parser, const char *name, int create)
+{
+    int created;
+    void **slot;
+
+    slot = cmetrics_table_lookup(&parser->families, name, strlen(name), create, &created);
+    if (slot == NULL) {
+        return NULL;
+    }
+    if (create && created) {
+        *slot = calloc(1, sizeof(struct prom_family));
+    }
+
+    return *slot;
+}
+
+/* Add the label keys of the current sample its family does not have yet. */
+static int
+family_scan_keys(struct prom_family *family, struct prom_parser *parser)
+{
+    size_t i;
+    size_t j;
+    size_t capacity;
+    char **keys;
+
+    for (i = 0; i < parser->label_count; i++) {
+        for (j = 0; j < family->key_count; j++) {
+            if (strcmp(family->keys[j], parser->keys[i]) == 0) {
+                break;
+            }
+        }
+        if (j < family->key_count) {
+            continue;
+        }
+
+        if (family->key_count == family->key_capacity) {
+            capacity = family->key_capacity > 0 ? family->key_capacity * 2 : 4;
+            keys = realloc(family->keys, capacity * sizeof(char *));
+            if (keys == NULL) {
+                return -2;
+            }
+            family->keys = keys;
+            family->key_capacity = capacity;
+        }
+        family->keys[family->key_count] = strdup(parser->keys[i]);
+        if (family->keys[family->key_count] == NULL) {
+            return -2;
+        }
+        family->key_count++;
+    }
+
+    return 0;
+}
+
+static struct cmt_map *
+family_create(struct prom_parser *parser, struct prom_family *family, const char *name)
+{
+    size_t length;
+    struct cmt_opts opts;
+    struct prom_meta *meta;
+    struct prom_meta *help;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.ns = "";
+    opts.subsystem = "";
+    opts.name = (char *)name;
+    opts.description = (char *)name;
+
+    length = strlen(name);
+    meta = meta_get(parser, name, length, CMT_FALSE);
+    help = meta;
+    if (help == NULL) {
+        /* samples of histograms and summaries share the help of their family */
+        if (length > 7 && strcmp(name + length - 7, "_bucket") == 0) {
+            help = meta_get(parser, name, length - 7, CMT_FALSE);
+        }
+        else if (length > 4 && strcmp(name + length - 4, "_sum") == 0) {
+            help = meta_get(parser, name, length - 4, CMT_FALSE);
+        }
+        else if (length > 6 && strcmp(name + length - 6, "_count") == 0) {
+            help = meta_get(parser, name, length - 6, CMT_FALSE);
+        }
+    }
+    if (help != NULL && help->help != NULL && help->help[0] != '\0') {
+        opts.description = help->help;
+    }
+
+    family->map = cmetrics_context_family_create(parser->cmt, meta ? meta->type : CMT_UNTYPED,
+                                                 &opts, family->key_count, family->keys);
+
+    return family->map;
+}
+
+/* Lay the labels of the current sample out in the order of the family keys. */
+static int
+family_row(struct prom_parser *parser, struct prom_family *family)
+{
+    size_t i;
+    size_t j;
+    char **row;
+
+    if (family->key_count > parser->row_capacity) {
+        row = realloc(parser->row, family->key_count * sizeof(char *));
+        if (row == NULL) {
+            return -2;
+        }
+        parser->row = row;
+        parser->row_capacity = family->key_count;
+    }
+
+    for (j = 0; j < family->key_count; j++) {
+        parser->row[j] = "";
+    }
+    for (i = 0; i < parser->label_count; i++) {
+        for (j = 0; j < family->key_count; j++) {
+            if (strcmp(family->keys[j], parser->keys[i]) == 0) {
+                parser->row[j] = parser->values[i];
+                break;
+            }
+        }
+        /* the first pass collected every key */
+        if (j == family->key_count) {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+/* 'name{labels} value [timestamp]' */
+static int
+parse_sample(struct prom_parser *parser, const char *p, const char *end)
+{
+    int ret;
+    size_t i;
+    size_t name_offset;
+    const char *name;
+    double value;
+    int64_t timestamp = -1;
+    uint64_t ts;
+    struct prom_family *family;
+    struct cmt_map *map;
+    struct cmt_metric *metric;
+
+    parser->scratch_length = 0;
+    parser->label_count = 0;
+
+    name = p;
+    if (!is_name_start(*p)) {
+        return -1;
+    }
+    while (p < end && is_name_char(*p)) {
+        p++;
+    }
+    ret = scratch_append(parser, name, p, &name_offset);
+    if (ret != 0) {
+        return ret;
+    }
+
+    p = skip_blanks(p, end);
+    if (p < end && *p == '{') {
+        p++;
+        ret = parse_labels(parser, &p, end);
+        if (ret != 0) {
+            return ret;
+        }
+        p = skip_blanks(p, end);
+    }
+
+    if (parse_number(&p, end, CMT_FALSE, &value, NULL) != 0) {
+        return -1;
+    }
+    p = skip_blanks(p, end);
+    if (p < end && *p != '#') {
+        if (parse_number(&p, end, CMT_TRUE, NULL, &timestamp) != 0) {
+            return -1;
+        }
+        p = skip_blanks(p, end);
+    }
+    /* anything else but an exemplar comment is garbage */
+    if (p < end && *p != '#') {
+        return -1;
+    }
+
+    /* scratch does not move anymore */
+    for (i = 0; i < parser->label_count; i++) {
+        parser->keys[i] = parser->scratch + parser->offsets[i * 2];
+        parser->values[i] = parser->scratch + parser->offsets[i * 2 + 1];
+    }
+
+    family = family_get(parser, parser->scratch + name_offset, parser->scan);
+    if (family == NULL) {
+        return -2;
+    }
+    if (parser->scan) {
+        return family_scan_keys(family, parser);
+    }
+
+    map = family->map;
+    if (map == NULL) {
+        map = family_create(parser, family, parser->scratch + name_offset);
+        if (map == NULL) {
+            return -2;
+        }
+    }
+
+    if (parser->label_count == 0) {
+        metric = cmt_map_metric_get(map->opts, map, 0, NULL, CMT_TRUE);
+    }
+    else {
+        if (family_row(parser, family) != 0) {
+            return -2;
+        }
+        metric = cmt_map_metric_get(map->opts, map, family->key_count, parser->row, CMT_TRUE);
+    }
+    if (metric == NULL) {
+        return -2;
+    }
+
+    ts = timestamp >= 0 ? (uint64_t)timestamp * 1000000 : parser->now;
+    cmt_metric_set(metric, ts, value);
+
+    return 0;
+}
+
+static int
+parse_line(struct prom_parser *parser, const char *p, const char *end)
+{
+    if (end > p && end[-1] == '\r') {
+        end--;
+    }
+    p = skip_blanks(p, end);
+    if (p >= end) {
+        return 0;
+    }
+    if (*p == '#') {
+        return parser->scan ? parse_comment(parser, p, end) : 0;
+    }
+
+    return parse_sample(parser, p, end);
+}
+
+static void
+parser_destroy(struct prom_parser *parser)
+{
+    size_t i;
+    size_t j;
+    struct prom_meta *meta;
+    struct prom_family *family;
+
+    if (parser->families.entries != NULL) {
+        for (i = 0; i < parser->families.size; i++) {
+            if (parser->families.entries[i].key == NULL) {
+                continue;
+            }
+            family = parser->families.entries[i].value;
+            if (family != NULL) {
+                for (j = 0; j < family->key_count; j++) {
+                    free(family->keys[j]);
+                }
+                free(family->keys);
+                free(family);
+            }
+        }
+    }
+    if (parser->meta.entries != NULL) {
+        for (i = 0; i < parser->meta.size; i++) {
+            if (parser->meta.entries[i].key == NULL) {
+                continue;
+            }
+            meta = parser->meta.entries[i].value;
+            if (meta != NULL) {
+                free(meta->help);
+                free(meta);
+            }
+        }
+    }
+    cmetrics_table_destroy(&parser->meta);
+    cmetrics_table_destroy(&parser->families);
+    free(parser->row);
+    free(parser->scratch);
+    free(parser->offsets);
+    free(parser->keys);
+    free(parser->values);
+}
+
+/*
+ * Parse Prometheus text exposition format into 'cmt'. Samples without a
+ * timestamp are stamped with the current time.
+ *
+ * Returns 0 on success, -1 on syntax errors ('line' is set to the faulty
+ * line number) and -2 on allocation failures.
+ */
+int
+cmetrics_prometheus_decode(struct cmt *cmt, const char *buffer, size_t size, size_t *line)
+{
+    int ret = 0;
+    const char *p = buffer;
+    const char *end = buffer + size;
+    const char *line_end;
+    struct prom_parser parser;
+
+    memset(&parser, 0, sizeof(parser));
+    parser.cmt = cmt;
+    parser.now = cfl_time_now();
+
+    if (cmetrics_table_init(&parser.meta, 64) != 0 ||
+        cmetrics_table_init(&parser.families, 64) != 0) {
+        parser_destroy(&parser);
+        return -2;
+    }
+
+    for (parser.scan = CMT_TRUE; ret == 0; parser.scan = CMT_FALSE) {
+        p = buffer;
+        parser.line = 0;
+        while (p < end) {
+            parser.line++;
+            line_end = memchr(p, '\n', end - p);
+            if (line_end == NULL) {
+                line_end = end;
+            }
+
+            ret = parse_line(&parser, p, line_end);
+            if (ret != 0) {
+                break;
+            }
+            p = line_end < end ? line_end + 1 : end;
+        }
+        if (!parser.scan) {
+            break;
+        }
+    }
+
+    *line = parser.line;
+    parser_destroy(&parser);
+
+    return ret;
+}
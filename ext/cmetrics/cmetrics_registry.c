@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+VALUE rb_cRegistry;
+
+static void registry_mark(void* ptr);
+static void registry_free(void* ptr);
+
+static const rb_data_type_t rb_cmetrics_registry_type = { "cmetrics/registry",
+                                                          {
+                                                              registry_mark,
+                                                              registry_free,
+                                                              0,
+                                                          },
+                                                          NULL,
+                                                          NULL,
+                                                          RUBY_TYPED_FREE_IMMEDIATELY };
+
+/* Prometheus client defaults, in milliseconds as StatsD timers are */
+static double default_buckets[] = {
+    1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static void
+registry_mark(void* ptr)
+{
+    struct CMetricsRegistry* cmetricsRegistry = (struct CMetricsRegistry*)ptr;
+
+    cmetrics_cache_mark(&cmetricsRegistry->cache);
+}
+
+static void
+registry_free(void* ptr)
+{
+    struct CMetricsRegistry* cmetricsRegistry = (struct CMetricsRegistry*)ptr;
+
+    if (cmetricsRegistry) {
+        cmetrics_cache_destroy(&cmetricsRegistry->cache);
+        if (cmetricsRegistry->statsd) {
+            cmetrics_statsd_destroy(cmetricsRegistry->statsd);
+        }
+        if (cmetricsRegistry->instance) {
+            cmt_destroy(cmetricsRegistry->instance);
+        }
+    }
+
+    xfree(ptr);
+}
+
+static VALUE
+rb_cmetrics_registry_alloc(VALUE klass)
+{
+    VALUE obj;
+    struct CMetricsRegistry* cmetricsRegistry;
+    obj = TypedData_Make_Struct(
+            klass, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+    cmetrics_cache_init(&cmetricsRegistry->cache);
+    return obj;
+}
+
+/*
+ * Initailize Registry class.
+ *
+ * @param histogram_buckets [Array<Numeric>] upper bounds for timers and histograms
+ * @return [Registry]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_opts = Qnil;
+    VALUE rb_buckets = Qnil;
+    VALUE tmp_buckets;
+    struct CMetricsRegistry* cmetricsRegistry;
+    double *buckets = default_buckets;
+    size_t bucket_count = sizeof(default_buckets) / sizeof(double);
+    long i;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+
+    if (!NIL_P(rb_opts)) {
+        rb_buckets = rb_hash_aref(rb_opts, ID2SYM(rb_intern("histogram_buckets")));
+    }
+    if (!NIL_P(rb_buckets)) {
+        Check_Type(rb_buckets, T_ARRAY);
+        if (RARRAY_LEN(rb_buckets) == 0) {
+            rb_raise(rb_eArgError, "histogram_buckets must not be empty");
+        }
+        bucket_count = RARRAY_LEN(rb_buckets);
+        buckets = ALLOCV_N(double, tmp_buckets, bucket_count);
+        for (i = 0; i < (long)bucket_count; i++) {
+            buckets[i] = NUM2DBL(RARRAY_AREF(rb_buckets, i));
+            if (i > 0 && buckets[i] <= buckets[i - 1]) {
+                ALLOCV_END(tmp_buckets);
+                rb_raise(rb_eArgError, "histogram_buckets must be increasing");
+            }
+        }
+    }
+
+    if (cmetricsRegistry->statsd) {
+        cmetrics_statsd_destroy(cmetricsRegistry->statsd);
+        cmetricsRegistry->statsd = NULL;
+    }
+    if (cmetricsRegistry->instance) {
+        cmt_destroy(cmetricsRegistry->instance);
+    }
+
+    cmt_initialize();
+
+    cmetricsRegistry->instance = cmt_create();
+    if (cmetricsRegistry->instance != NULL) {
+        cmetricsRegistry->statsd = cmetrics_statsd_create(cmetricsRegistry->instance,
+                                                          &cmetricsRegistry->cache,
+                                                          buckets, bucket_count);
+    }
+
+    if (buckets != default_buckets) {
+        ALLOCV_END(tmp_buckets);
+    }
+    if (cmetricsRegistry->statsd == NULL) {
+        rb_raise(rb_eNoMemError, "failed to create registry");
+    }
+
+    return Qnil;
+}
+
+/*
+ * Apply a batch of StatsD / DogStatsD lines, as received in one or more
+ * datagrams. Counters (c), gauges (g, with +/- deltas) and timers or
+ * histograms (ms, h, d) are supported, with sample rates and tags.
+ * Malformed lines, sets and lines whose type differs from the first line
+ * of their name are rejected, see #statsd_rejected_lines.
+ *
+ * @param buffer [String] newline separated lines
+ * @return [Integer] the number of applied values
+ *
+ */
+static VALUE
+rb_cmetrics_registry_ingest_statsd(VALUE self, VALUE rb_buffer)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+    long applied;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    if (cmetricsRegistry->statsd == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    Check_Type(rb_buffer, T_STRING);
+
+    applied = cmetrics_statsd_ingest(cmetricsRegistry->statsd,
+                                     RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer),
+                                     cfl_time_now());
+    RB_GC_GUARD(rb_buffer);
+
+    if (applied < 0) {
+        rb_raise(rb_eNoMemError, "failed to apply StatsD lines");
+    }
+
+    return LONG2NUM(applied);
+}
+
+/*
+ * The number of StatsD lines rejected by #ingest_statsd so far.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_statsd_rejected_lines(VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    if (cmetricsRegistry->statsd == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return ULL2NUM(cmetrics_statsd_rejected(cmetricsRegistry->statsd));
+}
+
+static VALUE
+rb_cmetrics_registry_to_prometheus(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_prometheus(cmetricsRegistry->instance, &cmetricsRegistry->cache, argc, argv);
+}
+
+/*
+ * Reuse the output of #to_prometheus, as a frozen String, until the
+ * registry is updated.
+ *
+ * @param max_staleness [Float] also reuse it for this many seconds after updates
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_enable_exposition_cache(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    cmetrics_cache_configure(&cmetricsRegistry->cache, argc, argv);
+
+    return Qnil;
+}
+
+static VALUE
+rb_cmetrics_registry_disable_exposition_cache(VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    cmetrics_cache_disable(&cmetricsRegistry->cache);
+
+    return Qnil;
+}
+
+static VALUE
+rb_cmetrics_registry_to_influx(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_influx(cmetricsRegistry->instance, argc, argv);
+}
+
+/*
+ * Encode as OpenTelemetry (OTLP) protobuf.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String] binary String
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_opentelemetry(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_opentelemetry(cmetricsRegistry->instance, argc, argv);
+}
+
+/*
+ * Encode as Splunk HTTP Event Collector metric events.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param host [String] event host
+ * @param index [String] target index
+ * @param source [String] event source
+ * @param source_type [String] event sourcetype
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_splunk_hec(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_splunk_hec(cmetricsRegistry->instance, argc, argv);
+}
+
+/*
+ * Encode as CloudWatch embedded metric format (EMF), one JSON document
+ * per line.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_cloudwatch_emf(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_cloudwatch_emf(cmetricsRegistry->instance, argc, argv);
+}
+
+/*
+ * Encode as a binary snapshot, see CMetrics::Serde.from_snapshot.
+ * Histograms and summaries are not supported.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_snapshot(VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_snapshot_encode(cmetricsRegistry->instance);
+}
+
+/*
+ * Encode as OpenMetrics text.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_openmetrics(VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_openmetrics(cmetricsRegistry->instance, NULL);
+}
+
+/*
+ * Encode as msgpack.
+ *
+ * @param changed_since [Integer] only encode series updated after this token
+ * @return [String, Array] the buffer, or [buffer, token] with changed_since:
+ *
+ */
+static VALUE
+rb_cmetrics_registry_to_msgpack(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_msgpack(cmetricsRegistry->instance, &cmetricsRegistry->cache, argc, argv);
+}
+
+static VALUE
+rb_cmetrics_registry_to_text(VALUE self)
+{
+    struct CMetricsRegistry* cmetricsRegistry;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsRegistry, &rb_cmetrics_registry_type, cmetricsRegistry);
+
+    return cmetrics_export_text(cmetricsRegistry->instance);
+}
+
+void Init_cmetrics_registry(VALUE rb_mCMetrics)
+{
+    rb_cRegistry = rb_define_class_under(rb_mCMetrics, "Registry", rb_cObject);
+
+    rb_define_alloc_func(rb_cRegistry, rb_cmetrics_registry_alloc);
+
+    rb_define_method(rb_cRegistry, "initialize", rb_cmetrics_registry_initialize, -1);
+    rb_define_method(rb_cRegistry, "ingest_statsd", rb_cmetrics_registry_ingest_statsd, 1);
+    rb_define_method(rb_cRegistry, "statsd_rejected_lines", rb_cmetrics_registry_statsd_rejected_lines, 0);
+    rb_define_method(rb_cRegistry, "to_influx", rb_cmetrics_registry_to_influx, -1);
+    rb_define_method(rb_cRegistry, "to_opentelemetry", rb_cmetrics_registry_to_opentelemetry, -1);
+    rb_define_method(rb_cRegistry, "to_splunk_hec", rb_cmetrics_registry_to_splunk_hec, -1);
+    rb_define_method(rb_cRegistry, "to_cloudwatch_emf", rb_cmetrics_registry_to_cloudwatch_emf, -1);
+    rb_define_method(rb_cRegistry, "to_snapshot", rb_cmetrics_registry_to_snapshot, 0);
+    rb_define_method(rb_cRegistry, "to_openmetrics", rb_cmetrics_registry_to_openmetrics, 0);
+    rb_define_method(rb_cRegistry, "to_prometheus", rb_cmetrics_registry_to_prometheus, -1);
+    rb_define_method(rb_cRegistry, "enable_exposition_cache", rb_cmetrics_registry_enable_exposition_cache, -1);
+    rb_define_method(rb_cRegistry, "disable_exposition_cache", rb_cmetrics_registry_disable_exposition_cache, 0);
+    rb_define_method(rb_cRegistry, "to_msgpack", rb_cmetrics_registry_to_msgpack, -1);
+    rb_define_method(rb_cRegistry, "to_s", rb_cmetrics_registry_to_text, 0);
+}
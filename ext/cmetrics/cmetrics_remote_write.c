@@ -0,0 +1,848 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+#include <cmetrics/cmt_encode_prometheus_remote_write.h>
+
+/*
+ * Prometheus remote write encoder which splits the WriteRequest while
+ * building it. Every series carries one sample; labels are sorted by name
+ * as receivers expect, and each batch has the metadata of its families.
+ */
+
+struct rw_series {
+    size_t label_start;
+    size_t label_count;
+    Prometheus__Sample sample;
+};
+
+struct rw_batch {
+    struct cmt *cmt;
+    int method;
+    size_t max_samples;
+    size_t max_bytes;
+    size_t batches;
+
+    /* current batch */
+    struct rw_series *series;
+    size_t series_count;
+    size_t series_capacity;
+    Prometheus__Label *labels;
+    size_t label_count;
+    size_t label_capacity;
+    Prometheus__MetricMetadata *metadata;
+    size_t metadata_count;
+    size_t metadata_capacity;
+    size_t bytes;
+
+    /* current family */
+    struct cmt_map *map;
+    int family_in_batch;
+    char **values;
+    char **keys;
+
+    /* labels of the series being added */
+    Prometheus__Label *scratch;
+    Prometheus__Label **scratch_ptrs;
+    size_t scratch_capacity;
+};
+
+static size_t
+varint_size(size_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+/* size of a length delimited field holding 'size' bytes */
+static size_t
+field_size(size_t size)
+{
+    return 1 + varint_size(size) + size;
+}
+
+static void *
+grow(void *ptr, size_t *capacity, size_t needed, size_t item_size)
+{
+    size_t capacity_new;
+    void *tmp;
+
+    if (needed <= *capacity) {
+        return ptr;
+    }
+    capacity_new = *capacity > 0 ? *capacity : 64;
+    while (capacity_new < needed) {
+        capacity_new *= 2;
+    }
+    tmp = ruby_xrealloc2(ptr, capacity_new, item_size);
+    *capacity = capacity_new;
+
+    return tmp;
+}
+
+static void
+scratch_add(struct rw_batch *batch, size_t *count, char *name, char *value)
+{
+    Prometheus__Label init = PROMETHEUS__LABEL__INIT;
+    Prometheus__Label *label;
+
+    /* receivers treat empty labels as missing */
+    if (value == NULL || value[0] == '\0') {
+        return;
+    }
+
+    label = &batch->scratch[(*count)++];
+    *label = init;
+    label->name = name;
+    label->value = value;
+}
+
+static int
+metadata_type(int type)
+{
+    switch (type) {
+    case CMT_COUNTER:
+        return PROMETHEUS__METRIC_METADATA__METRIC_TYPE__COUNTER;
+    case CMT_GAUGE:
+        return PROMETHEUS__METRIC_METADATA__METRIC_TYPE__GAUGE;
+    default:
+        return PROMETHEUS__METRIC_METADATA__METRIC_TYPE__UNKNOWN;
+    }
+}
+
+static void
+batch_metadata(struct rw_batch *batch, Prometheus__MetricMetadata *metadata)
+{
+    Prometheus__MetricMetadata init = PROMETHEUS__METRIC_METADATA__INIT;
+
+    *metadata = init;
+    metadata->type = metadata_type(batch->map->type);
+    metadata->metric_family_name = batch->map->opts->fqname;
+    metadata->help = batch->map->opts->description;
+}
+
+struct rw_compress_args {
+    const char *buffer;
+    size_t size;
+    int method;
+};
+
+static VALUE
+batch_compress(VALUE data)
+{
+    struct rw_compress_args *args = (struct rw_compress_args *)data;
+
+    return cmetrics_compress(args->buffer, args->size, args->method);
+}
+
+static void
+batch_flush(struct rw_batch *batch)
+{
+    size_t i;
+    size_t size;
+    uint8_t *buffer;
+    VALUE rb_buffer;
+    Prometheus__WriteRequest request = PROMETHEUS__WRITE_REQUEST__INIT;
+    Prometheus__TimeSeries init = PROMETHEUS__TIME_SERIES__INIT;
+    Prometheus__TimeSeries *timeseries;
+    Prometheus__TimeSeries **timeseries_ptrs;
+    Prometheus__Label **label_ptrs;
+    Prometheus__Sample **sample_ptrs;
+    Prometheus__MetricMetadata **metadata_ptrs;
+    VALUE tmp = 0;
+    char *pool;
+    int state = 0;
+    struct rw_compress_args args;
+
+    if (batch->series_count == 0) {
+        return;
+    }
+
+    /* one allocation for every pointer array of the request */
+    pool = ALLOCV(tmp, batch->series_count * (sizeof(Prometheus__TimeSeries) +
+                                              sizeof(Prometheus__TimeSeries *) +
+                                              sizeof(Prometheus__Sample *)) +
+                       batch->label_count * sizeof(Prometheus__Label *) +
+                       batch->metadata_count * sizeof(Prometheus__MetricMetadata *));
+    timeseries = (Prometheus__TimeSeries *)pool;
+    timeseries_ptrs = (Prometheus__TimeSeries **)(timeseries + batch->series_count);
+    sample_ptrs = (Prometheus__Sample **)(timeseries_ptrs + batch->series_count);
+    label_ptrs = (Prometheus__Label **)(sample_ptrs + batch->series_count);
+    metadata_ptrs = (Prometheus__MetricMetadata **)(label_ptrs + batch->label_count);
+
+    for (i = 0; i < batch->label_count; i++) {
+        label_ptrs[i] = &batch->labels[i];
+    }
+    for (i = 0; i < batch->series_count; i++) {
+        timeseries[i] = init;
+        timeseries[i].n_labels = batch->series[i].label_count;
+        timeseries[i].labels = &label_ptrs[batch->series[i].label_start];
+        sample_ptrs[i] = &batch->series[i].sample;
+        timeseries[i].n_samples = 1;
+        timeseries[i].samples = &sample_ptrs[i];
+        timeseries_ptrs[i] = &timeseries[i];
+    }
+    for (i = 0; i < batch->metadata_count; i++) {
+        metadata_ptrs[i] = &batch->metadata[i];
+    }
+
+    request.n_timeseries = batch->series_count;
+    request.timeseries = timeseries_ptrs;
+    request.n_metadata = batch->metadata_count;
+    request.metadata = metadata_ptrs;
+
+    size = prometheus__write_request__get_packed_size(&request);
+    buffer = ruby_xmalloc(size > 0 ? size : 1);
+    prometheus__write_request__pack(&request, buffer);
+    ALLOCV_END(tmp);
+
+    batch->series_count = 0;
+    batch->label_count = 0;
+    batch->metadata_count = 0;
+    batch->bytes = 0;
+    batch->family_in_batch = CMT_FALSE;
+    batch->batches++;
+
+    /* compression may raise, do not leak the packed buffer */
+    args.buffer = (const char *)buffer;
+    args.size = size;
+    args.method = batch->method;
+    rb_buffer = rb_protect(batch_compress, (VALUE)&args, &state);
+    ruby_xfree(buffer);
+    if (state) {
+        rb_jump_tag(state);
+    }
+
+    rb_yield(rb_buffer);
+}
+
+static void
+sort_labels(Prometheus__Label *labels, size_t count)
+{
+    size_t i;
+    size_t j;
+    Prometheus__Label tmp;
+
+    /* label sets are small, insertion sort is enough */
+    for (i = 1; i < count; i++) {
+        tmp = labels[i];
+        for (j = i; j > 0 && strcmp(labels[j - 1].name, tmp.name) > 0; j--) {
+            labels[j] = labels[j - 1];
+        }
+        labels[j] = tmp;
+    }
+}
+
+static int
+batch_add_series(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    size_t count = 0;
+    size_t series_bytes;
+    size_t metadata_bytes;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    struct rw_batch *batch = data;
+    struct rw_series *series;
+    Prometheus__TimeSeries timeseries = PROMETHEUS__TIME_SERIES__INIT;
+    Prometheus__Sample sample = PROMETHEUS__SAMPLE__INIT;
+    Prometheus__Sample *sample_ptr = &sample;
+    Prometheus__MetricMetadata metadata;
+
+    sample.value = cmt_metric_get_value(metric);
+    sample.timestamp = (int64_t)(cmt_metric_get_timestamp(metric) / 1000000);
+
+    scratch_add(batch, &count, "__name__", map->opts->fqname);
+    cfl_list_foreach(head, &batch->cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        scratch_add(batch, &count, static_label->key, static_label->val);
+    }
+    if (metric != &map->metric) {
+        cmetrics_context_label_values(map, metric, batch->values);
+        for (i = 0; i < map->label_count; i++) {
+            scratch_add(batch, &count, batch->keys[i], batch->values[i]);
+        }
+    }
+    sort_labels(batch->scratch, count);
+
+    for (i = 0; i < (int)count; i++) {
+        batch->scratch_ptrs[i] = &batch->scratch[i];
+    }
+    timeseries.n_labels = count;
+    timeseries.labels = batch->scratch_ptrs;
+    timeseries.n_samples = 1;
+    timeseries.samples = &sample_ptr;
+    series_bytes = field_size(prometheus__time_series__get_packed_size(&timeseries));
+
+    batch_metadata(batch, &metadata);
+    metadata_bytes = field_size(prometheus__metric_metadata__get_packed_size(&metadata));
+
+    if (batch->series_count > 0 &&
+        (batch->series_count + 1 > batch->max_samples ||
+         batch->bytes + series_bytes +
+         (batch->family_in_batch ? 0 : metadata_bytes) > batch->max_bytes)) {
+        batch_flush(batch);
+    }
+
+    if (!batch->family_in_batch) {
+        batch->metadata = grow(batch->metadata, &batch->metadata_capacity,
+                               batch->metadata_count + 1, sizeof(Prometheus__MetricMetadata));
+        batch->metadata[batch->metadata_count++] = metadata;
+        batch->bytes += metadata_bytes;
+        batch->family_in_batch = CMT_TRUE;
+    }
+
+    batch->labels = grow(batch->labels, &batch->label_capacity,
+                         batch->label_count + count, sizeof(Prometheus__Label));
+    memcpy(&batch->labels[batch->label_count], batch->scratch, count * sizeof(Prometheus__Label));
+
+    batch->series = grow(batch->series, &batch->series_capacity,
+                         batch->series_count + 1, sizeof(struct rw_series));
+    series = &batch->series[batch->series_count++];
+    series->label_start = batch->label_count;
+    series->label_count = count;
+    series->sample = sample;
+
+    batch->label_count += count;
+    batch->bytes += series_bytes;
+
+    return 0;
+}
+
+static int
+batch_add_family(struct cmt_map *map, void *data)
+{
+    size_t needed;
+    struct rw_batch *batch = data;
+
+    batch->map = map;
+    batch->family_in_batch = CMT_FALSE;
+
+    needed = map->label_count + cfl_list_size(&batch->cmt->static_labels->list) + 1;
+    if (needed > batch->scratch_capacity) {
+        batch->scratch = ruby_xrealloc2(batch->scratch, needed, sizeof(Prometheus__Label));
+        batch->scratch_ptrs = ruby_xrealloc2(batch->scratch_ptrs, needed, sizeof(Prometheus__Label *));
+        batch->scratch_capacity = needed;
+    }
+    batch->keys = ruby_xrealloc2(batch->keys, map->label_count + 1, sizeof(char *));
+    batch->values = ruby_xrealloc2(batch->values, map->label_count + 1, sizeof(char *));
+    cmetrics_context_label_keys(map, batch->keys);
+
+    return cmetrics_context_foreach_metric(map, batch_add_series, batch);
+}
+
+static VALUE
+batch_run(VALUE data)
+{
+    struct rw_batch *batch = (struct rw_batch *)data;
+
+    cmetrics_context_foreach_map(batch->cmt, batch_add_family, batch);
+    batch_flush(batch);
+
+    return SIZET2NUM(batch->batches);
+}
+
+static VALUE
+batch_release(VALUE data)
+{
+    struct rw_batch *batch = (struct rw_batch *)data;
+
+    ruby_xfree(batch->series);
+    ruby_xfree(batch->labels);
+    ruby_xfree(batch->metadata);
+    ruby_xfree(batch->scratch);
+    ruby_xfree(batch->scratch_ptrs);
+    ruby_xfree(batch->keys);
+    ruby_xfree(batch->values);
+
+    return Qnil;
+}
+
+static size_t
+batch_limit(VALUE rb_opts, const char *name)
+{
+    VALUE rb_limit = rb_hash_aref(rb_opts, ID2SYM(rb_intern(name)));
+    long limit;
+
+    if (NIL_P(rb_limit)) {
+        return SIZE_MAX;
+    }
+    limit = NUM2LONG(rb_limit);
+    if (limit <= 0) {
+        rb_raise(rb_eArgError, "%s: must be positive", name);
+    }
+
+    return (size_t)limit;
+}
+
+/*
+ * Implementation of Serde#each_remote_write_batch(max_samples: nil,
+ * max_bytes: nil, compress: :snappy). Yields WriteRequests and returns
+ * the number of batches. max_bytes bounds the uncompressed size; a series
+ * which does not fit alone is sent in its own batch.
+ */
+VALUE
+cmetrics_remote_write_each_batch(struct cmt *cmt, VALUE rb_opts)
+{
+    struct rw_batch batch;
+
+    if (cfl_list_size(&cmt->histograms) > 0 || cfl_list_size(&cmt->summaries) > 0) {
+        rb_raise(rb_eArgError, "histograms and summaries cannot be batched");
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.cmt = cmt;
+    batch.method = CMETRICS_COMPRESS_SNAPPY;
+    batch.max_samples = SIZE_MAX;
+    batch.max_bytes = SIZE_MAX;
+
+    if (!NIL_P(rb_opts)) {
+        batch.max_samples = batch_limit(rb_opts, "max_samples");
+        batch.max_bytes = batch_limit(rb_opts, "max_bytes");
+        if (RTEST(rb_funcall(rb_opts, rb_intern("key?"), 1, ID2SYM(rb_intern("compress"))))) {
+            batch.method = cmetrics_compress_parse(rb_opts);
+        }
+    }
+
+    return rb_ensure(batch_run, (VALUE)&batch, batch_release, (VALUE)&batch);
+}
+
+/*
+ * Prometheus remote write decoder. protobuf-c allocates every message,
+ * repeated field and string of the request separately, so unpacking goes
+ * through a bump allocator whose chunks are released at once at the end.
+ */
+
+#define RW_ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+struct rw_arena_chunk {
+    struct rw_arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+#define RW_ARENA_HEADER RW_ARENA_ALIGN(sizeof(struct rw_arena_chunk))
+
+struct rw_arena {
+    struct rw_arena_chunk *chunks;
+    size_t chunk_size;
+};
+
+static void *
+arena_alloc(void *data, size_t size)
+{
+    size_t chunk_size;
+    void *ptr;
+    struct rw_arena *arena = data;
+    struct rw_arena_chunk *chunk = arena->chunks;
+
+    size = RW_ARENA_ALIGN(size);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk_size = arena->chunk_size > size ? arena->chunk_size : size;
+        chunk = malloc(RW_ARENA_HEADER + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->chunks = chunk;
+        arena->chunk_size *= 2;
+    }
+
+    ptr = (char *)chunk + RW_ARENA_HEADER + chunk->used;
+    chunk->used += size;
+
+    return ptr;
+}
+
+static void
+arena_free(void *data, void *ptr)
+{
+    /* released with the whole arena */
+    (void)data;
+    (void)ptr;
+}
+
+static void
+arena_destroy(struct rw_arena *arena)
+{
+    struct rw_arena_chunk *chunk;
+
+    while (arena->chunks != NULL) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+}
+
+/*
+ * Every metric name is one family whose label keys are the union of the
+ * keys of its series, collected before any family is created. Keys a
+ * series does not have (remote write drops empty labels) are set to ""
+ * and series with only a name are stored in the static series.
+ */
+struct rw_family {
+    struct cmt_map *map;
+    char **keys;           /* point into the unpacked request */
+    size_t key_count;
+    size_t key_capacity;
+};
+
+struct rw_decoder {
+    struct cmt *cmt;
+
+    /* family name -> Prometheus__MetricMetadata */
+    struct cmetrics_table metadata;
+    /* family name -> struct rw_family */
+    struct cmetrics_table families;
+
+    /* label values of the current series in the order of its family keys */
+    char **row;
+    size_t row_capacity;
+};
+
+static int
+decoder_family_type(int type)
+{
+    switch (type) {
+    case PROMETHEUS__METRIC_METADATA__METRIC_TYPE__COUNTER:
+        return CMT_COUNTER;
+    case PROMETHEUS__METRIC_METADATA__METRIC_TYPE__GAUGE:
+        return CMT_GAUGE;
+    default:
+        return CMT_UNTYPED;
+    }
+}
+
+static char *
+series_name(Prometheus__TimeSeries *timeseries)
+{
+    size_t i;
+
+    for (i = 0; i < timeseries->n_labels; i++) {
+        if (strcmp(timeseries->labels[i]->name, "__name__") == 0) {
+            return timeseries->labels[i]->value;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+family_has_key(struct rw_family *family, const char *key, size_t *index)
+{
+    size_t i;
+
+    for (i = 0; i < family->key_count; i++) {
+        if (strcmp(family->keys[i], key) == 0) {
+            *index = i;
+            return CMT_TRUE;
+        }
+    }
+
+    return CMT_FALSE;
+}
+
+/* Add the label keys of 'timeseries' its family does not have yet. */
+static int
+decoder_scan_series(struct rw_decoder *decoder, Prometheus__TimeSeries *timeseries)
+{
+    int created;
+    size_t i;
+    size_t index;
+    size_t capacity;
+    char *name;
+    char **keys;
+    void **slot;
+    struct rw_family *family;
+
+    name = series_name(timeseries);
+    if (timeseries->n_samples == 0 || name == NULL || name[0] == '\0') {
+        return 0;
+    }
+
+    slot = cmetrics_table_lookup(&decoder->families, name, strlen(name), CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -2;
+    }
+    if (created) {
+        *slot = calloc(1, sizeof(struct rw_family));
+        if (*slot == NULL) {
+            return -2;
+        }
+    }
+    family = *slot;
+
+    for (i = 0; i < timeseries->n_labels; i++) {
+        if (strcmp(timeseries->labels[i]->name, "__name__") == 0 ||
+            family_has_key(family, timeseries->labels[i]->name, &index)) {
+            continue;
+        }
+        if (family->key_count == family->key_capacity) {
+            capacity = family->key_capacity > 0 ? family->key_capacity * 2 : 4;
+            keys = realloc(family->keys, capacity * sizeof(char *));
+            if (keys == NULL) {
+                return -2;
+            }
+            family->keys = keys;
+            family->key_capacity = capacity;
+        }
+        family->keys[family->key_count++] = timeseries->labels[i]->name;
+    }
+
+    return 0;
+}
+
+static struct cmt_map *
+decoder_family_create(struct rw_decoder *decoder, struct rw_family *family, char *name)
+{
+    int type = CMT_UNTYPED;
+    void **metadata_slot;
+    struct cmt_opts opts;
+    Prometheus__MetricMetadata *metadata;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.ns = "";
+    opts.subsystem = "";
+    opts.name = name;
+    opts.description = name;
+
+    metadata_slot = cmetrics_table_lookup(&decoder->metadata, name, strlen(name), CMT_FALSE, NULL);
+    if (metadata_slot != NULL) {
+        metadata = *metadata_slot;
+        type = decoder_family_type(metadata->type);
+        /* cmetrics requires a help text */
+        if (metadata->help != NULL && metadata->help[0] != '\0') {
+            opts.description = metadata->help;
+        }
+    }
+
+    family->map = cmetrics_context_family_create(decoder->cmt, type, &opts,
+                                                 (int)family->key_count, family->keys);
+
+    return family->map;
+}
+
+static int
+decoder_add_series(struct rw_decoder *decoder, Prometheus__TimeSeries *timeseries)
+{
+    size_t i;
+    size_t index;
+    size_t count = 0;
+    char *name;
+    char **row;
+    void **slot;
+    int64_t timestamp;
+    Prometheus__Sample *sample;
+    struct rw_family *family;
+    struct cmt_map *map;
+    struct cmt_metric *metric;
+
+    name = series_name(timeseries);
+    /* series without a name cannot be mapped to a family */
+    if (timeseries->n_samples == 0 || name == NULL || name[0] == '\0') {
+        return 0;
+    }
+
+    slot = cmetrics_table_lookup(&decoder->families, name, strlen(name), CMT_FALSE, NULL);
+    if (slot == NULL) {
+        return -2;
+    }
+    family = *slot;
+    map = family->map;
+    if (map == NULL) {
+        map = decoder_family_create(decoder, family, name);
+        if (map == NULL) {
+            return -2;
+        }
+    }
+
+    if (family->key_count > decoder->row_capacity) {
+        row = realloc(decoder->row, family->key_count * sizeof(char *));
+        if (row == NULL) {
+            return -2;
+        }
+        decoder->row = row;
+        decoder->row_capacity = family->key_count;
+    }
+    for (i = 0; i < family->key_count; i++) {
+        decoder->row[i] = "";
+    }
+    for (i = 0; i < timeseries->n_labels; i++) {
+        if (strcmp(timeseries->labels[i]->name, "__name__") == 0) {
+            continue;
+        }
+        /* the scan collected every key */
+        if (!family_has_key(family, timeseries->labels[i]->name, &index)) {
+            return -2;
+        }
+        decoder->row[index] = timeseries->labels[i]->value;
+        count++;
+    }
+
+    /* a context holds one value per series, keep the newest sample */
+    sample = timeseries->samples[0];
+    for (i = 1; i < timeseries->n_samples; i++) {
+        if (timeseries->samples[i]->timestamp > sample->timestamp) {
+            sample = timeseries->samples[i];
+        }
+    }
+    timestamp = sample->timestamp > 0 ? sample->timestamp : 0;
+
+    if (count == 0) {
+        metric = cmt_map_metric_get(map->opts, map, 0, NULL, CMT_TRUE);
+    }
+    else {
+        metric = cmt_map_metric_get(map->opts, map, (int)family->key_count, decoder->row,
+                                    CMT_TRUE);
+    }
+    if (metric == NULL) {
+        return -2;
+    }
+    cmt_metric_set(metric, (uint64_t)timestamp * 1000000, sample->value);
+
+    return 0;
+}
+
+static void
+decoder_destroy(struct rw_decoder *decoder)
+{
+    size_t i;
+    struct rw_family *family;
+
+    if (decoder->families.entries != NULL) {
+        for (i = 0; i < decoder->families.size; i++) {
+            if (decoder->families.entries[i].key == NULL) {
+                continue;
+            }
+            family = decoder->families.entries[i].value;
+            if (family != NULL) {
+                free(family->keys);
+                free(family);
+            }
+        }
+    }
+    cmetrics_table_destroy(&decoder->metadata);
+    cmetrics_table_destroy(&decoder->families);
+    free(decoder->row);
+}
+
+static int
+decoder_run(struct rw_decoder *decoder, Prometheus__WriteRequest *request)
+{
+    int ret;
+    int created;
+    size_t i;
+    void **slot;
+    Prometheus__MetricMetadata *metadata;
+
+    for (i = 0; i < request->n_metadata; i++) {
+        metadata = request->metadata[i];
+        if (metadata->metric_family_name == NULL) {
+            continue;
+        }
+        slot = cmetrics_table_lookup(&decoder->metadata, metadata->metric_family_name,
+                                     strlen(metadata->metric_family_name), CMT_TRUE, &created);
+        if (slot == NULL) {
+            return -2;
+        }
+        *slot = metadata;
+    }
+
+    for (i = 0; i < request->n_timeseries; i++) {
+        ret = decoder_scan_series(decoder, request->timeseries[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < request->n_timeseries; i++) {
+        ret = decoder_add_series(decoder, request->timeseries[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decode a Prometheus remote write WriteRequest into 'cmt'. Families are
+ * typed by the request metadata, untyped otherwise; histograms and
+ * exemplars are ignored. 'method' is CMETRICS_COMPRESS_SNAPPY or
+ * CMETRICS_COMPRESS_NONE.
+ *
+ * Returns 0 on success, -1 on malformed buffers and -2 on allocation
+ * failures.
+ */
+int
+cmetrics_remote_write_decode(struct cmt *cmt, const char *buffer, size_t size, int method)
+{
+    int ret;
+    char *uncompressed = NULL;
+    size_t uncompressed_size;
+    struct rw_arena arena;
+    struct rw_decoder decoder;
+    ProtobufCAllocator allocator;
+    Prometheus__WriteRequest *request;
+
+    if (method == CMETRICS_COMPRESS_SNAPPY) {
+        if (cmetrics_snappy_uncompress(buffer, size, &uncompressed, &uncompressed_size) != 0) {
+            return -1;
+        }
+        buffer = uncompressed;
+        size = uncompressed_size;
+    }
+
+    /* unpacked messages are a few times larger than their encoding */
+    memset(&arena, 0, sizeof(arena));
+    arena.chunk_size = size * 4 + 4096;
+    allocator.alloc = arena_alloc;
+    allocator.free = arena_free;
+    allocator.allocator_data = &arena;
+
+    request = prometheus__write_request__unpack(&allocator, size, (const uint8_t *)buffer);
+    free(uncompressed);
+    if (request == NULL) {
+        arena_destroy(&arena);
+        return -1;
+    }
+
+    memset(&decoder, 0, sizeof(decoder));
+    decoder.cmt = cmt;
+    if (cmetrics_table_init(&decoder.metadata, 64) != 0 ||
+        cmetrics_table_init(&decoder.families, 64) != 0) {
+        ret = -2;
+    }
+    else {
+        ret = decoder_run(&decoder, request);
+    }
+
+    decoder_destroy(&decoder);
+    arena_destroy(&arena);
+
+    return ret;
+}
@@ -18,10 +18,8 @@
  */
 
 #include "cmetrics_c.h"
-#include <cmetrics/cmt_map.h>
-#include <cmetrics/cmt_metric.h>
 #include <cmetrics/cmt_cat.h>
-#include <cmetrics/cmt_encode_prometheus_remote_write.h>
+#include <cmetrics/cmt_decode_opentelemetry.h>
 
 VALUE rb_cSerde;
 
@@ -29,11 +27,12 @@ extern VALUE rb_cCounter;
 extern VALUE rb_cGauge;
 extern VALUE rb_cUntyped;
 
+static void serde_mark(void* ptr);
 static void serde_free(void* ptr);
 
 static const rb_data_type_t rb_cmetrics_serde_type = { "cmetrics/serde",
                                                          {
-                                                             0,
+                                                             serde_mark,
                                                              serde_free,
                                                              0,
                                                          },
@@ -42,20 +41,53 @@ static const rb_data_type_t rb_cmetrics_serde_type = { "cmetrics/serde",
                                                          RUBY_TYPED_FREE_IMMEDIATELY };
 
 
+static void
+serde_mark(void* ptr)
+{
+    struct CMetricsSerde* cmetricsSerde = (struct CMetricsSerde*)ptr;
+
+    cmetrics_cache_mark(&cmetricsSerde->cache);
+}
+
 static void
 serde_free(void* ptr)
 {
     struct CMetricsSerde* cmetricsSerde = (struct CMetricsSerde*)ptr;
 
     if (cmetricsSerde) {
+        cmetrics_cache_destroy(&cmetricsSerde->cache);
         if (cmetricsSerde->instance) {
             cmt_destroy(cmetricsSerde->instance);
         }
+        cmetrics_buffer_destroy(&cmetricsSerde->filtered);
     }
 
     xfree(ptr);
 }
 
+struct CMetricsSerde *cmetrics_serde_get_ptr(VALUE self)
+{
+    struct CMetricsSerde *cmetricsSerde = NULL;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    return cmetricsSerde;
+}
+
+/* Wrap a cmt context into a new Serde instance which takes its ownership. */
+VALUE cmetrics_serde_new(struct cmt *cmt)
+{
+    VALUE rb_serde;
+    struct CMetricsSerde *cmetricsSerde;
+
+    rb_serde = rb_class_new_instance(0, NULL, rb_cSerde);
+    cmetricsSerde = cmetrics_serde_get_ptr(rb_serde);
+    cmetricsSerde->instance = cmt;
+
+    return rb_serde;
+}
+
 static VALUE
 rb_cmetrics_serde_alloc(VALUE klass)
 {
@@ -63,6 +95,7 @@ rb_cmetrics_serde_alloc(VALUE klass)
     struct CMetricsSerde* cmetricsSerde;
     obj = TypedData_Make_Struct(
             klass, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+    cmetrics_cache_init(&cmetricsSerde->cache);
     return obj;
 }
 
@@ -88,12 +121,151 @@ rb_cmetrics_serde_initialize(VALUE self)
     return Qnil;
 }
 
+static int
+serde_parse_filter(VALUE rb_opts, struct cmetrics_msgpack_filter *filter)
+{
+    VALUE rb_only = Qnil;
+    VALUE rb_labels = Qnil;
+    VALUE rb_keys;
+    VALUE rb_key;
+    long i;
+
+    filter->names = Qnil;
+    filter->label_keys = rb_ary_new();
+    filter->label_values = rb_ary_new();
+    filter->scratch = rb_str_buf_new(0);
+    filter->error = 0;
+
+    if (!NIL_P(rb_opts)) {
+        rb_only = rb_hash_aref(rb_opts, ID2SYM(rb_intern("only")));
+        rb_labels = rb_hash_aref(rb_opts, ID2SYM(rb_intern("labels")));
+    }
+
+    if (NIL_P(rb_only) && NIL_P(rb_labels)) {
+        return CMT_FALSE;
+    }
+
+    if (!NIL_P(rb_only)) {
+        filter->names = rb_Array(rb_only);
+        for (i = 0; i < RARRAY_LEN(filter->names); i++) {
+            VALUE item = RARRAY_AREF(filter->names, i);
+            if (!RB_TYPE_P(item, T_STRING) && !RB_TYPE_P(item, T_REGEXP)) {
+                rb_raise(rb_eArgError, "only: must be String or Regexp");
+            }
+        }
+    }
+
+    if (!NIL_P(rb_labels)) {
+        Check_Type(rb_labels, T_HASH);
+        rb_keys = rb_funcall(rb_labels, rb_intern("keys"), 0);
+        for (i = 0; i < RARRAY_LEN(rb_keys); i++) {
+            VALUE item;
+
+            rb_key = RARRAY_AREF(rb_keys, i);
+            item = rb_hash_aref(rb_labels, rb_key);
+            switch(TYPE(rb_key)) {
+            case T_SYMBOL:
+                rb_key = rb_sym2str(rb_key);
+                break;
+            case T_STRING:
+                break;
+            default:
+                rb_raise(rb_eArgError, "label keys must be Symbol/String");
+            }
+            if (RB_TYPE_P(item, T_SYMBOL)) {
+                item = rb_sym2str(item);
+            }
+            if (!RB_TYPE_P(item, T_STRING) && !RB_TYPE_P(item, T_REGEXP)) {
+                rb_raise(rb_eArgError, "label values must be String, Symbol or Regexp");
+            }
+            rb_ary_push(filter->label_keys, rb_key);
+            rb_ary_push(filter->label_values, item);
+        }
+    }
+
+    return CMT_TRUE;
+}
+
+/*
+ * Re-raise an exception of a Regexp of 'filter', once the decoder freed
+ * its state, destroying the context it was building.
+ */
+static void
+serde_filter_check(struct cmetrics_msgpack_filter *filter, struct cmt **cmt)
+{
+    int state;
+
+    if (filter == NULL || filter->error == 0) {
+        return;
+    }
+    if (*cmt != NULL) {
+        cmt_destroy(*cmt);
+        *cmt = NULL;
+    }
+    state = filter->error;
+    filter->error = 0;
+    rb_jump_tag(state);
+}
+
+/*
+ * Decode one context. With a filter, the payload is first copied into
+ * 'scratch' without the rejected families and series so that cmetrics
+ * never builds them; compact payloads skip them while decoding.
+ */
+static int
+serde_decode_msgpack(struct cmt **cmt, char *buffer, size_t length, size_t *offset,
+                     struct cmetrics_msgpack_filter *filter, struct cmetrics_buffer *scratch)
+{
+    int ret;
+    size_t filtered_offset = 0;
+
+    if (cmetrics_compact_detect(buffer, length, *offset)) {
+        *cmt = cmt_create();
+        if (*cmt == NULL) {
+            return -1;
+        }
+        ret = cmetrics_compact_decode(*cmt, buffer, length, offset, filter);
+        if (ret != 0) {
+            cmt_destroy(*cmt);
+            *cmt = NULL;
+        }
+        serde_filter_check(filter, cmt);
+        return ret;
+    }
+
+    if (filter == NULL) {
+        return cmt_decode_msgpack_create(cmt, buffer, length, offset);
+    }
+
+    ret = cmetrics_msgpack_filter(buffer, length, offset, filter, scratch);
+    serde_filter_check(filter, cmt);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return cmt_decode_msgpack_create(cmt, scratch->data, scratch->size, &filtered_offset);
+}
+
+/*
+ * Decode a context from msgpack buffer.
+ *
+ * @param buffer [String] msgpack buffer
+ * @param length [Integer] length of the buffer to use
+ * @param offset [Integer] decode from this offset
+ * @param only [String, Regexp, Array] keep only families whose fully
+ *   qualified name matches
+ * @param labels [Hash] keep only series whose label values match
+ * @return [Boolean]
+ *
+ */
 static VALUE
 rb_cmetrics_serde_from_msgpack(int argc, VALUE *argv, VALUE self)
 {
-    VALUE rb_msgpack_buffer, rb_msgpack_length, rb_offset;
+    VALUE rb_msgpack_buffer, rb_msgpack_length, rb_offset, rb_opts;
     struct CMetricsSerde* cmetricsSerde;
+    struct cmetrics_msgpack_filter filter;
     int ret = 0;
+    int filtered;
     struct cmt *cmt = NULL;
     size_t offset = 0;
     size_t msgpack_length = 0;
@@ -101,10 +273,19 @@ rb_cmetrics_serde_from_msgpack(int argc, VALUE *argv, VALUE self)
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
 
-    rb_scan_args(argc, argv, "12", &rb_msgpack_buffer, &rb_msgpack_length, &rb_offset);
+    rb_scan_args(argc, argv, "12:", &rb_msgpack_buffer, &rb_msgpack_length, &rb_offset, &rb_opts);
+
+    if (NIL_P(rb_msgpack_buffer)) {
+        rb_raise(rb_eArgError, "nil is not valid value for buffer");
+    }
+    StringValue(rb_msgpack_buffer);
+
     if (!NIL_P(rb_msgpack_length)) {
         Check_Type(rb_msgpack_length, T_FIXNUM);
-        msgpack_length = ULONG2NUM(rb_msgpack_length);
+        msgpack_length = NUM2ULONG(rb_msgpack_length);
+        if (msgpack_length > (size_t)RSTRING_LEN(rb_msgpack_buffer)) {
+            msgpack_length = RSTRING_LEN(rb_msgpack_buffer);
+        }
     } else {
         msgpack_length = RSTRING_LEN(rb_msgpack_buffer);
     }
@@ -119,15 +300,17 @@ rb_cmetrics_serde_from_msgpack(int argc, VALUE *argv, VALUE self)
         rb_raise(rb_eRuntimeError, "offset should be smaller than msgpack buffer size.");
     }
 
-    if (!NIL_P(rb_msgpack_buffer)) {
-        ret = cmt_decode_msgpack_create(&cmt, StringValuePtr(rb_msgpack_buffer), msgpack_length, &offset);
-    } else {
-        rb_raise(rb_eArgError, "nil is not valid value for buffer");
-    }
+    filtered = serde_parse_filter(rb_opts, &filter);
+    ret = serde_decode_msgpack(&cmt, RSTRING_PTR(rb_msgpack_buffer), msgpack_length, &offset,
+                               filtered ? &filter : NULL, &cmetricsSerde->filtered);
 
     if (ret == 0) {
+        if (cmetricsSerde->instance) {
+            cmt_destroy(cmetricsSerde->instance);
+        }
         cmetricsSerde->instance = cmt;
         cmetricsSerde->unpack_msgpack_offset = offset;
+        cmetrics_cache_touch(&cmetricsSerde->cache);
 
         return Qtrue;
     } else {
@@ -136,23 +319,28 @@ rb_cmetrics_serde_from_msgpack(int argc, VALUE *argv, VALUE self)
 }
 
 static VALUE
-rb_cmetrics_serde_from_msgpack_feed_each_impl(VALUE self, VALUE rb_msgpack_buffer, size_t msgpack_length)
+rb_cmetrics_serde_from_msgpack_feed_each_impl(VALUE self, VALUE rb_msgpack_buffer, size_t msgpack_length,
+                                              struct cmetrics_msgpack_filter *filter)
 {
     struct CMetricsSerde* cmetricsSerde;
     struct cmt *cmt = NULL;
     int ret = 0;
     size_t offset = 0;
 
-    RETURN_ENUMERATOR(self, 0, 0);
-
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
 
     for (offset = 0; offset <= msgpack_length; ) {
-        ret = cmt_decode_msgpack_create(&cmt, StringValuePtr(rb_msgpack_buffer), msgpack_length, &offset);
+        ret = serde_decode_msgpack(&cmt, StringValuePtr(rb_msgpack_buffer), msgpack_length, &offset,
+                                   filter, &cmetricsSerde->filtered);
         if (ret == 0) {
+            /* the previous context is not reachable anymore, the Serde is reused */
+            if (cmetricsSerde->instance) {
+                cmt_destroy(cmetricsSerde->instance);
+            }
             cmetricsSerde->instance = cmt;
             cmetricsSerde->unpack_msgpack_offset = offset;
+            cmetrics_cache_touch(&cmetricsSerde->cache);
 
             rb_yield(self);
         } else {
@@ -163,17 +351,295 @@ rb_cmetrics_serde_from_msgpack_feed_each_impl(VALUE self, VALUE rb_msgpack_buffe
     return Qnil;
 }
 
+/*
+ * Decode each context in a wired buffer and yield self for each of them.
+ * Accepts the same only:/labels: filters as #from_msgpack.
+ *
+ */
 static VALUE
-rb_cmetrics_serde_from_msgpack_feed_each(VALUE self, VALUE rb_data)
+rb_cmetrics_serde_from_msgpack_feed_each(int argc, VALUE *argv, VALUE self)
 {
-    RETURN_ENUMERATOR(self, 0, 0);
+    VALUE rb_data, rb_opts;
+    struct cmetrics_msgpack_filter filter;
+    int filtered;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    rb_scan_args(argc, argv, "1:", &rb_data, &rb_opts);
+
     if (!NIL_P(rb_data)) {
-        return rb_cmetrics_serde_from_msgpack_feed_each_impl(self, rb_data, RSTRING_LEN(rb_data));
+        StringValue(rb_data);
+        filtered = serde_parse_filter(rb_opts, &filter);
+        return rb_cmetrics_serde_from_msgpack_feed_each_impl(self, rb_data, RSTRING_LEN(rb_data),
+                                                             filtered ? &filter : NULL);
     } else {
         rb_raise(rb_eArgError, "nil is not valid value for buffer");
     }
 }
 
+struct serde_open_args {
+    struct cmetrics_mapping mapping;
+    struct cmetrics_msgpack_filter *filter;
+    VALUE serde;
+};
+
+static VALUE
+serde_open_each(VALUE data)
+{
+    struct serde_open_args *args = (struct serde_open_args *)data;
+    struct CMetricsSerde *cmetricsSerde;
+    struct cmt *cmt = NULL;
+    int ret;
+    size_t offset = 0;
+
+    args->serde = rb_class_new_instance(0, NULL, rb_cSerde);
+    cmetricsSerde = cmetrics_serde_get_ptr(args->serde);
+
+    if (cmetrics_snapshot_detect(args->mapping.buffer, args->mapping.size)) {
+        cmt = cmt_create();
+        if (cmt == NULL) {
+            rb_raise(rb_eNoMemError, "cannot create cmt context");
+        }
+        ret = cmetrics_snapshot_decode(cmt, args->mapping.buffer, args->mapping.size,
+                                       args->filter);
+        serde_filter_check(args->filter, &cmt);
+        if (ret != 0) {
+            cmt_destroy(cmt);
+            rb_raise(rb_eArgError, "invalid snapshot buffer");
+        }
+        cmetricsSerde->instance = cmt;
+        rb_yield(args->serde);
+
+        return SIZET2NUM(args->mapping.size);
+    }
+
+    while (offset < args->mapping.size) {
+        /* filtered payloads are copied into the same scratch buffer each time */
+        if (serde_decode_msgpack(&cmt, args->mapping.buffer, args->mapping.size, &offset,
+                                 args->filter, &cmetricsSerde->filtered) != 0) {
+            break;
+        }
+
+        /* the previous context is not reachable anymore, the Serde is reused */
+        if (cmetricsSerde->instance) {
+            cmt_destroy(cmetricsSerde->instance);
+        }
+        cmetricsSerde->instance = cmt;
+        cmetricsSerde->unpack_msgpack_offset = offset;
+        cmetrics_cache_touch(&cmetricsSerde->cache);
+
+        cmetrics_mapping_release(&args->mapping, offset);
+        rb_yield(args->serde);
+    }
+
+    return SIZET2NUM(offset);
+}
+
+static VALUE
+serde_open_close(VALUE data)
+{
+    cmetrics_mapping_close(&((struct serde_open_args *)data)->mapping);
+
+    return Qnil;
+}
+
+/*
+ * Memory-map a file of recorded msgpack buffers (or a snapshot written by
+ * #to_snapshot) and yield a Serde for each context, decoding them straight
+ * from the mapping. The same Serde is yielded every time, holding the
+ * current context. Accepts the same only:/labels: filters as #from_msgpack.
+ *
+ * @param path [String] path of the file
+ * @return [Integer] number of bytes decoded; less than the file size when
+ *   the file ends with a truncated or invalid context
+ * @raise [ArgumentError] when the file is a corrupt snapshot
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE rb_path, rb_opts;
+    struct cmetrics_msgpack_filter filter;
+    struct serde_open_args args;
+
+    RETURN_ENUMERATOR(klass, argc, argv);
+
+    rb_scan_args(argc, argv, "1:", &rb_path, &rb_opts);
+
+    FilePathValue(rb_path);
+    args.filter = serde_parse_filter(rb_opts, &filter) ? &filter : NULL;
+    args.serde = Qnil;
+
+    if (cmetrics_mapping_open(&args.mapping, RSTRING_PTR(rb_path)) != 0) {
+        rb_sys_fail_str(rb_path);
+    }
+
+    return rb_ensure(serde_open_each, (VALUE)&args, serde_open_close, (VALUE)&args);
+}
+
+/*
+ * Check whether the buffer consists of well-formed cmetrics msgpack
+ * payloads without decoding them into cmt contexts.
+ *
+ * @param buffer [String] msgpack buffer (a wired buffer is allowed)
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_valid_p(VALUE klass, VALUE rb_msgpack_buffer)
+{
+    size_t offset = 0;
+    size_t msgpack_length;
+    const char *buffer;
+
+    if (NIL_P(rb_msgpack_buffer)) {
+        rb_raise(rb_eArgError, "nil is not valid value for buffer");
+    }
+    StringValue(rb_msgpack_buffer);
+
+    buffer = RSTRING_PTR(rb_msgpack_buffer);
+    msgpack_length = RSTRING_LEN(rb_msgpack_buffer);
+
+    if (msgpack_length == 0) {
+        return Qfalse;
+    }
+
+    while (offset < msgpack_length) {
+        if (cmetrics_compact_detect(buffer, msgpack_length, offset)) {
+            if (cmetrics_compact_decode(NULL, buffer, msgpack_length, &offset, NULL) != 0) {
+                return Qfalse;
+            }
+        }
+        else if (cmetrics_msgpack_validate(buffer, msgpack_length, &offset) != 0) {
+            return Qfalse;
+        }
+    }
+
+    return Qtrue;
+}
+
+/*
+ * Transcode msgpack buffers, as produced by #to_msgpack, to the
+ * Prometheus text format without decoding them into a cmt context.
+ * Families are written in buffer order; repeated ones are not merged.
+ *
+ * @param buffer [String] msgpack buffer (a wired buffer is allowed)
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_msgpack_to_prometheus(int argc, VALUE *argv, VALUE klass)
+{
+    return cmetrics_export_transcoded(argc, argv, CMT_FALSE);
+}
+
+/*
+ * Transcode msgpack buffers to Influx line protocol without decoding them
+ * into a cmt context.
+ *
+ * @param buffer [String] msgpack buffer (a wired buffer is allowed)
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_msgpack_to_influx(int argc, VALUE *argv, VALUE klass)
+{
+    return cmetrics_export_transcoded(argc, argv, CMT_TRUE);
+}
+
+/* Parse the op: option of #aggregate and .snapshot_aggregate. */
+static int
+serde_parse_aggregate_op(VALUE rb_op)
+{
+    if (NIL_P(rb_op)) {
+        return CMETRICS_AGGREGATE_SUM;
+    }
+
+    Check_Type(rb_op, T_SYMBOL);
+    if (SYM2ID(rb_op) == rb_intern("sum")) {
+        return CMETRICS_AGGREGATE_SUM;
+    } else if (SYM2ID(rb_op) == rb_intern("avg")) {
+        return CMETRICS_AGGREGATE_AVG;
+    } else if (SYM2ID(rb_op) == rb_intern("max")) {
+        return CMETRICS_AGGREGATE_MAX;
+    } else if (SYM2ID(rb_op) == rb_intern("min")) {
+        return CMETRICS_AGGREGATE_MIN;
+    } else if (SYM2ID(rb_op) == rb_intern("count")) {
+        return CMETRICS_AGGREGATE_COUNT;
+    }
+
+    rb_raise(rb_eArgError, "op: should be :sum, :avg, :max, :min or :count");
+}
+
+/*
+ * Decode a binary snapshot, as produced by #to_snapshot, into a new Serde.
+ *
+ * @param buffer [String] snapshot buffer
+ * @return [Serde]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_from_snapshot(VALUE klass, VALUE rb_buffer)
+{
+    struct cmt *cmt;
+
+    StringValue(rb_buffer);
+
+    cmt = cmt_create();
+    if (cmt == NULL) {
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+    if (cmetrics_snapshot_decode(cmt, RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer), NULL) != 0) {
+        cmt_destroy(cmt);
+        rb_raise(rb_eArgError, "invalid snapshot buffer");
+    }
+    RB_GC_GUARD(rb_buffer);
+
+    return cmetrics_serde_new(cmt);
+}
+
+/*
+ * Aggregate the values of a family straight from a snapshot buffer,
+ * without decoding its labels nor building a context.
+ *
+ * @param buffer [String] snapshot buffer
+ * @param family [String] fully qualified name of the family
+ * @param op [Symbol] one of :sum, :avg, :max, :min and :count
+ * @return [Float, nil] nil when no series matched, except for :count
+ *
+ */
+static VALUE
+rb_cmetrics_serde_s_snapshot_aggregate(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE rb_buffer, rb_family, rb_opts;
+    VALUE rb_op = Qnil;
+    double result;
+    int op;
+    int ret;
+
+    rb_scan_args(argc, argv, "2:", &rb_buffer, &rb_family, &rb_opts);
+
+    StringValue(rb_buffer);
+    StringValueCStr(rb_family);
+    if (!NIL_P(rb_opts)) {
+        rb_op = rb_hash_aref(rb_opts, ID2SYM(rb_intern("op")));
+    }
+    op = serde_parse_aggregate_op(rb_op);
+
+    ret = cmetrics_snapshot_aggregate(RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer),
+                                      RSTRING_PTR(rb_family), op, &result);
+    if (ret < 0) {
+        rb_raise(rb_eArgError, "invalid snapshot buffer");
+    }
+    if (ret > 0 && op != CMETRICS_AGGREGATE_COUNT) {
+        return Qnil;
+    }
+
+    return DBL2NUM(result);
+}
+
 static VALUE
 rb_cmetrics_serde_concat_metric(VALUE self, VALUE rb_data)
 {
@@ -189,6 +655,7 @@ rb_cmetrics_serde_concat_metric(VALUE self, VALUE rb_data)
         if (cmetricsSerde->instance == NULL) {
             cmetricsSerde->instance = cmt_create();
         }
+        cmetrics_cache_touch(&cmetricsSerde->cache);
 
         if (rb_obj_is_kind_of(rb_data, rb_cCounter)) {
             cmetricsCounter = (struct CMetricsCounter *)cmetrics_counter_get_ptr(rb_data);
@@ -206,15 +673,622 @@ rb_cmetrics_serde_concat_metric(VALUE self, VALUE rb_data)
         rb_raise(rb_eArgError, "nil is not valid value for concatenating");
     }
 
-    return Qnil;
+    return Qnil;
+}
+
+/*
+ * Concatenate a metric object by moving its families instead of copying
+ * them. The source is left empty: Counter, Gauge and Untyped objects need
+ * #create again, and a Serde has no families anymore.
+ *
+ * @param rb_data [Serde, Counter, Gauge, Untyped]
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_absorb_metric(VALUE self, VALUE rb_data)
+{
+    struct CMetricsSerde* cmetricsSerde = NULL;
+    struct CMetricsSerde* srcSerde = NULL;
+    struct CMetricsCounter* cmetricsCounter = NULL;
+    struct CMetricsGauge* cmetricsGauge = NULL;
+    struct CMetricsUntyped* cmetricsUntyped = NULL;
+    struct cmt *src = NULL;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (NIL_P(rb_data)) {
+        rb_raise(rb_eArgError, "nil is not valid value for concatenating");
+    }
+
+    if (rb_obj_is_kind_of(rb_data, rb_cSerde)) {
+        srcSerde = cmetrics_serde_get_ptr(rb_data);
+        src = srcSerde->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cCounter)) {
+        cmetricsCounter = (struct CMetricsCounter *)cmetrics_counter_get_ptr(rb_data);
+        src = cmetricsCounter->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cGauge)) {
+        cmetricsGauge = (struct CMetricsGauge *)cmetrics_gauge_get_ptr(rb_data);
+        src = cmetricsGauge->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cUntyped)) {
+        cmetricsUntyped = (struct CMetricsUntyped *)cmetrics_untyped_get_ptr(rb_data);
+        src = cmetricsUntyped->instance;
+    } else {
+        rb_raise(rb_eArgError, "specified type of instance is not supported.");
+    }
+
+    if (src == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+    if (src == cmetricsSerde->instance) {
+        rb_raise(rb_eArgError, "cannot concatenate a context into itself");
+    }
+
+    if (cmetricsSerde->instance == NULL) {
+        cmetricsSerde->instance = cmt_create();
+        if (cmetricsSerde->instance == NULL) {
+            rb_raise(rb_eNoMemError, "cannot create cmt context");
+        }
+    }
+
+    cmetrics_cache_touch(&cmetricsSerde->cache);
+    if (cmetrics_context_move(cmetricsSerde->instance, src) != 0) {
+        rb_raise(rb_eRuntimeError, "cannot copy static labels");
+    }
+
+    /*
+     * The families now belong to this context: the source must not keep
+     * entries keyed by series it does not own anymore.
+     */
+    if (srcSerde) {
+        cmetrics_cache_forget_all(&srcSerde->cache);
+    } else if (cmetricsCounter) {
+        cmetricsCounter->counter = NULL;
+        cmetrics_exemplars_destroy(&cmetricsCounter->exemplars);
+        cmetrics_cache_forget_all(&cmetricsCounter->cache);
+    } else if (cmetricsGauge) {
+        cmetricsGauge->gauge = NULL;
+        cmetrics_cache_forget_all(&cmetricsGauge->cache);
+    } else if (cmetricsUntyped) {
+        cmetricsUntyped->untyped = NULL;
+        cmetrics_cache_forget_all(&cmetricsUntyped->cache);
+    }
+
+    return Qnil;
+}
+
+static struct cmt *
+serde_source_context(VALUE rb_data)
+{
+    struct CMetricsSerde* cmetricsSerde = NULL;
+    struct CMetricsCounter* cmetricsCounter = NULL;
+    struct CMetricsGauge* cmetricsGauge = NULL;
+    struct CMetricsUntyped* cmetricsUntyped = NULL;
+
+    if (rb_obj_is_kind_of(rb_data, rb_cSerde)) {
+        cmetricsSerde = cmetrics_serde_get_ptr(rb_data);
+        return cmetricsSerde->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cCounter)) {
+        cmetricsCounter = (struct CMetricsCounter *)cmetrics_counter_get_ptr(rb_data);
+        return cmetricsCounter->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cGauge)) {
+        cmetricsGauge = (struct CMetricsGauge *)cmetrics_gauge_get_ptr(rb_data);
+        return cmetricsGauge->instance;
+    } else if (rb_obj_is_kind_of(rb_data, rb_cUntyped)) {
+        cmetricsUntyped = (struct CMetricsUntyped *)cmetrics_untyped_get_ptr(rb_data);
+        return cmetricsUntyped->instance;
+    }
+
+    rb_raise(rb_eArgError, "specified type of instance is not supported.");
+}
+
+/*
+ * Merge metrics into this context. Families with the same type and name
+ * and series with the same labels are unified instead of being appended.
+ * Histograms and summaries are not supported.
+ *
+ * @param other [Serde, Counter, Gauge, Untyped]
+ * @param policy [Symbol] :sum (default), :last (newest timestamp wins) or :max
+ * @return [Serde] self
+ *
+ */
+static VALUE
+rb_cmetrics_serde_merge(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_data, rb_opts, rb_policy = Qnil;
+    struct CMetricsSerde* cmetricsSerde = NULL;
+    struct cmt *src;
+    int policy = CMETRICS_MERGE_SUM;
+    int ret;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    rb_scan_args(argc, argv, "1:", &rb_data, &rb_opts);
+
+    if (NIL_P(rb_data)) {
+        rb_raise(rb_eArgError, "nil is not valid value for merging");
+    }
+    if (!NIL_P(rb_opts)) {
+        rb_policy = rb_hash_aref(rb_opts, ID2SYM(rb_intern("policy")));
+    }
+    if (!NIL_P(rb_policy)) {
+        Check_Type(rb_policy, T_SYMBOL);
+        if (SYM2ID(rb_policy) == rb_intern("sum")) {
+            policy = CMETRICS_MERGE_SUM;
+        } else if (SYM2ID(rb_policy) == rb_intern("last")) {
+            policy = CMETRICS_MERGE_LAST;
+        } else if (SYM2ID(rb_policy) == rb_intern("max")) {
+            policy = CMETRICS_MERGE_MAX;
+        } else {
+            rb_raise(rb_eArgError, "policy: should be :sum, :last or :max");
+        }
+    }
+
+    src = serde_source_context(rb_data);
+    if (src == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+    if (src == cmetricsSerde->instance) {
+        rb_raise(rb_eArgError, "cannot merge a context into itself");
+    }
+    if (cfl_list_size(&src->histograms) > 0 || cfl_list_size(&src->summaries) > 0) {
+        rb_raise(rb_eArgError, "histograms and summaries cannot be merged");
+    }
+
+    if (cmetricsSerde->instance == NULL) {
+        cmetricsSerde->instance = cmt_create();
+        if (cmetricsSerde->instance == NULL) {
+            rb_raise(rb_eNoMemError, "cannot create cmt context");
+        }
+    }
+
+    cmetrics_cache_touch(&cmetricsSerde->cache);
+    ret = cmetrics_merge(cmetricsSerde->instance, src, policy);
+    if (ret == CMETRICS_MERGE_ERROR_LABELS) {
+        rb_raise(rb_eArgError, "label keys of the same family differ");
+    } else if (ret == CMETRICS_MERGE_ERROR_STATIC_LABELS) {
+        rb_raise(rb_eArgError, "static label values of both contexts differ");
+    } else if (ret != 0) {
+        rb_raise(rb_eRuntimeError, "merge failed");
+    }
+
+    return self;
+}
+
+static char **
+serde_label_keys(VALUE rb_keys, VALUE *tmp_keys, int *count)
+{
+    long i;
+    char **keys;
+
+    rb_keys = rb_Array(rb_keys);
+    *count = (int)RARRAY_LEN(rb_keys);
+    keys = ALLOCV_N(char *, *tmp_keys, *count + 1);
+    for (i = 0; i < *count; i++) {
+        VALUE item = RARRAY_AREF(rb_keys, i);
+        switch(TYPE(item)) {
+        case T_SYMBOL:
+            keys[i] = RSTRING_PTR(rb_sym2str(item));
+            break;
+        case T_STRING:
+            keys[i] = StringValueCStr(item);
+            break;
+        default:
+            ALLOCV_END(*tmp_keys);
+            rb_raise(rb_eArgError, "labels must be Symbol/String");
+        }
+    }
+
+    return keys;
+}
+
+/*
+ * Aggregate the series of a family into a new context.
+ *
+ * @param family [String] fully qualified name of the family
+ * @param by [Array] keep only these labels
+ * @param without [Array] drop these labels and keep the others
+ * @param op [Symbol] one of :sum, :avg, :max, :min and :count
+ * @return [Serde]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_aggregate(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_family, rb_opts;
+    VALUE rb_by = Qnil, rb_without = Qnil, rb_op = Qnil;
+    VALUE tmp_keys = 0;
+    struct CMetricsSerde* cmetricsSerde;
+    struct cmt *cmt;
+    char **keys = NULL;
+    int key_count = 0;
+    int op;
+    int ret;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    rb_scan_args(argc, argv, "1:", &rb_family, &rb_opts);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    StringValueCStr(rb_family);
+    if (!NIL_P(rb_opts)) {
+        rb_by = rb_hash_aref(rb_opts, ID2SYM(rb_intern("by")));
+        rb_without = rb_hash_aref(rb_opts, ID2SYM(rb_intern("without")));
+        rb_op = rb_hash_aref(rb_opts, ID2SYM(rb_intern("op")));
+    }
+
+    if (!NIL_P(rb_by) && !NIL_P(rb_without)) {
+        rb_raise(rb_eArgError, "by: and without: are exclusive");
+    }
+
+    op = serde_parse_aggregate_op(rb_op);
+
+    if (!NIL_P(rb_without)) {
+        keys = serde_label_keys(rb_without, &tmp_keys, &key_count);
+    } else if (!NIL_P(rb_by)) {
+        keys = serde_label_keys(rb_by, &tmp_keys, &key_count);
+    }
+
+    cmt = cmt_create();
+    if (cmt == NULL) {
+        ALLOCV_END(tmp_keys);
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+
+    ret = cmetrics_aggregate(cmt, cmetricsSerde->instance, RSTRING_PTR(rb_family),
+                             key_count, keys, !NIL_P(rb_without), op);
+    ALLOCV_END(tmp_keys);
+
+    if (ret != 0) {
+        cmt_destroy(cmt);
+        if (ret == -1) {
+            rb_raise(rb_eArgError, "no such metric family: %s", RSTRING_PTR(rb_family));
+        }
+        rb_raise(rb_eRuntimeError, "aggregation failed");
+    }
+
+    return cmetrics_serde_new(cmt);
+}
+
+/*
+ * Encode as Prometheus remote write protobuf.
+ *
+ * @param compress [Symbol] :snappy, :gzip or :zstd
+ * @return [String] binary String
+ *
+ */
+static VALUE
+rb_metrics_serde_prometheus_remote_write(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_export_remote_write(cmetricsSerde->instance, argc, argv);
+}
+
+/*
+ * Encode as Prometheus remote write WriteRequests split by the number of
+ * samples and the encoded size, and yield each of them.
+ *
+ * @param max_samples [Integer] samples per WriteRequest
+ * @param max_bytes [Integer] size of an uncompressed WriteRequest
+ * @param compress [Symbol] :snappy (default), :gzip, :zstd or nil
+ * @return [Integer] the number of yielded WriteRequests
+ *
+ */
+static VALUE
+rb_cmetrics_serde_each_remote_write_batch(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_opts;
+    struct CMetricsSerde* cmetricsSerde;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    rb_scan_args(argc, argv, "0:", &rb_opts);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_remote_write_each_batch(cmetricsSerde->instance, rb_opts);
+}
+
+/*
+ * Decode a context from a Prometheus remote write WriteRequest. Families
+ * are typed by the request metadata and each series keeps its newest
+ * sample.
+ *
+ * @param buffer [String] WriteRequest buffer
+ * @param compressed [Symbol] :snappy (default) or nil for raw protobuf
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_from_prometheus_remote_write(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_buffer, rb_opts, rb_compressed;
+    struct CMetricsSerde* cmetricsSerde;
+    struct cmt *cmt;
+    int method = CMETRICS_COMPRESS_SNAPPY;
+    int ret;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    rb_scan_args(argc, argv, "1:", &rb_buffer, &rb_opts);
+
+    if (NIL_P(rb_buffer)) {
+        rb_raise(rb_eArgError, "nil is not valid value for buffer");
+    }
+    StringValue(rb_buffer);
+
+    if (!NIL_P(rb_opts) &&
+        RTEST(rb_funcall(rb_opts, rb_intern("key?"), 1, ID2SYM(rb_intern("compressed"))))) {
+        rb_compressed = rb_hash_aref(rb_opts, ID2SYM(rb_intern("compressed")));
+        if (NIL_P(rb_compressed)) {
+            method = CMETRICS_COMPRESS_NONE;
+        }
+        else if (!RB_TYPE_P(rb_compressed, T_SYMBOL) ||
+                 SYM2ID(rb_compressed) != rb_intern("snappy")) {
+            rb_raise(rb_eArgError, "compressed: should be :snappy or nil");
+        }
+    }
+
+    cmt = cmt_create();
+    if (cmt == NULL) {
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+
+    ret = cmetrics_remote_write_decode(cmt, RSTRING_PTR(rb_buffer), RSTRING_LEN(rb_buffer), method);
+    RB_GC_GUARD(rb_buffer);
+    if (ret != 0) {
+        cmt_destroy(cmt);
+        if (ret == -1) {
+            rb_raise(rb_eArgError, "invalid remote write buffer");
+        }
+        rb_raise(rb_eNoMemError, "cannot decode remote write buffer");
+    }
+
+    if (cmetricsSerde->instance) {
+        cmt_destroy(cmetricsSerde->instance);
+    }
+    cmetricsSerde->instance = cmt;
+    cmetrics_cache_touch(&cmetricsSerde->cache);
+
+    return Qtrue;
+}
+
+/*
+ * Decode a context from Prometheus text exposition format. Histogram and
+ * summary samples are imported as untyped series.
+ *
+ * @param text [String] exposition text
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_from_prometheus(VALUE self, VALUE rb_text)
+{
+    struct CMetricsSerde* cmetricsSerde;
+    struct cmt *cmt;
+    size_t line = 0;
+    int ret;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (NIL_P(rb_text)) {
+        rb_raise(rb_eArgError, "nil is not valid value for text");
+    }
+    StringValue(rb_text);
+
+    cmt = cmt_create();
+    if (cmt == NULL) {
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+
+    ret = cmetrics_prometheus_decode(cmt, RSTRING_PTR(rb_text), RSTRING_LEN(rb_text), &line);
+    RB_GC_GUARD(rb_text);
+    if (ret != 0) {
+        cmt_destroy(cmt);
+        if (ret == -1) {
+            rb_raise(rb_eArgError, "invalid Prometheus text at line %lu", (unsigned long)line);
+        }
+        rb_raise(rb_eNoMemError, "cannot decode Prometheus text");
+    }
+
+    if (cmetricsSerde->instance) {
+        cmt_destroy(cmetricsSerde->instance);
+    }
+    cmetricsSerde->instance = cmt;
+    cmetrics_cache_touch(&cmetricsSerde->cache);
+
+    return Qtrue;
+}
+
+/*
+ * Decode a context from an OpenTelemetry (OTLP) ExportMetricsServiceRequest.
+ * The metrics of every resource are gathered into one context.
+ *
+ * @param buffer [String] protobuf buffer
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_from_opentelemetry(VALUE self, VALUE rb_buffer)
+{
+    struct CMetricsSerde* cmetricsSerde;
+    struct cfl_list contexts;
+    struct cfl_list *head;
+    struct cmt *cmt;
+    struct cmt *decoded;
+    size_t offset = 0;
+    int ret;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (NIL_P(rb_buffer)) {
+        rb_raise(rb_eArgError, "nil is not valid value for buffer");
+    }
+    StringValue(rb_buffer);
+
+    cfl_list_init(&contexts);
+    ret = cmt_decode_opentelemetry_create(&contexts, RSTRING_PTR(rb_buffer),
+                                          RSTRING_LEN(rb_buffer), &offset);
+    RB_GC_GUARD(rb_buffer);
+    if (ret != CMT_DECODE_OPENTELEMETRY_SUCCESS) {
+        rb_raise(rb_eArgError, "invalid OpenTelemetry buffer");
+    }
+
+    cmt = cmt_create();
+    if (cmt == NULL) {
+        cmt_decode_opentelemetry_destroy(&contexts);
+        rb_raise(rb_eNoMemError, "cannot create cmt context");
+    }
+
+    /* one context per resource: move their families, no copies */
+    cfl_list_foreach(head, &contexts) {
+        decoded = cfl_list_entry(head, struct cmt, _head);
+        if (cmetrics_context_move(cmt, decoded) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    cmt_decode_opentelemetry_destroy(&contexts);
+
+    if (ret != 0) {
+        cmt_destroy(cmt);
+        rb_raise(rb_eNoMemError, "cannot decode OpenTelemetry buffer");
+    }
+
+    if (cmetricsSerde->instance) {
+        cmt_destroy(cmetricsSerde->instance);
+    }
+    cmetricsSerde->instance = cmt;
+    cmetrics_cache_touch(&cmetricsSerde->cache);
+
+    return Qtrue;
+}
+
+static VALUE
+rb_cmetrics_serde_to_prometheus(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_export_prometheus(cmetricsSerde->instance, &cmetricsSerde->cache, argc, argv);
+}
+
+/*
+ * Reuse the output of #to_prometheus, as a frozen String, until the
+ * context is updated by decoding, concatenating or merging.
+ *
+ * @param max_staleness [Float] also reuse it for this many seconds after updates
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_enable_exposition_cache(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    cmetrics_cache_configure(&cmetricsSerde->cache, argc, argv);
+
+    return Qnil;
+}
+
+static VALUE
+rb_cmetrics_serde_disable_exposition_cache(VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    cmetrics_cache_disable(&cmetricsSerde->cache);
+
+    return Qnil;
+}
+
+static VALUE
+rb_cmetrics_serde_to_influx(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_export_influx(cmetricsSerde->instance, argc, argv);
+}
+
+/*
+ * Encode as OpenTelemetry (OTLP) protobuf.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String] binary String
+ *
+ */
+static VALUE
+rb_cmetrics_serde_to_opentelemetry(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_export_opentelemetry(cmetricsSerde->instance, argc, argv);
 }
 
+/*
+ * Encode as Splunk HTTP Event Collector metric events.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param host [String] event host
+ * @param index [String] target index
+ * @param source [String] event source
+ * @param source_type [String] event sourcetype
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
 static VALUE
-rb_metrics_serde_prometheus_remote_write(VALUE self)
+rb_cmetrics_serde_to_splunk_hec(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsSerde* cmetricsSerde;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
@@ -223,21 +1297,21 @@ rb_metrics_serde_prometheus_remote_write(VALUE self)
         rb_raise(rb_eRuntimeError, "Invalid cmt context");
     }
 
-    prom = cmt_encode_prometheus_remote_write_create(cmetricsSerde->instance);
-
-    str = rb_str_new2(prom);
-
-    cmt_encode_prometheus_remote_write_destroy(prom);
-
-    return str;
+    return cmetrics_export_splunk_hec(cmetricsSerde->instance, argc, argv);
 }
 
+/*
+ * Encode as CloudWatch embedded metric format (EMF), one JSON document
+ * per line.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @return [String]
+ *
+ */
 static VALUE
-rb_cmetrics_serde_to_prometheus(VALUE self)
+rb_cmetrics_serde_to_cloudwatch_emf(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsSerde* cmetricsSerde;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
@@ -246,21 +1320,20 @@ rb_cmetrics_serde_to_prometheus(VALUE self)
         rb_raise(rb_eRuntimeError, "Invalid cmt context");
     }
 
-    prom = cmt_encode_prometheus_create(cmetricsSerde->instance, CMT_TRUE);
-
-    str = rb_str_new2(prom);
-
-    cmt_encode_prometheus_destroy(prom);
-
-    return str;
+    return cmetrics_export_cloudwatch_emf(cmetricsSerde->instance, argc, argv);
 }
 
+/*
+ * Encode as a binary snapshot, see CMetrics::Serde.from_snapshot.
+ * Histograms and summaries are not supported.
+ *
+ * @return [String]
+ *
+ */
 static VALUE
-rb_cmetrics_serde_to_influx(VALUE self)
+rb_cmetrics_serde_to_snapshot(VALUE self)
 {
     struct CMetricsSerde* cmetricsSerde;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
@@ -269,21 +1342,37 @@ rb_cmetrics_serde_to_influx(VALUE self)
         rb_raise(rb_eRuntimeError, "Invalid cmt context");
     }
 
-    prom = cmt_encode_influx_create(cmetricsSerde->instance);
+    return cmetrics_snapshot_encode(cmetricsSerde->instance);
+}
 
-    str = rb_str_new2(prom);
+/*
+ * Encode as OpenMetrics text.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_to_openmetrics(VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
 
-    cmt_encode_influx_destroy(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
 
-    return str;
+    return cmetrics_export_openmetrics(cmetricsSerde->instance, NULL);
 }
+
+/*
+ * Encode as msgpack.
+ *
+ * @param changed_since [Integer] only encode series updated after this token
+ * @return [String, Array] the buffer, or [buffer, token] with changed_since:
+ *
+ */
 static VALUE
-rb_cmetrics_serde_to_msgpack(VALUE self)
+rb_cmetrics_serde_to_msgpack(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsSerde* cmetricsSerde;
-    char *buffer;
-    size_t buffer_size;
-    int ret = 0;
 
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
@@ -292,21 +1381,13 @@ rb_cmetrics_serde_to_msgpack(VALUE self)
         rb_raise(rb_eRuntimeError, "Invalid cmt context");
     }
 
-    ret = cmt_encode_msgpack_create(cmetricsSerde->instance, &buffer, &buffer_size);
-
-    if (ret == 0) {
-        return rb_str_new(buffer, buffer_size);
-    } else {
-        return Qnil;
-    }
+    return cmetrics_export_msgpack(cmetricsSerde->instance, &cmetricsSerde->cache, argc, argv);
 }
 
 static VALUE
 rb_cmetrics_serde_to_text(VALUE self)
 {
     struct CMetricsSerde* cmetricsSerde;
-    cfl_sds_t buffer;
-    VALUE text;
 
     TypedData_Get_Struct(
             self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
@@ -315,20 +1396,112 @@ rb_cmetrics_serde_to_text(VALUE self)
         rb_raise(rb_eRuntimeError, "Invalid cmt context");
     }
 
-    buffer = cmt_encode_text_create(cmetricsSerde->instance);
-    if (buffer == NULL) {
+    return cmetrics_export_text(cmetricsSerde->instance);
+}
+
+/* Hash keys shared by every series Hash. */
+static VALUE rb_key_namespace;
+static VALUE rb_key_subsystem;
+static VALUE rb_key_name;
+static VALUE rb_key_description;
+static VALUE rb_key_value;
+static VALUE rb_key_timestamp;
+static VALUE rb_key_labels;
+static VALUE rb_key_static_labels;
+
+/*
+ * Ruby objects which are identical for every series of a family are
+ * created once per family instead of once per series.
+ */
+struct serde_family_strings {
+    int frozen;
+    VALUE ns;
+    VALUE subsystem;
+    VALUE name;
+    VALUE description;
+    VALUE label_keys;
+    VALUE static_labels;
+};
+
+static VALUE
+serde_str_new(const char *str, int frozen)
+{
+    VALUE rb_str = rb_str_new2(str);
+
+    if (frozen) {
+        rb_obj_freeze(rb_str);
+    }
+
+    return rb_str;
+}
+
+static VALUE
+format_static_labels(struct cmt *cmt, int frozen)
+{
+    struct cfl_list *head;
+    struct cmt_label *slabel;
+    VALUE shash;
+
+    if (cmt_labels_count(cmt->static_labels) <= 0) {
         return Qnil;
     }
 
-    text = rb_str_new2(buffer);
+    shash = rb_hash_new();
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        slabel = cfl_list_entry(head, struct cmt_label, _head);
+        rb_hash_aset(shash, rb_str_new2(slabel->key), serde_str_new(slabel->val, frozen));
+    }
+
+    if (frozen) {
+        rb_obj_freeze(shash);
+    }
+
+    return shash;
+}
+
+static void
+family_strings_init(struct serde_family_strings *strings,
+                    struct cmt_map *map, VALUE static_labels, int frozen)
+{
+    struct cfl_list *head;
+    struct cmt_map_label *label_k;
+    struct cmt_opts *opts = map->opts;
+
+    strings->frozen = frozen;
+    strings->label_keys = rb_ary_new_capa(map->label_count);
+    cfl_list_foreach(head, &map->label_keys) {
+        label_k = cfl_list_entry(head, struct cmt_map_label, _head);
+        /* frozen Strings are used as Hash keys without being copied */
+        rb_ary_push(strings->label_keys, serde_str_new(label_k->name, CMT_TRUE));
+    }
+    strings->static_labels = static_labels;
+
+    if (frozen) {
+        strings->ns = serde_str_new(opts->ns, CMT_TRUE);
+        strings->subsystem = serde_str_new(opts->subsystem, CMT_TRUE);
+        strings->name = serde_str_new(opts->name, CMT_TRUE);
+        strings->description = serde_str_new(opts->description, CMT_TRUE);
+    }
+    else {
+        strings->ns = Qnil;
+        strings->subsystem = Qnil;
+        strings->name = Qnil;
+        strings->description = Qnil;
+    }
+}
 
-    cfl_sds_destroy(buffer);
+static VALUE
+family_string(struct serde_family_strings *strings, VALUE shared, const char *str)
+{
+    if (strings->frozen) {
+        return shared;
+    }
 
-    return text;
+    return rb_str_new2(str);
 }
 
 static VALUE
-append_metric_value(struct cmt_map *map,
+append_metric_value(struct cmt_map *map, struct serde_family_strings *strings,
                     VALUE rbHash, struct cmt_metric *metric)
 {
     uint64_t ts;
@@ -342,62 +1515,68 @@ append_metric_value(struct cmt_map *map,
 
     ts = cmt_metric_get_timestamp(metric);
 
-    rb_hash_aset(rbHash, rb_str_new2("name"), rb_str_new2(opts->name));
-    rb_hash_aset(rbHash, rb_str_new2("description"), rb_str_new2(opts->description));
-    rb_hash_aset(rbHash, rb_str_new2("value"), DBL2NUM(val));
-    rb_hash_aset(rbHash, rb_str_new2("timestamp"), DBL2NUM(ts/1000000000.0));
+    rb_hash_aset(rbHash, rb_key_name, family_string(strings, strings->name, opts->name));
+    rb_hash_aset(rbHash, rb_key_description,
+                 family_string(strings, strings->description, opts->description));
+    rb_hash_aset(rbHash, rb_key_value, DBL2NUM(val));
+    rb_hash_aset(rbHash, rb_key_timestamp, DBL2NUM(ts/1000000000.0));
 
     return rbHash;
 }
 
 static VALUE
 format_metric(struct cmt *cmt, struct cmt_map *map,
+              struct serde_family_strings *strings,
               struct cmt_metric *metric)
 {
     int n;
-    int static_labels = 0;
-    struct cmt_map_label *label_k;
+    long i = 0;
     struct cmt_map_label *label_v;
     struct cfl_list *head;
     struct cmt_opts *opts;
-    struct cmt_label *slabel;
     VALUE rb_hash = rb_hash_new();
-    VALUE shash = rb_hash_new();
-    VALUE lhash = rb_hash_new();
+    VALUE shash;
+    VALUE lhash;
 
     opts = map->opts;
 
     /* Measurement */
-    rb_hash_aset(rb_hash, rb_str_new2("namespace"), rb_str_new2(opts->ns));
-    rb_hash_aset(rb_hash, rb_str_new2("subsystem"), rb_str_new2(opts->subsystem));
+    rb_hash_aset(rb_hash, rb_key_namespace, family_string(strings, strings->ns, opts->ns));
+    rb_hash_aset(rb_hash, rb_key_subsystem,
+                 family_string(strings, strings->subsystem, opts->subsystem));
 
     /* Static labels (tags) */
-    static_labels = cmt_labels_count(cmt->static_labels);
-    if (static_labels > 0) {
-        cfl_list_foreach(head, &cmt->static_labels->list) {
-            slabel = cfl_list_entry(head, struct cmt_label, _head);
-            rb_hash_aset(shash, rb_str_new2(slabel->key), rb_str_new2(slabel->val));
-        }
-        rb_hash_aset(rb_hash, rb_str_new2("static_labels"), shash);
+    shash = strings->frozen ? strings->static_labels : format_static_labels(cmt, CMT_FALSE);
+    if (!NIL_P(shash)) {
+        rb_hash_aset(rb_hash, rb_key_static_labels, shash);
     }
 
     /* Labels / Tags */
     n = cfl_list_size(&metric->labels);
     if (n > 0) {
-        label_k = cfl_list_entry_first(&map->label_keys, struct cmt_map_label, _head);
+        lhash = rb_hash_new();
 
         cfl_list_foreach(head, &metric->labels) {
             label_v = cfl_list_entry(head, struct cmt_map_label, _head);
+            if (i >= RARRAY_LEN(strings->label_keys)) {
+                break;
+            }
 
-            rb_hash_aset(lhash, rb_str_new2(label_k->name), rb_str_new2(label_v->name));
-
-            label_k = cfl_list_entry_next(&label_k->_head, struct cmt_map_label,
-                                         _head, &map->label_keys);
+            rb_hash_aset(lhash, RARRAY_AREF(strings->label_keys, i),
+                         serde_str_new(label_v->name, strings->frozen));
+            i++;
+        }
+        if (strings->frozen) {
+            rb_obj_freeze(lhash);
         }
-        rb_hash_aset(rb_hash, rb_str_new2("labels"), lhash);
+        rb_hash_aset(rb_hash, rb_key_labels, lhash);
     }
 
-    rb_hash = append_metric_value(map, rb_hash, metric);
+    rb_hash = append_metric_value(map, strings, rb_hash, metric);
+
+    if (strings->frozen) {
+        rb_obj_freeze(rb_hash);
+    }
 
     return rb_hash;
 }
@@ -410,19 +1589,24 @@ format_metrics(struct cmt *cmt,
     VALUE rbMetric;
     struct cfl_list *head;
     struct cmt_metric *metric;
+    struct serde_family_strings strings;
+
+    family_strings_init(&strings, map, Qnil, CMT_FALSE);
 
     /* Simple metric, no labels */
     if (map->metric_static_set == 1) {
-        rbMetric = format_metric(cmt, map, &map->metric);
+        rbMetric = format_metric(cmt, map, &strings, &map->metric);
         rb_ary_push(rbMetrics, rbMetric);
     }
 
     cfl_list_foreach(head, &map->metrics) {
         metric = cfl_list_entry(head, struct cmt_metric, _head);
-        rbMetric = format_metric(cmt, map, metric);
+        rbMetric = format_metric(cmt, map, &strings, metric);
         rb_ary_push(rbMetrics, rbMetric);
     }
 
+    RB_GC_GUARD(strings.label_keys);
+
     return rbMetrics;
 }
 
@@ -472,21 +1656,326 @@ rb_cmetrics_serde_get_metrics(VALUE self)
     return rbMetrics;
 }
 
+static void
+yield_family_series(struct cmt *cmt, struct cmt_map *map, VALUE static_labels)
+{
+    struct cfl_list *head;
+    struct cmt_metric *metric;
+    struct serde_family_strings strings;
+
+    family_strings_init(&strings, map, static_labels, CMT_TRUE);
+
+    if (map->metric_static_set == 1) {
+        rb_yield(format_metric(cmt, map, &strings, &map->metric));
+    }
+
+    cfl_list_foreach(head, &map->metrics) {
+        metric = cfl_list_entry(head, struct cmt_metric, _head);
+        rb_yield(format_metric(cmt, map, &strings, metric));
+    }
+
+    RB_GC_GUARD(strings.ns);
+    RB_GC_GUARD(strings.subsystem);
+    RB_GC_GUARD(strings.name);
+    RB_GC_GUARD(strings.description);
+    RB_GC_GUARD(strings.label_keys);
+}
+
+/*
+ * Iterate series as frozen Hashes with the same layout as #metrics.
+ * Keys, namespace, subsystem, name, description and static labels are
+ * shared between all series of a family instead of being copied.
+ *
+ * @yieldparam series [Hash] frozen series Hash
+ * @return [Serde]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_each_series(VALUE self)
+{
+    VALUE static_labels;
+    struct CMetricsSerde* cmetricsSerde;
+    struct cfl_list *head;
+    struct cmt_gauge *gauge;
+    struct cmt_counter *counter;
+    struct cmt_untyped *untyped;
+    struct cmt *cmt;
+
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    cmt = cmetricsSerde->instance;
+
+    if (cmt == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    static_labels = format_static_labels(cmt, CMT_TRUE);
+
+    cfl_list_foreach(head, &cmt->counters) {
+        counter = cfl_list_entry(head, struct cmt_counter, _head);
+        yield_family_series(cmt, counter->map, static_labels);
+    }
+
+    cfl_list_foreach(head, &cmt->gauges) {
+        gauge = cfl_list_entry(head, struct cmt_gauge, _head);
+        yield_family_series(cmt, gauge->map, static_labels);
+    }
+
+    cfl_list_foreach(head, &cmt->untypeds) {
+        untyped = cfl_list_entry(head, struct cmt_untyped, _head);
+        yield_family_series(cmt, untyped->map, static_labels);
+    }
+
+    RB_GC_GUARD(static_labels);
+
+    return self;
+}
+
+struct serde_columns {
+    VALUE families;
+    VALUE family_index;
+    VALUE labels;
+    VALUE values;
+    VALUE timestamps;
+};
+
+static void
+columns_append_series(struct serde_columns *columns, long family_index,
+                      struct cmt_metric *metric)
+{
+    double val;
+    int64_t ts;
+    struct cfl_list *head;
+    struct cmt_map_label *label_v;
+    VALUE rb_label_values;
+
+    val = cmt_metric_get_value(metric);
+    ts = (int64_t)cmt_metric_get_timestamp(metric);
+
+    rb_str_cat(columns->values, (const char *)&val, sizeof(val));
+    rb_str_cat(columns->timestamps, (const char *)&ts, sizeof(ts));
+
+    rb_label_values = rb_ary_new_capa(cfl_list_size(&metric->labels));
+    cfl_list_foreach(head, &metric->labels) {
+        label_v = cfl_list_entry(head, struct cmt_map_label, _head);
+        rb_ary_push(rb_label_values, rb_str_new2(label_v->name));
+    }
+    rb_ary_push(columns->labels, rb_label_values);
+    rb_ary_push(columns->family_index, LONG2FIX(family_index));
+}
+
+static void
+columns_append_family(struct serde_columns *columns, const char *type, struct cmt_map *map)
+{
+    struct cfl_list *head;
+    struct cmt_metric *metric;
+    struct cmt_map_label *label_k;
+    struct cmt_opts *opts = map->opts;
+    VALUE rb_family = rb_hash_new();
+    VALUE rb_label_keys = rb_ary_new_capa(map->label_count);
+    long family_index = RARRAY_LEN(columns->families);
+
+    cfl_list_foreach(head, &map->label_keys) {
+        label_k = cfl_list_entry(head, struct cmt_map_label, _head);
+        rb_ary_push(rb_label_keys, rb_str_new2(label_k->name));
+    }
+
+    rb_hash_aset(rb_family, rb_key_namespace, rb_str_new2(opts->ns));
+    rb_hash_aset(rb_family, rb_key_subsystem, rb_str_new2(opts->subsystem));
+    rb_hash_aset(rb_family, rb_key_name, rb_str_new2(opts->name));
+    rb_hash_aset(rb_family, rb_key_description, rb_str_new2(opts->description));
+    rb_hash_aset(rb_family, rb_str_new_cstr("type"), rb_str_new_cstr(type));
+    rb_hash_aset(rb_family, rb_str_new_cstr("label_keys"), rb_label_keys);
+    rb_ary_push(columns->families, rb_family);
+
+    if (map->metric_static_set == 1) {
+        columns_append_series(columns, family_index, &map->metric);
+    }
+
+    cfl_list_foreach(head, &map->metrics) {
+        metric = cfl_list_entry(head, struct cmt_metric, _head);
+        columns_append_series(columns, family_index, metric);
+    }
+}
+
+/*
+ * Encode decoded series as JSON, with the layout of #metrics: an Array
+ * of families, each an Array of series Objects. NaN and infinite values
+ * are written as null. Arguments given by JSON.generate are ignored.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_to_json(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    rb_check_arity(argc, 0, 1);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_encode_json(cmetricsSerde->instance, CMT_FALSE);
+}
+
+/*
+ * Encode decoded series as newline delimited JSON, one series Object,
+ * as in #each_series, per line.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_to_ndjson(VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    if (cmetricsSerde->instance == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    return cmetrics_encode_json(cmetricsSerde->instance, CMT_TRUE);
+}
+
+/*
+ * Export decoded series as columns.
+ *
+ * Family metadata is held once in "families". Every other column has one
+ * entry per series: "family_index" and "labels" are Arrays, "values" is a
+ * String of packed native doubles (unpack with "d*") and "timestamps" a
+ * String of packed native int64 nanoseconds (unpack with "q*").
+ *
+ * @return [Hash]
+ *
+ */
+static VALUE
+rb_cmetrics_serde_to_columns(VALUE self)
+{
+    struct CMetricsSerde* cmetricsSerde;
+    struct cfl_list *head;
+    struct cmt_gauge *gauge;
+    struct cmt_counter *counter;
+    struct cmt_untyped *untyped;
+    struct cmt *cmt;
+    struct serde_columns columns;
+    VALUE rb_columns;
+    VALUE rb_static_labels;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsSerde, &rb_cmetrics_serde_type, cmetricsSerde);
+
+    cmt = cmetricsSerde->instance;
+
+    if (cmt == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+
+    rb_static_labels = format_static_labels(cmt, CMT_FALSE);
+
+    columns.families = rb_ary_new();
+    columns.family_index = rb_ary_new();
+    columns.labels = rb_ary_new();
+    columns.values = rb_str_buf_new(0);
+    columns.timestamps = rb_str_buf_new(0);
+
+    rb_columns = rb_hash_new();
+    rb_hash_aset(rb_columns, rb_str_new_cstr("families"), columns.families);
+    rb_hash_aset(rb_columns, rb_key_static_labels,
+                 NIL_P(rb_static_labels) ? rb_hash_new() : rb_static_labels);
+    rb_hash_aset(rb_columns, rb_str_new_cstr("family_index"), columns.family_index);
+    rb_hash_aset(rb_columns, rb_key_labels, columns.labels);
+    rb_hash_aset(rb_columns, rb_str_new_cstr("values"), columns.values);
+    rb_hash_aset(rb_columns, rb_str_new_cstr("timestamps"), columns.timestamps);
+
+    cfl_list_foreach(head, &cmt->counters) {
+        counter = cfl_list_entry(head, struct cmt_counter, _head);
+        columns_append_family(&columns, "counter", counter->map);
+    }
+
+    cfl_list_foreach(head, &cmt->gauges) {
+        gauge = cfl_list_entry(head, struct cmt_gauge, _head);
+        columns_append_family(&columns, "gauge", gauge->map);
+    }
+
+    cfl_list_foreach(head, &cmt->untypeds) {
+        untyped = cfl_list_entry(head, struct cmt_untyped, _head);
+        columns_append_family(&columns, "untyped", untyped->map);
+    }
+
+    return rb_columns;
+}
+
+static VALUE
+frozen_key(const char *key)
+{
+    VALUE rb_key = rb_obj_freeze(rb_str_new_cstr(key));
+
+    rb_gc_register_mark_object(rb_key);
+
+    return rb_key;
+}
+
 void Init_cmetrics_serde(VALUE rb_mCMetrics)
 {
     rb_cSerde = rb_define_class_under(rb_mCMetrics, "Serde", rb_cObject);
 
+    rb_key_namespace = frozen_key("namespace");
+    rb_key_subsystem = frozen_key("subsystem");
+    rb_key_name = frozen_key("name");
+    rb_key_description = frozen_key("description");
+    rb_key_value = frozen_key("value");
+    rb_key_timestamp = frozen_key("timestamp");
+    rb_key_labels = frozen_key("labels");
+    rb_key_static_labels = frozen_key("static_labels");
+
     rb_define_alloc_func(rb_cSerde, rb_cmetrics_serde_alloc);
 
+    rb_define_singleton_method(rb_cSerde, "valid?", rb_cmetrics_serde_s_valid_p, 1);
+    rb_define_singleton_method(rb_cSerde, "msgpack_to_prometheus", rb_cmetrics_serde_s_msgpack_to_prometheus, -1);
+    rb_define_singleton_method(rb_cSerde, "msgpack_to_influx", rb_cmetrics_serde_s_msgpack_to_influx, -1);
+    rb_define_singleton_method(rb_cSerde, "from_snapshot", rb_cmetrics_serde_s_from_snapshot, 1);
+    rb_define_singleton_method(rb_cSerde, "snapshot_aggregate", rb_cmetrics_serde_s_snapshot_aggregate, -1);
+    rb_define_singleton_method(rb_cSerde, "open", rb_cmetrics_serde_s_open, -1);
+
     rb_define_method(rb_cSerde, "initialize", rb_cmetrics_serde_initialize, 0);
     rb_define_method(rb_cSerde, "concat", rb_cmetrics_serde_concat_metric, 1);
+    rb_define_method(rb_cSerde, "concat!", rb_cmetrics_serde_absorb_metric, 1);
+    rb_define_alias(rb_cSerde, "absorb", "concat!");
+    rb_define_method(rb_cSerde, "merge", rb_cmetrics_serde_merge, -1);
+    rb_define_method(rb_cSerde, "aggregate", rb_cmetrics_serde_aggregate, -1);
     rb_define_method(rb_cSerde, "from_msgpack", rb_cmetrics_serde_from_msgpack, -1);
-    rb_define_method(rb_cSerde, "prometheus_remote_write", rb_metrics_serde_prometheus_remote_write, 0);
-    rb_define_method(rb_cSerde, "to_prometheus", rb_cmetrics_serde_to_prometheus, 0);
-    rb_define_method(rb_cSerde, "to_influx", rb_cmetrics_serde_to_influx, 0);
-    rb_define_method(rb_cSerde, "to_msgpack", rb_cmetrics_serde_to_msgpack, 0);
-    rb_define_method(rb_cSerde, "feed_each", rb_cmetrics_serde_from_msgpack_feed_each, 1);
+    rb_define_method(rb_cSerde, "prometheus_remote_write", rb_metrics_serde_prometheus_remote_write, -1);
+    rb_define_method(rb_cSerde, "each_remote_write_batch", rb_cmetrics_serde_each_remote_write_batch, -1);
+    rb_define_method(rb_cSerde, "from_prometheus_remote_write", rb_cmetrics_serde_from_prometheus_remote_write, -1);
+    rb_define_method(rb_cSerde, "from_opentelemetry", rb_cmetrics_serde_from_opentelemetry, 1);
+    rb_define_method(rb_cSerde, "from_prometheus", rb_cmetrics_serde_from_prometheus, 1);
+    rb_define_method(rb_cSerde, "to_prometheus", rb_cmetrics_serde_to_prometheus, -1);
+    rb_define_method(rb_cSerde, "enable_exposition_cache", rb_cmetrics_serde_enable_exposition_cache, -1);
+    rb_define_method(rb_cSerde, "disable_exposition_cache", rb_cmetrics_serde_disable_exposition_cache, 0);
+    rb_define_method(rb_cSerde, "to_influx", rb_cmetrics_serde_to_influx, -1);
+    rb_define_method(rb_cSerde, "to_opentelemetry", rb_cmetrics_serde_to_opentelemetry, -1);
+    rb_define_method(rb_cSerde, "to_splunk_hec", rb_cmetrics_serde_to_splunk_hec, -1);
+    rb_define_method(rb_cSerde, "to_cloudwatch_emf", rb_cmetrics_serde_to_cloudwatch_emf, -1);
+    rb_define_method(rb_cSerde, "to_snapshot", rb_cmetrics_serde_to_snapshot, 0);
+    rb_define_method(rb_cSerde, "to_openmetrics", rb_cmetrics_serde_to_openmetrics, 0);
+    rb_define_method(rb_cSerde, "to_msgpack", rb_cmetrics_serde_to_msgpack, -1);
+    rb_define_method(rb_cSerde, "feed_each", rb_cmetrics_serde_from_msgpack_feed_each, -1);
     rb_define_method(rb_cSerde, "to_s", rb_cmetrics_serde_to_text, 0);
     rb_define_method(rb_cSerde, "get_metrics", rb_cmetrics_serde_get_metrics, 0);
     rb_define_method(rb_cSerde, "metrics", rb_cmetrics_serde_get_metrics, 0);
+    rb_define_method(rb_cSerde, "each_series", rb_cmetrics_serde_each_series, 0);
+    rb_define_method(rb_cSerde, "to_columns", rb_cmetrics_serde_to_columns, 0);
+    rb_define_method(rb_cSerde, "to_json", rb_cmetrics_serde_to_json, -1);
+    rb_define_method(rb_cSerde, "to_ndjson", rb_cmetrics_serde_to_ndjson, 0);
 }
@@ -0,0 +1,785 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include "cmetrics_c.h"
+
+/*
+ * Binary snapshots, a flat layout meant to be read in place (for
+ * instance from a mmap'ed file) by another process on the same host.
+ * Every integer is little endian and every section starts on an 8 byte
+ * boundary:
+ *
+ *   header     magic, version, counts and the offset of each section
+ *   strings    string_count {u32 offset, u32 length} entries followed by
+ *              the NUL terminated string data
+ *   families   family_count entries of SNAPSHOT_FAMILY_SIZE bytes
+ *   values     series_count doubles
+ *   timestamps series_count u64 nanoseconds
+ *   labels     u32 string indexes: the static label pairs, then for each
+ *              family its keys followed by the values of its series
+ *
+ * The series of a family are contiguous in the value and timestamp
+ * arrays, so aggregates only walk the family table and the values.
+ * Only counters, gauges and untyped families are supported.
+ */
+
+#define SNAPSHOT_MAGIC         "CMTSNAP"
+#define SNAPSHOT_VERSION       1
+#define SNAPSHOT_HEADER_SIZE   96
+#define SNAPSHOT_FAMILY_SIZE   56
+#define SNAPSHOT_STATIC_SERIES 0x1 /* the first series has no labels */
+
+struct snapshot_family {
+    uint32_t type;
+    uint32_t ns;
+    uint32_t subsystem;
+    uint32_t name;
+    uint32_t description;
+    uint32_t fqname;
+    uint32_t label_count;
+    uint32_t flags;
+    uint64_t first_series;
+    uint64_t series_count;
+    uint64_t labels_index;
+};
+
+struct snapshot {
+    const unsigned char *buf;
+    size_t size;
+    uint32_t string_count;
+    uint32_t family_count;
+    uint32_t static_label_count;
+    uint64_t series_count;
+    uint64_t label_ref_count;
+    const unsigned char *strings;
+    const unsigned char *string_data;
+    size_t string_data_size;
+    const unsigned char *families;
+    const unsigned char *values;
+    const unsigned char *timestamps;
+    const unsigned char *labels;
+};
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+    return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static double
+get_double(const unsigned char *p)
+{
+    uint64_t bits = get_u64(p);
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+static size_t
+align8(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+/* Encoder */
+
+struct snapshot_encoder {
+    struct cmetrics_table strings; /* string -> index + 1 */
+    const char **dictionary;       /* strings in index order */
+    uint32_t count;
+    uint32_t capacity;
+    size_t string_bytes;
+    char **values;                 /* label keys or values of one series */
+    int values_capacity;
+    uint32_t families;
+    uint64_t series;
+    uint64_t label_refs;
+    struct cmt *cmt;
+    /* write cursors */
+    unsigned char *family;
+    uint64_t next_series;
+    uint64_t next_label;
+    unsigned char *value_data;
+    unsigned char *timestamp_data;
+    unsigned char *label_data;
+};
+
+static int
+snapshot_intern(struct snapshot_encoder *enc, const char *str)
+{
+    int created;
+    void **slot;
+    uint32_t capacity;
+    const char **dictionary;
+    size_t length = strlen(str);
+
+    slot = cmetrics_table_lookup(&enc->strings, str, length, CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (!created) {
+        return 0;
+    }
+
+    if (enc->count == enc->capacity) {
+        capacity = enc->capacity > 0 ? enc->capacity * 2 : 64;
+        dictionary = realloc(enc->dictionary, capacity * sizeof(char *));
+        if (dictionary == NULL) {
+            return -1;
+        }
+        enc->dictionary = dictionary;
+        enc->capacity = capacity;
+    }
+    enc->dictionary[enc->count++] = str;
+    enc->string_bytes += length + 1;
+    *slot = (void *)(uintptr_t)enc->count;
+
+    return 0;
+}
+
+static uint32_t
+snapshot_ref(struct snapshot_encoder *enc, const char *str)
+{
+    void **slot = cmetrics_table_lookup(&enc->strings, str, strlen(str), CMT_FALSE, NULL);
+
+    /* every string was interned by the first pass */
+    return (uint32_t)((uintptr_t)*slot - 1);
+}
+
+static int
+snapshot_reserve_values(struct snapshot_encoder *enc, int count)
+{
+    char **values;
+
+    if (count <= enc->values_capacity) {
+        return 0;
+    }
+    values = realloc(enc->values, count * sizeof(char *));
+    if (values == NULL) {
+        return -1;
+    }
+    enc->values = values;
+    enc->values_capacity = count;
+
+    return 0;
+}
+
+static int
+intern_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    struct snapshot_encoder *enc = data;
+
+    enc->series++;
+    if (metric == &map->metric) {
+        return 0;
+    }
+
+    cmetrics_context_label_values(map, metric, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        if (snapshot_intern(enc, enc->values[i]) != 0) {
+            return -1;
+        }
+    }
+    enc->label_refs += map->label_count;
+
+    return 0;
+}
+
+static int
+intern_map(struct cmt_map *map, void *data)
+{
+    int i;
+    struct snapshot_encoder *enc = data;
+
+    if (snapshot_reserve_values(enc, map->label_count) != 0 ||
+        snapshot_intern(enc, map->opts->ns) != 0 ||
+        snapshot_intern(enc, map->opts->subsystem) != 0 ||
+        snapshot_intern(enc, map->opts->name) != 0 ||
+        snapshot_intern(enc, map->opts->description) != 0 ||
+        snapshot_intern(enc, map->opts->fqname) != 0) {
+        return -1;
+    }
+
+    cmetrics_context_label_keys(map, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        if (snapshot_intern(enc, enc->values[i]) != 0) {
+            return -1;
+        }
+    }
+    enc->label_refs += map->label_count;
+    enc->families++;
+
+    return cmetrics_context_foreach_metric(map, intern_metric, enc);
+}
+
+static int
+write_metric(struct cmt_map *map, struct cmt_metric *metric, void *data)
+{
+    int i;
+    uint64_t bits;
+    double value;
+    struct snapshot_encoder *enc = data;
+
+    value = cmt_metric_get_value(metric);
+    memcpy(&bits, &value, sizeof(bits));
+    put_u64(enc->value_data + enc->next_series * 8, bits);
+    put_u64(enc->timestamp_data + enc->next_series * 8, cmt_metric_get_timestamp(metric));
+    enc->next_series++;
+
+    if (metric == &map->metric) {
+        return 0;
+    }
+
+    cmetrics_context_label_values(map, metric, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        put_u32(enc->label_data + enc->next_label++ * 4, snapshot_ref(enc, enc->values[i]));
+    }
+
+    return 0;
+}
+
+static int
+write_map(struct cmt_map *map, void *data)
+{
+    int i;
+    struct snapshot_encoder *enc = data;
+    unsigned char *family = enc->family;
+
+    put_u32(family, map->type);
+    put_u32(family + 4, snapshot_ref(enc, map->opts->ns));
+    put_u32(family + 8, snapshot_ref(enc, map->opts->subsystem));
+    put_u32(family + 12, snapshot_ref(enc, map->opts->name));
+    put_u32(family + 16, snapshot_ref(enc, map->opts->description));
+    put_u32(family + 20, snapshot_ref(enc, map->opts->fqname));
+    put_u32(family + 24, map->label_count);
+    put_u32(family + 28, map->metric_static_set ? SNAPSHOT_STATIC_SERIES : 0);
+    put_u64(family + 32, enc->next_series);
+    put_u64(family + 40, map->metric_static_set + cfl_list_size(&map->metrics));
+    put_u64(family + 48, enc->next_label);
+    enc->family += SNAPSHOT_FAMILY_SIZE;
+
+    cmetrics_context_label_keys(map, enc->values);
+    for (i = 0; i < map->label_count; i++) {
+        put_u32(enc->label_data + enc->next_label++ * 4, snapshot_ref(enc, enc->values[i]));
+    }
+
+    return cmetrics_context_foreach_metric(map, write_metric, enc);
+}
+
+static VALUE
+snapshot_encode(VALUE data)
+{
+    uint32_t i;
+    size_t length;
+    size_t strings_offset;
+    size_t families_offset;
+    size_t values_offset;
+    size_t timestamps_offset;
+    size_t labels_offset;
+    size_t size;
+    unsigned char *buf;
+    unsigned char *index;
+    unsigned char *string_data;
+    size_t string_offset = 0;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    struct snapshot_encoder *enc = (struct snapshot_encoder *)data;
+    VALUE out;
+
+    strings_offset = SNAPSHOT_HEADER_SIZE;
+    families_offset = align8(strings_offset + (size_t)enc->count * 8 + enc->string_bytes);
+    values_offset = families_offset + (size_t)enc->families * SNAPSHOT_FAMILY_SIZE;
+    timestamps_offset = values_offset + enc->series * 8;
+    labels_offset = timestamps_offset + enc->series * 8;
+    size = align8(labels_offset + enc->label_refs * 4);
+
+    out = rb_str_new(NULL, size);
+    buf = (unsigned char *)RSTRING_PTR(out);
+    memset(buf, 0, size);
+
+    memcpy(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put_u32(buf + 8, SNAPSHOT_VERSION);
+    put_u32(buf + 12, SNAPSHOT_HEADER_SIZE);
+    put_u32(buf + 16, enc->count);
+    put_u32(buf + 20, enc->families);
+    put_u32(buf + 24, cfl_list_size(&enc->cmt->static_labels->list));
+    put_u64(buf + 32, enc->series);
+    put_u64(buf + 40, enc->label_refs);
+    put_u64(buf + 48, strings_offset);
+    put_u64(buf + 56, families_offset);
+    put_u64(buf + 64, values_offset);
+    put_u64(buf + 72, timestamps_offset);
+    put_u64(buf + 80, labels_offset);
+    put_u64(buf + 88, size);
+
+    index = buf + strings_offset;
+    string_data = index + (size_t)enc->count * 8;
+    for (i = 0; i < enc->count; i++) {
+        length = strlen(enc->dictionary[i]);
+        put_u32(index + (size_t)i * 8, (uint32_t)string_offset);
+        put_u32(index + (size_t)i * 8 + 4, (uint32_t)length);
+        memcpy(string_data + string_offset, enc->dictionary[i], length);
+        string_offset += length + 1;
+    }
+
+    enc->family = buf + families_offset;
+    enc->value_data = buf + values_offset;
+    enc->timestamp_data = buf + timestamps_offset;
+    enc->label_data = buf + labels_offset;
+
+    cfl_list_foreach(head, &enc->cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        put_u32(enc->label_data + enc->next_label++ * 4, snapshot_ref(enc, static_label->key));
+        put_u32(enc->label_data + enc->next_label++ * 4, snapshot_ref(enc, static_label->val));
+    }
+
+    cmetrics_context_foreach_map(enc->cmt, write_map, enc);
+
+    return out;
+}
+
+static VALUE
+snapshot_release(VALUE data)
+{
+    struct snapshot_encoder *enc = (struct snapshot_encoder *)data;
+
+    cmetrics_table_destroy(&enc->strings);
+    free(enc->dictionary);
+    free(enc->values);
+
+    return Qnil;
+}
+
+/*
+ * Encode the counters, gauges and untyped families of 'cmt' as a binary
+ * snapshot String.
+ */
+VALUE
+cmetrics_snapshot_encode(struct cmt *cmt)
+{
+    int ret = 0;
+    struct cfl_list *head;
+    struct cmt_label *static_label;
+    struct snapshot_encoder enc;
+
+    if (cmt == NULL) {
+        rb_raise(rb_eRuntimeError, "Invalid cmt context");
+    }
+    if (cfl_list_size(&cmt->histograms) > 0 || cfl_list_size(&cmt->summaries) > 0) {
+        rb_raise(rb_eArgError, "snapshots do not support histograms and summaries");
+    }
+
+    memset(&enc, 0, sizeof(enc));
+    enc.cmt = cmt;
+    if (cmetrics_table_init(&enc.strings, 64) != 0) {
+        rb_raise(rb_eNoMemError, "cannot encode the cmt context");
+    }
+
+    cfl_list_foreach(head, &cmt->static_labels->list) {
+        static_label = cfl_list_entry(head, struct cmt_label, _head);
+        if (snapshot_intern(&enc, static_label->key) != 0 ||
+            snapshot_intern(&enc, static_label->val) != 0) {
+            ret = -1;
+            break;
+        }
+        enc.label_refs += 2;
+    }
+    if (ret == 0) {
+        ret = cmetrics_context_foreach_map(cmt, intern_map, &enc);
+    }
+    if (ret == 0 && enc.string_bytes > UINT32_MAX) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        snapshot_release((VALUE)&enc);
+        rb_raise(rb_eNoMemError, "cannot encode the cmt context");
+    }
+
+    return rb_ensure(snapshot_encode, (VALUE)&enc, snapshot_release, (VALUE)&enc);
+}
+
+/* Reader */
+
+static int
+snapshot_section(struct snapshot *snap, uint64_t offset, uint64_t count, size_t item,
+                 const unsigned char **section)
+{
+    if (offset % 8 != 0 || offset < SNAPSHOT_HEADER_SIZE || offset > snap->size ||
+        count > (snap->size - offset) / item) {
+        return -1;
+    }
+    *section = snap->buf + offset;
+
+    return 0;
+}
+
+static void
+snapshot_family_get(struct snapshot *snap, uint32_t index, struct snapshot_family *family)
+{
+    const unsigned char *p = snap->families + (size_t)index * SNAPSHOT_FAMILY_SIZE;
+
+    family->type = get_u32(p);
+    family->ns = get_u32(p + 4);
+    family->subsystem = get_u32(p + 8);
+    family->name = get_u32(p + 12);
+    family->description = get_u32(p + 16);
+    family->fqname = get_u32(p + 20);
+    family->label_count = get_u32(p + 24);
+    family->flags = get_u32(p + 28);
+    family->first_series = get_u64(p + 32);
+    family->series_count = get_u64(p + 40);
+    family->labels_index = get_u64(p + 48);
+}
+
+static const char *
+snapshot_string(struct snapshot *snap, uint32_t index)
+{
+    return (const char *)snap->string_data + get_u32(snap->strings + (size_t)index * 8);
+}
+
+static uint32_t
+snapshot_label(struct snapshot *snap, uint64_t index)
+{
+    return get_u32(snap->labels + index * 4);
+}
+
+/* Number of label references a family uses, keys included. */
+static int
+snapshot_family_label_refs(struct snapshot_family *family, uint64_t *refs)
+{
+    uint64_t labeled = family->series_count;
+
+    if (family->flags & SNAPSHOT_STATIC_SERIES) {
+        if (labeled == 0) {
+            return -1;
+        }
+        labeled--;
+    }
+    if (family->label_count > 0 && labeled > UINT64_MAX / family->label_count - 1) {
+        return -1;
+    }
+    *refs = (labeled + 1) * family->label_count;
+
+    return 0;
+}
+
+/*
+ * Check the header, the string table and the family table. The label
+ * references are only checked when 'check_labels' is set, aggregates do
+ * not read them.
+ */
+static int
+snapshot_open(struct snapshot *snap, const char *buf, size_t size, int check_labels)
+{
+    uint32_t i;
+    uint64_t j;
+    uint64_t refs;
+    uint64_t snapshot_size;
+    uint32_t offset;
+    uint32_t length;
+    struct snapshot_family family;
+    const unsigned char *p = (const unsigned char *)buf;
+
+    memset(snap, 0, sizeof(struct snapshot));
+    if (size < SNAPSHOT_HEADER_SIZE ||
+        memcmp(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        get_u32(p + 8) != SNAPSHOT_VERSION ||
+        get_u32(p + 12) != SNAPSHOT_HEADER_SIZE) {
+        return -1;
+    }
+
+    snapshot_size = get_u64(p + 88);
+    if (snapshot_size < SNAPSHOT_HEADER_SIZE || snapshot_size > size) {
+        return -1;
+    }
+    snap->buf = p;
+    snap->size = (size_t)snapshot_size;
+    snap->string_count = get_u32(p + 16);
+    snap->family_count = get_u32(p + 20);
+    snap->static_label_count = get_u32(p + 24);
+    snap->series_count = get_u64(p + 32);
+    snap->label_ref_count = get_u64(p + 40);
+
+    if (snapshot_section(snap, get_u64(p + 48), snap->string_count, 8, &snap->strings) != 0 ||
+        snapshot_section(snap, get_u64(p + 56), snap->family_count, SNAPSHOT_FAMILY_SIZE,
+                         &snap->families) != 0 ||
+        snapshot_section(snap, get_u64(p + 64), snap->series_count, 8, &snap->values) != 0 ||
+        snapshot_section(snap, get_u64(p + 72), snap->series_count, 8, &snap->timestamps) != 0 ||
+        snapshot_section(snap, get_u64(p + 80), snap->label_ref_count, 4, &snap->labels) != 0 ||
+        (uint64_t)snap->static_label_count * 2 > snap->label_ref_count) {
+        return -1;
+    }
+
+    /* the string data runs up to the end of the snapshot, each string is NUL terminated */
+    snap->string_data = snap->strings + (size_t)snap->string_count * 8;
+    snap->string_data_size = snap->buf + snap->size - snap->string_data;
+    for (i = 0; i < snap->string_count; i++) {
+        offset = get_u32(snap->strings + (size_t)i * 8);
+        length = get_u32(snap->strings + (size_t)i * 8 + 4);
+        if ((uint64_t)offset + length >= snap->string_data_size ||
+            snap->string_data[(size_t)offset + length] != '\0' ||
+            memchr(snap->string_data + offset, '\0', length) != NULL) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < snap->family_count; i++) {
+        snapshot_family_get(snap, i, &family);
+        if ((family.type != CMT_COUNTER && family.type != CMT_GAUGE &&
+             family.type != CMT_UNTYPED) ||
+            family.ns >= snap->string_count || family.subsystem >= snap->string_count ||
+            family.name >= snap->string_count || family.description >= snap->string_count ||
+            family.fqname >= snap->string_count || family.label_count > INT_MAX ||
+            family.first_series > snap->series_count ||
+            family.series_count > snap->series_count - family.first_series ||
+            snapshot_family_label_refs(&family, &refs) != 0 ||
+            family.labels_index > snap->label_ref_count ||
+            refs > snap->label_ref_count - family.labels_index) {
+            return -1;
+        }
+    }
+
+    if (check_labels) {
+        for (j = 0; j < snap->label_ref_count; j++) {
+            if (snapshot_label(snap, j) >= snap->string_count) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Whether 'buf' starts like a snapshot, before any validation. */
+int
+cmetrics_snapshot_detect(const char *buf, size_t size)
+{
+    return size >= sizeof(SNAPSHOT_MAGIC) && memcmp(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+}
+
+static int
+snapshot_decode_family(struct cmt *cmt, struct snapshot *snap, struct snapshot_family *family,
+                       struct cmetrics_msgpack_filter_state *state, char **labels, uint32_t *refs)
+{
+    uint32_t i;
+    uint32_t count;
+    uint64_t j;
+    uint64_t series;
+    uint64_t label = family->labels_index;
+    char **values = labels + family->label_count;
+    struct cmt_opts opts;
+    struct cmt_map *map = NULL;
+    struct cmt_metric *metric;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.ns = (char *)snapshot_string(snap, family->ns);
+    opts.subsystem = (char *)snapshot_string(snap, family->subsystem);
+    opts.name = (char *)snapshot_string(snap, family->name);
+    opts.description = (char *)snapshot_string(snap, family->description);
+
+    for (i = 0; i < family->label_count; i++) {
+        labels[i] = (char *)snapshot_string(snap, snapshot_label(snap, label++));
+    }
+    if (!cmetrics_msgpack_filter_state_family(state, &opts, labels, family->label_count)) {
+        return 0;
+    }
+
+    for (j = 0; j < family->series_count; j++) {
+        series = family->first_series + j;
+        count = 0;
+        if (j > 0 || !(family->flags & SNAPSHOT_STATIC_SERIES)) {
+            count = family->label_count;
+            for (i = 0; i < count; i++) {
+                refs[i] = snapshot_label(snap, label++);
+                values[i] = (char *)snapshot_string(snap, refs[i]);
+            }
+        }
+        if (!cmetrics_msgpack_filter_state_series(state, count, refs, values)) {
+            continue;
+        }
+
+        /* families left without series by the filter are not created */
+        if (map == NULL) {
+            map = cmetrics_context_family_create(cmt, family->type, &opts,
+                                                 (int)family->label_count, labels);
+            if (map == NULL) {
+                return -1;
+            }
+        }
+        metric = cmt_map_metric_get(map->opts, map, (int)count, count > 0 ? values : NULL,
+                                    CMT_TRUE);
+        if (metric == NULL) {
+            return -1;
+        }
+        cmt_metric_set(metric, get_u64(snap->timestamps + series * 8),
+                       get_double(snap->values + series * 8));
+    }
+
+    if (map == NULL && !state->per_series &&
+        cmetrics_context_family_create(cmt, family->type, &opts, (int)family->label_count,
+                                       labels) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decode a snapshot into 'cmt', skipping the families and series rejected
+ * by 'filter' when it is not NULL. The strings are used in place, cmetrics
+ * copies them while building the families.
+ */
+int
+cmetrics_snapshot_decode(struct cmt *cmt, const char *buf, size_t size,
+                         struct cmetrics_msgpack_filter *filter)
+{
+    int ret = 0;
+    uint32_t i;
+    uint32_t max_labels = 0;
+    char **labels;
+    uint32_t *refs;
+    const char *key;
+    const char *val;
+    struct snapshot snap;
+    struct snapshot_family family;
+    struct cmetrics_msgpack_filter_state state;
+
+    if (snapshot_open(&snap, buf, size, CMT_TRUE) != 0) {
+        return -1;
+    }
+    if (cmetrics_msgpack_filter_state_init(&state, filter, snap.string_count) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < snap.static_label_count; i++) {
+        key = snapshot_string(&snap, snapshot_label(&snap, i * 2));
+        val = snapshot_string(&snap, snapshot_label(&snap, i * 2 + 1));
+        if (cmt_label_add(cmt, (char *)key, (char *)val) != 0) {
+            cmetrics_msgpack_filter_state_destroy(&state);
+            return -1;
+        }
+        cmetrics_msgpack_filter_state_static(&state, key, val);
+    }
+
+    for (i = 0; i < snap.family_count; i++) {
+        snapshot_family_get(&snap, i, &family);
+        if (family.label_count > max_labels) {
+            max_labels = family.label_count;
+        }
+    }
+    /* the keys of a family, then the values of its current series */
+    labels = malloc(((size_t)max_labels * 2 + 1) * sizeof(char *));
+    refs = malloc(((size_t)max_labels + 1) * sizeof(uint32_t));
+    if (labels == NULL || refs == NULL) {
+        ret = -1;
+    }
+
+    for (i = 0; i < snap.family_count && ret == 0; i++) {
+        snapshot_family_get(&snap, i, &family);
+        ret = snapshot_decode_family(cmt, &snap, &family, &state, labels, refs);
+    }
+    free(labels);
+    free(refs);
+    cmetrics_msgpack_filter_state_destroy(&state);
+
+    return ret;
+}
+
+/*
+ * Aggregate the values of every family named 'fqname' with one of the
+ * CMETRICS_AGGREGATE_* operations, reading only the family table and the
+ * value array. Returns -1 on an invalid snapshot, 1 when no series matched
+ * (the result is then 0 for :count) and 0 otherwise.
+ */
+int
+cmetrics_snapshot_aggregate(const char *buf, size_t size, const char *fqname, int op,
+                            double *result)
+{
+    uint32_t i;
+    uint64_t j;
+    uint64_t count = 0;
+    double value;
+    double acc = 0;
+    struct snapshot snap;
+    struct snapshot_family family;
+
+    if (snapshot_open(&snap, buf, size, CMT_FALSE) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < snap.family_count; i++) {
+        snapshot_family_get(&snap, i, &family);
+        if (strcmp(snapshot_string(&snap, family.fqname), fqname) != 0) {
+            continue;
+        }
+        for (j = family.first_series; j < family.first_series + family.series_count; j++) {
+            value = get_double(snap.values + j * 8);
+            switch (op) {
+            case CMETRICS_AGGREGATE_MAX:
+                acc = count == 0 || value > acc ? value : acc;
+                break;
+            case CMETRICS_AGGREGATE_MIN:
+                acc = count == 0 || value < acc ? value : acc;
+                break;
+            default:
+                acc += value;
+                break;
+            }
+            count++;
+        }
+    }
+
+    if (op == CMETRICS_AGGREGATE_COUNT) {
+        *result = (double)count;
+    }
+    else if (op == CMETRICS_AGGREGATE_AVG && count > 0) {
+        *result = acc / (double)count;
+    }
+    else {
+        *result = acc;
+    }
+
+    return count > 0 ? 0 : 1;
+}
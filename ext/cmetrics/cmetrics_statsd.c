@@ -0,0 +1,854 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/*
+ * StatsD / DogStatsD line ingestion:
+ *
+ *   name:value[:value...]|type[|@sample_rate][|#tag:value,tag...]
+ *
+ * Series are cached by their raw name, type and tags, so that a known
+ * series costs one hash lookup and no tag parsing. Families are cached by
+ * their sanitized name: the first line of a name fixes its type, and its
+ * label keys are the sorted tag keys seen so far for that name. A line
+ * with a new tag key recreates the family with the wider key set and
+ * moves its series over, with "" for the new key. Tags a line does not
+ * have are set to "", lines with another type are rejected.
+ */
+
+/* longest value token, "-1.7976931348623157e+308" fits */
+#define STATSD_NUMBER_MAX 64
+
+struct statsd_tag {
+    char *key;
+    char *value;
+};
+
+struct statsd_series;
+
+struct statsd_family {
+    int type;
+    struct cmt_map *map;              /* of a cmt_counter, cmt_gauge or cmt_histogram */
+    int key_count;
+    char **keys;                      /* sorted */
+    size_t series_count;
+    size_t series_capacity;
+    struct statsd_series **series;
+};
+
+struct statsd_series {
+    struct statsd_family *family;
+    struct cmt_metric *metric;        /* NULL until a histogram is observed */
+    char **labels;                    /* values of the family keys */
+};
+
+struct cmetrics_statsd {
+    struct cmt *cmt;
+    struct cmetrics_cache *cache;
+    double *buckets;
+    size_t bucket_count;
+    uint64_t rejected;
+
+    /* raw name, type and tags -> struct statsd_series */
+    struct cmetrics_table series;
+    /* sanitized name -> struct statsd_family */
+    struct cmetrics_table families;
+    struct cmetrics_key key;
+
+    /* tags and sanitized strings of the line being parsed */
+    struct statsd_tag *tags;
+    size_t tag_capacity;
+    char *scratch;
+    size_t scratch_capacity;
+    char **label_keys;
+    char **label_values;
+};
+
+static const char *
+find_char(const char *p, const char *end, char c)
+{
+    const char *found = memchr(p, c, end - p);
+
+    return found ? found : end;
+}
+
+static int
+is_name_char(int c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == ':';
+}
+
+/*
+ * Copy [p, end) into 'out' replacing the characters Prometheus does not
+ * accept with '_'. Returns the byte after the NUL terminator.
+ */
+static char *
+sanitize(char *out, const char *p, const char *end, int allow_colon)
+{
+    if (p < end && *p >= '0' && *p <= '9') {
+        *out++ = '_';
+    }
+    for (; p < end; p++) {
+        *out++ = (is_name_char(*p) && (allow_colon || *p != ':')) ? *p : '_';
+    }
+    *out++ = '\0';
+
+    return out;
+}
+
+static int
+parse_double(const char *p, const char *end, double *value)
+{
+    char buf[STATSD_NUMBER_MAX];
+    char *parsed;
+    size_t length = end - p;
+
+    if (length == 0 || length >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, p, length);
+    buf[length] = '\0';
+    *value = strtod(buf, &parsed);
+
+    return parsed == buf + length ? 0 : -1;
+}
+
+static int
+statsd_type(const char *p, const char *end)
+{
+    size_t length = end - p;
+
+    if (length == 1 && *p == 'c') {
+        return CMT_COUNTER;
+    }
+    else if (length == 1 && *p == 'g') {
+        return CMT_GAUGE;
+    }
+    else if ((length == 2 && memcmp(p, "ms", 2) == 0) ||
+             (length == 1 && (*p == 'h' || *p == 'd'))) {
+        return CMT_HISTOGRAM;
+    }
+
+    /* sets and unknown types */
+    return -1;
+}
+
+static int
+reserve(struct cmetrics_statsd *statsd, size_t tag_count, size_t bytes)
+{
+    char *tmp_scratch;
+    struct statsd_tag *tmp_tags;
+    char **tmp_keys;
+    char **tmp_values;
+
+    if (bytes > statsd->scratch_capacity) {
+        tmp_scratch = realloc(statsd->scratch, bytes);
+        if (tmp_scratch == NULL) {
+            return -1;
+        }
+        statsd->scratch = tmp_scratch;
+        statsd->scratch_capacity = bytes;
+    }
+
+    if (tag_count > statsd->tag_capacity) {
+        tmp_tags = realloc(statsd->tags, tag_count * sizeof(struct statsd_tag));
+        if (tmp_tags == NULL) {
+            return -1;
+        }
+        statsd->tags = tmp_tags;
+        tmp_keys = realloc(statsd->label_keys, tag_count * sizeof(char *));
+        if (tmp_keys == NULL) {
+            return -1;
+        }
+        statsd->label_keys = tmp_keys;
+        tmp_values = realloc(statsd->label_values, tag_count * sizeof(char *));
+        if (tmp_values == NULL) {
+            return -1;
+        }
+        statsd->label_values = tmp_values;
+        statsd->tag_capacity = tag_count;
+    }
+
+    return 0;
+}
+
+/* Parse and sort 'tag:value,tag' into statsd->tags; returns the count or -1. */
+static int
+parse_tags(struct cmetrics_statsd *statsd, const char *p, const char *end,
+           char *out)
+{
+    int i;
+    int j;
+    int count = 0;
+    const char *tag_end;
+    const char *colon;
+    struct statsd_tag tmp;
+
+    while (p < end) {
+        tag_end = find_char(p, end, ',');
+        if (tag_end > p) {
+            colon = find_char(p, tag_end, ':');
+            statsd->tags[count].key = out;
+            out = sanitize(out, p, colon, CMT_FALSE);
+            statsd->tags[count].value = out;
+            if (colon < tag_end) {
+                memcpy(out, colon + 1, tag_end - colon - 1);
+                out += tag_end - colon - 1;
+            }
+            *out++ = '\0';
+            count++;
+        }
+        p = tag_end < end ? tag_end + 1 : end;
+    }
+
+    /* the same tags in any order belong to the same family */
+    for (i = 1; i < count; i++) {
+        tmp = statsd->tags[i];
+        for (j = i; j > 0 && strcmp(statsd->tags[j - 1].key, tmp.key) > 0; j--) {
+            statsd->tags[j] = statsd->tags[j - 1];
+        }
+        statsd->tags[j] = tmp;
+    }
+
+    return count;
+}
+
+/* Copy 'count' strings into one allocation: the pointers, then the strings. */
+static char **
+strings_copy(char **strings, int count)
+{
+    int i;
+    size_t size = count * sizeof(char *);
+    size_t length;
+    char **copy;
+    char *out;
+
+    for (i = 0; i < count; i++) {
+        size += strlen(strings[i]) + 1;
+    }
+    copy = malloc(size > 0 ? size : 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    out = (char *)(copy + count);
+    for (i = 0; i < count; i++) {
+        length = strlen(strings[i]) + 1;
+        memcpy(out, strings[i], length);
+        copy[i] = out;
+        out += length;
+    }
+
+    return copy;
+}
+
+static struct cmt_map *
+family_map_create(struct cmetrics_statsd *statsd, int type, char *name,
+                  int count, char **keys)
+{
+    struct cmt_opts opts;
+    struct cmt_histogram *histogram;
+    struct cmt_histogram_buckets *buckets;
+
+    if (type == CMT_HISTOGRAM) {
+        buckets = cmt_histogram_buckets_create_size(statsd->buckets, statsd->bucket_count);
+        if (buckets == NULL) {
+            return NULL;
+        }
+        histogram = cmt_histogram_create(statsd->cmt, "", "", name, name, buckets, count, keys);
+        return histogram ? histogram->map : NULL;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.ns = "";
+    opts.subsystem = "";
+    opts.name = name;
+    opts.description = name;
+
+    return cmetrics_context_family_create(statsd->cmt, type, &opts, count, keys);
+}
+
+/* Destroy the cmt family of a map, which unlinks it from its context. */
+static void
+family_map_destroy(struct cmt_map *map)
+{
+    switch (map->type) {
+    case CMT_COUNTER:
+        cmt_counter_destroy(map->parent);
+        break;
+    case CMT_GAUGE:
+        cmt_gauge_destroy(map->parent);
+        break;
+    case CMT_HISTOGRAM:
+        cmt_histogram_destroy(map->parent);
+        break;
+    }
+}
+
+static void
+family_destroy(struct statsd_family *family)
+{
+    free(family->keys);
+    free(family->series);
+    free(family);
+}
+
+/* Create a family with the distinct keys of the sorted tags of the line. */
+static struct statsd_family *
+family_create(struct cmetrics_statsd *statsd, int type, char *name, int count)
+{
+    int i;
+    int key_count = 0;
+    struct statsd_family *family;
+
+    family = calloc(1, sizeof(struct statsd_family));
+    if (family == NULL) {
+        return NULL;
+    }
+    family->type = type;
+
+    for (i = 0; i < count; i++) {
+        if (key_count == 0 ||
+            strcmp(statsd->label_keys[key_count - 1], statsd->tags[i].key) != 0) {
+            statsd->label_keys[key_count++] = statsd->tags[i].key;
+        }
+    }
+    family->keys = strings_copy(statsd->label_keys, key_count);
+    if (family->keys == NULL) {
+        family_destroy(family);
+        return NULL;
+    }
+    family->key_count = key_count;
+
+    family->map = family_map_create(statsd, type, name, key_count, family->keys);
+    if (family->map == NULL) {
+        family_destroy(family);
+        return NULL;
+    }
+
+    return family;
+}
+
+static int
+family_add_series(struct statsd_family *family, struct statsd_series *series)
+{
+    size_t capacity;
+    struct statsd_series **tmp;
+
+    if (family->series_count == family->series_capacity) {
+        capacity = family->series_capacity > 0 ? family->series_capacity * 2 : 4;
+        tmp = realloc(family->series, capacity * sizeof(struct statsd_series *));
+        if (tmp == NULL) {
+            return -1;
+        }
+        family->series = tmp;
+        family->series_capacity = capacity;
+    }
+    family->series[family->series_count++] = series;
+
+    return 0;
+}
+
+/* Copy the value of 'metric' into the series of 'map' with the given labels. */
+static struct cmt_metric *
+metric_copy(struct cmetrics_statsd *statsd, struct cmt_metric *metric,
+            struct cmt_map *map, int count, char **labels, uint64_t *buckets)
+{
+    size_t i;
+    uint64_t timestamp = cmt_metric_get_timestamp(metric);
+    struct cmt_metric *copy;
+
+    if (map->type != CMT_HISTOGRAM) {
+        copy = cmt_map_metric_get(map->opts, map, count, labels, CMT_TRUE);
+        if (copy != NULL) {
+            cmt_metric_set(copy, timestamp, cmt_metric_get_value(metric));
+        }
+        return copy;
+    }
+
+    for (i = 0; i <= statsd->bucket_count; i++) {
+        buckets[i] = cmt_metric_hist_get_value(metric, (int)i);
+    }
+    if (cmt_histogram_set_default(map->parent, timestamp, buckets,
+                                  cmt_metric_hist_get_sum_value(metric),
+                                  cmt_metric_hist_get_count_value(metric),
+                                  count, labels) != 0) {
+        return NULL;
+    }
+
+    return cmt_map_metric_get(map->opts, map, count, labels, CMT_FALSE);
+}
+
+/*
+ * Recreate the family with the union of its keys and the tag keys of the
+ * line being parsed, and move its series over with "" for the new keys.
+ * The family is left untouched on failure.
+ */
+static int
+family_widen(struct cmetrics_statsd *statsd, struct statsd_family *family, int count)
+{
+    int i = 0;
+    int j = 0;
+    int k;
+    int cmp;
+    int key_count = 0;
+    int *positions;
+    size_t s;
+    char **keys = NULL;
+    char **values = statsd->label_values;
+    char ***labels = NULL;
+    uint64_t *buckets = NULL;
+    struct cmt_map *map = NULL;
+    struct cmt_metric **metrics = NULL;
+    struct statsd_series *series;
+
+    /* the key index in the old family of every key, -1 for the new ones */
+    positions = malloc((family->key_count + count) * sizeof(int));
+    if (positions == NULL) {
+        return -1;
+    }
+    while (i < family->key_count || j < count) {
+        if (j > 0 && j < count && strcmp(statsd->tags[j].key, statsd->tags[j - 1].key) == 0) {
+            j++;
+            continue;
+        }
+        cmp = i == family->key_count ? 1 :
+              j == count ? -1 : strcmp(family->keys[i], statsd->tags[j].key);
+        if (cmp <= 0) {
+            positions[key_count] = i;
+            statsd->label_keys[key_count++] = family->keys[i++];
+            j += cmp == 0;
+        }
+        else {
+            positions[key_count] = -1;
+            statsd->label_keys[key_count++] = statsd->tags[j++].key;
+        }
+    }
+
+    keys = strings_copy(statsd->label_keys, key_count);
+    labels = calloc(family->series_count + 1, sizeof(char **));
+    metrics = calloc(family->series_count + 1, sizeof(struct cmt_metric *));
+    buckets = malloc((statsd->bucket_count + 1) * sizeof(uint64_t));
+    if (keys == NULL || labels == NULL || metrics == NULL || buckets == NULL) {
+        goto error;
+    }
+    map = family_map_create(statsd, family->type, family->map->opts->name, key_count, keys);
+    if (map == NULL) {
+        goto error;
+    }
+
+    for (s = 0; s < family->series_count; s++) {
+        series = family->series[s];
+        for (k = 0; k < key_count; k++) {
+            values[k] = positions[k] < 0 ? "" : series->labels[positions[k]];
+        }
+        labels[s] = strings_copy(values, key_count);
+        if (labels[s] == NULL) {
+            goto error;
+        }
+        if (series->metric != NULL) {
+            metrics[s] = metric_copy(statsd, series->metric, map, key_count, labels[s], buckets);
+            if (metrics[s] == NULL) {
+                goto error;
+            }
+        }
+    }
+
+    for (s = 0; s < family->series_count; s++) {
+        series = family->series[s];
+        if (series->metric != NULL) {
+            cmetrics_cache_forget_metric(statsd->cache, series->metric);
+            series->metric = metrics[s];
+            cmetrics_cache_touch_metric(statsd->cache, series->metric);
+        }
+        free(series->labels);
+        series->labels = labels[s];
+    }
+    family_map_destroy(family->map);
+    family->map = map;
+    free(family->keys);
+    family->keys = keys;
+    family->key_count = key_count;
+
+    free(positions);
+    free(labels);
+    free(metrics);
+    free(buckets);
+
+    return 0;
+
+error:
+    if (map != NULL) {
+        family_map_destroy(map);
+    }
+    for (s = 0; labels != NULL && s < family->series_count; s++) {
+        free(labels[s]);
+    }
+    free(positions);
+    free(keys);
+    free(labels);
+    free(metrics);
+    free(buckets);
+
+    return -1;
+}
+
+/*
+ * Lay the sorted tags of the line out in the order of the family keys.
+ * Returns -1 when the family lacks one of the tag keys.
+ */
+static int
+family_layout(struct cmetrics_statsd *statsd, struct statsd_family *family, int count)
+{
+    int i;
+    int j;
+    char **values = statsd->label_values;
+
+    for (i = 0; i < family->key_count; i++) {
+        values[i] = "";
+    }
+    for (i = 0, j = 0; j < count; j++) {
+        while (i < family->key_count && strcmp(family->keys[i], statsd->tags[j].key) < 0) {
+            i++;
+        }
+        if (i == family->key_count || strcmp(family->keys[i], statsd->tags[j].key) != 0) {
+            return -1;
+        }
+        values[i] = statsd->tags[j].value;
+    }
+
+    return 0;
+}
+
+/* Returns 0, -1 when the line does not fit its family and -2 on errors. */
+static int
+series_create(struct cmetrics_statsd *statsd, int type,
+              const char *name, const char *name_end,
+              const char *tags, const char *tags_end,
+              struct statsd_series **out_series)
+{
+    int count;
+    int created;
+    char *out;
+    char *family_name;
+    void **slot;
+    struct statsd_family *family;
+    struct statsd_series *series;
+
+    /* every tag gains at most a '_' prefix and two terminators */
+    if (reserve(statsd, (tags_end - tags) / 2 + 1,
+                (name_end - name) + 2 + (tags_end - tags) * 2 + 16) != 0) {
+        return -2;
+    }
+    family_name = statsd->scratch;
+    out = sanitize(family_name, name, name_end, CMT_TRUE);
+    count = parse_tags(statsd, tags, tags_end, out);
+
+    slot = cmetrics_table_lookup(&statsd->families, family_name, strlen(family_name),
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -2;
+    }
+    if (*slot == NULL) {
+        *slot = family_create(statsd, type, family_name, count);
+        if (*slot == NULL) {
+            return -2;
+        }
+    }
+    family = *slot;
+    if (family->type != type) {
+        return -1;
+    }
+
+    if (reserve(statsd, family->key_count + count + 1, 0) != 0) {
+        return -2;
+    }
+    if (family_layout(statsd, family, count) != 0) {
+        if (family_widen(statsd, family, count) != 0) {
+            return -2;
+        }
+        family_layout(statsd, family, count);
+    }
+
+    series = calloc(1, sizeof(struct statsd_series));
+    if (series == NULL) {
+        return -2;
+    }
+    series->family = family;
+    series->labels = strings_copy(statsd->label_values, family->key_count);
+    if (series->labels == NULL || family_add_series(family, series) != 0) {
+        free(series->labels);
+        free(series);
+        return -2;
+    }
+
+    /* histogram series are created by their first observation */
+    if (type != CMT_HISTOGRAM) {
+        series->metric = cmt_map_metric_get(family->map->opts, family->map, family->key_count,
+                                            family->key_count > 0 ? series->labels : NULL,
+                                            CMT_TRUE);
+        if (series->metric == NULL) {
+            family->series_count--;
+            free(series->labels);
+            free(series);
+            return -2;
+        }
+    }
+    *out_series = series;
+
+    return 0;
+}
+
+/* Returns the number of applied values, -1 to skip the line and -2 on errors. */
+static int
+ingest_line(struct cmetrics_statsd *statsd, const char *p, const char *end, uint64_t now)
+{
+    int ret;
+    int type;
+    int count;
+    int created;
+    int applied = 0;
+    void **slot;
+    double value;
+    double rate = 1.0;
+    const char *name_end;
+    const char *values;
+    const char *values_end;
+    const char *type_start;
+    const char *type_end;
+    const char *section;
+    const char *section_end;
+    const char *tags = end;
+    const char *tags_end = end;
+    const char *value_end;
+    struct cmt_map *map;
+    struct statsd_series *series;
+
+    name_end = find_char(p, end, ':');
+    values_end = find_char(name_end, end, '|');
+    if (name_end == p || name_end >= end || values_end >= end) {
+        return -1;
+    }
+    values = name_end + 1;
+
+    type_start = values_end + 1;
+    type_end = find_char(type_start, end, '|');
+    type = statsd_type(type_start, type_end);
+    if (type < 0) {
+        return -1;
+    }
+
+    section = type_end;
+    while (section < end) {
+        section++;
+        section_end = find_char(section, end, '|');
+        if (section < section_end && *section == '@') {
+            if (parse_double(section + 1, section_end, &rate) != 0 || rate <= 0 || rate > 1) {
+                return -1;
+            }
+        }
+        else if (section < section_end && *section == '#') {
+            tags = section + 1;
+            tags_end = section_end;
+        }
+        section = section_end;
+    }
+
+    /* names hold no ':' and types no '|', so the key is unambiguous */
+    statsd->key.length = 0;
+    if (cmetrics_key_append(&statsd->key, p, name_end - p + 1) != 0 ||
+        cmetrics_key_append(&statsd->key, type_start, type_end - type_start) != 0 ||
+        cmetrics_key_append(&statsd->key, "|", 1) != 0 ||
+        cmetrics_key_append(&statsd->key, tags, tags_end - tags) != 0) {
+        return -2;
+    }
+    slot = cmetrics_table_lookup(&statsd->series, statsd->key.buf, statsd->key.length,
+                                 CMT_TRUE, &created);
+    if (slot == NULL) {
+        return -2;
+    }
+    if (*slot == NULL) {
+        ret = series_create(statsd, type, p, name_end, tags, tags_end, &series);
+        if (ret != 0) {
+            return ret;
+        }
+        *slot = series;
+    }
+    series = *slot;
+    map = series->family->map;
+    count = series->family->key_count;
+
+    /* DogStatsD packs several values of a series in one line */
+    while (values < values_end) {
+        value_end = find_char(values, values_end, ':');
+        if (parse_double(values, value_end, &value) == 0) {
+            switch (map->type) {
+            case CMT_COUNTER:
+                cmt_metric_add(series->metric, now, value / rate);
+                break;
+            case CMT_GAUGE:
+                /* a signed value is a delta */
+                if (*values == '+' || *values == '-') {
+                    cmt_metric_add(series->metric, now, value);
+                }
+                else {
+                    cmt_metric_set(series->metric, now, value);
+                }
+                break;
+            default:
+                if (cmt_histogram_observe(map->parent, now, value, count, series->labels) != 0) {
+                    return -2;
+                }
+                break;
+            }
+            applied++;
+        }
+        values = value_end < values_end ? value_end + 1 : values_end;
+    }
+
+    if (applied > 0 && series->metric == NULL) {
+        series->metric = count > 0 ?
+            cmt_map_metric_get(map->opts, map, count, series->labels, CMT_FALSE) : &map->metric;
+    }
+    if (applied > 0) {
+        if (series->metric != NULL) {
+            cmetrics_cache_touch_metric(statsd->cache, series->metric);
+        }
+        else {
+            cmetrics_cache_touch(statsd->cache);
+        }
+    }
+
+    return applied;
+}
+
+/*
+ * Create a StatsD ingester writing into 'cmt'. Updated series are stamped
+ * in 'cache', see cmetrics_cache_touch_metric().
+ */
+struct cmetrics_statsd *
+cmetrics_statsd_create(struct cmt *cmt, struct cmetrics_cache *cache,
+                       double *buckets, size_t bucket_count)
+{
+    struct cmetrics_statsd *statsd;
+
+    statsd = calloc(1, sizeof(struct cmetrics_statsd));
+    if (statsd == NULL) {
+        return NULL;
+    }
+    statsd->cmt = cmt;
+    statsd->cache = cache;
+    statsd->buckets = malloc(bucket_count * sizeof(double));
+    if (statsd->buckets == NULL ||
+        cmetrics_table_init(&statsd->series, 256) != 0 ||
+        cmetrics_table_init(&statsd->families, 64) != 0) {
+        cmetrics_statsd_destroy(statsd);
+        return NULL;
+    }
+    memcpy(statsd->buckets, buckets, bucket_count * sizeof(double));
+    statsd->bucket_count = bucket_count;
+
+    return statsd;
+}
+
+void
+cmetrics_statsd_destroy(struct cmetrics_statsd *statsd)
+{
+    size_t i;
+
+    if (statsd == NULL) {
+        return;
+    }
+
+    if (statsd->series.entries != NULL) {
+        for (i = 0; i < statsd->series.size; i++) {
+            if (statsd->series.entries[i].key != NULL &&
+                statsd->series.entries[i].value != NULL) {
+                free(((struct statsd_series *)statsd->series.entries[i].value)->labels);
+                free(statsd->series.entries[i].value);
+            }
+        }
+    }
+    if (statsd->families.entries != NULL) {
+        for (i = 0; i < statsd->families.size; i++) {
+            if (statsd->families.entries[i].key != NULL &&
+                statsd->families.entries[i].value != NULL) {
+                family_destroy(statsd->families.entries[i].value);
+            }
+        }
+    }
+    cmetrics_table_destroy(&statsd->series);
+    cmetrics_table_destroy(&statsd->families);
+    free(statsd->key.buf);
+    free(statsd->buckets);
+    free(statsd->tags);
+    free(statsd->scratch);
+    free(statsd->label_keys);
+    free(statsd->label_values);
+    free(statsd);
+}
+
+/*
+ * Apply every line of a datagram batch. Malformed lines, sets, unknown
+ * types and lines which do not match the type of their family are
+ * rejected, see cmetrics_statsd_rejected().
+ *
+ * Returns the number of applied values, or -1 on allocation failures.
+ */
+long
+cmetrics_statsd_ingest(struct cmetrics_statsd *statsd, const char *buffer, size_t size,
+                       uint64_t now)
+{
+    int ret;
+    long applied = 0;
+    const char *p = buffer;
+    const char *end = buffer + size;
+    const char *line_end;
+    const char *value_end;
+
+    while (p < end) {
+        /* memchr is vectorized by the C library */
+        line_end = find_char(p, end, '\n');
+        value_end = line_end > p && line_end[-1] == '\r' ? line_end - 1 : line_end;
+        if (value_end > p) {
+            ret = ingest_line(statsd, p, value_end, now);
+            if (ret == -2) {
+                return -1;
+            }
+            else if (ret > 0) {
+                applied += ret;
+            }
+            else {
+                statsd->rejected++;
+            }
+        }
+        p = line_end < end ? line_end + 1 : end;
+    }
+
+    return applied;
+}
+
+/* The number of lines rejected since the ingester was created. */
+uint64_t
+cmetrics_statsd_rejected(struct cmetrics_statsd *statsd)
+{
+    return statsd->rejected;
+}
@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  CMetrics-Ruby
+ *  =============
+ *  Copyright 2021 Hiroshi Hatake <hatake@calyptia.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cmetrics_c.h"
+
+/*
+ * Open addressing hash table with byte string keys. Keys are copied into
+ * the table, values are opaque pointer sized slots owned by the caller.
+ */
+
+#define TABLE_MIN_SIZE 16
+
+static inline uint64_t
+hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+uint64_t
+cmetrics_hash_bytes(const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)length;
+    uint64_t chunk;
+
+    while (length >= 8) {
+        memcpy(&chunk, p, 8);
+        h = hash_mix(h ^ chunk);
+        p += 8;
+        length -= 8;
+    }
+
+    chunk = 0;
+    memcpy(&chunk, p, length);
+
+    return hash_mix(h ^ chunk);
+}
+
+int
+cmetrics_table_init(struct cmetrics_table *table, size_t capacity)
+{
+    size_t size = TABLE_MIN_SIZE;
+
+    while (size < capacity * 2) {
+        size <<= 1;
+    }
+
+    table->entries = calloc(size, sizeof(struct cmetrics_table_entry));
+    if (table->entries == NULL) {
+        return -1;
+    }
+    table->size = size;
+    table->count = 0;
+
+    return 0;
+}
+
+void
+cmetrics_table_destroy(struct cmetrics_table *table)
+{
+    size_t i;
+
+    if (table->entries == NULL) {
+        return;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        free(table->entries[i].key);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+/* Remove every entry and keep the slots; values are the caller's. */
+void
+cmetrics_table_clear(struct cmetrics_table *table)
+{
+    size_t i;
+
+    if (table->entries == NULL) {
+        return;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        free(table->entries[i].key);
+    }
+    memset(table->entries, 0, table->size * sizeof(struct cmetrics_table_entry));
+    table->count = 0;
+}
+
+static struct cmetrics_table_entry *
+table_find_slot(struct cmetrics_table_entry *entries, size_t size,
+                uint64_t hash, const void *key, size_t length)
+{
+    size_t mask = size - 1;
+    size_t i = (size_t)hash & mask;
+    struct cmetrics_table_entry *entry;
+
+    for (;;) {
+        entry = &entries[i];
+        if (entry->key == NULL) {
+            return entry;
+        }
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->key, key, length) == 0) {
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int
+table_grow(struct cmetrics_table *table)
+{
+    size_t i;
+    size_t size = table->size * 2;
+    struct cmetrics_table_entry *entries;
+    struct cmetrics_table_entry *entry;
+
+    entries = calloc(size, sizeof(struct cmetrics_table_entry));
+    if (entries == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        if (table->entries[i].key == NULL) {
+            continue;
+        }
+        entry = table_find_slot(entries, size, table->entries[i].hash,
+                                table->entries[i].key, table->entries[i].length);
+        *entry = table->entries[i];
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->size = size;
+
+    return 0;
+}
+
+/*
+ * Look up 'key'. When it is missing and 'create' is set, insert it with a
+ * NULL value. Returns the value slot, or NULL when the key is missing (or
+ * could not be inserted).
+ */
+void **
+cmetrics_table_lookup(struct cmetrics_table *table, const void *key, size_t length,
+                      int create, int *created)
+{
+    uint64_t hash;
+    struct cmetrics_table_entry *entry;
+
+    if (created) {
+        *created = CMT_FALSE;
+    }
+
+    hash = cmetrics_hash_bytes(key, length);
+    entry = table_find_slot(table->entries, table->size, hash, key, length);
+    if (entry->key != NULL) {
+        return &entry->value;
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    /* keep the load factor under 1/2 */
+    if ((table->count + 1) * 2 > table->size) {
+        if (table_grow(table) != 0) {
+            return NULL;
+        }
+        entry = table_find_slot(table->entries, table->size, hash, key, length);
+    }
+
+    /* never store a NULL key, it marks empty slots */
+    entry->key = malloc(length > 0 ? length : 1);
+    if (entry->key == NULL) {
+        return NULL;
+    }
+    memcpy(entry->key, key, length);
+    entry->length = length;
+    entry->hash = hash;
+    entry->value = NULL;
+    table->count++;
+
+    if (created) {
+        *created = CMT_TRUE;
+    }
+
+    return &entry->value;
+}
+
+/*
+ * Remove 'key' and return its value, or NULL when it is missing. The
+ * entries probed after it are shifted back, so no tombstones are left.
+ */
+void *
+cmetrics_table_remove(struct cmetrics_table *table, const void *key, size_t length)
+{
+    size_t mask = table->size - 1;
+    size_t hole;
+    size_t i;
+    size_t home;
+    void *value;
+    struct cmetrics_table_entry *entry;
+
+    if (table->entries == NULL) {
+        return NULL;
+    }
+
+    entry = table_find_slot(table->entries, table->size, cmetrics_hash_bytes(key, length),
+                            key, length);
+    if (entry->key == NULL) {
+        return NULL;
+    }
+    value = entry->value;
+    free(entry->key);
+    table->count--;
+
+    hole = i = entry - table->entries;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (table->entries[i].key == NULL) {
+            break;
+        }
+        /* an entry may fill the hole unless its home slot lies in (hole, i] */
+        home = (size_t)table->entries[i].hash & mask;
+        if (hole < i ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            table->entries[hole] = table->entries[i];
+            hole = i;
+        }
+    }
+    memset(&table->entries[hole], 0, sizeof(struct cmetrics_table_entry));
+
+    return value;
+}
+
+/*
+ * Serialize strings into an unambiguous table key: each string is
+ * prefixed with its length.
+ */
+int
+cmetrics_key_append(struct cmetrics_key *key, const char *str, size_t length)
+{
+    size_t needed = key->length + sizeof(uint32_t) + length;
+    uint32_t prefix = (uint32_t)length;
+    char *tmp;
+
+    if (needed > key->capacity) {
+        size_t capacity = key->capacity > 0 ? key->capacity : 64;
+
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        tmp = realloc(key->buf, capacity);
+        if (tmp == NULL) {
+            return -1;
+        }
+        key->buf = tmp;
+        key->capacity = capacity;
+    }
+
+    memcpy(key->buf + key->length, &prefix, sizeof(prefix));
+    memcpy(key->buf + key->length + sizeof(prefix), str, length);
+    key->length = needed;
+
+    return 0;
+}
+
+int
+cmetrics_buffer_append(struct cmetrics_buffer *buffer, const void *data, size_t length)
+{
+    size_t capacity;
+    char *tmp;
+
+    if (length > buffer->capacity - buffer->size) {
+        capacity = buffer->capacity > 0 ? buffer->capacity : 256;
+        while (capacity - buffer->size < length) {
+            capacity *= 2;
+        }
+        tmp = realloc(buffer->data, capacity);
+        if (tmp == NULL) {
+            return -1;
+        }
+        buffer->data = tmp;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += length;
+
+    return 0;
+}
+
+void
+cmetrics_buffer_destroy(struct cmetrics_buffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
@@ -21,11 +21,12 @@
 
 VALUE rb_cUntyped;
 
+static void untyped_mark(void* ptr);
 static void untyped_free(void* ptr);
 
 static const rb_data_type_t rb_cmetrics_untyped_type = { "cmetrics/untyped",
                                                          {
-                                                             0,
+                                                             untyped_mark,
                                                              untyped_free,
                                                              0,
                                                          },
@@ -50,12 +51,21 @@ const struct CMetricsUntyped *cmetrics_untyped_get_ptr(VALUE self)
     return cmetricsUntyped;
 }
 
+static void
+untyped_mark(void* ptr)
+{
+    struct CMetricsUntyped* cmetricsUntyped = (struct CMetricsUntyped*)ptr;
+
+    cmetrics_cache_mark(&cmetricsUntyped->cache);
+}
+
 static void
 untyped_free(void* ptr)
 {
     struct CMetricsUntyped* cmetricsUntyped = (struct CMetricsUntyped*)ptr;
 
     if (cmetricsUntyped) {
+        cmetrics_cache_destroy(&cmetricsUntyped->cache);
         if (cmetricsUntyped->untyped) {
             cmt_untyped_destroy(cmetricsUntyped->untyped);
         }
@@ -74,6 +84,7 @@ rb_cmetrics_untyped_alloc(VALUE klass)
     struct CMetricsUntyped* cmetricsUntyped;
     obj = TypedData_Make_Struct(
             klass, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
+    cmetrics_cache_init(&cmetricsUntyped->cache);
     return obj;
 }
 
@@ -116,6 +127,8 @@ rb_cmetrics_untyped_create(int argc, VALUE* argv, VALUE self)
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
+    cmetrics_cache_touch(&cmetricsUntyped->cache);
+
     rb_scan_args(argc, argv, "41", &rb_namespace, &rb_subsystem, &rb_name, &rb_help, &rb_labels);
 
     Check_Type(rb_namespace, T_STRING);
@@ -274,9 +287,10 @@ rb_cmetrics_untyped_set(int argc, VALUE* argv, VALUE self)
     uint64_t ts;
     int ret = 0;
     double value = 0;
+    char *label;
     char **labels = NULL;
     int labels_count = 0;
-    VALUE tmp_label;
+    VALUE tmp_label = 0;
     long i;
 
     TypedData_Get_Struct(
@@ -303,13 +317,15 @@ rb_cmetrics_untyped_set(int argc, VALUE* argv, VALUE self)
     if (!NIL_P(rb_labels)) {
         switch(TYPE(rb_labels)) {
         case T_STRING:
-            labels = (char *[]) { StringValuePtr(rb_labels) };
+            label = StringValuePtr(rb_labels);
+            labels = &label;
             labels_count = 1;
             ret = cmt_untyped_set(cmetricsUntyped->untyped, ts, value,
                                   labels_count, labels);
             break;
         case T_SYMBOL:
-            labels = (char *[]) { RSTRING_PTR(rb_sym2str(rb_labels)) };
+            label = RSTRING_PTR(rb_sym2str(rb_labels));
+            labels = &label;
             labels_count = 1;
             ret = cmt_untyped_set(cmetricsUntyped->untyped, ts, value,
                                   labels_count, labels);
@@ -334,8 +350,6 @@ rb_cmetrics_untyped_set(int argc, VALUE* argv, VALUE self)
             ret = cmt_untyped_set(cmetricsUntyped->untyped, ts, value,
                                   labels_count, labels);
 
-            ALLOCV_END(tmp_label);
-
             break;
         default:
             rb_raise(rb_eArgError, "labels should be String, Symbol or Array class instance.");
@@ -345,6 +359,10 @@ rb_cmetrics_untyped_set(int argc, VALUE* argv, VALUE self)
                               labels_count, labels);
     }
 
+    cmetrics_cache_touch_series(&cmetricsUntyped->cache, cmetricsUntyped->untyped->map,
+                                labels_count, labels);
+    ALLOCV_END(tmp_label);
+
     if (ret == 0) {
         return Qtrue;
     } else {
@@ -368,6 +386,8 @@ rb_cmetrics_untyped_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
+    cmetrics_cache_touch(&cmetricsUntyped->cache);
+
     if (!cmetricsUntyped->untyped) {
         rb_raise(rb_eRuntimeError, "Create untyped with CMetrics::Untyped#create first.");
     }
@@ -403,83 +423,184 @@ rb_cmetrics_untyped_add_label(VALUE self, VALUE rb_key, VALUE rb_value)
 }
 
 static VALUE
-rb_cmetrics_untyped_to_prometheus(VALUE self)
+rb_cmetrics_untyped_to_prometheus(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsUntyped* cmetricsUntyped;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    prom = cmt_encode_prometheus_create(cmetricsUntyped->instance, CMT_TRUE);
+    return cmetrics_export_prometheus(cmetricsUntyped->instance, &cmetricsUntyped->cache, argc, argv);
+}
+
+/*
+ * Reuse the output of #to_prometheus, as a frozen String, until the
+ * untyped is updated.
+ *
+ * @param max_staleness [Float] also reuse it for this many seconds after updates
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_cmetrics_untyped_enable_exposition_cache(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
 
-    str = rb_str_new2(prom);
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    cmt_encode_prometheus_destroy(prom);
+    cmetrics_cache_configure(&cmetricsUntyped->cache, argc, argv);
 
-    return str;
+    return Qnil;
 }
 
 static VALUE
-rb_cmetrics_untyped_to_influx(VALUE self)
+rb_cmetrics_untyped_disable_exposition_cache(VALUE self)
 {
     struct CMetricsUntyped* cmetricsUntyped;
-    cfl_sds_t prom;
-    VALUE str;
 
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    prom = cmt_encode_influx_create(cmetricsUntyped->instance);
+    cmetrics_cache_disable(&cmetricsUntyped->cache);
 
-    str = rb_str_new2(prom);
+    return Qnil;
+}
 
-    cmt_encode_influx_destroy(prom);
+static VALUE
+rb_cmetrics_untyped_to_influx(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    return str;
+    return cmetrics_export_influx(cmetricsUntyped->instance, argc, argv);
 }
 
+/*
+ * Encode as OpenTelemetry (OTLP) protobuf.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String] binary String
+ *
+ */
 static VALUE
-rb_cmetrics_untyped_to_msgpack(VALUE self)
+rb_cmetrics_untyped_to_opentelemetry(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsUntyped* cmetricsUntyped;
-    char *buffer;
-    size_t buffer_size;
-    int ret = 0;
 
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    ret = cmt_encode_msgpack_create(cmetricsUntyped->instance, &buffer, &buffer_size);
+    return cmetrics_export_opentelemetry(cmetricsUntyped->instance, argc, argv);
+}
 
-    if (ret == 0) {
-        return rb_str_new(buffer, buffer_size);
-    } else {
-        return Qnil;
-    }
+/*
+ * Encode as Splunk HTTP Event Collector metric events.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @param host [String] event host
+ * @param index [String] target index
+ * @param source [String] event source
+ * @param source_type [String] event sourcetype
+ * @param compress [Symbol] :gzip, :zstd or :snappy
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_untyped_to_splunk_hec(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
+
+    return cmetrics_export_splunk_hec(cmetricsUntyped->instance, argc, argv);
 }
 
+/*
+ * Encode as CloudWatch embedded metric format (EMF), one JSON document
+ * per line.
+ *
+ * @param buffer [String] overwrite and return this String instead of allocating one
+ * @return [String]
+ *
+ */
 static VALUE
-rb_cmetrics_untyped_to_text(VALUE self)
+rb_cmetrics_untyped_to_cloudwatch_emf(int argc, VALUE *argv, VALUE self)
 {
     struct CMetricsUntyped* cmetricsUntyped;
-    cfl_sds_t buffer;
-    VALUE text;
 
     TypedData_Get_Struct(
             self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    buffer = cmt_encode_text_create(cmetricsUntyped->instance);
-    if (buffer == NULL) {
-        return Qnil;
-    }
+    return cmetrics_export_cloudwatch_emf(cmetricsUntyped->instance, argc, argv);
+}
+
+/*
+ * Encode as a binary snapshot, see CMetrics::Serde.from_snapshot.
+ * Histograms and summaries are not supported.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_untyped_to_snapshot(VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
+
+    return cmetrics_snapshot_encode(cmetricsUntyped->instance);
+}
+
+/*
+ * Encode as OpenMetrics text.
+ *
+ * @return [String]
+ *
+ */
+static VALUE
+rb_cmetrics_untyped_to_openmetrics(VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
 
-    text = rb_str_new2(buffer);
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
+
+    return cmetrics_export_openmetrics(cmetricsUntyped->instance, NULL);
+}
 
-    cfl_sds_destroy(buffer);
+/*
+ * Encode as msgpack.
+ *
+ * @param changed_since [Integer] only encode series updated after this token
+ * @return [String, Array] the buffer, or [buffer, token] with changed_since:
+ *
+ */
+static VALUE
+rb_cmetrics_untyped_to_msgpack(int argc, VALUE *argv, VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
+
+    return cmetrics_export_msgpack(cmetricsUntyped->instance, &cmetricsUntyped->cache, argc, argv);
+}
+
+static VALUE
+rb_cmetrics_untyped_to_text(VALUE self)
+{
+    struct CMetricsUntyped* cmetricsUntyped;
+
+    TypedData_Get_Struct(
+            self, struct CMetricsUntyped, &rb_cmetrics_untyped_type, cmetricsUntyped);
 
-    return text;
+    return cmetrics_export_text(cmetricsUntyped->instance);
 }
 
 void Init_cmetrics_untyped(VALUE rb_mCMetrics)
@@ -497,8 +618,15 @@ void Init_cmetrics_untyped(VALUE rb_mCMetrics)
     rb_define_method(rb_cUntyped, "val=", rb_cmetrics_untyped_set, -1);
     rb_define_method(rb_cUntyped, "value=", rb_cmetrics_untyped_set, -1);
     rb_define_method(rb_cUntyped, "add_label", rb_cmetrics_untyped_add_label, 2);
-    rb_define_method(rb_cUntyped, "to_influx", rb_cmetrics_untyped_to_influx, 0);
-    rb_define_method(rb_cUntyped, "to_prometheus", rb_cmetrics_untyped_to_prometheus, 0);
-    rb_define_method(rb_cUntyped, "to_msgpack", rb_cmetrics_untyped_to_msgpack, 0);
+    rb_define_method(rb_cUntyped, "to_influx", rb_cmetrics_untyped_to_influx, -1);
+    rb_define_method(rb_cUntyped, "to_opentelemetry", rb_cmetrics_untyped_to_opentelemetry, -1);
+    rb_define_method(rb_cUntyped, "to_splunk_hec", rb_cmetrics_untyped_to_splunk_hec, -1);
+    rb_define_method(rb_cUntyped, "to_cloudwatch_emf", rb_cmetrics_untyped_to_cloudwatch_emf, -1);
+    rb_define_method(rb_cUntyped, "to_snapshot", rb_cmetrics_untyped_to_snapshot, 0);
+    rb_define_method(rb_cUntyped, "to_openmetrics", rb_cmetrics_untyped_to_openmetrics, 0);
+    rb_define_method(rb_cUntyped, "to_prometheus", rb_cmetrics_untyped_to_prometheus, -1);
+    rb_define_method(rb_cUntyped, "enable_exposition_cache", rb_cmetrics_untyped_enable_exposition_cache, -1);
+    rb_define_method(rb_cUntyped, "disable_exposition_cache", rb_cmetrics_untyped_disable_exposition_cache, 0);
+    rb_define_method(rb_cUntyped, "to_msgpack", rb_cmetrics_untyped_to_msgpack, -1);
     rb_define_method(rb_cUntyped, "to_s", rb_cmetrics_untyped_to_text, 0);
 }
@@ -166,4 +166,12 @@ find_library("fluent-otel-proto", nil, __dir__)
 
 have_func("gmtime_s", "time.h")
 
+# Optional compressors for the compress: option of the encoders.
+# snappy is built in.
+have_header("zlib.h") && have_library("z", "deflate")
+have_header("zstd.h") && have_library("zstd", "ZSTD_compress")
+
+# Serde.open maps recorded buffers instead of reading them.
+have_header("sys/mman.h") && have_func("mmap", "sys/mman.h") && have_func("madvise", "sys/mman.h")
+
 create_makefile("cmetrics/cmetrics")
@@ -39,9 +39,6 @@
  */
 
 /**
- * \todo 64-BIT OPTIMIZATION: certain implementations use 32-bit math
- * even on 64-bit platforms (uint64_size, uint64_pack, parse_uint64).
- *
  * \todo Use size_t consistently.
  */
 
@@ -350,23 +347,19 @@ sint32_size(int32_t v)
 static inline size_t
 uint64_size(uint64_t v)
 {
-	uint32_t upper_v = (uint32_t) (v >> 32);
+#if defined(__GNUC__)
+	/* ceil(bits / 7) without branches, 'v | 1' keeps zero one byte long */
+	unsigned log2v = 63 - __builtin_clzll(v | 1);
+	return (log2v * 9 + 73) / 64;
+#else
+	size_t rv = 1;
 
-	if (upper_v == 0) {
-		return uint32_size((uint32_t) v);
-	} else if (upper_v < (1UL << 3)) {
-		return 5;
-	} else if (upper_v < (1UL << 10)) {
-		return 6;
-	} else if (upper_v < (1UL << 17)) {
-		return 7;
-	} else if (upper_v < (1UL << 24)) {
-		return 8;
-	} else if (upper_v < (1UL << 31)) {
-		return 9;
-	} else {
-		return 10;
+	while (v >= 0x80) {
+		v >>= 7;
+		rv++;
 	}
+	return rv;
+#endif
 }
 
 /**
@@ -861,29 +854,20 @@ sint32_pack(int32_t value, uint8_t *out)
 static size_t
 uint64_pack(uint64_t value, uint8_t *out)
 {
-	uint32_t hi = (uint32_t) (value >> 32);
-	uint32_t lo = (uint32_t) value;
-	unsigned rv;
-
-	if (hi == 0)
-		return uint32_pack((uint32_t) lo, out);
-	out[0] = (lo) | 0x80;
-	out[1] = (lo >> 7) | 0x80;
-	out[2] = (lo >> 14) | 0x80;
-	out[3] = (lo >> 21) | 0x80;
-	if (hi < 8) {
-		out[4] = (hi << 4) | (lo >> 28);
-		return 5;
-	} else {
-		out[4] = ((hi & 7) << 4) | (lo >> 28) | 0x80;
-		hi >>= 3;
-	}
-	rv = 5;
-	while (hi >= 128) {
-		out[rv++] = hi | 0x80;
-		hi >>= 7;
+	unsigned rv = 4;
+
+	if (value < (1ULL << 28))
+		return uint32_pack((uint32_t) value, out);
+	out[0] = (uint8_t) value | 0x80;
+	out[1] = (uint8_t) (value >> 7) | 0x80;
+	out[2] = (uint8_t) (value >> 14) | 0x80;
+	out[3] = (uint8_t) (value >> 21) | 0x80;
+	value >>= 28;
+	while (value >= 0x80) {
+		out[rv++] = (uint8_t) value | 0x80;
+		value >>= 7;
 	}
-	out[rv++] = hi;
+	out[rv++] = (uint8_t) value;
 	return rv;
 }
 
@@ -2150,6 +2134,17 @@ static size_t
 max_b128_numbers(size_t len, const uint8_t *data)
 {
 	size_t rv = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t word;
+
+	/* count the terminating bytes of eight varint bytes at a time */
+	while (len >= 8) {
+		memcpy(&word, data, 8);
+		rv += __builtin_popcountll(~word & 0x8080808080808080ULL);
+		data += 8;
+		len -= 8;
+	}
+#endif
 	while (len--)
 		if ((*data++ & 0x80) == 0)
 			++rv;
@@ -2732,6 +2727,22 @@ static unsigned
 scan_varint(unsigned len, const uint8_t *data)
 {
 	unsigned i;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t word;
+
+	/* find the terminating byte among the first eight at once */
+	if (len >= 8) {
+		memcpy(&word, data, 8);
+		word = ~word & 0x8080808080808080ULL;
+		if (word != 0)
+			return (__builtin_ctzll(word) >> 3) + 1;
+		if (len > 8 && (data[8] & 0x80) == 0)
+			return 9;
+		if (len > 9 && (data[9] & 0x80) == 0)
+			return 10;
+		return 0;
+	}
+#endif
 	if (len > 10)
 		len = 10;
 	for (i = 0; i < len; i++)
@@ -1,6 +1,8 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "json"
+require "zlib"
 
 class CMetricsCounterTest < Test::Unit::TestCase
   sub_test_case "counter" do
@@ -41,7 +43,11 @@ kubernetes_network_load{hostname="localhost",app="cmetrics"} 1 \\d+
 kubernetes_network_load{hostname="localhost",app="test"} 12.15 \\d+
 EOC
       assert_match(/#{expected}/, @counter.to_prometheus)
-      assert_not_nil @counter.to_s
+      expected = <<-EOC
+\\S+Z kubernetes_network_load{hostname="localhost",app="cmetrics"} = 1
+\\S+Z kubernetes_network_load{hostname="localhost",app="test"} = 12.15
+EOC
+      assert_match(/\A#{expected}\z/, @counter.to_s)
     end
 
     def test_prometheus
@@ -94,6 +100,128 @@ cmt_labels,dev=Calyptia,lang=C test=1 \\d+
 cmt_labels,dev=Calyptia,lang=C,host=calyptia.com,app=cmetrics test=2 \\d+
 EOC
       assert_match(/#{expected2}/, counter.to_influx)
+
+      counter.add(0.1, ["calyptia.com", "cmetrics"])
+      assert_match(/app=cmetrics test=2.1 \d+\n/, counter.to_influx)
+      assert_equal CMetrics::Serde.msgpack_to_influx(counter.to_msgpack), counter.to_influx
+    end
+
+    def test_exposition_cache
+      @counter.inc(["localhost", "cmetrics"])
+      assert_not_same @counter.to_prometheus, @counter.to_prometheus
+
+      @counter.enable_exposition_cache
+      cached = @counter.to_prometheus
+      assert_true cached.frozen?
+      assert_same cached, @counter.to_prometheus
+
+      @counter.inc(["localhost", "cmetrics"])
+      updated = @counter.to_prometheus
+      assert_not_same cached, updated
+      assert_match(/app="cmetrics"} 2 /, updated)
+
+      @counter.enable_exposition_cache(max_staleness: 60)
+      stale = @counter.to_prometheus
+      @counter.inc(["localhost", "cmetrics"])
+      assert_same stale, @counter.to_prometheus
+
+      @counter.disable_exposition_cache
+      assert_match(/app="cmetrics"} 3 /, @counter.to_prometheus)
+    end
+
+    def test_opentelemetry
+      @counter.inc(["localhost", "cmetrics"])
+      encoded = @counter.to_opentelemetry
+      assert_equal Encoding::ASCII_8BIT, encoded.encoding
+      assert_true encoded.include?("kubernetes_network_load")
+      assert_true encoded.include?("localhost")
+
+      buffer = String.new(capacity: 4096)
+      assert_same buffer, @counter.to_opentelemetry(buffer)
+      assert_equal encoded.bytesize, buffer.bytesize
+      assert_same buffer, @counter.to_opentelemetry(buffer, compress: :snappy)
+      assert_not_equal encoded, buffer
+      assert_raise(FrozenError) do
+        @counter.to_opentelemetry("".freeze)
+      end
+    end
+
+    def test_splunk_hec
+      @counter.inc(["localhost", "cmetrics"])
+      encoded = @counter.to_splunk_hec(host: "calyptia.com", index: "metrics", source: "cmetrics")
+      assert_true encoded.include?("calyptia.com")
+      assert_true encoded.include?("kubernetes_network_load")
+
+      buffer = String.new(capacity: 4096)
+      assert_same buffer, @counter.to_splunk_hec(buffer, host: "calyptia.com", index: "metrics", source: "cmetrics")
+      assert_equal encoded, buffer
+      assert_same buffer, @counter.to_splunk_hec(buffer, host: "calyptia.com", index: "metrics", source: "cmetrics",
+                                                 compress: :gzip)
+      assert_equal encoded, Zlib.gunzip(buffer)
+      assert_raise(ArgumentError) do
+        @counter.to_splunk_hec(index: "metrics")
+      end
+    end
+
+    def test_cloudwatch_emf
+      @counter.inc(["localhost", "cmetrics"])
+      encoded = @counter.to_cloudwatch_emf
+      assert_equal Encoding::UTF_8, encoded.encoding
+      records = encoded.lines.map {|line| JSON.parse(line) }
+      assert_equal 1, records.size
+      assert_true records.first.key?("_aws")
+      assert_true encoded.include?("localhost")
+
+      buffer = String.new(capacity: 4096)
+      assert_same buffer, @counter.to_cloudwatch_emf(buffer)
+      assert_equal encoded, buffer
+    end
+
+    def test_openmetrics
+      assert_true @counter.add(2.5, ["localhost", "cmetrics"], exemplar: {trace_id: "4bf92f3577b34da6"})
+      assert_true @counter.inc(["localhost", "test"])
+      expected = <<-EOC
+# TYPE kubernetes_network_load counter
+# HELP kubernetes_network_load Network load
+kubernetes_network_load_total{hostname="localhost",app="cmetrics"} 2.5 [\\d.]+ # {trace_id="4bf92f3577b34da6"} 2.5 [\\d.]+
+kubernetes_network_load_total{hostname="localhost",app="test"} 1 [\\d.]+
+# EOF
+EOC
+      assert_match(/\A#{expected}\z/, @counter.to_openmetrics)
+
+      assert_true @counter.add(1, ["localhost", "cmetrics"], exemplar: {"trace_id" => "0af7651916cd43dd"})
+      assert_match(/app="cmetrics"} 3.5 [\d.]+ # {trace_id="0af7651916cd43dd"} 1 /, @counter.to_openmetrics)
+
+      assert_raise(ArgumentError) do
+        @counter.add(1, ["localhost", "cmetrics"], exemplar: {trace_id: "x" * 65})
+      end
+      assert_raise(ArgumentError) do
+        @counter.add(1, ["localhost", "cmetrics"], exemplar: {})
+      end
+      assert_equal 3.5, @counter.val(["localhost", "cmetrics"])
+    end
+
+    def test_changed_since
+      @counter.inc(["localhost", "cmetrics"])
+      @counter.inc(["localhost", "test"])
+      buffer, token = @counter.to_msgpack(changed_since: nil)
+      assert_kind_of Integer, token
+      serde = CMetrics::Serde.new
+      assert_true serde.from_msgpack(buffer)
+      assert_equal 2, serde.metrics.first.size
+
+      @counter.inc(["localhost", "test"])
+      buffer, token2 = @counter.to_msgpack(changed_since: token)
+      assert_operator token2, :>, token
+      serde = CMetrics::Serde.new
+      assert_true serde.from_msgpack(buffer)
+      assert_equal([[{"hostname"=>"localhost", "app"=>"test"}, 2.0]],
+                   serde.metrics.first.map {|e| [e["labels"], e["value"]] })
+
+      buffer, token3 = @counter.to_msgpack(changed_since: token2)
+      assert_equal token2, token3
+      assert_true CMetrics::Serde.valid?(buffer)
+      assert_kind_of String, @counter.to_msgpack
     end
   end
 
@@ -80,6 +80,24 @@ EOC
       assert_match(/#{expected2}/, gauge.to_prometheus)
     end
 
+    def test_prometheus_values
+      {
+        1234567.0 => "1234567",
+        -2.0 => "-2",
+        0.1 + 0.2 => "0.30000000000000004",
+        1.5e-7 => "1.5e-07",
+        2.0**70 => "1.1805916207174113e\\+21",
+        Float::INFINITY => "\\+Inf",
+        Float::NAN => "NaN",
+      }.each do |value, text|
+        assert_true @gauge.set(value)
+        assert_match(/^kubernetes_network_load #{text} \d+$/, @gauge.to_prometheus)
+        if value.finite?
+          assert_equal value, Float(@gauge.to_prometheus[/^kubernetes_network_load (\S+)/, 1])
+        end
+      end
+    end
+
     def test_influx
       gauge = CMetrics::Gauge.new
       gauge.create("cmt", "labels", "test", "Static labels test", ["host", "app"])
@@ -176,6 +194,31 @@ EOC
       assert_not_nil @gauge.to_s
     end
 
+    def test_changed_since
+      @gauge.set(1, [:localhost, :a])
+      @gauge.set(2, [:localhost, :b])
+      buffer, token = @gauge.to_msgpack(changed_since: nil)
+      serde = CMetrics::Serde.new
+      assert_true serde.from_msgpack(buffer)
+      assert_equal 2, serde.metrics.first.size
+
+      # every update of a series counts, even within one clock tick
+      3.times { @gauge.inc([:localhost, :a]) }
+      buffer, token2 = @gauge.to_msgpack(changed_since: token)
+      assert_equal token + 3, token2
+      serde = CMetrics::Serde.new
+      assert_true serde.from_msgpack(buffer)
+      assert_equal([[{"hostname"=>"localhost", "app"=>"a"}, 4.0]],
+                   serde.metrics.first.map {|e| [e["labels"], e["value"]] })
+
+      # static labels apply to every series
+      @gauge.add_label("dc", "eu")
+      buffer, = @gauge.to_msgpack(changed_since: token2)
+      serde = CMetrics::Serde.new
+      assert_true serde.from_msgpack(buffer)
+      assert_equal 2, serde.metrics.first.size
+    end
+
     def test_labels
       assert_true @gauge.inc([:localhost, :cmetrics])
       assert_equal 1.0, @gauge.val([:localhost, :cmetrics])
@@ -0,0 +1,124 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class CMetricsRegistryTest < Test::Unit::TestCase
+  sub_test_case "registry" do
+    setup do
+      @registry = CMetrics::Registry.new
+    end
+
+    def metrics
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(@registry.to_msgpack)
+      serde.metrics.flatten
+    end
+
+    def test_ingest_statsd
+      lines = <<-EOS
+page.views:1|c
+page.views:2|c|@0.5
+mem:10|g|#host:web-1
+mem:-3|g|#host:web-1
+req.time:12:300|ms|#route:/a,env:prod
+req.time:5|ms|#env:prod,route:/a\r
+users:alice|s
+broken
+EOS
+      assert_equal 7, @registry.ingest_statsd(lines)
+      assert_equal 2, @registry.statsd_rejected_lines
+      assert_equal 1, @registry.ingest_statsd("page.views:1|c")
+
+      values = metrics.to_h {|m| [m["name"], m] }
+      assert_equal 6.0, values["page_views"]["value"]
+      assert_equal 7.0, values["mem"]["value"]
+      assert_equal({"host" => "web-1"}, values["mem"]["labels"])
+
+      text = @registry.to_prometheus
+      assert_match(/^# TYPE req_time histogram$/, text)
+      assert_match(/^req_time_count\{.*\} 3 \d+$/, text)
+      assert_match(/^req_time_bucket\{.*le="\+Inf".*\} 3 \d+$/, text)
+      assert_not_nil @registry.to_s
+    end
+
+    def test_ingest_statsd_one_family_per_name
+      lines = <<-EOS
+req:1|c
+req:2|c|#host:a
+req:3|c|#env:prod,host:b
+req:9|g
+EOS
+      assert_equal 3, @registry.ingest_statsd(lines)
+      assert_equal 1, @registry.statsd_rejected_lines
+      assert_equal 1, @registry.ingest_statsd("req:1|c|#region:eu")
+
+      text = @registry.to_prometheus
+      assert_equal 1, text.scan(/^# TYPE req /).size
+      values = metrics.to_h {|m| [m["labels"], m["value"]] }
+      assert_equal({
+                     {"env" => "", "host" => "", "region" => ""} => 1.0,
+                     {"env" => "", "host" => "a", "region" => ""} => 2.0,
+                     {"env" => "prod", "host" => "b", "region" => ""} => 3.0,
+                     {"env" => "", "host" => "", "region" => "eu"} => 1.0,
+                   },
+                   values)
+    end
+
+    def test_ingest_statsd_changed_since
+      @registry.ingest_statsd("a:1|c\nb:1|c|#host:x\n")
+      _, token = @registry.to_msgpack(changed_since: nil)
+
+      @registry.ingest_statsd("b:1|c|#host:x\n")
+      buffer, token = @registry.to_msgpack(changed_since: token)
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(buffer)
+      assert_equal ["b"], serde.metrics.flatten.map {|m| m["name"] }
+
+      # a new tag key moves every series of the family
+      @registry.ingest_statsd("b:1|c|#env:prod\n")
+      buffer, = @registry.to_msgpack(changed_since: token)
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(buffer)
+      assert_equal 2, serde.metrics.flatten.size
+    end
+
+    def test_changed_since_histograms
+      @registry.ingest_statsd("lat:5|ms|#route:/a\nlat:7|ms|#route:/b\n")
+      _, token = @registry.to_msgpack(changed_since: nil)
+
+      @registry.ingest_statsd("lat:20|ms|#route:/b\n")
+      buffer, = @registry.to_msgpack(changed_since: token)
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(buffer)
+      text = serde.to_prometheus
+      assert_match(/^lat_count\{route="\/b"\} 2 \d+$/, text)
+      assert_match(/^lat_sum\{route="\/b"\} 27 \d+$/, text)
+      assert_not_match(/route="\/a"/, text)
+    end
+
+    def test_compact_histograms
+      @registry.ingest_statsd("lat:5|ms|#route:/a\nlat:700|ms\nreq:1|c\n")
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(@registry.to_msgpack(compact: true))
+      assert_equal @registry.to_prometheus, serde.to_prometheus
+
+      _, token = @registry.to_msgpack(changed_since: nil, compact: true)
+      @registry.ingest_statsd("lat:1|ms|#route:/a\n")
+      buffer, = @registry.to_msgpack(changed_since: token, compact: true)
+      serde = CMetrics::Serde.new
+      serde.from_msgpack(buffer)
+      assert_match(/^lat_count\{route="\/a"\} 2 \d+$/, serde.to_prometheus)
+      assert_not_match(/^req/, serde.to_prometheus)
+    end
+
+    def test_histogram_buckets
+      registry = CMetrics::Registry.new(histogram_buckets: [0.1, 1])
+      assert_equal 2, registry.ingest_statsd("latency:0.05|h\nlatency:5|d\n")
+      assert_match(/^latency_bucket\{le="0\.10*"\} 1 \d+$/, registry.to_prometheus)
+
+      assert_raise(ArgumentError) do
+        CMetrics::Registry.new(histogram_buckets: [1, 0.5])
+      end
+    end
+  end
+end
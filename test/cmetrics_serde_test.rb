@@ -1,5 +1,8 @@
 require "test_helper"
+require "json"
 require "msgpack"
+require "tempfile"
+require "zlib"
 
 class CMetricsSerdeTest < Test::Unit::TestCase
   sub_test_case "Serde" do
@@ -53,6 +56,191 @@ class CMetricsSerdeTest < Test::Unit::TestCase
         @buffer = @counter.to_msgpack
       end
 
+      test "valid?" do
+        assert_true CMetrics::Serde.valid?(@buffer)
+        assert_true CMetrics::Serde.valid?(@buffer + @buffer)
+      end
+
+      test "valid? with broken buffers" do
+        assert_false CMetrics::Serde.valid?("")
+        assert_false CMetrics::Serde.valid?(@buffer[0...-1])
+        assert_false CMetrics::Serde.valid?(@buffer + "\xc1".b)
+        assert_false CMetrics::Serde.valid?(MessagePack.pack({"meta" => {}, "metrics" => [{"meta" => {}}]}))
+        assert_false CMetrics::Serde.valid?(MessagePack.pack([1, 2, 3]))
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.valid?(nil)
+        end
+      end
+
+      test "compact msgpack round trip" do
+        compact = @counter.to_msgpack(compact: true)
+        assert_true compact.bytesize < @buffer.bytesize
+        assert_true CMetrics::Serde.valid?(compact)
+        assert_true CMetrics::Serde.valid?(compact + @buffer)
+        assert_false CMetrics::Serde.valid?(compact[0...-1])
+
+        expected = CMetrics::Serde.new
+        expected.from_msgpack(@buffer)
+        assert_true @serde.from_msgpack(compact)
+        assert_equal(expected.to_prometheus, @serde.to_prometheus)
+        assert_equal(expected.metrics, @serde.metrics)
+      end
+
+      test "compact msgpack with filters" do
+        compact = @counter.to_msgpack(compact: true)
+        [{only: /network_load/}, {only: "other"}, {labels: {app: "cmetrics"}},
+         {labels: {app: /^x/}}, {only: "kubernetes_network_load", labels: {hostname: /calyptia/}}].each do |filter|
+          expected = CMetrics::Serde.new
+          expected.from_msgpack(@buffer, **filter)
+          assert_true @serde.from_msgpack(compact, **filter)
+          assert_equal(expected.metrics, @serde.metrics, filter.inspect)
+        end
+        assert_equal([[{"hostname"=>"calyptia.com", "app"=>"cmetrics"}]],
+                     @serde.metrics.map {|family| family.map {|e| e["labels"] } })
+      end
+
+      test "compact msgpack of a wired buffer" do
+        compact = @counter.to_msgpack(compact: true)
+        contexts = []
+        @serde.from_msgpack_feed_each(compact + @buffer + compact) do |serde|
+          contexts << serde.to_prometheus
+        end
+        assert_equal(3, contexts.size)
+        assert_equal([contexts[1]] * 3, contexts)
+      end
+
+      test "compact msgpack with changed_since" do
+        compact, token = @counter.to_msgpack(changed_since: nil, compact: true)
+        assert_true @serde.from_msgpack(compact)
+        assert_equal(3, @serde.metrics.flatten.size)
+        compact, = @counter.to_msgpack(changed_since: token, compact: true)
+        assert_true @serde.from_msgpack(compact)
+        assert_equal([], @serde.metrics.flatten)
+      end
+
+      test "snapshot round trip" do
+        snapshot = @counter.to_snapshot
+        assert_equal(Encoding::ASCII_8BIT, snapshot.encoding)
+        assert_equal("CMTSNAP\0".b, snapshot[0, 8])
+        assert_equal(0, snapshot.bytesize % 8)
+
+        expected = CMetrics::Serde.new
+        expected.from_msgpack(@buffer)
+        decoded = CMetrics::Serde.from_snapshot(snapshot)
+        assert_equal(expected.to_prometheus, decoded.to_prometheus)
+        assert_equal(expected.metrics, decoded.metrics)
+        assert_equal(snapshot, decoded.to_snapshot)
+      end
+
+      test "snapshot_aggregate" do
+        snapshot = @counter.to_snapshot
+        assert_equal(3.0, CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load"))
+        assert_equal(2.0, CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load", op: :max))
+        assert_equal(1.0, CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load", op: :min))
+        assert_equal(1.5, CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load", op: :avg))
+        assert_equal(2.0, CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load", op: :count))
+        assert_nil CMetrics::Serde.snapshot_aggregate(snapshot, "unknown")
+        assert_equal(0.0, CMetrics::Serde.snapshot_aggregate(snapshot, "unknown", op: :count))
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.snapshot_aggregate(snapshot, "kubernetes_network_load", op: :median)
+        end
+      end
+
+      test "snapshot with broken buffers" do
+        snapshot = @counter.to_snapshot
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.from_snapshot("")
+        end
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.from_snapshot(snapshot[0...-8])
+        end
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.from_snapshot(@buffer)
+        end
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.snapshot_aggregate(snapshot[0, 64], "kubernetes_network_load")
+        end
+      end
+
+      test "open a recorded wired buffer" do
+        Tempfile.create(["cmetrics", ".msgpack"]) do |file|
+          file.binmode
+          file.write(@buffer + @counter.to_msgpack(compact: true) + @buffer)
+          file.close
+
+          expected = CMetrics::Serde.new
+          expected.from_msgpack(@buffer)
+          encoded = []
+          size = CMetrics::Serde.open(file.path) do |serde|
+            encoded << serde.to_prometheus
+          end
+          assert_equal(File.size(file.path), size)
+          assert_equal([expected.to_prometheus] * 3, encoded)
+          assert_equal(3, CMetrics::Serde.open(file.path).count)
+        end
+      end
+
+      test "open a snapshot" do
+        Tempfile.create(["cmetrics", ".snap"]) do |file|
+          file.binmode
+          file.write(@counter.to_snapshot)
+          file.close
+
+          values = []
+          CMetrics::Serde.open(file.path) do |serde|
+            values.concat(serde.metrics.flatten.map {|series| series["value"] })
+          end
+          assert_equal([1.0, 2.0], values)
+        end
+      end
+
+      test "open with filters" do
+        [[".msgpack", @buffer + @counter.to_msgpack(compact: true)], [".snap", @counter.to_snapshot]].each do |ext, data|
+          Tempfile.create(["cmetrics", ext]) do |file|
+            file.binmode
+            file.write(data)
+            file.close
+
+            [{only: /network_load/}, {only: "other"}, {labels: {app: "cmetrics"}},
+             {labels: {app: /^x/}}, {only: "kubernetes_network_load", labels: {hostname: /calyptia/}}].each do |filter|
+              expected = CMetrics::Serde.new
+              expected.from_msgpack(@buffer, **filter)
+              CMetrics::Serde.open(file.path, **filter) do |serde|
+                assert_equal(expected.metrics, serde.metrics, "#{ext} #{filter.inspect}")
+              end
+            end
+          end
+        end
+      end
+
+      test "open a truncated file" do
+        Tempfile.create(["cmetrics", ".msgpack"]) do |file|
+          file.binmode
+          file.write(@buffer + @buffer[0...-1])
+          file.close
+
+          count = 0
+          size = CMetrics::Serde.open(file.path) { count += 1 }
+          assert_equal(1, count)
+          assert_equal(@buffer.bytesize, size)
+        end
+        assert_raise(Errno::ENOENT) do
+          CMetrics::Serde.open("/nonexistent/cmetrics.msgpack") {}
+        end
+      end
+
+      test "open a corrupt snapshot" do
+        Tempfile.create(["cmetrics", ".snap"]) do |file|
+          file.binmode
+          file.write(@counter.to_snapshot[0, 64])
+          file.close
+
+          assert_raise_message("invalid snapshot buffer") do
+            CMetrics::Serde.open(file.path) {}
+          end
+        end
+      end
+
       test "decode counter" do
         assert_true @serde.from_msgpack(@buffer)
         buffer = @serde.to_msgpack
@@ -64,6 +252,146 @@ class CMetricsSerdeTest < Test::Unit::TestCase
         assert_not_nil @serde.prometheus_remote_write
       end
 
+      test "compress encoded buffers" do
+        assert_true @serde.from_msgpack(@buffer)
+        assert_equal(@serde.to_prometheus, Zlib.gunzip(@serde.to_prometheus(compress: :gzip)))
+        assert_equal(@serde.to_msgpack, Zlib.gunzip(@serde.to_msgpack(compress: :gzip)))
+        assert_equal(@serde.to_msgpack(compact: true),
+                     Zlib.gunzip(@serde.to_msgpack(compact: true, compress: :gzip)))
+
+        payload = @serde.prometheus_remote_write
+        assert_equal(Encoding::ASCII_8BIT, payload.encoding)
+        snappy = @serde.prometheus_remote_write(compress: :snappy)
+        # snappy blocks start with the uncompressed length as a varint
+        length = 0
+        snappy.each_byte.with_index do |b, i|
+          length |= (b & 0x7f) << (7 * i)
+          break if b < 0x80
+        end
+        assert_equal(payload.bytesize, length)
+        assert_raise(ArgumentError) do
+          @serde.to_influx(compress: :lz4)
+        end
+      end
+
+      test "each_remote_write_batch" do
+        @counter.inc(["fluentbit.io", "cmetrics"])
+        @counter.inc(["fluentd.org", "cmetrics"])
+        assert_true @serde.from_msgpack(@counter.to_msgpack)
+
+        batches = @serde.each_remote_write_batch(max_samples: 2, compress: nil).to_a
+        assert_equal(2, batches.size)
+        assert_true batches.all? {|b| b.include?("kubernetes_network_load") && b.include?("Network load") }
+        assert_equal(["calyptia.com", "fluentbit.io", "fluentd.org"],
+                     batches.join.scan(/calyptia\.com|fluentbit\.io|fluentd\.org/))
+
+        limit = batches.map(&:bytesize).max
+        assert_true @serde.each_remote_write_batch(max_bytes: limit, compress: nil).all? {|b| b.bytesize <= limit }
+        assert_equal(4, @serde.each_remote_write_batch(max_bytes: 1) {})
+        assert_equal(1, @serde.each_remote_write_batch {})
+        assert_raise(ArgumentError) do
+          @serde.each_remote_write_batch(max_samples: 0) {}
+        end
+      end
+
+      test "decode remote write" do
+        assert_true @serde.from_msgpack(@buffer)
+        expected = <<-EOC
+# HELP kubernetes_network_load Network load
+# TYPE kubernetes_network_load counter
+kubernetes_network_load 1 \\d+
+kubernetes_network_load{app=\"cmetrics\",hostname=\"calyptia.com\"} 2 \\d+
+EOC
+        decoded = CMetrics::Serde.new
+        assert_true decoded.from_prometheus_remote_write(@serde.prometheus_remote_write(compress: :snappy))
+        assert_match(/#{expected}/, decoded.to_prometheus)
+
+        raw = CMetrics::Serde.new
+        assert_true raw.from_prometheus_remote_write(@serde.prometheus_remote_write(compress: nil), compressed: nil)
+        assert_equal(decoded.to_prometheus, raw.to_prometheus)
+
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.new.from_prometheus_remote_write("\xff\xff\xff", compressed: nil)
+        end
+      end
+
+      test "decode remote write into one family per name" do
+        counter = CMetrics::Counter.new
+        counter.create("kubernetes", "network", "load", "Network load", ["hostname", "app"])
+        counter.inc
+        counter.inc(["calyptia.com", "cmetrics"])
+        # the empty hostname is dropped from the request
+        counter.inc(["", "fluentd"])
+        @serde.concat(counter)
+
+        decoded = CMetrics::Serde.new
+        assert_true decoded.from_prometheus_remote_write(@serde.prometheus_remote_write(compress: nil), compressed: nil)
+        assert_equal(1, decoded.to_prometheus.scan(/^# TYPE kubernetes_network_load counter$/).size)
+        assert_equal([[nil, 1.0], [{"app" => "cmetrics", "hostname" => "calyptia.com"}, 1.0], [{"app" => "fluentd", "hostname" => ""}, 1.0]],
+                     decoded.metrics.flatten.map {|m| [m["labels"], m["value"]] })
+      end
+
+      test "decode opentelemetry" do
+        assert_true @serde.from_msgpack(@buffer)
+        expected = <<-EOC
+# HELP kubernetes_network_load Network load
+# TYPE kubernetes_network_load counter
+kubernetes_network_load 1 \\d+
+kubernetes_network_load{hostname=\"calyptia.com\",app=\"cmetrics\"} 2 \\d+
+EOC
+        decoded = CMetrics::Serde.new
+        assert_true decoded.from_opentelemetry(@counter.to_opentelemetry)
+        assert_match(/#{expected}/, decoded.to_prometheus)
+        assert_true CMetrics::Serde.valid?(decoded.to_msgpack)
+
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.new.from_opentelemetry("\xff\xff\xff")
+        end
+      end
+
+      test "decode prometheus" do
+        assert_true @serde.from_msgpack(@buffer)
+        assert_true @serde.from_prometheus(@counter.to_prometheus)
+        assert_equal(@counter.to_prometheus, @serde.to_prometheus)
+
+        text = <<-'EOT'
+# HELP go_gc_duration_seconds A summary of the GC pause\ndurations.
+# TYPE go_gc_duration_seconds summary
+go_gc_duration_seconds{quantile="0.5"} 1.5e-05
+go_gc_duration_seconds_count 12
+# TYPE up gauge
+up{job="node",path="C:\\tmp \"x\""} 1 1700000000000
+EOT
+        assert_true @serde.from_prometheus(text)
+        metrics = @serde.metrics.flatten.to_h {|m| [m["name"], m] }
+        assert_equal({"go_gc_duration_seconds" => 1.5e-05, "go_gc_duration_seconds_count" => 12.0, "up" => 1.0},
+                     metrics.transform_values {|m| m["value"] })
+        assert_equal("A summary of the GC pause\ndurations.", metrics["go_gc_duration_seconds"]["description"])
+        assert_equal("A summary of the GC pause\ndurations.", metrics["go_gc_duration_seconds_count"]["description"])
+        assert_equal({"job" => "node", "path" => "C:\\tmp \"x\""}, metrics["up"]["labels"])
+        assert_equal(1700000000.0, metrics["up"]["timestamp"])
+        assert_match(/^# TYPE up gauge$/, @serde.to_prometheus)
+
+        assert_raise(ArgumentError.new("invalid Prometheus text at line 2")) do
+          CMetrics::Serde.new.from_prometheus("up 1\nup{job=\"x} 1\n")
+        end
+      end
+
+      test "decode prometheus into one family per name" do
+        text = <<-'EOT'
+# TYPE requests counter
+requests 1
+requests{method="GET"} 2
+requests{code="200",method="POST"} 3
+requests{method="POST",code="200"} 4
+EOT
+        assert_true @serde.from_prometheus(text)
+        exposition = @serde.to_prometheus
+        assert_equal(1, exposition.scan(/^# TYPE requests counter$/).size)
+        assert_equal([[nil, 1.0], [{"method" => "GET", "code" => ""}, 2.0], [{"method" => "POST", "code" => "200"}, 4.0]],
+                     @serde.metrics.flatten.map {|m| [m["labels"], m["value"]] })
+      end
+
       test "encode text" do
         assert_true @serde.from_msgpack(@buffer)
         assert_not_nil @serde.to_s
@@ -78,6 +406,32 @@ EOC
         assert_match(/#{expected}/, @serde.to_influx)
       end
 
+      test "msgpack_to_prometheus" do
+        assert_true @serde.from_msgpack(@buffer)
+        assert_equal @serde.to_prometheus, CMetrics::Serde.msgpack_to_prometheus(@buffer)
+
+        @counter.add_label("dev", "Calyptia")
+        buffer = @counter.to_msgpack
+        assert_true @serde.from_msgpack(buffer)
+        assert_equal @serde.to_prometheus, CMetrics::Serde.msgpack_to_prometheus(buffer)
+        assert_equal @serde.to_prometheus * 2, CMetrics::Serde.msgpack_to_prometheus(buffer + buffer)
+        assert_equal "", CMetrics::Serde.msgpack_to_prometheus("")
+
+        assert_raise(ArgumentError) do
+          CMetrics::Serde.msgpack_to_prometheus(@buffer[0...-1])
+        end
+      end
+
+      test "msgpack_to_influx" do
+        expected = <<-EOC
+kubernetes_network load=1 \\d+
+kubernetes_network,hostname=calyptia.com,app=cmetrics load=2 \\d+
+EOC
+        assert_match(/\A#{expected}\z/, CMetrics::Serde.msgpack_to_influx(@buffer))
+        assert_equal Zlib.gunzip(CMetrics::Serde.msgpack_to_influx(@buffer, compress: :gzip)),
+                     CMetrics::Serde.msgpack_to_influx(@buffer)
+      end
+
       test "encode prometheus" do
         assert_true @serde.from_msgpack(@buffer)
         expected = <<-EOC
@@ -99,6 +453,56 @@ EOC
         assert_equal(expected, @serde.metrics.first.map{|e| e.reject!{|k| k == "timestamp"}})
       end
 
+      test "to_columns" do
+        assert_true @serde.from_msgpack(@buffer)
+        columns = @serde.to_columns
+        assert_equal([{"namespace"=>"kubernetes", "subsystem"=>"network", "name"=>"load",
+                       "description"=>"Network load", "type"=>"counter", "label_keys"=>["hostname", "app"]}],
+                     columns["families"])
+        assert_equal([0, 0], columns["family_index"])
+        assert_equal([[], ["calyptia.com", "cmetrics"]], columns["labels"])
+        assert_equal([1.0, 2.0], columns["values"].unpack("d*"))
+        assert_equal(@serde.metrics.first.map {|e| e["timestamp"] },
+                     columns["timestamps"].unpack("q*").map {|ts| ts / 1000000000.0 })
+        assert_equal({}, columns["static_labels"])
+      end
+
+      test "to_json" do
+        @counter.add_label("dev", "Calyptia \"C\"\n")
+        assert_true @serde.from_msgpack(@counter.to_msgpack)
+        assert_equal JSON.parse(JSON.generate(@serde.metrics)), JSON.parse(@serde.to_json)
+        assert_equal @serde.to_json, JSON.generate(@serde)
+
+        series = []
+        @serde.each_series {|e| series << e }
+        assert_equal JSON.parse(JSON.generate(series)),
+                     @serde.to_ndjson.lines.map {|line| JSON.parse(line) }
+        assert_equal Encoding::UTF_8, @serde.to_ndjson.encoding
+      end
+
+      test "aggregate" do
+        @counter.inc(["fluentbit.io", "cmetrics"])
+        assert_true @serde.from_msgpack(@counter.to_msgpack)
+        total = @serde.aggregate("kubernetes_network_load", op: :sum)
+        assert_equal([4.0], total.metrics.first.map {|e| e["value"] })
+
+        by_app = @serde.aggregate("kubernetes_network_load", by: [:app], op: :max)
+        assert_equal([[{"app"=>""}, 1.0], [{"app"=>"cmetrics"}, 2.0]],
+                     by_app.metrics.first.map {|e| [e["labels"], e["value"]] })
+        without = @serde.aggregate("kubernetes_network_load", without: ["hostname"], op: :max)
+        assert_equal(by_app.metrics, without.metrics)
+
+        avg = @serde.aggregate("kubernetes_network_load", by: ["app"], op: :avg)
+        assert_match(/# TYPE kubernetes_network_load gauge/, avg.to_prometheus)
+        assert_equal([1.0, 1.5], avg.metrics.first.map {|e| e["value"] })
+        assert_raise(ArgumentError) do
+          @serde.aggregate("kubernetes_network_nothing", by: ["app"])
+        end
+        assert_raise(ArgumentError) do
+          @serde.aggregate("kubernetes_network_load", op: :median)
+        end
+      end
+
       sub_test_case "w/ static labels" do
         setup do
           @counter = CMetrics::Counter.new
@@ -111,6 +515,15 @@ EOC
           @buffer = @counter.to_msgpack
         end
 
+        test "each_series" do
+          assert_true @serde.from_msgpack(@buffer)
+          series = @serde.each_series.to_a
+          assert_equal(@serde.metrics.flatten, series)
+          assert_true series.all?(&:frozen?)
+          assert_same series[0]["name"], series[1]["name"]
+          assert_same series[0]["static_labels"], series[1]["static_labels"]
+        end
+
         test "decode as Hash" do
           assert_true @serde.from_msgpack(@buffer)
           expected = [
@@ -308,6 +721,105 @@ EOC
                        values
                      ])
       end
+
+      data(
+        counter: ["counter", CMetrics::Counter.new],
+        gauge: ["gauge", CMetrics::Gauge.new],
+        untyped: ["untyped", CMetrics::Untyped.new]
+      )
+      test "absorb cmetric object" do |(label, obj)|
+        assert_true @serde.from_msgpack(@buffer)
+
+        obj.create("test", "concat", label, "Source #{label} data")
+        obj.set(10)
+        obj.add_label("dev", "Calyptia")
+        @serde.concat!(obj)
+
+        metrics = MessagePack.unpack(@serde.to_msgpack)["metrics"]
+        assert_equal([2, "Source #{label} data", 10.0],
+                     [metrics.size, metrics.last["meta"]["opts"]["desc"], metrics.last["values"].last["value"]])
+        assert_match(/dev="Calyptia"/, @serde.to_prometheus)
+        assert_raise(RuntimeError) do
+          obj.set(11)
+        end
+
+        other = CMetrics::Serde.new
+        other.absorb(@serde)
+        assert_equal(2, MessagePack.unpack(other.to_msgpack)["metrics"].size)
+        assert_equal(0, MessagePack.unpack(@serde.to_msgpack)["metrics"].size)
+      end
+
+      test "absorb drops the exemplars and change stamps of the source" do
+        counter = CMetrics::Counter.new
+        counter.create("test", "concat", "counter", "Source data", ["host"])
+        counter.add(1, ["localhost"], exemplar: {trace_id: "4bf92f3577b34da6"})
+        _, token = counter.to_msgpack(changed_since: nil)
+        @serde.concat!(counter)
+
+        counter.create("test", "concat", "counter", "Source data", ["host"])
+        counter.inc(["localhost"])
+        assert_not_match(/trace_id/, counter.to_openmetrics)
+        buffer, = counter.to_msgpack(changed_since: token)
+        assert_equal([1.0],
+                     MessagePack.unpack(buffer)["metrics"].first["values"].map {|v| v["value"] })
+      end
+
+      test "merge many cmetric objects" do
+        10.times do |i|
+          counter = CMetrics::Counter.new
+          counter.create("test", "concat", "counter", "Source data", ["host"])
+          counter.set(i)
+          counter.set(1, ["host#{i % 2}"])
+          @serde.merge(counter)
+        end
+        metrics = MessagePack.unpack(@serde.to_msgpack)["metrics"]
+        assert_equal([1, [45.0, 5.0, 5.0]],
+                     [metrics.size, metrics.first["values"].map {|v| v["value"] }])
+
+        other = CMetrics::Counter.new
+        other.create("test", "concat", "counter", "Source data", ["host"])
+        other.set(100, ["host1"])
+        @serde.merge(other, policy: :max)
+        other.set(1, ["host0"])
+        @serde.merge(other, policy: :last)
+        assert_equal([45.0, 1.0, 100.0],
+                     MessagePack.unpack(@serde.to_msgpack)["metrics"].first["values"].map {|v| v["value"] })
+      end
+
+      test "merge families with other label keys" do
+        @serde.merge(@counter)
+        other = CMetrics::Counter.new
+        other.create("test", "concat", "counter", "Dest counter data", ["host"])
+        other.set(1, ["localhost"])
+        before = @serde.to_msgpack
+        assert_raise(ArgumentError) do
+          @serde.merge(other)
+        end
+        assert_equal(before, @serde.to_msgpack)
+        assert_raise(ArgumentError) do
+          @serde.merge(@counter, policy: :avg)
+        end
+      end
+
+      test "merge contexts with conflicting static labels" do
+        @counter.add_label("dev", "Calyptia")
+        @serde.merge(@counter)
+        other = CMetrics::Counter.new
+        other.create("test", "concat", "other", "Other counter data")
+        other.set(1)
+        other.add_label("dev", "Fluent")
+        before = @serde.to_msgpack
+        assert_raise(ArgumentError) do
+          @serde.merge(other)
+        end
+        assert_equal(before, @serde.to_msgpack)
+        other = CMetrics::Counter.new
+        other.create("test", "concat", "other", "Other counter data")
+        other.set(1)
+        other.add_label("dev", "Calyptia")
+        @serde.merge(other)
+        assert_equal(2, MessagePack.unpack(@serde.to_msgpack)["metrics"].size)
+      end
     end
 
     sub_test_case "w/ wired buffer" do
@@ -355,6 +867,74 @@ EOC
         end
       end
 
+      sub_test_case "decode with filters" do
+        test "only families matching the name" do
+          counter = CMetrics::Counter.new
+          counter.create("fluentbit", "output", "proc_records", "Records", ["name"])
+          counter.add(5, ["es.0"])
+          counter.add(6, ["stdout.0"])
+          buffer = @counter.to_msgpack + counter.to_msgpack
+
+          assert_true @serde.from_msgpack(buffer, only: [/fluentbit_output_/])
+          assert_equal [], @serde.metrics
+          assert_true @serde.from_msgpack(buffer, only: [/fluentbit_output_/])
+          assert_equal [["proc_records", "proc_records"]],
+                       @serde.metrics.map {|family| family.map {|e| e["name"] } }
+        end
+
+        test "only series matching labels" do
+          assert_true @serde.from_msgpack(@wired_buffer, labels: {app: "test"})
+          assert_equal [[{"hostname"=>"localhost", "app"=>"test"}]],
+                       @serde.metrics.map {|family| family.map {|e| e["labels"] } }
+          assert_true @serde.from_msgpack(@wired_buffer, labels: {"app" => /cm/})
+          assert_equal [[1.0]], @serde.metrics.map {|family| family.map {|e| e["value"] } }
+        end
+
+        test "regexp filters leave $~ alone" do
+          "cmetrics" =~ /met/
+          assert_true @serde.from_msgpack(@wired_buffer, only: /network_l/, labels: {app: /^te/})
+          assert_equal "met", $~[0]
+          assert_equal [[{"hostname"=>"localhost", "app"=>"test"}]],
+                       @serde.metrics.map {|family| family.map {|e| e["labels"] } }
+        end
+
+        test "regexp filters with non-ASCII characters" do
+          gauge = CMetrics::Gauge.new
+          gauge.create("kubernetes", "network", "load", "Network load", ["hostname"])
+          gauge.set(1, ["caf\u00e9"])
+          gauge.set(2, ["localhost"])
+          buffer = gauge.to_msgpack
+          [buffer, gauge.to_msgpack(compact: true)].each do |payload|
+            assert_true @serde.from_msgpack(payload, labels: {hostname: /\u00e9\z/})
+            assert_equal [[1.0]], @serde.metrics.map {|family| family.map {|e| e["value"] } }
+          end
+        end
+
+        test "regexp filters raising" do
+          failing = Class.new(Regexp) do
+            def match?(*)
+              raise "filter failure"
+            end
+          end.new("load")
+          compact = @counter.to_msgpack(compact: true)
+          [@wired_buffer, compact].each do |payload|
+            assert_raise_message("filter failure") do
+              @serde.from_msgpack(payload, only: failing)
+            end
+          end
+          assert_true @serde.from_msgpack(compact, only: /network_load/)
+          assert_equal [3], @serde.metrics.map(&:size)
+        end
+
+        test "#feed_each with filters" do
+          values = []
+          @serde.feed_each(@wired_buffer, only: "kubernetes_network_load", labels: {hostname: "localhost"}) do |serde|
+            values << serde.metrics.map {|family| family.map {|e| e["value"] } }
+          end
+          assert_equal [[[1.0, 10.0]], [[1.0, 10.5]]], values
+        end
+      end
+
       sub_test_case "decode and encode as prometheus remote write" do
         test "prometheus remote with multiple cmetrics objects" do
           encoded_buffer = ""